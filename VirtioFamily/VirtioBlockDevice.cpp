@@ -33,12 +33,15 @@ namespace VirtioBlockDeviceFeatures
 		
 	};
 	
-	static const uint32_t SUPPORTED_FEATURES =
+	static const uint64_t SUPPORTED_FEATURES =
 		VirtioBlockDeviceFeatures::VIRTIO_BLK_F_SEG_MAX
 		| VirtioBlockDeviceFeatures::VIRTIO_BLK_F_BLK_SIZE
 		| VirtioBlockDeviceFeatures::VIRTIO_BLK_F_TOPOLOGY
 		| VirtioBlockDeviceFeatures::VIRTIO_BLK_F_RO
-		| VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC;
+		| VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC
+		| VirtioDeviceGenericFeature::VIRTIO_F_RING_EVENT_IDX
+		| VirtioDeviceGenericFeature::VIRTIO_F_IN_ORDER
+		| VirtioDeviceGenericFeature::VIRTIO_F_RING_PACKED;
 }
 
 struct VirtioBlockDeviceRequest;
@@ -149,8 +152,8 @@ bool VirtioBlockDevice::start(IOService* provider)
 	virtio->resetDevice();
 	//kprintf("VirtioBlockDevice::start() resetDevice\n");
 	
-	uint32_t dev_features = virtio->supportedFeatures();
-	uint32_t use_features = dev_features & VirtioBlockDeviceFeatures::SUPPORTED_FEATURES;
+	uint64_t dev_features = virtio->supportedFeatures();
+	uint64_t use_features = dev_features & VirtioBlockDeviceFeatures::SUPPORTED_FEATURES;
 	this->active_features = use_features;
 	//kprintf("VirtioBlockDevice::start() use Features\n");
 
@@ -189,9 +192,10 @@ bool VirtioBlockDevice::start(IOService* provider)
 	//kprintf("VirtioBlockDevice::start() setup virtqueues\n");
 
 	
-	if((this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC) == 0)
+	if((this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC) == 0
+		|| (this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_PACKED) != 0)
 	{
-		//indirct feature not supported
+		//indirct feature not supported, or not used with packed rings
 		if(seg_max > queue_size-2)
 		{
 			seg_max = queue_size - 2;
@@ -596,6 +600,8 @@ void VirtioBlockDevice::handlePendingRequests(bool device_reset)
 {
 	if (!device_reset)
 	{
+		// publish all resubmitted requests to the device with a single notification
+		this->virtio_device->beginVirtqueueBatch(0);
 		while (!genc_slq_is_empty(&this->pending_requests))
 		{
 			VirtioBlockDeviceRequest* next_request =
@@ -607,6 +613,7 @@ void VirtioBlockDevice::handlePendingRequests(bool device_reset)
 				break;
 			}
 		}
+		this->virtio_device->commitVirtqueueBatch(0);
 	}
 	else
 	{
@@ -31,7 +31,7 @@ protected:
 	static const unsigned CONFIG_SEG_MAX_OFFSET = 12;
 	static const unsigned CONFIG_BLK_SIZE_OFFSET = 20;
 	uint32_t block_size;
-	uint32_t active_features;
+	uint64_t active_features;
 	uint64_t capacity_in_bytes;
 	uint32_t sectors_per_block;
 	uint32_t max_request_segments;
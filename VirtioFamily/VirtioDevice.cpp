@@ -8,6 +8,54 @@
 
 #include "VirtioDevice.h"
 #include <IOKit/IOLib.h>
+#include <IOKit/IODMACommand.h>
+#include <IOKit/IOWorkLoop.h>
+#include <mach/thread_policy.h>
+
+extern "C" kern_return_t thread_policy_set(thread_t thread, thread_policy_flavor_t flavor, thread_policy_t policy_info, mach_msg_type_number_t count);
+
+#define VirtioCompletionWorkLoop eu_dennis__jordan_driver_VirtioCompletionWorkLoop
+
+/// Work loop whose thread's scheduling policy can be set, which needs access to the protected workThread.
+class VirtioCompletionWorkLoop : public IOWorkLoop
+{
+	OSDeclareDefaultStructors(VirtioCompletionWorkLoop);
+public:
+	static VirtioCompletionWorkLoop* workLoop(int32_t thread_importance, uint32_t affinity_tag);
+};
+
+OSDefineMetaClassAndStructors(VirtioCompletionWorkLoop, IOWorkLoop);
+
+VirtioCompletionWorkLoop* VirtioCompletionWorkLoop::workLoop(int32_t thread_importance, uint32_t affinity_tag)
+{
+	VirtioCompletionWorkLoop* loop = new VirtioCompletionWorkLoop;
+	if (loop == nullptr)
+		return nullptr;
+	if (!loop->init())
+	{
+		loop->release();
+		return nullptr;
+	}
+	
+	// Scheduling policies are only hints, so failing to apply one isn't fatal.
+	if (thread_importance != 0)
+	{
+		thread_precedence_policy_data_t precedence = { thread_importance };
+		kern_return_t res = thread_policy_set(loop->workThread, THREAD_PRECEDENCE_POLICY,
+			reinterpret_cast<thread_policy_t>(&precedence), THREAD_PRECEDENCE_POLICY_COUNT);
+		if (res != KERN_SUCCESS)
+			IOLog("VirtioCompletionWorkLoop::workLoop(): Setting thread importance %d failed (%x)\n", thread_importance, res);
+	}
+	if (affinity_tag != 0)
+	{
+		thread_affinity_policy_data_t affinity = { static_cast<integer_t>(affinity_tag) };
+		kern_return_t res = thread_policy_set(loop->workThread, THREAD_AFFINITY_POLICY,
+			reinterpret_cast<thread_policy_t>(&affinity), THREAD_AFFINITY_POLICY_COUNT);
+		if (res != KERN_SUCCESS)
+			IOLog("VirtioCompletionWorkLoop::workLoop(): Setting thread affinity tag %u failed (%x)\n", affinity_tag, res);
+	}
+	return loop;
+}
 
 OSDefineMetaClassAndAbstractStructors(VirtioDevice, IOService);
 
@@ -32,6 +80,34 @@ OSMetaClassDefineReservedUnused(VirtioDevice, 17)
 OSMetaClassDefineReservedUnused(VirtioDevice, 18)
 OSMetaClassDefineReservedUnused(VirtioDevice, 19)
 
+bool VirtioDevice::init(OSDictionary* dictionary)
+{
+	if (!IOService::init(dictionary))
+		return false;
+	// cached bytes are tagged with generation 0 until filled
+	this->config_cache_generation = 1;
+	return true;
+}
+
+IOWorkLoop* VirtioDevice::createCompletionWorkLoop(const VirtioVirtqueueCompletionContext& context)
+{
+	return VirtioCompletionWorkLoop::workLoop(context.thread_importance, context.affinity_tag);
+}
+
+void VirtioDevice::invalidateDeviceConfigCache()
+{
+	OSIncrementAtomic(&this->config_cache_generation);
+	this->config_cache_invalidations++;
+}
+
+void VirtioDevice::getDeviceConfigCacheStatistics(VirtioDeviceConfigCacheStatistics* out_stats)
+{
+	out_stats->hits = this->config_cache_hits;
+	out_stats->misses = this->config_cache_misses;
+	out_stats->accesses_saved = this->config_cache_accesses_saved;
+	out_stats->invalidations = this->config_cache_invalidations;
+}
+
 bool VirtioDevice::matchPropertyTable(OSDictionary* table, SInt32* score)
 {
 	if (!IOService::matchPropertyTable(table, score))
@@ -62,3 +138,95 @@ bool VirtioDevice::matchPropertyTable(OSDictionary* table, SInt32* score)
 	}
 	return true;
 }
+
+struct virtio_registered_segment_output
+{
+	/// nullptr while only counting the segments
+	VirtioRegisteredSegment* segments;
+};
+
+static bool outputRegisteredSegment(
+	IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex)
+{
+	virtio_registered_segment_output* output = static_cast<virtio_registered_segment_output*>(segments);
+	if (output->segments != nullptr)
+	{
+		output->segments[segmentIndex].phys_address = segment.fIOVMAddr;
+		output->segments[segmentIndex].length = static_cast<uint32_t>(segment.fLength);
+	}
+	return true;
+}
+
+static inline size_t registered_buffer_size(unsigned num_segments)
+{
+	return sizeof(VirtioRegisteredBuffer) + sizeof(VirtioRegisteredSegment) * num_segments;
+}
+
+IOReturn VirtioDevice::registerBuffer(IOMemoryDescriptor* buffer, VirtioRegisteredBuffer** out_registered_buffer)
+{
+	if (buffer == nullptr || out_registered_buffer == nullptr || buffer->getLength() == 0 || buffer->getLength() > UINT32_MAX)
+		return kIOReturnBadArgument;
+	
+	// descriptor lengths are 32 bits
+	IODMACommand* dma_cmd = IODMACommand::withSpecification(
+		outputRegisteredSegment, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
+	if (dma_cmd == nullptr)
+		return kIOReturnNoMemory;
+	IOReturn result = dma_cmd->setMemoryDescriptor(buffer, true /* prepare DMA */);
+	if (result != kIOReturnSuccess)
+	{
+		dma_cmd->release();
+		return result;
+	}
+	
+	// count the segments first, so the list can be allocated in one piece with the buffer
+	virtio_registered_segment_output output = { nullptr };
+	UInt64 offset = 0;
+	UInt32 num_segments = UINT32_MAX;
+	result = dma_cmd->genIOVMSegments(&offset, &output, &num_segments);
+	if (result != kIOReturnSuccess || offset != buffer->getLength() || num_segments == 0)
+	{
+		IOLog("VirtioDevice::registerBuffer(): failed to generate segments (%x) up to offset %llu for buffer with %llu bytes\n", result, offset, buffer->getLength());
+		dma_cmd->clearMemoryDescriptor(true);
+		dma_cmd->release();
+		return result != kIOReturnSuccess ? result : kIOReturnInternalError;
+	}
+	
+	VirtioRegisteredBuffer* registered_buffer = static_cast<VirtioRegisteredBuffer*>(IOMalloc(registered_buffer_size(num_segments)));
+	if (registered_buffer == nullptr)
+	{
+		dma_cmd->clearMemoryDescriptor(true);
+		dma_cmd->release();
+		return kIOReturnNoMemory;
+	}
+	
+	output.segments = registered_buffer->segments;
+	offset = 0;
+	UInt32 emitted_segments = num_segments;
+	result = dma_cmd->genIOVMSegments(&offset, &output, &emitted_segments);
+	if (result != kIOReturnSuccess || emitted_segments != num_segments)
+	{
+		IOFree(registered_buffer, registered_buffer_size(num_segments));
+		dma_cmd->clearMemoryDescriptor(true);
+		dma_cmd->release();
+		return result != kIOReturnSuccess ? result : kIOReturnInternalError;
+	}
+	
+	buffer->retain();
+	registered_buffer->memory = buffer;
+	registered_buffer->dma_cmd = dma_cmd;
+	registered_buffer->length = static_cast<uint32_t>(buffer->getLength());
+	registered_buffer->num_segments = num_segments;
+	*out_registered_buffer = registered_buffer;
+	return kIOReturnSuccess;
+}
+
+void VirtioDevice::unregisterBuffer(VirtioRegisteredBuffer* registered_buffer)
+{
+	if (registered_buffer == nullptr)
+		return;
+	registered_buffer->dma_cmd->clearMemoryDescriptor(true);
+	OSSafeReleaseNULL(registered_buffer->dma_cmd);
+	OSSafeReleaseNULL(registered_buffer->memory);
+	IOFree(registered_buffer, registered_buffer_size(registered_buffer->num_segments));
+}
@@ -23,6 +23,14 @@
 struct VirtioCompletion;
 struct VirtioVirtqueue;
 struct VirtioBuffer;
+struct VirtioVirtqueueStatistics;
+struct VirtioRegisteredBuffer;
+struct VirtioDeviceConfigCacheStatistics;
+struct VirtioVirtqueueCompletionContext;
+class IOWorkLoop;
+
+/// Leading bytes of the device specific config which are cached; fields beyond are always read from the device.
+static const unsigned VIRTIO_DEVICE_CONFIG_CACHE_SIZE = 64;
 class IOBufferMemoryDescriptor;
 
 class VirtioDevice : public IOService
@@ -31,22 +39,102 @@ class VirtioDevice : public IOService
 protected:
 	uint32_t virtio_device_type;
 	
+	/// Bumped on config change interrupts, resets and config writes; cached bytes from older generations are stale.
+	volatile SInt32 config_cache_generation;
+	/// Set while a read is filling the cache
+	volatile UInt32 config_cache_filling;
+	SInt32 config_cache_byte_generation[VIRTIO_DEVICE_CONFIG_CACHE_SIZE];
+	uint8_t config_cache_bytes[VIRTIO_DEVICE_CONFIG_CACHE_SIZE];
+	uint64_t config_cache_hits;
+	uint64_t config_cache_misses;
+	uint64_t config_cache_accesses_saved;
+	uint64_t config_cache_invalidations;
+	
+	/// Returns a device config field from the cache, or reads it with read_fn and caches it.
+	/** device_accesses is the number of register accesses read_fn makes, for the statistics. */
+	template <typename T, typename READ_FN> T cachedDeviceConfigRead(uint16_t offset, unsigned device_accesses, READ_FN read_fn);
+	
+	/// Creates a dedicated work loop for a virtqueue completion group, with the context's thread policy applied.
+	static IOWorkLoop* createCompletionWorkLoop(const VirtioVirtqueueCompletionContext& context);
+	
 public:
+	virtual bool init(OSDictionary* dictionary = nullptr) override;
 	virtual bool matchPropertyTable(OSDictionary* table, SInt32* score) override;
 
 	virtual bool resetDevice() = 0;
-	virtual uint32_t supportedFeatures() = 0;
-	virtual bool requestFeatures(uint32_t use_features) = 0;
+	virtual uint64_t supportedFeatures() = 0;
+	virtual bool requestFeatures(uint64_t use_features) = 0;
 	virtual void failDevice() = 0;
 
-	virtual IOReturn setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[] = nullptr, unsigned out_queue_sizes[] = nullptr, const unsigned indirect_desc_per_request[] = nullptr) = 0;
+	/// Sets up the device's virtqueues; all arrays are optional and have one entry per queue.
+	/** completion_contexts selects the work loop on which each queue's
+	 * interrupt driven completions run, see VirtioVirtqueueCompletionContext. */
+	virtual IOReturn setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[] = nullptr, unsigned out_queue_sizes[] = nullptr, const unsigned indirect_desc_per_request[] = nullptr, const VirtioVirtqueueCompletionContext completion_contexts[] = nullptr) = 0;
 	virtual IOReturn setVirtqueueInterruptsEnabled(uint16_t queue_id, bool enabled) = 0;
+	/// The work loop on which the queue's completion actions are called from interrupts.
+	virtual IOWorkLoop* getVirtqueueWorkLoop(uint16_t queue_id) = 0;
 	
 	typedef void(*ConfigChangeAction)(OSObject* target, VirtioDevice* source);
 	virtual void startDevice(ConfigChangeAction action = nullptr, OSObject* target = nullptr, IOWorkLoop* workloop = nullptr) = 0;
 	
+	/// Queues a request; may be called concurrently from multiple threads for the same queue.
+	/** Returns kIOReturnBusy if the queue has too few free descriptors, in
+	 * which case the request should be retried after completions. Queues
+	 * using VIRTIO_F_IN_ORDER still require callers to serialise submission.
+	 * With VIRTIO_F_IN_ORDER, the device may retire several requests with one
+	 * used entry and only reports the written length for the last of them;
+	 * the others complete with num_bytes_written 0, so clients which need
+	 * that length must not negotiate the feature.
+	 * The buffers must stay alive until the completion action has run. Small
+	 * wired buffers, i.e. IOBufferMemoryDescriptors allocated without
+	 * kIOMemoryPageable or kIOMemoryPurgeable, may skip DMA mapping; all
+	 * others are prepared for the duration of the request. */
 	virtual IOReturn submitBuffersToVirtqueue(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion) = 0;
+	/// Like submitBuffersToVirtqueue(), but for buffers mapped up front with registerBuffer().
+	/** Descriptors are written straight from the registered segment lists, so
+	 * neither submission nor completion does any DMA mapping work. Either
+	 * buffer may be null, but not both. */
+	virtual IOReturn submitRegisteredBuffersToVirtqueue(uint16_t queue_index, VirtioRegisteredBuffer* device_readable_buf, VirtioRegisteredBuffer* device_writable_buf, VirtioCompletion completion) = 0;
+	
+	/// Prepares a long-lived buffer for DMA once, for repeated use with submitRegisteredBuffersToVirtqueue().
+	/** The memory descriptor is retained and stays prepared (wired and mapped)
+	 * until the buffer is unregistered. */
+	IOReturn registerBuffer(IOMemoryDescriptor* buffer, VirtioRegisteredBuffer** out_registered_buffer);
+	/// Must not be called while a request using the buffer is in flight.
+	/** Static, so that buffers can still be cleaned up after the client has let go of the device. */
+	static void unregisterBuffer(VirtioRegisteredBuffer* registered_buffer);
+	/// Runs completion actions for finished requests, at most completion_limit of them if non-zero.
+	/** If the limit is reached, interrupts are left as they are and the caller
+	 * should poll again; otherwise, interrupts are re-armed if requested. */
 	virtual unsigned pollCompletedRequestsInVirtqueue(uint16_t queue_index, unsigned completion_limit = 0) = 0;
+	typedef void(*CompletionPassAction)(OSObject* target, uint16_t queue_index);
+	/// Sets an action to run after every pass over the queue's completions which completed anything; null to remove it.
+	/** Lets clients hand on work collected by the individual completion
+	 * actions in one go, e.g. network input. Runs in the same context as the
+	 * completion actions, including polls from debugger context. The target
+	 * is not retained. */
+	virtual IOReturn setVirtqueueCompletionPassAction(uint16_t queue_index, CompletionPassAction action, OSObject* target) = 0;
+	virtual IOReturn getVirtqueueStatistics(uint16_t queue_index, VirtioVirtqueueStatistics* out_stats) = 0;
+
+	/// Defers making requests submitted to the queue visible to the device until the matching commit.
+	/** Batches may be nested; the device is notified at most once, when the
+	 * outermost batch is committed. Completion processing implicitly runs
+	 * inside a batch, so requests resubmitted from completion actions are
+	 * published together. */
+	virtual void beginVirtqueueBatch(uint16_t queue_index) = 0;
+	virtual void commitVirtqueueBatch(uint16_t queue_index) = 0;
+	/// Delays notifying the device of new requests, so that several submissions share one notification.
+	/** The device is notified once max_batch notifications are owed, or
+	 * max_delay_us after the first was deferred, whichever comes first; 0 for
+	 * either turns coalescing off again. Requests are still published straight
+	 * away, so a device polling the ring sees them regardless. Only possible
+	 * once the device has been started, and not concurrently with submissions
+	 * to the queue. */
+	virtual IOReturn setVirtqueueKickCoalescing(uint16_t queue_index, unsigned max_batch, uint32_t max_delay_us) = 0;
+	/// Sends any notification held back by kick coalescing right away.
+	/** Safe to call concurrently with submissions, and from debugger context,
+	 * where the coalescing timer never fires. */
+	virtual void flushVirtqueueKicks(uint16_t queue_index) = 0;
 	
 	virtual uint8_t readDeviceConfig8(uint16_t offset) = 0;
 
@@ -82,6 +170,10 @@ public:
 	virtual void writeDeviceConfig32LETransitional(uint16_t offset, uint32_t value_to_write) = 0;
 
 	uint32_t getVirtioDeviceType() { return virtio_device_type; }
+	
+	/// Drops all cached device config; safe to call from primary interrupt context.
+	void invalidateDeviceConfigCache();
+	void getDeviceConfigCacheStatistics(VirtioDeviceConfigCacheStatistics* out_stats);
 
 private:
 	OSMetaClassDeclareReservedUnused(VirtioDevice, 0);
@@ -117,21 +209,151 @@ struct VirtioCompletion
 	void* ref;
 };
 
-struct VirtioBuffer
+/// Counters for tuning interrupt mitigation on a virtqueue
+struct VirtioVirtqueueStatistics
+{
+	/// Interrupts which masked the queue
+	uint64_t interrupts;
+	/// Budgeted completion passes run on behalf of interrupts
+	uint64_t polls;
+	/// Passes that used up the whole budget, keeping the queue in polling mode
+	uint64_t budget_exhausted;
+	/// Requests completed
+	uint64_t completions;
+	/// Notifications sent to the device, each one a VM exit
+	uint64_t notifications;
+	/// Notifications folded into a later one by kick coalescing: the exits saved
+	uint64_t notifications_coalesced;
+	/// Coalesced notifications sent, and how long the oldest request of each waited for it
+	uint64_t deferred_kicks;
+	uint64_t deferred_kick_latency_total_ns;
+	uint64_t deferred_kick_latency_max_ns;
+};
+
+/// Where a virtqueue's completions run; passed per queue to VirtioDevice::setupVirtqueues().
+/** Queues with the same nonzero group share a dedicated work loop, so their
+ * completions run in parallel with other groups' on different cores. Group 0
+ * runs on the device's work loop. The first queue of a group sets its thread
+ * policy. Separate work loops only take effect when the transport can give
+ * each queue its own interrupt; otherwise all completions run on the device's
+ * work loop. */
+struct VirtioVirtqueueCompletionContext
+{
+	uint8_t group;
+	/// Precedence of the work loop thread relative to other kernel threads (THREAD_PRECEDENCE_POLICY); 0 for the default.
+	int32_t thread_importance;
+	/// Threads sharing a nonzero tag are kept on cores sharing a cache, different tags are spread apart (THREAD_AFFINITY_POLICY).
+	uint32_t affinity_tag;
+};
+
+struct VirtioDeviceConfigCacheStatistics
 {
-	/// Pre-allocated DMA command.
-	/** Only up to 2 DMA commands in a chain will be used, dma_cmd_used will
-	 * indicate which ones need cleaning up after completion. */
+	/// Device config reads answered from the cache
+	uint64_t hits;
+	/// Reads which went to the device
+	uint64_t misses;
+	/// Register accesses, each a VM exit, avoided by cache hits
+	uint64_t accesses_saved;
+	/// Config changes, resets and writes which emptied the cache
+	uint64_t invalidations;
+};
+
+template <typename T, typename READ_FN> T VirtioDevice::cachedDeviceConfigRead(uint16_t offset, unsigned device_accesses, READ_FN read_fn)
+{
+	if (offset + sizeof(T) > VIRTIO_DEVICE_CONFIG_CACHE_SIZE)
+		return read_fn();
+	
+	T value;
+	SInt32 generation = this->config_cache_generation;
+	bool cached = true;
+	for (unsigned i = 0; cached && i < sizeof(T); ++i)
+	{
+		cached = (this->config_cache_byte_generation[offset + i] == generation);
+	}
+	if (cached)
+	{
+		OSMemoryBarrier();
+		memcpy(&value, &this->config_cache_bytes[offset], sizeof(T));
+		OSMemoryBarrier();
+		// an invalidation during the copy may have let a refill change the bytes
+		if (generation == this->config_cache_generation)
+		{
+			this->config_cache_hits++;
+			this->config_cache_accesses_saved += device_accesses;
+			return value;
+		}
+	}
+	
+	this->config_cache_misses++;
+	value = read_fn();
+	// Only one fill at a time, and never one whose value predates an invalidation.
+	if (OSCompareAndSwap(0, 1, &this->config_cache_filling))
+	{
+		if (generation == this->config_cache_generation)
+		{
+			memcpy(&this->config_cache_bytes[offset], &value, sizeof(T));
+			OSMemoryBarrier();
+			for (unsigned i = 0; i < sizeof(T); ++i)
+			{
+				this->config_cache_byte_generation[offset + i] = generation;
+			}
+		}
+		OSMemoryBarrier();
+		this->config_cache_filling = 0;
+	}
+	return value;
+}
+
+/// Physical extent of a registered buffer, as written to a descriptor.
+struct VirtioRegisteredSegment
+{
+	uint64_t phys_address;
+	uint32_t length;
+};
+
+/// A buffer whose DMA mapping persists across requests; see VirtioDevice::registerBuffer().
+struct VirtioRegisteredBuffer
+{
+	IOMemoryDescriptor* memory;
+	/// Holds the mapping for as long as the buffer is registered.
 	IODMACommand* dma_cmd;
+	uint32_t length;
+	unsigned num_segments;
+	VirtioRegisteredSegment segments[];
+};
+
+/// Largest queue size allowed by the virtio spec, for split and packed rings alike
+static const unsigned VIRTIO_MAX_QUEUE_SIZE = 32768;
+/// Marks the end of a descriptor chain or free list; never a valid index as queues have at most 32768 entries.
+static const uint16_t VIRTIO_DESC_INDEX_NONE = 0xffff;
+
+/// Per-descriptor state read and written on every submission and completion.
+/** Holds no object pointers, so that walking chains during completion
+ * processing touches as few cache lines as possible; the DMA commands,
+ * only needed for mapping and unmapping, are kept in VirtioBufferDMA. */
+struct VirtioBuffer
+{
+	/// Next descriptor used in the chain. VIRTIO_DESC_INDEX_NONE to indicate last descriptor in chain.
+	/** Also used for maintaining the list of unused descriptors. */
+	uint16_t next_desc;
+	/// Whether the descriptor's DMA command(s) need cleaning up after completion.
+	bool dma_cmd_used;
+	/// Indirect descriptors only: large table borrowed by the request, or
+	/// VIRTIO_DESC_INDEX_NONE if it fit into this descriptor's own small table.
+	uint16_t indirect_large_table;
+	/// Packed rings only: number of ring slots taken up by the request using this buffer ID, 0 if unused.
+	uint16_t packed_chain_length;
 	/// Mechanism for notifying the client that submitted the request.
 	/** Only the completion of the first descriptor in the chain for a request is used. */
 	VirtioCompletion completion;
-	/// Next descriptor used in the chain. -1 to indicate last descriptor in chain.
-	/** Also used for maintaining the list of unused descriptors. */
-	int16_t next_desc;
-	bool dma_cmd_used;
-	IOBufferMemoryDescriptor* indirect_descriptors;
-	IODMACommand* dma_indirect_descriptors;
+};
+
+/// Pre-allocated DMA commands, one set per descriptor; parallel to the VirtioBuffer array.
+/** Only up to 2 DMA commands in a chain will be used, VirtioBuffer::dma_cmd_used
+ * will indicate which ones need cleaning up after completion. */
+struct VirtioBufferDMA
+{
+	IODMACommand* dma_cmd;
 	IODMACommand* dma_cmd_2;
 };
 
@@ -151,17 +373,57 @@ struct VirtioVirtqueue
 	
 	/// Value of used_ring->head_index last time the used ring was checked for activity.
 	uint16_t used_ring_last_head_index;
+	/// Next slot in available_ring to be claimed by a submitter; advanced atomically.
+	volatile uint16_t available_ring_next_index;
+	/// Per avail ring slot: the avail position it was last filled for.
+	/** A submitter writes its slot's position here once the slot holds its
+	 * chain, so publishers can tell filled slots from merely claimed ones
+	 * without anybody waiting for anybody else. */
+	volatile uint16_t* available_ring_ready;
+	/// Nesting depth of open submission batches; the avail ring is only published at 0.
+	volatile SInt32 batch_depth;
 	
 	VirtioBuffer* descriptor_buffers;
+	VirtioBufferDMA* descriptor_dma;
 
 	/// Whether or not the client driver would like interrupts on request completion
 	bool interrupts_requested;
 	
+	VirtioVirtqueueStatistics stats;
+	
 	bool indirect_descriptors;
-
-	/// If >= 0, an unused descriptor table entry, with all others chained along next_desc
-	int16_t first_unused_descriptor_index;
-	unsigned num_unused_descriptors;
+	/// All indirect descriptor tables for the queue, carved from one physically contiguous slab.
+	/** Each ring descriptor owns a small table at a fixed offset; requests
+	 * that need more entries borrow one of the fewer large tables, which
+	 * follow the small ones and are kept on a lock-free stack like the
+	 * descriptors themselves. */
+	VirtioVringDesc* indirect_tables;
+	uint64_t indirect_tables_phys;
+	unsigned indirect_small_table_size;
+	/// 0 if a small table already holds the maximum number of descriptors per request.
+	unsigned indirect_large_table_size;
+	unsigned indirect_num_large_tables;
+	volatile UInt32 indirect_large_free_head;
+	uint16_t* indirect_large_next;
+	/// VIRTIO_F_RING_EVENT_IDX negotiated: used_ring_interrupt_index and
+	/// avail_ring_notify_index are authoritative, ring flags are ignored.
+	bool event_index;
+	/// VIRTIO_F_IN_ORDER negotiated: descriptors are handed out in table order
+	/// and one used entry retires all requests made available before it.
+	bool in_order;
+
+	/// Lock-free stack of unused descriptors, chained along next_desc.
+	/** The low 16 bits hold the index of the top entry (UINT16_MAX if empty),
+	 * the high 16 bits a tag that changes with every update, so that a
+	 * compare-and-swap against a stale head fails even when the same index
+	 * has found its way back to the top (ABA). */
+	volatile UInt32 free_list_head;
+	/// With in_order only: the next descriptor to hand out; the unused
+	/// descriptors are the num_unused_descriptors entries starting there.
+	uint16_t first_unused_descriptor_index;
+	/// Never less than the number of descriptors actually available, but may
+	/// briefly exceed it while concurrent reservations are in progress.
+	volatile SInt32 num_unused_descriptors;
 };
 
 namespace VirtioVringDescFlag
@@ -215,12 +477,57 @@ struct VirtioVringUsed
 	VirtioVringUsedElement ring[];
 };
 
+/// Packed ring descriptor (VIRTIO_F_RING_PACKED): descriptor and used rings in one.
+struct VirtioVringPackedDesc
+{
+	uint64_t phys_address;
+	uint32_t length_bytes;
+	uint16_t buffer_id;
+	uint16_t flags;
+};
+namespace VirtioVringPackedDescFlag
+{
+	enum VirtioVringPackedDescFlags : uint16_t
+	{
+		NEXT = 1,
+		DEVICE_WRITABLE = 2,
+		INDIRECT = 4,
+		AVAIL = (1u << 7u),
+		USED = (1u << 15u),
+	};
+}
+
+/// Driver and device event suppression areas of a packed ring.
+struct VirtioVringPackedEvent
+{
+	/// Bits 0-14: ring slot, bit 15: wrap counter. Only meaningful with DESC.
+	uint16_t offset_wrap;
+	uint16_t flags;
+};
+namespace VirtioVringPackedEventFlag
+{
+	enum VirtioVringPackedEventFlags : uint16_t
+	{
+		ENABLE = 0,
+		DISABLE = 1,
+		/// Only with VIRTIO_F_RING_EVENT_IDX: notify once offset_wrap has been reached
+		DESC = 2,
+	};
+}
+
 namespace VirtioDeviceGenericFeature
 {
-  enum VirtioDeviceGenericFeatures
+  enum VirtioDeviceGenericFeatures : uint64_t
 	{
 		VIRTIO_F_RING_EVENT_IDX = (1u << 29u),
 		VIRTIO_F_RING_INDIRECT_DESC = (1u << 28u),
+		// Feature bits 32 and up are only offered by modern devices
+		/// Modern (virtio 1.0) device; must be negotiated on the modern PCI transport
+		VIRTIO_F_VERSION_1 = (1ull << 32u),
+		VIRTIO_F_RING_PACKED = (1ull << 34u),
+		VIRTIO_F_IN_ORDER = (1ull << 35u),
+		/// Doorbell writes also carry the queue's next available index
+		VIRTIO_F_NOTIFICATION_DATA = (1ull << 38u),
 	};
 }
 
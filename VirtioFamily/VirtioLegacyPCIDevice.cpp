@@ -8,17 +8,29 @@
 
 #define __STDC_LIMIT_MACROS
 #include "VirtioLegacyPCIDevice.h"
+#include "VirtioSplitVirtqueue.h"
+#include "VirtioPackedVirtqueue.h"
 #include <IOKit/IOLib.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IODMACommand.h>
+#include <IOKit/IOMapper.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/clock.h>
 #include <stdint.h>
+#include "../virtio-net/virtio_ring.h"
 
 OSDefineMetaClassAndStructors(VirtioLegacyPCIDevice, VirtioDevice);
 
 #define CHECK_BIT(var,pos) ((var) & (1llu<<(pos)))
 #define VIRTIO_PCI_DEVICE_ISR_USED 0x01
 #define VIRTIO_PCI_DEVICE_ISR_CONF_CHANGE 0x02
+/// PCI device IDs from here on are non-transitional devices, of type (ID - base)
+#define VIRTIO_PCI_MODERN_DEVICE_ID_BASE 0x1040
+
+/// Default for VirtioInterruptPollBudget, which may be overridden in the personality
+static const unsigned VIRTIO_DEFAULT_INTERRUPT_POLL_BUDGET = 64;
 
 
 namespace VirtioLegacyHeaderOffset
@@ -44,14 +56,76 @@ namespace
 	const size_t VIRTIO_LEGACY_HEADER_MIN_LEN = VirtioLegacyHeaderOffset::BASIC_END_HEADER;
 }
 
-struct VirtioLegacyPCIVirtqueue
+/// Ring memory allocations: one block for the whole vring on the legacy
+/// transport, the descriptor table, available and used rings separately otherwise.
+enum VirtioRingAllocation
 {
-	IOBufferMemoryDescriptor* queue_mem;
-	IODMACommand* queue_mem_dma;
+	VIRTIO_RING_ALLOC_DESCRIPTORS = 0,
+	VIRTIO_RING_ALLOC_AVAILABLE,
+	VIRTIO_RING_ALLOC_USED,
+	VIRTIO_RING_ALLOC_MAX
+};
 
+struct VirtioLegacyPCIVirtqueue
+{
+	IOBufferMemoryDescriptor* ring_mem[VIRTIO_RING_ALLOC_MAX];
+	IODMACommand* ring_mem_dma[VIRTIO_RING_ALLOC_MAX];
+	/// Backing memory for queue.indirect_tables, if indirect descriptors are used
+	IOBufferMemoryDescriptor* indirect_slab;
+	IODMACommand* indirect_slab_dma;
+	/// Dedicated MSI-X interrupt source, if the device has enough vectors
+	IOFilterInterruptEventSource* intr_event_source;
+	/// Work loop of the queue's completion group, shared with the group's other queues; null for the device's work loop
+	IOWorkLoop* work_loop;
+	
+	/// Kick coalescing: fires kick_max_delay_us after a notification was first deferred; null if coalescing is off
+	IOTimerEventSource* kick_timer;
+	unsigned kick_max_batch;
+	uint32_t kick_max_delay_us;
+	/// Notifications owed to the device
+	volatile SInt32 kicks_deferred;
+	volatile UInt32 kick_timer_armed;
+	/// Runs after each completion pass that completed anything; not retained
+	VirtioDevice::CompletionPassAction pass_action;
+	OSObject* pass_target;
+	
+	/// mach_absolute_time() when the oldest owed notification was deferred; 0 if not yet recorded
+	/** Set by submitters and cleared by the flusher, both with atomic ops,
+	 * as submissions may come from several threads at once and race with
+	 * the timer. */
+	volatile UInt64 kick_deferred_since;
+
+	/// VIRTIO_F_RING_PACKED negotiated: requests go through packed, not queue's split rings
+	/** queue still holds the size, batch depth and statistics either way. */
+	bool packed_ring;
+	struct VirtioPackedVirtqueue packed;
 	struct VirtioVirtqueue queue;
 };
 
+/// What notification data carries for the queue's most recently published requests
+static inline uint16_t virtqueue_notify_index(VirtioLegacyPCIVirtqueue* vq)
+{
+	if (vq->packed_ring)
+		return virtio_packed_virtqueue_next_offset_wrap(&vq->packed);
+	return vq->queue.available_ring->head_index;
+}
+
+static inline bool virtqueue_has_completed(VirtioLegacyPCIVirtqueue* vq)
+{
+	if (vq->packed_ring)
+		return virtio_packed_virtqueue_has_completed(&vq->packed);
+	return vq->queue.used_ring->head_index != vq->queue.used_ring_last_head_index;
+}
+
+/// Safe from primary interrupt context.
+static inline void virtqueue_disable_interrupts(VirtioLegacyPCIVirtqueue* vq)
+{
+	if (vq->packed_ring)
+		virtio_packed_virtqueue_disable_interrupts(&vq->packed);
+	else
+		virtio_virtqueue_disable_interrupts(&vq->queue);
+}
+
 static inline bool is_pow2(uint16_t num)
 {
 	return 0u == (num & (num - 1));
@@ -142,16 +216,22 @@ bool VirtioLegacyPCIDevice::start(IOService* provider)
 	//correct length
 	uint32_t deviceType;
 	memcpy(&deviceType, deviceTypeIDData->getBytesNoCopy(), 4);
+	// Non-transitional (virtio 1.0 only) devices encode the type in the PCI device ID instead
+	uint16_t pciDeviceID = pciDevice->configRead16(kIOPCIConfigDeviceID);
+	if (pciDeviceID >= VIRTIO_PCI_MODERN_DEVICE_ID_BASE)
+	{
+		deviceType = pciDeviceID - VIRTIO_PCI_MODERN_DEVICE_ID_BASE;
+	}
 	this->virtio_device_type = deviceType;
 	this->setProperty("VirtioDeviceTypeID", deviceType, 32);
 	char name [100];
 	if (deviceType < DIMENSIONOF(VIRTIO_DEVICE_TYPES))
 	{
-		snprintf(name, sizeof(name), "VirtioPCILegacyDevice@%s", VIRTIO_DEVICE_TYPES[deviceType]);
+		snprintf(name, sizeof(name), "%s@%s", this->transportName(), VIRTIO_DEVICE_TYPES[deviceType]);
 	}
 	else
 	{
-		snprintf(name, sizeof(name), "VirtioPCILegacyDevice@%d", deviceType);
+		snprintf(name, sizeof(name), "%s@%d", this->transportName(), deviceType);
 	}
 	
 	this->setName(name);
@@ -171,10 +251,19 @@ bool VirtioLegacyPCIDevice::start(IOService* provider)
 	
 	this->deviceSpecificConfigStartHeaderOffset = VirtioLegacyHeaderOffset::BASIC_END_HEADER;
 	
+	this->interrupt_poll_budget = VIRTIO_DEFAULT_INTERRUPT_POLL_BUDGET;
+	OSNumber* poll_budget = OSDynamicCast(OSNumber, this->getProperty("VirtioInterruptPollBudget"));
+	if (poll_budget != nullptr && poll_budget->unsigned32BitValue() > 0)
+	{
+		this->interrupt_poll_budget = poll_budget->unsigned32BitValue();
+	}
+	// Without an IOMMU, bus addresses are physical addresses, so wired buffers can skip IODMACommand.
+	this->inline_physical_segments = (IOMapper::gSystem == nullptr);
+	
 	this->resetDevice();
 	//write out supported features
-	uint32_t supportedFeatures = this->supportedFeatures();
-	this->setProperty("VirtioDeviceSupportedFeatures", supportedFeatures, 32);
+	uint64_t supportedFeatures = this->supportedFeatures();
+	this->setProperty("VirtioDeviceSupportedFeatures", supportedFeatures, 64);
 	
 	this->failDevice();
 	
@@ -182,6 +271,11 @@ bool VirtioLegacyPCIDevice::start(IOService* provider)
 	return true;
 }
 
+const char* VirtioLegacyPCIDevice::transportName() const
+{
+	return "VirtioPCILegacyDevice";
+}
+
 bool VirtioLegacyPCIDevice::mapHeaderIORegion()
 {
 	assert(this->pci_virtio_header_iomap==NULL);
@@ -207,10 +301,16 @@ bool VirtioLegacyPCIDevice::mapHeaderIORegion()
 	return true;
 }
 
+void VirtioLegacyPCIDevice::unmapHeaderIORegion()
+{
+	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
+}
+
 
 bool VirtioLegacyPCIDevice::resetDevice()
 {
 	this->pci_device->ioWrite8(VirtioLegacyHeaderOffset::DEVICE_STATUS, 0, this->pci_virtio_header_iomap);
+	this->invalidateDeviceConfigCache();
 	uint16_t deviceStatusValue = this->pci_device->ioRead8(
 		VirtioLegacyHeaderOffset::DEVICE_STATUS, this->pci_virtio_header_iomap);
 	if(deviceStatusValue != 0)
@@ -223,28 +323,23 @@ bool VirtioLegacyPCIDevice::resetDevice()
 	return true;
 }
 
-uint32_t VirtioLegacyPCIDevice::supportedFeatures()
+uint64_t VirtioLegacyPCIDevice::supportedFeatures()
 {
 	return this->features;
 }
 
-bool VirtioLegacyPCIDevice::requestFeatures(uint32_t use_features)
+bool VirtioLegacyPCIDevice::requestFeatures(uint64_t use_features)
 {
 //read out feature bits
 	
-	uint32_t invertedSupportedFeatures = ~this->features;
-	uint32_t supportedFeaturesANDuseFeatures = invertedSupportedFeatures & use_features;
+	// the legacy header only has 32 feature bits, so high bits are never offered
+	uint64_t invertedSupportedFeatures = ~this->features;
+	uint64_t supportedFeaturesANDuseFeatures = invertedSupportedFeatures & use_features;
 	if (supportedFeaturesANDuseFeatures != 0)
 	{
 		//a feature is present in the use features that is not supported
 		return false;
 	}
-	if ((use_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_EVENT_IDX) != 0)
-	{
-		IOLog("VirtioLegacyPCIDevice::requestFeatures(): feature VIRTIO_F_RING_EVENT_IDX (bit 29) is not currently supported.\n");
-		return false;
-	}
-	
 	//check bit 30 isnt set
 	if (CHECK_BIT(use_features, 30))
 	{
@@ -253,9 +348,10 @@ bool VirtioLegacyPCIDevice::requestFeatures(uint32_t use_features)
 		return false;
 	}
 	this->active_features = use_features;
+	this->eventIndexFeatureEnabled = (use_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_EVENT_IDX) != 0;
 	
 	//otherwise all use features are in our supported features
-	this->pci_device->ioWrite32(VirtioLegacyHeaderOffset::GUEST_FEATURE_BITS_0_31, use_features, this->pci_virtio_header_iomap);
+	this->pci_device->ioWrite32(VirtioLegacyHeaderOffset::GUEST_FEATURE_BITS_0_31, static_cast<uint32_t>(use_features), this->pci_virtio_header_iomap);
 	return true;
 }
 
@@ -264,7 +360,7 @@ void VirtioLegacyPCIDevice::failDevice()
 	//write 128 to device status field realse and null memory OSSafe Realease
 	this->pci_device->ioWrite8(VirtioLegacyHeaderOffset::DEVICE_STATUS, 128, this->pci_virtio_header_iomap);
 	this->endHandlingInterrupts();
-	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
+	this->unmapHeaderIORegion();
 }
 
 /// Virtqueue size calculation, see section 2.3 in legacy virtio spec
@@ -275,56 +371,129 @@ static inline unsigned virtio_page_align(unsigned size)
 }
 static inline unsigned vring_mem_size(unsigned qsz)
 {
-	return virtio_page_align(sizeof(VirtioVringDesc) * qsz + sizeof(uint16_t) * (2 + qsz))
-		+ virtio_page_align(sizeof(VirtioVringUsedElement) * qsz);
+	// avail ring: flags, head index, ring, used_event; used ring: flags, head index, ring, avail_event
+	return virtio_page_align(sizeof(VirtioVringDesc) * qsz + sizeof(uint16_t) * (3 + qsz))
+		+ virtio_page_align(sizeof(uint16_t) * 3 + sizeof(VirtioVringUsedElement) * qsz);
 }
 
-IOReturn VirtioLegacyPCIDevice::setupVirtqueue(VirtioLegacyPCIVirtqueue* queue, uint16_t queue_id, bool interrupts_enabled, unsigned indirect_desc_per_request)
+/// Entries in each ring descriptor's own indirect table; requests needing more borrow a large table.
+static const unsigned VIRTIO_INDIRECT_SMALL_TABLE_SIZE = 8;
+/// Ring descriptors per large indirect table
+static const unsigned VIRTIO_INDIRECT_DESCS_PER_LARGE_TABLE = 4;
+
+/// Allocates all indirect descriptor tables for a queue as one physically contiguous slab.
+static IOReturn setup_indirect_table_slab(VirtioLegacyPCIVirtqueue* queue, unsigned num_queue_entries, unsigned indirect_desc_per_request)
 {
-	// write queue selector
-	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_SELECT, queue_id, this->pci_virtio_header_iomap);
+	unsigned small_table_size = min(indirect_desc_per_request, VIRTIO_INDIRECT_SMALL_TABLE_SIZE);
+	unsigned large_table_size = 0;
+	unsigned num_large_tables = 0;
+	if (indirect_desc_per_request > small_table_size)
+	{
+		large_table_size = indirect_desc_per_request;
+		num_large_tables = max(1u, num_queue_entries / VIRTIO_INDIRECT_DESCS_PER_LARGE_TABLE);
+	}
+	const size_t slab_size = sizeof(VirtioVringDesc)
+		* (static_cast<size_t>(small_table_size) * num_queue_entries + static_cast<size_t>(large_table_size) * num_large_tables);
 	
-	// read queue size
-	uint16_t num_queue_entries = this->pci_device->ioRead16(VirtioLegacyHeaderOffset::QUEUE_SIZE, this->pci_virtio_header_iomap);
-	// TODO: check it's power of 2
-	if (num_queue_entries == 0)
+	IOBufferMemoryDescriptor* slab = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
+		kernel_task, kIOMemoryPhysicallyContiguous | kIODirectionOut, slab_size, ~static_cast<mach_vm_address_t>(VIRTIO_PAGE_SIZE - 1u));
+	if (slab == nullptr)
+		return kIOReturnNoMemory;
+	
+	IODMACommand* slab_dma = IODMACommand::withSpecification(
+		IODMACommand::OutputHost64, 64, 0 /* no limit on segment size */, IODMACommand::kMapped, 0 /* no limit on transfer size */, VIRTIO_PAGE_SIZE /* alignment */);
+	if (slab_dma == nullptr)
 	{
-		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is 0.\n", queue_id);
-		return kIOReturnBadArgument;
+		OSSafeReleaseNULL(slab);
+		return kIOReturnNoMemory;
 	}
-	else if (!is_pow2(num_queue_entries))
+	IOReturn result = slab_dma->setMemoryDescriptor(slab);
+	if (result != kIOReturnSuccess)
 	{
-		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is %u, which is not a power of 2. Aborting.\n", queue_id, num_queue_entries);
-		return kIOReturnDeviceError;
+		OSSafeReleaseNULL(slab);
+		OSSafeReleaseNULL(slab_dma);
+		return result;
+	}
+	IODMACommand::Segment64 phys_segment = {};
+	uint64_t offset = 0;
+	UInt32 num_segments = 1;
+	result = slab_dma->genIOVMSegments(&offset, &phys_segment, &num_segments);
+	if (result == kIOReturnSuccess && (offset != slab_size || num_segments != 1 || phys_segment.fLength != slab_size))
+	{
+		result = kIOReturnInternalError;
 	}
-	//IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is %u.\n", queue_id, num_queue_entries);
-
-	// calculate queue memory size
-	const size_t queue_mem_size = vring_mem_size(num_queue_entries);
 	
-	// allocate & zero-init queue memory
-	const mach_vm_address_t VIRTIO_RING_ALLOC_MASK = 0xffffffffull << 12u;
-	IOBufferMemoryDescriptor* queue_mem = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
-		kernel_task, kIOMemoryPhysicallyContiguous | kIODirectionInOut, queue_mem_size, VIRTIO_RING_ALLOC_MASK);
-	if (queue_mem == nullptr)
-		return kIOReturnNoMemory;
+	uint16_t* large_next = nullptr;
+	if (result == kIOReturnSuccess && num_large_tables > 0)
+	{
+		large_next = static_cast<uint16_t*>(IOMalloc(sizeof(large_next[0]) * num_large_tables));
+		if (large_next == nullptr)
+			result = kIOReturnNoMemory;
+	}
+	if (result != kIOReturnSuccess)
+	{
+		slab_dma->clearMemoryDescriptor();
+		OSSafeReleaseNULL(slab);
+		OSSafeReleaseNULL(slab_dma);
+		return result;
+	}
 	
-	memset(queue_mem->getBytesNoCopy(), 0, queue_mem_size);
+	// all large tables start out unused
+	for (unsigned i = 0; i < num_large_tables; ++i)
+	{
+		large_next[i] = (i + 1 < num_large_tables) ? i + 1 : VIRTIO_DESC_INDEX_NONE;
+	}
+	queue->queue.indirect_large_free_head = (num_large_tables > 0) ? 0 : VIRTIO_DESC_INDEX_NONE;
+	queue->queue.indirect_large_next = large_next;
+	queue->queue.indirect_num_large_tables = num_large_tables;
+	queue->queue.indirect_small_table_size = small_table_size;
+	queue->queue.indirect_large_table_size = large_table_size;
+	queue->queue.indirect_tables = static_cast<VirtioVringDesc*>(slab->getBytesNoCopy());
+	queue->queue.indirect_tables_phys = phys_segment.fIOVMAddr;
+	queue->indirect_slab = slab;
+	queue->indirect_slab_dma = slab_dma;
+	return kIOReturnSuccess;
+}
+
+static void destroy_indirect_table_slab(VirtioLegacyPCIVirtqueue* queue)
+{
+	if (queue->indirect_slab_dma != nullptr)
+		queue->indirect_slab_dma->clearMemoryDescriptor();
+	OSSafeReleaseNULL(queue->indirect_slab_dma);
+	OSSafeReleaseNULL(queue->indirect_slab);
+	if (queue->queue.indirect_large_next != nullptr)
+	{
+		IOFree(queue->queue.indirect_large_next, sizeof(queue->queue.indirect_large_next[0]) * queue->queue.indirect_num_large_tables);
+		queue->queue.indirect_large_next = nullptr;
+	}
+	queue->queue.indirect_tables = nullptr;
+}
 
+static void destroy_virtqueue(VirtioLegacyPCIVirtqueue* queue);
 
+/// Allocates zeroed, physically contiguous memory for (part of) a vring and looks up its bus address.
+static IOReturn allocate_ring_memory(size_t size, uint8_t address_bits, size_t alignment, IOBufferMemoryDescriptor** out_mem, IODMACommand** out_dma, uint64_t* out_phys)
+{
+	const mach_vm_address_t phys_mask = (address_bits >= 64 ? ~0ull : ((1ull << address_bits) - 1u)) & ~static_cast<mach_vm_address_t>(alignment - 1u);
+	IOBufferMemoryDescriptor* mem = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
+		kernel_task, kIOMemoryPhysicallyContiguous | kIODirectionInOut, size, phys_mask);
+	if (mem == nullptr)
+		return kIOReturnNoMemory;
+	memset(mem->getBytesNoCopy(), 0, size);
+	
 	// allocate and inititalise DMA command (in+out directions)
 	IODMACommand* dma_cmd = IODMACommand::withSpecification(
-		IODMACommand::OutputHost64, 12 + 32,
-		0 /* no limit on segment size */, IODMACommand::kMapped, 0 /* no limit on transfer size */, 4096 /* alignment */);
+		IODMACommand::OutputHost64, address_bits,
+		0 /* no limit on segment size */, IODMACommand::kMapped, 0 /* no limit on transfer size */, static_cast<UInt32>(alignment));
 	if (dma_cmd == nullptr)
 	{
-		OSSafeReleaseNULL(queue_mem);
+		OSSafeReleaseNULL(mem);
 		return kIOReturnNoMemory;
 	}
-	IOReturn result = dma_cmd->setMemoryDescriptor(queue_mem);
+	IOReturn result = dma_cmd->setMemoryDescriptor(mem);
 	if (result != kIOReturnSuccess)
 	{
-		OSSafeReleaseNULL(queue_mem);
+		OSSafeReleaseNULL(mem);
 		OSSafeReleaseNULL(dma_cmd);
 		return result;
 	}
@@ -333,66 +502,199 @@ IOReturn VirtioLegacyPCIDevice::setupVirtqueue(VirtioLegacyPCIVirtqueue* queue,
 	uint64_t offset = 0;
 	UInt32 num_segments = 1;
 	result = dma_cmd->genIOVMSegments(&offset, &phys_segment, &num_segments);
-	if (result == kIOReturnSuccess && (offset != queue_mem_size || num_segments != 1 || phys_segment.fLength != queue_mem_size))
+	if (result == kIOReturnSuccess && (offset != size || num_segments != 1 || phys_segment.fLength != size))
 	{
 		result = kIOReturnInternalError;
 	}
 	if (result != kIOReturnSuccess)
 	{
 		dma_cmd->clearMemoryDescriptor();
-		OSSafeReleaseNULL(queue_mem);
+		OSSafeReleaseNULL(mem);
 		OSSafeReleaseNULL(dma_cmd);
 		return result;
 	}
+	*out_mem = mem;
+	*out_dma = dma_cmd;
+	*out_phys = phys_segment.fIOVMAddr;
+	return kIOReturnSuccess;
+}
+
+static void free_ring_memory(VirtioLegacyPCIVirtqueue* queue)
+{
+	for (unsigned i = 0; i < VIRTIO_RING_ALLOC_MAX; ++i)
+	{
+		if (queue->ring_mem_dma[i] != nullptr)
+			queue->ring_mem_dma[i]->clearMemoryDescriptor();
+		OSSafeReleaseNULL(queue->ring_mem_dma[i]);
+		OSSafeReleaseNULL(queue->ring_mem[i]);
+	}
+}
+
+/// Sizes of the split ring parts, see section 2.4 of the virtio 1.0 spec.
+static inline size_t vring_avail_size(unsigned qsz)
+{
+	// flags, head index, ring, used_event
+	return sizeof(uint16_t) * (3 + qsz);
+}
+static inline size_t vring_used_size(unsigned qsz)
+{
+	// flags, head index, ring, avail_event
+	return sizeof(uint16_t) * 3 + sizeof(VirtioVringUsedElement) * qsz;
+}
+
+/** Points the queue at its rings and returns their bus addresses in
+ * ring_phys. Legacy devices only take a single page frame number, so the
+ * whole vring must sit in one block in the low 44 bits of the address
+ * space; modern devices accept any 64-bit address for each part. */
+static IOReturn allocate_vring(VirtioLegacyPCIVirtqueue* queue, unsigned num_queue_entries, bool separate_allocations, uint64_t ring_phys[VIRTIO_RING_ALLOC_MAX])
+{
+	const size_t desc_size = sizeof(VirtioVringDesc) * num_queue_entries;
+	uint8_t* ring_bytes[VIRTIO_RING_ALLOC_MAX] = {};
+	if (separate_allocations)
+	{
+		// alignment requirements from section 2.4 of the virtio 1.0 spec
+		const size_t sizes[VIRTIO_RING_ALLOC_MAX] = { desc_size, vring_avail_size(num_queue_entries), vring_used_size(num_queue_entries) };
+		const size_t alignments[VIRTIO_RING_ALLOC_MAX] = { 16, 2, 4 };
+		for (unsigned i = 0; i < VIRTIO_RING_ALLOC_MAX; ++i)
+		{
+			IOReturn result = allocate_ring_memory(sizes[i], 64, alignments[i], &queue->ring_mem[i], &queue->ring_mem_dma[i], &ring_phys[i]);
+			if (result != kIOReturnSuccess)
+			{
+				free_ring_memory(queue);
+				return result;
+			}
+			ring_bytes[i] = static_cast<uint8_t*>(queue->ring_mem[i]->getBytesNoCopy());
+		}
+	}
+	else
+	{
+		IOReturn result = allocate_ring_memory(
+			vring_mem_size(num_queue_entries), 12 + 32, VIRTIO_PAGE_SIZE,
+			&queue->ring_mem[VIRTIO_RING_ALLOC_DESCRIPTORS], &queue->ring_mem_dma[VIRTIO_RING_ALLOC_DESCRIPTORS], &ring_phys[VIRTIO_RING_ALLOC_DESCRIPTORS]);
+		if (result != kIOReturnSuccess)
+			return result;
+		
+		// avail ring follows the descriptor table, used ring starts on the next page
+		const size_t avail_offset = desc_size;
+		const size_t used_offset = virtio_page_align(static_cast<unsigned>(avail_offset + vring_avail_size(num_queue_entries)));
+		uint8_t* queue_mem_bytes = static_cast<uint8_t*>(queue->ring_mem[VIRTIO_RING_ALLOC_DESCRIPTORS]->getBytesNoCopy());
+		ring_bytes[VIRTIO_RING_ALLOC_DESCRIPTORS] = queue_mem_bytes;
+		ring_bytes[VIRTIO_RING_ALLOC_AVAILABLE] = queue_mem_bytes + avail_offset;
+		ring_bytes[VIRTIO_RING_ALLOC_USED] = queue_mem_bytes + used_offset;
+		ring_phys[VIRTIO_RING_ALLOC_AVAILABLE] = ring_phys[VIRTIO_RING_ALLOC_DESCRIPTORS] + avail_offset;
+		ring_phys[VIRTIO_RING_ALLOC_USED] = ring_phys[VIRTIO_RING_ALLOC_DESCRIPTORS] + used_offset;
+	}
+	
+	// fill out virtqueue pointer fields (desc table, rings, etc.)
+	queue->queue.descriptor_table = reinterpret_cast<VirtioVringDesc*>(ring_bytes[VIRTIO_RING_ALLOC_DESCRIPTORS]);
+	queue->queue.available_ring = reinterpret_cast<VirtioVringAvail*>(ring_bytes[VIRTIO_RING_ALLOC_AVAILABLE]);
+	// used_event lives directly after the avail ring; only meaningful with VIRTIO_F_RING_EVENT_IDX
+	queue->queue.used_ring_interrupt_index = &queue->queue.available_ring->ring[num_queue_entries];
+	queue->queue.used_ring = reinterpret_cast<VirtioVringUsed*>(ring_bytes[VIRTIO_RING_ALLOC_USED]);
+	// avail_event directly follows the used ring
+	queue->queue.avail_ring_notify_index = reinterpret_cast<uint16_t*>(&queue->queue.used_ring->ring[num_queue_entries]);
+	return kIOReturnSuccess;
+}
+
+IOReturn VirtioLegacyPCIDevice::setupVirtqueue(VirtioLegacyPCIVirtqueue* queue, uint16_t queue_id, bool interrupts_enabled, unsigned indirect_desc_per_request)
+{
+	uint16_t num_queue_entries = this->selectVirtqueue(queue_id);
+	if (num_queue_entries == 0)
+	{
+		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is 0.\n", queue_id);
+		return kIOReturnBadArgument;
+	}
+	else if (this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_PACKED)
+	{
+		// feature bit 34, so modern devices only; packed queue sizes needn't be powers of 2
+		return this->setupPackedVirtqueue(queue, queue_id, num_queue_entries, interrupts_enabled);
+	}
+	else if (!is_pow2(num_queue_entries))
+	{
+		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is %u, which is not a power of 2. Aborting.\n", queue_id, num_queue_entries);
+		return kIOReturnDeviceError;
+	}
+	else if (num_queue_entries > VIRTIO_MAX_QUEUE_SIZE)
+	{
+		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is %u, which exceeds the maximum of %u. Aborting.\n", queue_id, num_queue_entries, VIRTIO_MAX_QUEUE_SIZE);
+		return kIOReturnDeviceError;
+	}
+	//IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Queue size for queue %u is %u.\n", queue_id, num_queue_entries);
+
+	uint64_t ring_phys[VIRTIO_RING_ALLOC_MAX] = {};
+	IOReturn result = allocate_vring(queue, num_queue_entries, this->separate_ring_allocations, ring_phys);
+	if (result != kIOReturnSuccess)
+		return result;
 	
 	bool use_indirect =
 		((this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC) && indirect_desc_per_request > 0);
 	queue->queue.indirect_descriptors = use_indirect;
+	if (use_indirect)
+	{
+		result = setup_indirect_table_slab(queue, num_queue_entries, indirect_desc_per_request);
+		if (result != kIOReturnSuccess)
+		{
+			free_ring_memory(queue);
+			return result;
+		}
+	}
 	
 	// allocate array of VirtioBuffers for descriptor_array
 	const size_t desc_buffer_array_size = sizeof(queue->queue.descriptor_buffers[0]) * num_queue_entries;
 	VirtioBuffer* descriptor_buffers = static_cast<VirtioBuffer*>(
 		IOMallocAligned(desc_buffer_array_size, alignof(decltype(queue->queue.descriptor_buffers[0]))));
+	// and the parallel array of their DMA commands
+	const size_t desc_dma_array_size = sizeof(queue->queue.descriptor_dma[0]) * num_queue_entries;
+	VirtioBufferDMA* descriptor_dma = static_cast<VirtioBufferDMA*>(
+		IOMallocAligned(desc_dma_array_size, alignof(decltype(queue->queue.descriptor_dma[0]))));
+	// and the avail ring slots' fill markers
+	const size_t avail_ready_array_size = sizeof(queue->queue.available_ring_ready[0]) * num_queue_entries;
+	volatile uint16_t* available_ring_ready = static_cast<volatile uint16_t*>(IOMalloc(avail_ready_array_size));
+	if (descriptor_buffers == nullptr || descriptor_dma == nullptr || available_ring_ready == nullptr)
+	{
+		if (descriptor_buffers != nullptr)
+			IOFreeAligned(descriptor_buffers, desc_buffer_array_size);
+		if (descriptor_dma != nullptr)
+			IOFreeAligned(descriptor_dma, desc_dma_array_size);
+		if (available_ring_ready != nullptr)
+			IOFree(const_cast<uint16_t*>(available_ring_ready), avail_ready_array_size);
+		destroy_indirect_table_slab(queue);
+		free_ring_memory(queue);
+		return kIOReturnNoMemory;
+	}
 	memset(descriptor_buffers, 0, desc_buffer_array_size);
+	memset(descriptor_dma, 0, desc_dma_array_size);
 	for (unsigned i = 0; i < num_queue_entries; i++)
 	{
 		bool ok = true;
 
+		descriptor_buffers[i].indirect_large_table = VIRTIO_DESC_INDEX_NONE;
 		if(use_indirect)
 		{
-			IOBufferMemoryDescriptor* indirect_descriptors = IOBufferMemoryDescriptor::inTaskWithOptions(
-				kernel_task, kIODirectionOut | kIOMemoryPhysicallyContiguous, indirect_desc_per_request * sizeof(VirtioVringDesc), alignof(VirtioVringDesc));
-			IODMACommand* dma_indirect_descriptors = descriptor_buffers[i].dma_cmd = IODMACommand::withSpecification(
-				outputVringDescSegmentForIndirectTable, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
-			IODMACommand* buffer_dma = descriptor_buffers[i].dma_cmd = IODMACommand::withSpecification(
+			// the indirect tables themselves live in the queue's slab
+			IODMACommand* buffer_dma = IODMACommand::withSpecification(
 				outputIndirectVringDescSegment, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
-			IODMACommand* dma_cmd_2 = descriptor_buffers[i].dma_cmd = IODMACommand::withSpecification(
+			IODMACommand* dma_cmd_2 = IODMACommand::withSpecification(
 				outputIndirectVringDescSegment, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
 			
-			if (buffer_dma && dma_cmd_2 && dma_indirect_descriptors && indirect_descriptors)
+			if (buffer_dma && dma_cmd_2)
 			{
-				descriptor_buffers[i].dma_cmd = buffer_dma;
-				descriptor_buffers[i].dma_cmd_2 = dma_cmd_2;
-				descriptor_buffers[i].dma_indirect_descriptors = dma_indirect_descriptors;
-				descriptor_buffers[i].indirect_descriptors = indirect_descriptors;
+				descriptor_dma[i].dma_cmd = buffer_dma;
+				descriptor_dma[i].dma_cmd_2 = dma_cmd_2;
 			}
 			else
 			{
 				ok = false;
 				OSSafeReleaseNULL(buffer_dma);
 				OSSafeReleaseNULL(dma_cmd_2);
-				OSSafeReleaseNULL(dma_indirect_descriptors);
-				OSSafeReleaseNULL(indirect_descriptors);
 			}
 		}
 		else
 		{
-			IODMACommand* buffer_dma = descriptor_buffers[i].dma_cmd = IODMACommand::withSpecification(
+			IODMACommand* buffer_dma = IODMACommand::withSpecification(
 				outputVringDescSegment, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
-			descriptor_buffers[i].dma_cmd = buffer_dma;
-			descriptor_buffers[i].dma_cmd_2 = nullptr;
-			descriptor_buffers[i].dma_indirect_descriptors = nullptr;
-			descriptor_buffers[i].indirect_descriptors = nullptr;
+			descriptor_dma[i].dma_cmd = buffer_dma;
+			descriptor_dma[i].dma_cmd_2 = nullptr;
 			
 			ok = buffer_dma != nullptr;
 		}
@@ -401,107 +703,168 @@ IOReturn VirtioLegacyPCIDevice::setupVirtqueue(VirtioLegacyPCIVirtqueue* queue,
 		{
 			for (unsigned j = 0; j < i; ++j)
 			{
-				OSSafeReleaseNULL(descriptor_buffers[j].dma_cmd);
+				OSSafeReleaseNULL(descriptor_dma[j].dma_cmd);
+				OSSafeReleaseNULL(descriptor_dma[j].dma_cmd_2);
 			}
-			OSSafeReleaseNULL(queue_mem);
-			OSSafeReleaseNULL(dma_cmd);
+			destroy_indirect_table_slab(queue);
+			free_ring_memory(queue);
 			IOFreeAligned(descriptor_buffers, desc_buffer_array_size);
+			IOFreeAligned(descriptor_dma, desc_dma_array_size);
+			IOFree(const_cast<uint16_t*>(available_ring_ready), avail_ready_array_size);
 			return kIOReturnNoMemory;
 		}
 	}
 	
-	queue->queue_mem = queue_mem;
-	queue->queue_mem_dma = dma_cmd;
-	
-	// fill out virtqueue pointer fields (desc table, rings, etc.)
-	uint8_t* queue_mem_bytes = static_cast<uint8_t*>(queue_mem->getBytesNoCopy());
-	unsigned spaceUsed = 0;
-	queue->queue.descriptor_table = (struct VirtioVringDesc*)queue_mem_bytes;
-	spaceUsed += sizeof(queue->queue.descriptor_table[0]) * num_queue_entries;
-	queue->queue.available_ring = (struct VirtioVringAvail*)(queue_mem_bytes + spaceUsed);
-	spaceUsed += sizeof(*queue->queue.available_ring) + sizeof(queue->queue.available_ring->ring[0]) * num_queue_entries;
-	
-	if (this->eventIndexFeatureEnabled)
-	{
-		queue->queue.used_ring_interrupt_index = (uint16_t*)(queue_mem_bytes + spaceUsed);
-		spaceUsed += sizeof(*queue->queue.used_ring_interrupt_index);
-	}
-	
-	spaceUsed = virtio_page_align(spaceUsed);
-	queue->queue.used_ring = (struct VirtioVringUsed*)(queue_mem_bytes + spaceUsed);
-	spaceUsed += sizeof(*queue->queue.used_ring) + sizeof(queue->queue.used_ring->ring[0]) * num_queue_entries;
-	if (this->eventIndexFeatureEnabled)
-	{
-		queue->queue.used_ring_interrupt_index = (uint16_t*)(queue_mem_bytes + spaceUsed);
-		spaceUsed += sizeof(*queue->queue.used_ring_interrupt_index);
-	}
-	
 	queue->queue.used_ring_last_head_index = queue->queue.used_ring->head_index;
+	queue->queue.num_entries = num_queue_entries;
+	queue->queue.available_ring_ready = available_ring_ready;
+	virtio_virtqueue_init_available_slots(&queue->queue);
+	queue->queue.batch_depth = 0;
+	queue->queue.event_index = this->eventIndexFeatureEnabled;
+	// VIRTIO_F_IN_ORDER is feature bit 35, so only modern devices can offer it
+	queue->queue.in_order = (this->active_features & VirtioDeviceGenericFeature::VIRTIO_F_IN_ORDER) != 0;
 
 	queue->queue.interrupts_requested = interrupts_enabled;
-	queue->queue.available_ring->flags = interrupts_enabled ? 0 : VirtioVringAvailFlag::NO_INTERRUPT;
+	if (interrupts_enabled)
+		virtio_virtqueue_enable_interrupts(&queue->queue);
+	else
+		virtio_virtqueue_disable_interrupts(&queue->queue);
 	
 	// initialise list of unused descriptors:
+	queue->queue.free_list_head = 0;
 	queue->queue.first_unused_descriptor_index = 0;
 	// iterate over all VirtioBuffers in descriptor_array and set up their next_desc to +1
-	for(uint16_t i = 0; i < num_queue_entries; i++)
+	for(unsigned i = 0; i < num_queue_entries; i++)
 	{
-		if(i == num_queue_entries-1)
+		if(i == num_queue_entries-1u)
 		{
-			descriptor_buffers[i].next_desc = -1;
+			// last one terminates the list
+			descriptor_buffers[i].next_desc = VIRTIO_DESC_INDEX_NONE;
 		}
 		else
 		{
 			descriptor_buffers[i].next_desc = i + 1;
 		}
 	}
-	// set last next_desc to -1
 	queue->queue.num_unused_descriptors = num_queue_entries;
 	
-	// write queue memory address to queue address field
-	uint32_t address = static_cast<uint32_t>(phys_segment.fIOVMAddr >> 12);
-	this->pci_device->ioWrite32(VirtioLegacyHeaderOffset::QUEUE_ADDRESS, address, this->pci_virtio_header_iomap);
-	
-	queue->queue.num_entries = num_queue_entries;
 	queue->queue.descriptor_buffers = descriptor_buffers;
+	queue->queue.descriptor_dma = descriptor_dma;
 	
+	// hand the rings to the device
+	if (!this->activateVirtqueue(queue_id, num_queue_entries,
+		ring_phys[VIRTIO_RING_ALLOC_DESCRIPTORS], ring_phys[VIRTIO_RING_ALLOC_AVAILABLE], ring_phys[VIRTIO_RING_ALLOC_USED]))
+	{
+		IOLog("VirtioLegacyPCIDevice::setupVirtqueue(): Device did not accept queue %u.\n", queue_id);
+		destroy_virtqueue(queue);
+		return kIOReturnDeviceError;
+	}
 	
+	return kIOReturnSuccess;
+}
+
+IOReturn VirtioLegacyPCIDevice::setupPackedVirtqueue(VirtioLegacyPCIVirtqueue* queue, uint16_t queue_id, uint16_t num_queue_entries, bool interrupts_enabled)
+{
+	IOReturn result = virtio_packed_virtqueue_init(&queue->packed, num_queue_entries, this->eventIndexFeatureEnabled, interrupts_enabled);
+	if (result != kIOReturnSuccess)
+	{
+		IOLog("VirtioLegacyPCIDevice::setupPackedVirtqueue(): Failed to set up packed queue %u with %u entries: 0x%x\n", queue_id, num_queue_entries, result);
+		return result;
+	}
+	queue->packed_ring = true;
+	queue->queue.num_entries = num_queue_entries;
+	queue->queue.batch_depth = 0;
 	
+	// the driver event area takes the avail ring's place, the device event area the used ring's
+	if (!this->activateVirtqueue(queue_id, num_queue_entries,
+		queue->packed.descriptor_ring_phys, queue->packed.driver_event_phys, queue->packed.device_event_phys))
+	{
+		IOLog("VirtioLegacyPCIDevice::setupPackedVirtqueue(): Device did not accept queue %u.\n", queue_id);
+		destroy_virtqueue(queue);
+		return kIOReturnDeviceError;
+	}
 	return kIOReturnSuccess;
 }
 
+uint16_t VirtioLegacyPCIDevice::selectVirtqueue(uint16_t queue_id)
+{
+	// write queue selector
+	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_SELECT, queue_id, this->pci_virtio_header_iomap);
+	
+	// read queue size
+	return this->pci_device->ioRead16(VirtioLegacyHeaderOffset::QUEUE_SIZE, this->pci_virtio_header_iomap);
+}
+
+bool VirtioLegacyPCIDevice::activateVirtqueue(uint16_t queue_id, uint16_t num_entries, uint64_t descriptor_table_phys, uint64_t available_ring_phys, uint64_t used_ring_phys)
+{
+	// the queue is still selected from selectVirtqueue(); the device derives
+	// the ring positions from the page frame number of the table
+	uint32_t address = static_cast<uint32_t>(descriptor_table_phys >> 12);
+	this->pci_device->ioWrite32(VirtioLegacyHeaderOffset::QUEUE_ADDRESS, address, this->pci_virtio_header_iomap);
+	return true;
+}
+
 IOReturn VirtioLegacyPCIDevice::setVirtqueueInterruptsEnabled(uint16_t queue_id, bool enabled)
 {
-	if (queue_id > this->num_virtqueues)
+	if (queue_id >= this->num_virtqueues)
 	{
 		return kIOReturnBadArgument;
 	}
 	
-	if (this->virtqueues[queue_id].queue.interrupts_requested != enabled)
+	if (this->virtqueues[queue_id].packed_ring)
+	{
+		virtio_packed_virtqueue_set_interrupts_enabled(&this->virtqueues[queue_id].packed, enabled);
+	}
+	else if (this->virtqueues[queue_id].queue.interrupts_requested != enabled)
 	{
 		this->virtqueues[queue_id].queue.interrupts_requested = enabled;
-		this->virtqueues[queue_id].queue.available_ring->flags = enabled ? 0 : VirtioVringAvailFlag::NO_INTERRUPT;
+		if (enabled)
+			virtio_virtqueue_enable_interrupts(&this->virtqueues[queue_id].queue);
+		else
+			virtio_virtqueue_disable_interrupts(&this->virtqueues[queue_id].queue);
 	}
 	return kIOReturnSuccess;
 }
 
+IOWorkLoop* VirtioLegacyPCIDevice::getVirtqueueWorkLoop(uint16_t queue_id)
+{
+	if (queue_id >= this->num_virtqueues)
+		return nullptr;
+	// a queue only completes on its own work loop if it has its own interrupt
+	VirtioLegacyPCIVirtqueue* queue = &this->virtqueues[queue_id];
+	if (queue->work_loop != nullptr && queue->intr_event_source != nullptr)
+		return queue->work_loop;
+	return this->getWorkLoop();
+}
+
 
 static void destroy_virtqueue(VirtioLegacyPCIVirtqueue* queue)
 {
+	OSSafeReleaseNULL(queue->work_loop);
+	if (queue->packed_ring)
+	{
+		virtio_packed_virtqueue_destroy(&queue->packed);
+		queue->packed_ring = false;
+		return;
+	}
 	// free any resources allocated for the queue
 	for (unsigned i = 0; i < queue->queue.num_entries; ++i)
 	{
-		OSSafeReleaseNULL(queue->queue.descriptor_buffers[i].dma_cmd);
+		OSSafeReleaseNULL(queue->queue.descriptor_dma[i].dma_cmd);
+		OSSafeReleaseNULL(queue->queue.descriptor_dma[i].dma_cmd_2);
 	}
+	destroy_indirect_table_slab(queue);
 
 	IOFreeAligned(queue->queue.descriptor_buffers, sizeof(queue->queue.descriptor_buffers[0])* queue->queue.num_entries);
 	queue->queue.descriptor_buffers = nullptr;
-	queue->queue_mem_dma->clearMemoryDescriptor();
-	OSSafeReleaseNULL(queue->queue_mem_dma);
-	OSSafeReleaseNULL(queue->queue_mem);
+	IOFreeAligned(queue->queue.descriptor_dma, sizeof(queue->queue.descriptor_dma[0])* queue->queue.num_entries);
+	queue->queue.descriptor_dma = nullptr;
+	IOFree(const_cast<uint16_t*>(queue->queue.available_ring_ready), sizeof(queue->queue.available_ring_ready[0]) * queue->queue.num_entries);
+	queue->queue.available_ring_ready = nullptr;
+	free_ring_memory(queue);
 }
 
-IOReturn VirtioLegacyPCIDevice::setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[], unsigned out_queue_sizes[], const unsigned indirect_desc_per_request[])
+IOReturn VirtioLegacyPCIDevice::setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[], unsigned out_queue_sizes[], const unsigned indirect_desc_per_request[], const VirtioVirtqueueCompletionContext completion_contexts[])
 {
 	const size_t queue_array_size = sizeof(this->virtqueues[0]) * number_queues;
 	VirtioLegacyPCIVirtqueue* queues = static_cast<VirtioLegacyPCIVirtqueue*>(
@@ -531,6 +894,20 @@ IOReturn VirtioLegacyPCIDevice::setupVirtqueues(uint16_t number_queues, const bo
 		}
 	}
 	
+	if (completion_contexts != nullptr)
+	{
+		result = this->createCompletionWorkLoops(queues, number_queues, completion_contexts);
+		if (result != kIOReturnSuccess)
+		{
+			this->failDevice();
+			for (unsigned j = 0; j < number_queues; ++j)
+			{
+				destroy_virtqueue(&queues[j]);
+			}
+			goto fail;
+		}
+	}
+	
 	this->virtqueues = queues;
 	this->num_virtqueues = number_queues;
 	
@@ -542,6 +919,37 @@ fail:
 	return result;
 }
 
+/// Gives each nonzero completion group one work loop, shared by all of the group's queues.
+IOReturn VirtioLegacyPCIDevice::createCompletionWorkLoops(VirtioLegacyPCIVirtqueue* queues, uint16_t number_queues, const VirtioVirtqueueCompletionContext completion_contexts[])
+{
+	for (uint16_t i = 0; i < number_queues; ++i)
+	{
+		uint8_t group = completion_contexts[i].group;
+		if (group == 0)
+			continue;
+		
+		for (uint16_t j = 0; j < i; ++j)
+		{
+			if (completion_contexts[j].group == group)
+			{
+				queues[i].work_loop = queues[j].work_loop;
+				queues[i].work_loop->retain();
+				break;
+			}
+		}
+		if (queues[i].work_loop == nullptr)
+		{
+			queues[i].work_loop = createCompletionWorkLoop(completion_contexts[i]);
+			if (queues[i].work_loop == nullptr)
+			{
+				IOLog("VirtioLegacyPCIDevice setupVirtqueues(): Error! Creating work loop for completion group %u failed.\n", group);
+				return kIOReturnNoResources;
+			}
+		}
+	}
+	return kIOReturnSuccess;
+}
+
 void VirtioLegacyPCIDevice::startDevice(ConfigChangeAction action, OSObject* target, IOWorkLoop* workloop)
 {
 	// save action & target
@@ -593,14 +1001,17 @@ void VirtioLegacyPCIDevice::handleClose(IOService* forClient, IOOptionBits optio
 		this->virtqueues = nullptr;
 		this->num_virtqueues = 0;
 	}
-	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
+	this->unmapHeaderIORegion();
 	VirtioDevice::handleClose(forClient, options);
 	
 }
 
 uint8_t VirtioLegacyPCIDevice::readDeviceConfig8(uint16_t device_specific_offset)
 {
-	return this->pci_device->ioRead8(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+	return this->cachedDeviceConfigRead<uint8_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return this->pci_device->ioRead8(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+		});
 }
 
 uint16_t VirtioLegacyPCIDevice::readDeviceConfig16LETransitional(uint16_t device_specific_offset)
@@ -618,44 +1029,63 @@ uint64_t VirtioLegacyPCIDevice::readDeviceConfig64LETransitional(uint16_t device
 
 uint16_t VirtioLegacyPCIDevice::readDeviceConfig16Native(uint16_t device_specific_offset)
 {
-	return this->pci_device->ioRead16(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+	return this->cachedDeviceConfigRead<uint16_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return this->pci_device->ioRead16(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+		});
 }
 
 uint32_t VirtioLegacyPCIDevice::readDeviceConfig32Native(uint16_t device_specific_offset)
 {
-	return this->pci_device->ioRead32(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+	return this->cachedDeviceConfigRead<uint32_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return this->pci_device->ioRead32(this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
+		});
 }
 
 uint64_t VirtioLegacyPCIDevice::readDeviceConfig64Native(uint16_t device_specific_offset)
 {
+	// The legacy header has no generation counter, so re-read the first word
+	// until it is stable to avoid combining halves of two different values.
+	return this->cachedDeviceConfigRead<uint64_t>(device_specific_offset, 3, [this, device_specific_offset]()
+		{
+			uint16_t offset = this->deviceSpecificConfigStartHeaderOffset + device_specific_offset;
+			uint32_t first, second, first_again;
+			first_again = this->pci_device->ioRead32(offset, this->pci_virtio_header_iomap);
+			do
+			{
+				first = first_again;
+				second = this->pci_device->ioRead32(offset + 4, this->pci_virtio_header_iomap);
+				first_again = this->pci_device->ioRead32(offset, this->pci_virtio_header_iomap);
+			} while (first != first_again);
 #if defined(__LITTLE_ENDIAN__)
-	uint32_t low = this->pci_device->ioRead32(
-		this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
-	uint32_t high = this->pci_device->ioRead32(
-		this->deviceSpecificConfigStartHeaderOffset + device_specific_offset + 4, this->pci_virtio_header_iomap);
+			uint32_t low = first;
+			uint32_t high = second;
 #elif defined(__BIG_ENDIAN__)
-	uint32_t high = this->pci_device->ioRead32(
-		this->deviceSpecificConfigStartHeaderOffset + device_specific_offset, this->pci_virtio_header_iomap);
-	uint32_t low = this->pci_device->ioRead32(
-		this->deviceSpecificConfigStartHeaderOffset + device_specific_offset + 4, this->pci_virtio_header_iomap);
+			uint32_t high = first;
+			uint32_t low = second;
 #endif
-	return (static_cast<uint64_t>(high) << 32u) | low;
+			return (static_cast<uint64_t>(high) << 32u) | low;
+		});
 }
 
 
 void VirtioLegacyPCIDevice::writeDeviceConfig8(uint16_t offset, uint8_t value_to_write)
 {
 	this->pci_device->ioWrite8(this->deviceSpecificConfigStartHeaderOffset + offset, value_to_write, this->pci_virtio_header_iomap);
+	this->invalidateDeviceConfigCache();
 }
 
 void VirtioLegacyPCIDevice::writeDeviceConfig16Native(uint16_t offset, uint16_t value_to_write)
 {
 	this->pci_device->ioWrite16(this->deviceSpecificConfigStartHeaderOffset + offset, value_to_write, this->pci_virtio_header_iomap);
+	this->invalidateDeviceConfigCache();
 }
 
 void VirtioLegacyPCIDevice::writeDeviceConfig32Native(uint16_t offset, uint32_t value_to_write)
 {
 	this->pci_device->ioWrite32(this->deviceSpecificConfigStartHeaderOffset + offset, value_to_write, this->pci_virtio_header_iomap);
+	this->invalidateDeviceConfigCache();
 }
 
 void VirtioLegacyPCIDevice::writeDeviceConfig16LETransitional(uint16_t device_specific_offset, uint16_t value_to_write)
@@ -676,23 +1106,62 @@ struct virtio_legacy_pci_vring_desc_chain
 	uint16_t reserved_descriptor_index;
 	uint16_t current_last_descriptor_index;
 	bool device_writable;
+	/// Set if the descriptor table ran dry part way through the chain
+	bool out_of_descriptors;
 };
 
-int16_t reserveNewDescriptor(VirtioVirtqueue* virtqueue)
+
+static const unsigned VIRTIO_MAX_INLINE_SEGMENTS = 2;
+
+struct virtio_inline_segments
 {
-	int16_t descriptorIndex = virtqueue->first_unused_descriptor_index;
-	if (descriptorIndex < 0)
-		return -1;
-	virtqueue->first_unused_descriptor_index = virtqueue->descriptor_buffers[descriptorIndex].next_desc;
-	virtqueue->num_unused_descriptors--;
-	return descriptorIndex;
+	unsigned count;
+	VirtioRegisteredSegment segments[VIRTIO_MAX_INLINE_SEGMENTS];
+};
+
+/// Whether buf is wired for its whole lifetime, so its physical segments can be used without prepare()
+/** That is only guaranteed for an IOBufferMemoryDescriptor allocated without
+ * kIOMemoryPageable (purgeable buffers are always pageable). Any other
+ * descriptor may be backed by pageable memory and must go through
+ * IODMACommand, which wires it for the duration of the request. */
+static bool virtio_buffer_is_wired(IOMemoryDescriptor* buf)
+{
+	if (OSDynamicCast(IOBufferMemoryDescriptor, buf) == nullptr)
+		return false;
+	return 0 == (buf->getFlags() & (kIOMemoryPageable | kIOMemoryPurgeable));
 }
 
-void returnUnusedDescriptor(VirtioVirtqueue* virtqueue, uint16_t descriptorIndex)
+/// Looks up the physical segments of a small wired buffer directly, bypassing IODMACommand.
+/** Only valid when there is no system mapper. Succeeds with no segments for
+ * an absent or empty buffer; fails if the buffer is not wired (see
+ * virtio_buffer_is_wired()) or is split into too many pieces. */
+static bool virtio_get_inline_segments(IOMemoryDescriptor* buf, virtio_inline_segments* out_segments)
 {
-	virtqueue->num_unused_descriptors++;
-	virtqueue->descriptor_buffers[descriptorIndex].next_desc = virtqueue->first_unused_descriptor_index;
-	virtqueue->first_unused_descriptor_index = descriptorIndex;
+	out_segments->count = 0;
+	if (buf == nullptr || buf->getLength() == 0)
+		return true;
+	if (!virtio_buffer_is_wired(buf))
+		return false;
+	
+	const IOByteCount length = buf->getLength();
+	IOByteCount offset = 0;
+	while (offset < length)
+	{
+		if (out_segments->count == VIRTIO_MAX_INLINE_SEGMENTS)
+			return false;
+		IOByteCount segment_length = 0;
+		addr64_t phys = buf->getPhysicalSegment(offset, &segment_length, kIOMemoryMapperNone);
+		if (phys == 0 || segment_length == 0)
+			return false;
+		segment_length = min(segment_length, length - offset);
+		if (segment_length > UINT32_MAX)
+			return false;
+		VirtioRegisteredSegment* segment = &out_segments->segments[out_segments->count++];
+		segment->phys_address = phys;
+		segment->length = static_cast<uint32_t>(segment_length);
+		offset += segment_length;
+	}
+	return true;
 }
 
 IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueue(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
@@ -703,6 +1172,27 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueue(uint16_t queue_index, I
 	}
 	
 	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
+	if (this->virtqueues[queue_index].packed_ring)
+	{
+		IOReturn result = virtio_packed_virtqueue_submit(&this->virtqueues[queue_index].packed, device_readable_buf, device_writable_buf, completion);
+		if (result == kIOReturnSuccess)
+			this->publishPackedVirtqueue(queue_index);
+		return result;
+	}
+	if (this->inline_physical_segments)
+	{
+		// fast path: wired buffers in at most 2 physically contiguous pieces each
+		virtio_inline_segments readable_segments = {};
+		virtio_inline_segments writable_segments = {};
+		if (virtio_get_inline_segments(device_readable_buf, &readable_segments)
+			&& virtio_get_inline_segments(device_writable_buf, &writable_segments)
+			&& readable_segments.count + writable_segments.count > 0)
+		{
+			return this->submitSegmentsToVirtqueue(queue_index,
+				readable_segments.segments, readable_segments.count,
+				writable_segments.segments, writable_segments.count, completion);
+		}
+	}
 	if (queue->indirect_descriptors)
 	{
 		return this->submitBuffersToVirtqueueIndirect(queue_index, device_readable_buf, device_writable_buf, completion);
@@ -713,14 +1203,13 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueue(uint16_t queue_index, I
 	}
 }
 
-static void virtio_virtqueue_add_descriptor_to_ring(VirtioVirtqueue* queue, uint16_t first_descriptor_index);
 
 IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
 {
 	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
 	
 	uint16_t first_descriptor_index = UINT16_MAX;
-	virtio_legacy_pci_vring_desc_chain chain = { queue, UINT16_MAX, UINT16_MAX, false };
+	virtio_legacy_pci_vring_desc_chain chain = { queue, UINT16_MAX, UINT16_MAX, false, false };
 	
 	const bool device_readable_descs = (device_readable_buf != nullptr && device_readable_buf->getLength() != 0);
 	const bool device_writable_descs = (device_writable_buf != nullptr && device_writable_buf->getLength() != 0);
@@ -733,7 +1222,9 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 	{
 		return kIOReturnBadArgument;
 	}
-	if (min_descs_required > queue->num_unused_descriptors)
+	// only a hint: other submitters may take descriptors at any point, so each reservation is checked
+	SInt32 num_unused = queue->num_unused_descriptors;
+	if (num_unused < 0 || min_descs_required > static_cast<unsigned>(num_unused))
 	{
 		return kIOReturnBusy;
 	}
@@ -741,11 +1232,13 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 	if (device_readable_descs)
 	{
 		min_descs_required--;
-		UInt32 max_segments = queue->num_unused_descriptors - min_descs_required;
+		UInt32 max_segments = static_cast<UInt32>(num_unused) - min_descs_required;
 		
 		// 1. reserve a descriptor
-		int16_t descriptorIndex = reserveNewDescriptor(queue);
+		uint16_t descriptorIndex = reserveNewDescriptor(queue);
 		//IOLog("VirtioLegacyPCIDevice::submitBuffersToVirtqueue(): reserved descriptor %d as first device_readable\n", descriptorIndex);
+		if (descriptorIndex == VIRTIO_DESC_INDEX_NONE)
+			return kIOReturnBusy;
 		// 2. save it as first_descriptor_index
 		first_descriptor_index = descriptorIndex;
 		// 3. save it as chain.reserved_descriptor_index
@@ -753,7 +1246,7 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 		chain.reserved_descriptor_index = descriptorIndex;
 		desc_buffer->completion = completion;
 		// 4. get its DMA command:
-		IODMACommand* device_readable_dma = desc_buffer->dma_cmd;
+		IODMACommand* device_readable_dma = queue->descriptor_dma[descriptorIndex].dma_cmd;
 		desc_buffer->dma_cmd_used = true;
 		// 5. prepare DMA command
 		IOReturn result = device_readable_dma->setMemoryDescriptor(device_readable_buf, true /* prepare DMA */);
@@ -767,21 +1260,16 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 		result = device_readable_dma->genIOVMSegments(&offset, &chain, &max_segments);
 		if (result != kIOReturnSuccess || max_segments < 1 || offset != device_readable_buf->getLength())
 		{
-			if (result == kIOReturnSuccess)
+			if (chain.out_of_descriptors)
+				result = kIOReturnBusy;
+			else if (result == kIOReturnSuccess)
 			{
 				IOLog("VirtioLegacyPCIDevice::submitBuffersToVirtqueue(): emitted %u segments up to offset %llu for device-readable buffer with %llu bytes\n", max_segments, offset, device_readable_buf->getLength());
-				result = kIOReturnInternalError;
+				// Running out of descriptors part way through: retry once in-flight requests have completed
+				result = (offset < device_readable_buf->getLength()) ? kIOReturnBusy : kIOReturnInternalError;
 			}
-			device_readable_dma->clearMemoryDescriptor(true /* complete dma */);
 			// clean up, return descriptors to unused list
-			desc_buffer->dma_cmd_used = false;
-			
-			while(descriptorIndex >= 0)
-			{
-				int16_t next = queue->descriptor_buffers[descriptorIndex].next_desc;
-				returnUnusedDescriptor(queue, descriptorIndex);
-				descriptorIndex = next;
-			}
+			virtio_virtqueue_release_chain(queue, first_descriptor_index);
 			return result;
 		}
 	}
@@ -789,11 +1277,18 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 	{
 		chain.device_writable = true;
 		// otherwise, same as above..
-		UInt32 max_segments = queue->num_unused_descriptors;
+		num_unused = queue->num_unused_descriptors;
+		UInt32 max_segments = num_unused > 0 ? static_cast<UInt32>(num_unused) : 1;
 		
 		// 1. reserve a descriptor
-		int16_t descriptorIndex = reserveNewDescriptor(queue);
+		uint16_t descriptorIndex = reserveNewDescriptor(queue);
 		//IOLog("VirtioLegacyPCIDevice::submitBuffersToVirtqueue(): reserved descriptor %d as first device writable\n", descriptorIndex);
+		if (descriptorIndex == VIRTIO_DESC_INDEX_NONE)
+		{
+			if (first_descriptor_index != UINT16_MAX)
+				virtio_virtqueue_release_chain(queue, first_descriptor_index);
+			return kIOReturnBusy;
+		}
 		// 2. save it as first_descriptor_index
 		VirtioBuffer* desc_buffer = &queue->descriptor_buffers[descriptorIndex];
 		if(first_descriptor_index == UINT16_MAX)
@@ -805,24 +1300,17 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 		// 3. save it as chain.reserved_descriptor_index
 		chain.reserved_descriptor_index = descriptorIndex;
 		// 4. get its DMA command:
-		IODMACommand* dma = desc_buffer->dma_cmd;
+		IODMACommand* dma = queue->descriptor_dma[descriptorIndex].dma_cmd;
 		desc_buffer->dma_cmd_used = true;
 		// 5.
 		IOReturn result = dma->setMemoryDescriptor(device_writable_buf, true /* prepare DMA */);
 		if (result != kIOReturnSuccess)
 		{
-			descriptorIndex = first_descriptor_index;
-			while(descriptorIndex >= 0)
-			{
-				int16_t next = queue->descriptor_buffers[descriptorIndex].next_desc;
-				if (queue->descriptor_buffers[descriptorIndex].dma_cmd_used)
-				{
-					queue->descriptor_buffers[descriptorIndex].dma_cmd->clearMemoryDescriptor(true);
-					queue->descriptor_buffers[descriptorIndex].dma_cmd_used = false;
-				}
+			desc_buffer->dma_cmd_used = false;
+			// not linked to the device-readable part of the chain yet
+			if (descriptorIndex != first_descriptor_index)
 				returnUnusedDescriptor(queue, descriptorIndex);
-				descriptorIndex = next;
-			}
+			virtio_virtqueue_release_chain(queue, first_descriptor_index);
 			return result;
 		}
 		// 6.
@@ -830,26 +1318,18 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 		result = dma->genIOVMSegments(&offset, &chain, &max_segments);
 		if (result != kIOReturnSuccess || max_segments < 1 || offset != device_writable_buf->getLength())
 		{
-			if (result == kIOReturnSuccess)
+			if (chain.out_of_descriptors)
+				result = kIOReturnBusy;
+			else if (result == kIOReturnSuccess)
 			{
 				IOLog("VirtioLegacyPCIDevice::submitBuffersToVirtqueue(): emitted %u segments up to offset %llu for device-writable buffer with %llu bytes\n", max_segments, offset, device_writable_buf->getLength());
-				result = kIOReturnInternalError;
+				// Running out of descriptors part way through: retry once in-flight requests have completed
+				result = (offset < device_writable_buf->getLength()) ? kIOReturnBusy : kIOReturnInternalError;
 			}
-			dma->clearMemoryDescriptor(true /* complete dma */);
 			// clean up, return descriptors to unused list
-			desc_buffer->dma_cmd_used = false;
-			descriptorIndex = first_descriptor_index;
-			while(descriptorIndex >= 0)
-			{
-				int16_t next = queue->descriptor_buffers[descriptorIndex].next_desc;
-				if (queue->descriptor_buffers[descriptorIndex].dma_cmd_used)
-				{
-					queue->descriptor_buffers[descriptorIndex].dma_cmd->clearMemoryDescriptor(true);
-					queue->descriptor_buffers[descriptorIndex].dma_cmd_used = false;
-				}
-				returnUnusedDescriptor(queue, descriptorIndex);
-				descriptorIndex = next;
-			}
+			if (chain.reserved_descriptor_index != UINT16_MAX && descriptorIndex != first_descriptor_index)
+				virtio_virtqueue_release_chain(queue, descriptorIndex);
+			virtio_virtqueue_release_chain(queue, first_descriptor_index);
 			return result;
 		}
 
@@ -857,25 +1337,214 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueDirect(uint16_t queue_in
 	}
 	
 	virtio_virtqueue_add_descriptor_to_ring(queue, first_descriptor_index);
-	
-	if((queue->used_ring->flags & VirtioVringUsedFlag::NO_NOTIFY)==0)
+	if (queue->batch_depth == 0 && virtio_virtqueue_publish_available(queue))
 	{
-		pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_NOTIFY, queue_index, this->pci_virtio_header_iomap);
+		this->kickVirtqueue(queue_index);
 	}
 
 	return kIOReturnSuccess;
 }
 
-static void virtio_virtqueue_add_descriptor_to_ring(VirtioVirtqueue* queue, uint16_t first_descriptor_index)
+/// Reading the ISR status register also clears it and deasserts the interrupt line.
+uint8_t VirtioLegacyPCIDevice::readISRStatus()
 {
-	// add index of first descriptor in chain to 'available' ring
-	
-	uint16_t avail_pos = queue->available_ring->head_index;
-	queue->available_ring->ring[avail_pos % queue->num_entries] = first_descriptor_index;
-	avail_pos++;
-	OSSynchronizeIO();
-	queue->available_ring->head_index = avail_pos;
-	OSSynchronizeIO();
+	return this->pci_device->ioRead8(VirtioLegacyHeaderOffset::ISR_STATUS, this->pci_virtio_header_iomap);
+}
+
+void VirtioLegacyPCIDevice::notifyVirtqueue(uint16_t queue_index, uint16_t next_avail_index)
+{
+	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_NOTIFY, queue_index, this->pci_virtio_header_iomap);
+}
+
+/// Makes a packed queue's new chains visible to the device unless a batch is open.
+void VirtioLegacyPCIDevice::publishPackedVirtqueue(uint16_t queue_index)
+{
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	if (vq->queue.batch_depth == 0 && virtio_packed_virtqueue_publish(&vq->packed))
+	{
+		this->kickVirtqueue(queue_index);
+	}
+}
+
+void VirtioLegacyPCIDevice::beginVirtqueueBatch(uint16_t queue_index)
+{
+	if (queue_index >= this->num_virtqueues)
+		return;
+	OSIncrementAtomic(&this->virtqueues[queue_index].queue.batch_depth);
+}
+
+void VirtioLegacyPCIDevice::commitVirtqueueBatch(uint16_t queue_index)
+{
+	if (queue_index >= this->num_virtqueues)
+		return;
+	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
+	assert(queue->batch_depth > 0);
+	if (queue->batch_depth <= 0)
+		return;
+	
+	// whoever closes the outermost batch publishes everything submitted during it
+	SInt32 old_depth = OSDecrementAtomic(&queue->batch_depth);
+	if (old_depth != 1)
+		return;
+	bool notify = this->virtqueues[queue_index].packed_ring
+		? virtio_packed_virtqueue_publish(&this->virtqueues[queue_index].packed)
+		: virtio_virtqueue_publish_available(queue);
+	if (notify)
+	{
+		this->kickVirtqueue(queue_index);
+	}
+}
+
+void VirtioLegacyPCIDevice::kickVirtqueue(uint16_t queue_index)
+{
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	if (vq->kick_timer == nullptr)
+	{
+		this->notifyVirtqueue(queue_index, virtqueue_notify_index(vq));
+		OSIncrementAtomic64(reinterpret_cast<volatile SInt64*>(&vq->queue.stats.notifications));
+		return;
+	}
+	
+	// record the start of the batch before owing the kick, so a flush that sees the kick sees a time too
+	if (vq->kick_deferred_since == 0)
+	{
+		OSCompareAndSwap64(0, mach_absolute_time(), &vq->kick_deferred_since);
+	}
+	SInt32 owed = OSIncrementAtomic(&vq->kicks_deferred) + 1;
+	if (owed >= static_cast<SInt32>(vq->kick_max_batch))
+	{
+		this->flushDeferredKicks(queue_index);
+	}
+	else if (OSCompareAndSwap(0, 1, &vq->kick_timer_armed))
+	{
+		// A timer armed for an earlier, since flushed, batch fires early for
+		// this one, which never delays a notification beyond the maximum.
+		vq->kick_timer->setTimeoutUS(vq->kick_max_delay_us);
+	}
+}
+
+/// Sends one notification on behalf of all deferred ones, if any are owed.
+/** Safe to call concurrently with kickVirtqueue() and itself. A kick that
+ * races with the flush may go without a deferral time of its own, so the
+ * latency statistics are approximate. */
+void VirtioLegacyPCIDevice::flushDeferredKicks(uint16_t queue_index)
+{
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	SInt32 owed;
+	do
+	{
+		owed = vq->kicks_deferred;
+		if (owed <= 0)
+			return;
+	} while (!OSCompareAndSwap(owed, 0, reinterpret_cast<volatile UInt32*>(&vq->kicks_deferred)));
+	uint64_t deferred_since;
+	do
+	{
+		deferred_since = vq->kick_deferred_since;
+	} while (!OSCompareAndSwap64(deferred_since, 0, &vq->kick_deferred_since));
+	
+	this->notifyVirtqueue(queue_index, virtqueue_notify_index(vq));
+	
+	uint64_t now = mach_absolute_time();
+	uint64_t latency_ns = 0;
+	if (deferred_since != 0 && now > deferred_since)
+		absolutetime_to_nanoseconds(now - deferred_since, &latency_ns);
+	VirtioVirtqueueStatistics* stats = &vq->queue.stats;
+	OSIncrementAtomic64(reinterpret_cast<volatile SInt64*>(&stats->notifications));
+	OSAddAtomic64(owed - 1, reinterpret_cast<volatile SInt64*>(&stats->notifications_coalesced));
+	OSIncrementAtomic64(reinterpret_cast<volatile SInt64*>(&stats->deferred_kicks));
+	OSAddAtomic64(latency_ns, reinterpret_cast<volatile SInt64*>(&stats->deferred_kick_latency_total_ns));
+	uint64_t max_latency;
+	do
+	{
+		max_latency = stats->deferred_kick_latency_max_ns;
+	} while (latency_ns > max_latency && !OSCompareAndSwap64(max_latency, latency_ns, &stats->deferred_kick_latency_max_ns));
+}
+
+void VirtioLegacyPCIDevice::kickTimerAction(OSObject* me, IOTimerEventSource* sender)
+{
+	VirtioLegacyPCIDevice* virtio_pci = OSDynamicCast(VirtioLegacyPCIDevice, me);
+	if (!virtio_pci)
+		return;
+	for (uint16_t i = 0; i < virtio_pci->num_virtqueues; ++i)
+	{
+		VirtioLegacyPCIVirtqueue* vq = &virtio_pci->virtqueues[i];
+		if (vq->kick_timer == sender)
+		{
+			// disarm first, so a kick racing with the flush arms a new timeout
+			OSCompareAndSwap(1, 0, &vq->kick_timer_armed);
+			virtio_pci->flushDeferredKicks(i);
+			return;
+		}
+	}
+}
+
+static void release_kick_timer(VirtioLegacyPCIVirtqueue* queue)
+{
+	IOTimerEventSource* timer = queue->kick_timer;
+	if (timer == nullptr)
+		return;
+	queue->kick_timer = nullptr;
+	OSMemoryBarrier();
+	timer->cancelTimeout();
+	IOWorkLoop* timer_work_loop = timer->getWorkLoop();
+	if (timer_work_loop != nullptr)
+		timer_work_loop->removeEventSource(timer);
+	timer->release();
+	// submissions to the queue are excluded here, see setVirtqueueKickCoalescing()
+	queue->kick_timer_armed = 0;
+	queue->kicks_deferred = 0;
+	queue->kick_deferred_since = 0;
+}
+
+IOReturn VirtioLegacyPCIDevice::setVirtqueueKickCoalescing(uint16_t queue_index, unsigned max_batch, uint32_t max_delay_us)
+{
+	if (queue_index >= this->num_virtqueues)
+		return kIOReturnBadArgument;
+	if (this->work_loop == nullptr)
+		return kIOReturnNotReady;
+	
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	if (max_batch <= 1 || max_delay_us == 0)
+	{
+		// don't leave the device waiting for anything deferred so far
+		this->flushDeferredKicks(queue_index);
+		release_kick_timer(vq);
+		return kIOReturnSuccess;
+	}
+	
+	vq->kick_max_batch = max_batch;
+	vq->kick_max_delay_us = max_delay_us;
+	if (vq->kick_timer == nullptr)
+	{
+		IOTimerEventSource* timer = IOTimerEventSource::timerEventSource(this, &kickTimerAction);
+		if (timer == nullptr)
+			return kIOReturnNoMemory;
+		IOWorkLoop* queue_work_loop = vq->work_loop ?: this->work_loop;
+		if (kIOReturnSuccess != queue_work_loop->addEventSource(timer))
+		{
+			timer->release();
+			return kIOReturnError;
+		}
+		OSMemoryBarrier();
+		vq->kick_timer = timer;
+	}
+	return kIOReturnSuccess;
+}
+
+void VirtioLegacyPCIDevice::flushVirtqueueKicks(uint16_t queue_index)
+{
+	if (queue_index >= this->num_virtqueues)
+		return;
+	this->flushDeferredKicks(queue_index);
+}
+
+void VirtioLegacyPCIDevice::releaseKickTimers()
+{
+	for (unsigned i = 0; this->virtqueues != nullptr && i < this->num_virtqueues; ++i)
+	{
+		release_kick_timer(&this->virtqueues[i]);
+	}
 }
 
 struct virtio_output_indirect_segment_state
@@ -883,34 +1552,41 @@ struct virtio_output_indirect_segment_state
 	VirtioVringDesc* desc_array;
 	uint16_t next_descriptor_index;
 	bool writable;
+	/// Number of entries in desc_array
+	unsigned capacity;
+	/// Large table holding desc_array, or VIRTIO_DESC_INDEX_NONE for the ring descriptor's own small table
+	uint16_t large_table;
 };
-struct virtio_output_segment_for_indirect_descs_state
+
+/// Moves a request which has outgrown its small indirect table over to a large one.
+static IOReturn grow_indirect_table(VirtioVirtqueue* queue, virtio_output_indirect_segment_state* desc_output)
 {
-	VirtioVirtqueue* queue;
-	int16_t main_descriptor_index;
-};
+	if (desc_output->large_table != VIRTIO_DESC_INDEX_NONE || queue->indirect_large_table_size == 0)
+		return kIOReturnNoSpace;
+	uint16_t table = virtio_virtqueue_reserve_indirect_large_table(queue);
+	if (table == VIRTIO_DESC_INDEX_NONE)
+		return kIOReturnBusy;
+	
+	// descriptors are linked by position within the table, so they can simply be copied
+	VirtioVringDesc* large_desc_array = queue->indirect_tables + virtio_indirect_table_offset(queue, 0, table);
+	memcpy(large_desc_array, desc_output->desc_array, sizeof(large_desc_array[0]) * desc_output->next_descriptor_index);
+	desc_output->desc_array = large_desc_array;
+	desc_output->capacity = queue->indirect_large_table_size;
+	desc_output->large_table = table;
+	return kIOReturnSuccess;
+}
 
-static IOReturn generate_indirect_segment_dma(VirtioVirtqueue* queue, IODMACommand* dma_cmd, IOMemoryDescriptor* buf, unsigned& min_descs_required, UInt32& max_segments, virtio_output_indirect_segment_state* desc_output);
+static IOReturn generate_indirect_segment_dma(VirtioVirtqueue* queue, IODMACommand* dma_cmd, IOMemoryDescriptor* buf, unsigned& min_descs_required, virtio_output_indirect_segment_state* desc_output);
 
 IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueIndirect(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
 {
 	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
 	
-	int16_t main_descriptor_index = reserveNewDescriptor(queue);
-	if (main_descriptor_index < 0)
-		return kIOReturnBusy;
-	
 	const bool device_readable_descs = (device_readable_buf != nullptr && device_readable_buf->getLength() != 0);
 	const bool device_writable_descs = (device_writable_buf != nullptr && device_writable_buf->getLength() != 0);
 	unsigned min_descs_required = (device_readable_descs ? 1 : 0) + (device_writable_descs ? 1 : 0);
 	
-	VirtioBuffer* desc_buffer = &queue->descriptor_buffers[main_descriptor_index];
-	desc_buffer->indirect_descriptors->setLength(desc_buffer->indirect_descriptors->getCapacity());
-	UInt32 max_segments = static_cast<UInt32>(
-		desc_buffer->indirect_descriptors->getLength() / sizeof(VirtioVringDesc));
-	VirtioVringDesc* desc_array = static_cast<VirtioVringDesc*>(desc_buffer->indirect_descriptors->getBytesNoCopy());
-	
-	if (min_descs_required > max_segments)
+	if (min_descs_required > max(queue->indirect_small_table_size, queue->indirect_large_table_size))
 	{
 		return kIOReturnUnsupported;
 	}
@@ -918,56 +1594,52 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueIndirect(uint16_t queue_
 	{
 		return kIOReturnBadArgument;
 	}
-
-	virtio_output_indirect_segment_state desc_output = { desc_array, 0 };
+	
+	uint16_t main_descriptor_index = reserveNewDescriptor(queue);
+	if (main_descriptor_index == VIRTIO_DESC_INDEX_NONE)
+		return kIOReturnBusy;
+	
+	VirtioBuffer* desc_buffer = &queue->descriptor_buffers[main_descriptor_index];
+	VirtioBufferDMA* desc_dma = &queue->descriptor_dma[main_descriptor_index];
+	// start out in the descriptor's own small table, switching to a large one if that fills up
+	virtio_output_indirect_segment_state desc_output = {
+		queue->indirect_tables + virtio_indirect_table_offset(queue, main_descriptor_index, VIRTIO_DESC_INDEX_NONE),
+		0, false, queue->indirect_small_table_size, VIRTIO_DESC_INDEX_NONE };
 	desc_buffer->dma_cmd_used = true;
+	IOReturn result = kIOReturnSuccess;
 	if (device_readable_descs)
 	{
 		desc_output.writable = false;
-		IOReturn result = generate_indirect_segment_dma(queue, desc_buffer->dma_cmd, device_readable_buf, min_descs_required, max_segments, &desc_output);
-		if (result != kIOReturnSuccess)
-		{
-			returnUnusedDescriptor(queue, main_descriptor_index);
-			return result;
-		}
+		result = generate_indirect_segment_dma(queue, desc_dma->dma_cmd, device_readable_buf, min_descs_required, &desc_output);
 	}
-	if (device_writable_descs)
+	if (result == kIOReturnSuccess && device_writable_descs)
 	{
 		desc_output.writable = true;
-		IOReturn result = generate_indirect_segment_dma(queue, desc_buffer->dma_cmd_2, device_writable_buf, min_descs_required, max_segments, &desc_output);
-		if (result != kIOReturnSuccess)
-		{
-			if (device_readable_descs)
-				desc_buffer->dma_cmd->clearMemoryDescriptor();
-			returnUnusedDescriptor(queue, main_descriptor_index);
-			return result;
-		}
+		result = generate_indirect_segment_dma(queue, desc_dma->dma_cmd_2, device_writable_buf, min_descs_required, &desc_output);
+		if (result != kIOReturnSuccess && device_readable_descs)
+			desc_dma->dma_cmd->clearMemoryDescriptor();
 	}
-	
-	desc_buffer->indirect_descriptors->setLength(desc_output.next_descriptor_index * sizeof(VirtioVringDesc));
-	IOReturn result = desc_buffer->dma_indirect_descriptors->setMemoryDescriptor(desc_buffer->indirect_descriptors, true /* prepare DMA */);
 	if (result != kIOReturnSuccess)
 	{
-		desc_buffer->dma_cmd->clearMemoryDescriptor();
-		desc_buffer->dma_cmd_2->clearMemoryDescriptor();
+		desc_buffer->dma_cmd_used = false;
+		if (desc_output.large_table != VIRTIO_DESC_INDEX_NONE)
+			virtio_virtqueue_return_indirect_large_table(queue, desc_output.large_table);
 		returnUnusedDescriptor(queue, main_descriptor_index);
 		return result;
 	}
 	
-	UInt64 offset = 0;
-	UInt32 segments = 1;
-	virtio_output_segment_for_indirect_descs_state state = { queue, main_descriptor_index };
-	result = desc_buffer->dma_indirect_descriptors->genIOVMSegments(&offset, &state, &segments);
-	if (result != kIOReturnSuccess || segments < 1 || offset != desc_buffer->indirect_descriptors->getLength())
-	{
-		desc_buffer->dma_indirect_descriptors->clearMemoryDescriptor();
-		desc_buffer->dma_cmd->clearMemoryDescriptor();
-		desc_buffer->dma_cmd_2->clearMemoryDescriptor();
-		returnUnusedDescriptor(queue, main_descriptor_index);
-		return result;
-	}
+	// point the ring descriptor at the table, whose physical address is known from the slab
+	IODMACommand::Segment64 table_segment = {};
+	table_segment.fIOVMAddr = queue->indirect_tables_phys
+		+ sizeof(VirtioVringDesc) * virtio_indirect_table_offset(queue, main_descriptor_index, desc_output.large_table);
+	table_segment.fLength = sizeof(VirtioVringDesc) * desc_output.next_descriptor_index;
+	VirtioVringDesc* descriptor = &queue->descriptor_table[main_descriptor_index];
+	virtio_fill_vring_descriptor(descriptor, main_descriptor_index, nullptr, table_segment, false);
+	descriptor->flags = VirtioVringDescFlag::INDIRECT;
+	
+	desc_buffer->indirect_large_table = desc_output.large_table;
 	desc_buffer->completion = completion;
-	desc_buffer->next_desc = -1;
+	desc_buffer->next_desc = VIRTIO_DESC_INDEX_NONE;
 	
 	/*
 	kprintf("Emitting request on descriptor %u with %llu bytes and %u indirect descriptors...\n",
@@ -975,47 +1647,82 @@ IOReturn VirtioLegacyPCIDevice::submitBuffersToVirtqueueIndirect(uint16_t queue_
 	*/
 	
 	virtio_virtqueue_add_descriptor_to_ring(queue, main_descriptor_index);
-	
-	if((queue->used_ring->flags & VirtioVringUsedFlag::NO_NOTIFY)==0)
+	if (queue->batch_depth == 0 && virtio_virtqueue_publish_available(queue))
 	{
-		pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_NOTIFY, queue_index, this->pci_virtio_header_iomap);
+		this->kickVirtqueue(queue_index);
 	}
 	return kIOReturnSuccess;
 }
 
-static IOReturn generate_indirect_segment_dma(VirtioVirtqueue* queue, IODMACommand* dma_cmd, IOMemoryDescriptor* buf, unsigned& min_descs_required, UInt32& max_segments, virtio_output_indirect_segment_state* desc_output)
+static IOReturn generate_indirect_segment_dma(VirtioVirtqueue* queue, IODMACommand* dma_cmd, IOMemoryDescriptor* buf, unsigned& min_descs_required, virtio_output_indirect_segment_state* desc_output)
 {
 	IOReturn result = dma_cmd->setMemoryDescriptor(buf, true /* prepare DMA */);
+	if (result != kIOReturnSuccess)
+		return result;
 	UInt64 offset = 0;
 	--min_descs_required;
-	UInt32 gen_segments = max_segments - min_descs_required;
-	result = dma_cmd->genIOVMSegments(&offset, desc_output, &gen_segments);
-	if (result != kIOReturnSuccess || max_segments < 1 || offset != buf->getLength())
+	while (offset < buf->getLength())
 	{
-		if (result == kIOReturnSuccess)
+		// leave room for the descriptor(s) still needed by the other buffer
+		UInt32 gen_segments = desc_output->capacity - desc_output->next_descriptor_index;
+		gen_segments = (gen_segments > min_descs_required) ? gen_segments - min_descs_required : 0;
+		if (gen_segments > 0)
+		{
+			result = dma_cmd->genIOVMSegments(&offset, desc_output, &gen_segments);
+			if (result != kIOReturnSuccess || offset == buf->getLength())
+				break;
+		}
+		
+		// out of room: carry on in a large table if there is one
+		result = grow_indirect_table(queue, desc_output);
+		if (result == kIOReturnNoSpace)
 		{
-			IOLog("VirtioLegacyPCIDevice: generate_indirect_segment_dma(): emitted %u segments up to offset %llu for buffer with %llu bytes\n", max_segments, offset, buf->getLength());
+			IOLog("VirtioLegacyPCIDevice: generate_indirect_segment_dma(): emitted %u segments up to offset %llu for buffer with %llu bytes\n", desc_output->next_descriptor_index, offset, buf->getLength());
 			result = kIOReturnInternalError;
 		}
+		if (result != kIOReturnSuccess)
+			break;
+	}
+	if (result != kIOReturnSuccess)
+	{
 		dma_cmd->clearMemoryDescriptor();
 		return result;
 	}
 	
-	max_segments -= gen_segments;
 	return kIOReturnSuccess;
 }
 
-static void fill_vring_descriptor(VirtioVringDesc* descriptor, int16_t descriptorIndex, VirtioVringDesc* previousDescriptor, IODMACommand::Segment64 segment, bool device_writable);
-
-bool VirtioLegacyPCIDevice::outputVringDescSegmentForIndirectTable(
-	IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex)
+IOReturn VirtioLegacyPCIDevice::submitRegisteredBuffersToVirtqueue(uint16_t queue_index, VirtioRegisteredBuffer* device_readable_buf, VirtioRegisteredBuffer* device_writable_buf, VirtioCompletion completion)
 {
-	virtio_output_segment_for_indirect_descs_state* state = static_cast<virtio_output_segment_for_indirect_descs_state*>(segments);
-	VirtioVringDesc* descriptor = &state->queue->descriptor_table[state->main_descriptor_index];
-	fill_vring_descriptor(descriptor, state->main_descriptor_index, nullptr, segment, false);
-	descriptor->flags = VirtioVringDescFlag::INDIRECT;
+	if (queue_index >= this->num_virtqueues || (device_readable_buf == nullptr && device_writable_buf == nullptr))
+	{
+		return kIOReturnBadArgument;
+	}
+	if (this->virtqueues[queue_index].packed_ring)
+	{
+		IOReturn result = virtio_packed_virtqueue_submit_registered(&this->virtqueues[queue_index].packed, device_readable_buf, device_writable_buf, completion);
+		if (result == kIOReturnSuccess)
+			this->publishPackedVirtqueue(queue_index);
+		return result;
+	}
+	return this->submitSegmentsToVirtqueue(queue_index,
+		device_readable_buf ? device_readable_buf->segments : nullptr, device_readable_buf ? device_readable_buf->num_segments : 0,
+		device_writable_buf ? device_writable_buf->segments : nullptr, device_writable_buf ? device_writable_buf->num_segments : 0,
+		completion);
+}
 
-	return true;
+/// Queues a request whose physical segments are already known; nothing needs unmapping on completion.
+IOReturn VirtioLegacyPCIDevice::submitSegmentsToVirtqueue(uint16_t queue_index, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion)
+{
+	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
+	IOReturn result = virtio_virtqueue_add_segments(queue, readable_segments, num_readable_segments, writable_segments, num_writable_segments, completion);
+	if (result != kIOReturnSuccess)
+		return result;
+	if (queue->batch_depth == 0 && virtio_virtqueue_publish_available(queue))
+	{
+		this->kickVirtqueue(queue_index);
+	}
+	return kIOReturnSuccess;
 }
 
 bool VirtioLegacyPCIDevice::outputIndirectVringDescSegment(
@@ -1025,7 +1732,7 @@ bool VirtioLegacyPCIDevice::outputIndirectVringDescSegment(
 	uint16_t index = state->next_descriptor_index;
 	VirtioVringDesc* descriptor = &state->desc_array[index];
 	
-	fill_vring_descriptor(descriptor, index, index == 0 ? nullptr : &state->desc_array[index - 1], segment, state->writable);
+	virtio_fill_vring_descriptor(descriptor, index, index == 0 ? nullptr : &state->desc_array[index - 1], segment, state->writable);
 	
 	state->next_descriptor_index++;
 	
@@ -1040,7 +1747,7 @@ bool VirtioLegacyPCIDevice::outputVringDescSegment(
 	VirtioVirtqueue* queue = chain->queue;
 	
 	// 1. Claim an unused descriptor from the descriptor table (or use chain->reserved_descriptor_index)
-	int16_t descriptorIndex;
+	uint16_t descriptorIndex;
 	if (chain->reserved_descriptor_index != UINT16_MAX)
 	{
 		descriptorIndex = chain->reserved_descriptor_index;
@@ -1050,6 +1757,12 @@ bool VirtioLegacyPCIDevice::outputVringDescSegment(
 	{
 		descriptorIndex = reserveNewDescriptor(queue);
 		//IOLog("VirtioLegacyPCIDevice::outputVringDescSegment(): reserved descriptor %d for segment %u\n", descriptorIndex,segmentIndex);
+		if (descriptorIndex == VIRTIO_DESC_INDEX_NONE)
+		{
+			// concurrent submitters got to the remaining descriptors first
+			chain->out_of_descriptors = true;
+			return false;
+		}
 	}
 	
 	VirtioVringDesc* descriptor = &queue->descriptor_table[descriptorIndex];
@@ -1061,96 +1774,89 @@ bool VirtioLegacyPCIDevice::outputVringDescSegment(
 		previousBuffer->next_desc = descriptorIndex;
 	}
 	
-	fill_vring_descriptor(descriptor, descriptorIndex, previousDescriptor, segment, chain->device_writable);
+	virtio_fill_vring_descriptor(descriptor, descriptorIndex, previousDescriptor, segment, chain->device_writable);
 
-	queue->descriptor_buffers[descriptorIndex].next_desc = -1;
+	queue->descriptor_buffers[descriptorIndex].next_desc = VIRTIO_DESC_INDEX_NONE;
 	chain->current_last_descriptor_index = descriptorIndex;
 	return true;
 }
 
-static void fill_vring_descriptor(VirtioVringDesc* descriptor, int16_t descriptorIndex, VirtioVringDesc* previousDescriptor, IODMACommand::Segment64 segment, bool device_writable)
-{
-	// 2. fill physical address & length fields in descriptor with values from segment argument
-	descriptor->phys_address = segment.fIOVMAddr;
-	descriptor->length_bytes = static_cast<uint32_t>(segment.fLength);
-	
-	// set flags to 0 or WRITE depending on chain->device_writable
-	if (device_writable)
-	{
-		descriptor->flags = VirtioVringDescFlag::DEVICE_WRITABLE;
-	}
-	else
-	{
-		descriptor->flags = 0;
-	}
-	// 3. Check if this is the first segment
-	if (previousDescriptor != nullptr)
-	{
-		// update previous descriptor's next field with current descriptor index, and set "next" flag
-		previousDescriptor->next = descriptorIndex;
-		previousDescriptor->flags |= VirtioVringDescFlag::NEXT;
-	}
 
-	// 5. Save index of current descriptor as last descriptor
-	descriptor->next = 0xffff;
+unsigned VirtioLegacyPCIDevice::pollCompletedRequestsInVirtqueue(uint16_t queue_index, unsigned completion_limit)
+{
+	if (queue_index >= this->num_virtqueues)
+		return 0;
+	
+	// anything resubmitted by completion actions is published in one go
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	this->beginVirtqueueBatch(queue_index);
+	unsigned handled = vq->packed_ring
+		? virtio_packed_virtqueue_process_completed(&vq->packed, completion_limit)
+		: this->processCompletedRequestsInVirtqueue(&vq->queue, completion_limit);
+	this->commitVirtqueueBatch(queue_index);
+	vq->queue.stats.completions += handled;
+	if (handled > 0 && vq->pass_action != nullptr)
+	{
+		vq->pass_action(vq->pass_target, queue_index);
+	}
+	return handled;
 }
 
-unsigned VirtioLegacyPCIDevice::pollCompletedRequestsInVirtqueue(uint16_t queue_index, unsigned completion_limit)
+IOReturn VirtioLegacyPCIDevice::setVirtqueueCompletionPassAction(uint16_t queue_index, CompletionPassAction action, OSObject* target)
 {
-	return this->processCompletedRequestsInVirtqueue(&this->virtqueues[queue_index].queue, completion_limit);
+	if (queue_index >= this->num_virtqueues)
+		return kIOReturnBadArgument;
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	vq->pass_action = nullptr;
+	OSMemoryBarrier();
+	vq->pass_target = target;
+	OSMemoryBarrier();
+	vq->pass_action = action;
+	return kIOReturnSuccess;
 }
 
+IOReturn VirtioLegacyPCIDevice::getVirtqueueStatistics(uint16_t queue_index, VirtioVirtqueueStatistics* out_stats)
+{
+	if (queue_index >= this->num_virtqueues || out_stats == nullptr)
+		return kIOReturnBadArgument;
+	*out_stats = this->virtqueues[queue_index].queue.stats;
+	return kIOReturnSuccess;
+}
 
-unsigned VirtioLegacyPCIDevice::processCompletedRequestsInVirtqueue(VirtioVirtqueue* virtqueue, unsigned completion_limit)
+/// One NAPI-style pass over a virtqueue on behalf of an interrupt, handling at
+/// most interrupt_poll_budget completions. Returns true if the queue should
+/// stay in polling mode: the budget was used up and the used ring still holds
+/// completions, so interrupts stay suppressed and the caller schedules
+/// another pass. Otherwise, the queue ran dry and interrupts were re-armed.
+bool VirtioLegacyPCIDevice::pollVirtqueueForInterrupt(uint16_t queue_index)
 {
-	unsigned total_handled = 0;
-	const unsigned queue_len = virtqueue->num_entries;
-	while (true)
+	VirtioVirtqueue* queue = &this->virtqueues[queue_index].queue;
+	queue->stats.polls++;
+	unsigned handled = this->pollCompletedRequestsInVirtqueue(queue_index, this->interrupt_poll_budget);
+	if (handled < this->interrupt_poll_budget)
+		return false;
+	
+	VirtioLegacyPCIVirtqueue* vq = &this->virtqueues[queue_index];
+	if (!virtqueue_has_completed(vq))
 	{
-		uint16_t currentUsedRingHeadIndex = virtqueue->used_ring->head_index;
-		uint16_t nextUsedRingIndex = virtqueue->used_ring_last_head_index;
-		uint16_t numAdded = currentUsedRingHeadIndex - virtqueue->used_ring_last_head_index;
-		if(numAdded == 0 || (completion_limit != 0 && total_handled >= completion_limit))
-		{
-			if (virtqueue->interrupts_requested)
-				virtqueue->available_ring->flags = 0; // clear NO_INTERRUPT
-			OSSynchronizeIO();
-			currentUsedRingHeadIndex = virtqueue->used_ring->head_index;
-			numAdded = currentUsedRingHeadIndex - virtqueue->used_ring_last_head_index;
-			if (numAdded == 0 || (completion_limit != 0 && total_handled >= completion_limit))
-				return total_handled;
-		}
-		for( ; nextUsedRingIndex != currentUsedRingHeadIndex && (completion_limit == 0 || total_handled < completion_limit); nextUsedRingIndex++)
-		{
-			unsigned item = nextUsedRingIndex % queue_len;
-			uint32_t writtenBytes = virtqueue->used_ring->ring[item].written_bytes;
-			uint32_t dequeuedDescriptor = virtqueue->used_ring->ring[item].descriptor_id;
-
-			VirtioCompletion completion = virtqueue->descriptor_buffers[dequeuedDescriptor].completion;
-			int16_t descriptorIndex = static_cast<uint16_t>(dequeuedDescriptor);
-			while (descriptorIndex >= 0)
-			{
-				int16_t next = virtqueue->descriptor_buffers[descriptorIndex].next_desc;
-				VirtioBuffer* buffer = &virtqueue->descriptor_buffers[descriptorIndex];
-				if (buffer->dma_cmd_used)
-				{
-					buffer->dma_cmd->clearMemoryDescriptor(true);
-					buffer->dma_cmd_used = false;
-					if (virtqueue->indirect_descriptors)
-					{
-						buffer->dma_cmd_2->clearMemoryDescriptor(true);
-						buffer->dma_indirect_descriptors->clearMemoryDescriptor(true);
-						//kprintf("Completed request on descriptor %u\n", descriptorIndex);
-					}
-				}
-				//IOLog("VirtioLegacyPCIDevice::processCompletedRequestsInVirtqueue(): returning descriptor %d to unused list\n", descriptorIndex);
-				returnUnusedDescriptor(virtqueue, descriptorIndex);
-				descriptorIndex = next;
-			}
-			completion.action(completion.target, completion.ref, false, writtenBytes);
-		}
-		virtqueue->used_ring_last_head_index = nextUsedRingIndex;
+		// exactly used up the budget; re-arm as if we'd run dry
+		if (vq->packed_ring)
+			virtio_packed_virtqueue_rearm_interrupts(&vq->packed);
+		else if (queue->interrupts_requested)
+			virtio_virtqueue_enable_interrupts(queue);
+		OSMemoryBarrier();
+		if (!virtqueue_has_completed(vq))
+			return false;
 	}
+	queue->stats.budget_exhausted++;
+	return true;
+}
+
+
+
+unsigned VirtioLegacyPCIDevice::processCompletedRequestsInVirtqueue(VirtioVirtqueue* virtqueue, unsigned completion_limit)
+{
+	return virtio_virtqueue_process_completed(virtqueue, completion_limit);
 }
 
 void VirtioLegacyPCIDevice::closePCIDevice()
@@ -1230,85 +1936,93 @@ bool VirtioLegacyPCIDevice::beginHandlingInterrupts(IOWorkLoop* workloop)
 	if (msi_start_index >= 0)
 	{
 		// MSI or MSI-X detected
-		uint32_t msix_cap_val = this->pci_device->extendedFindPCICapability(kIOPCIMSIXCapability, &msix_cap_offset);
+		this->pci_device->extendedFindPCICapability(kIOPCIMSIXCapability, &msix_cap_offset);
 		
 		if (msix_cap_offset != 0)
 		{
 			kprintf("VirtioLegacyPCIDevice beginHandlingInterrupts(): MSI-X detected, capability offset %llu\n", msix_cap_offset);
-			/*
-			// Device supports MSI-X. IOPCIFamily seems to have problems with this, so revert to legacy interrupts
-			intr_index = legacy_index;
-			kprintf("VirtioLegacyPCIDevice beginHandlingInterrupts(): Reverted from message signaled interrupts (index %d) to legacy due to problems with MSI-X.\n", intr_index);
-			*/
 		}
 	}
 	
-	__asm__("int $3");
-	
-	this->intr_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(
-		this, &interruptAction, &interruptFilter, this->pci_device, intr_index);
-	if (!intr_event_source)
+	assert(this->work_loop == nullptr);
+	if (workloop == nullptr)
 	{
-		IOLog("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! %s interrupt event source with index %u failed.\n", intr_event_source ? "Initialising" : "Allocating", msi_last_index);
-		kprintf("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! %s interrupt event source with index %u failed.\n", intr_event_source ? "Initialising" : "Allocating", msi_last_index);
-		OSSafeReleaseNULL(intr_event_source);
+		workloop = this->pci_device->getWorkLoop();
+	}
+	if (workloop == nullptr)
+	{
+		workloop = IOWorkLoop::workLoop();
+	}
+	else
+	{
+		workloop->retain();
+	}
+	this->work_loop = workloop;
+	if (!this->work_loop)
 		return false;
+	
+	// Ideally, config changes and each virtqueue get their own MSI-X vector.
+	// Failing that, separating config from queue events still means the ISR
+	// status never needs to be read.
+	unsigned num_msi_vectors = (msi_start_index >= 0) ? (msi_last_index - msi_start_index + 1) : 0;
+	if (msix_cap_offset > 0 && this->num_virtqueues > 0 && num_msi_vectors >= this->num_virtqueues + 1u)
+	{
+		if (this->beginHandlingMSIXInterrupts(msi_start_index, msix_cap_offset, true /* per queue */))
+		{
+			kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): using %u MSI-X vectors, one per virtqueue plus config.\n", this, this->num_virtqueues + 1);
+			return true;
+		}
 	}
-
+	for (unsigned i = 0; i < this->num_virtqueues; ++i)
 	{
-		++intr_index;
-		auto temp_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(this, &interruptAction, &interruptFilter, this->pci_device, intr_index);
-		if (temp_event_source == nullptr)
+		if (this->virtqueues[i].work_loop != nullptr)
 		{
-			kprintf("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! Failed to create second interrupt source with index %u.\n", msi_start_index);
+			kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): no per-queue interrupts, virtqueue completion groups will run on the device work loop.\n", this);
+			break;
 		}
 	}
+	if (msix_cap_offset > 0 && this->num_virtqueues > 0 && num_msi_vectors >= 2)
+	{
+		if (this->beginHandlingMSIXInterrupts(msi_start_index, msix_cap_offset, false /* shared by queues */))
+		{
+			kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): using 2 MSI-X vectors, for config and all virtqueues.\n", this);
+			return true;
+		}
+		kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): separate MSI-X vectors unavailable, falling back to a single interrupt.\n", this);
+	}
+	
+	this->intr_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(
+		this, &interruptAction, &interruptFilter, this->pci_device, intr_index);
+	if (!intr_event_source)
+	{
+		IOLog("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! Allocating interrupt event source with index %d failed.\n", intr_index);
+		OSSafeReleaseNULL(this->work_loop);
+		return false;
+	}
 	
 	if (msi_start_index >= 0 && msix_cap_offset > 0)
 	{
 		// check if MSI-X is enabled on device. If so, shift the configuration area
-		uint16_t msix_control = this->pci_device->configRead16(msix_cap_offset + 2);
-		this->msix_active = (msix_control & 0x8000) != 0;
+		this->msix_active = this->isMSIXEnabled(msix_cap_offset);
 		if (this->msix_active)
 		{
 			kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): MSI-X appears to be active\n", this);
 			this->deviceSpecificConfigStartHeaderOffset = VirtioLegacyHeaderOffset::MSIX_END_HEADER;
 			
-			// Attempt to use vector 0 for both config and queue events
-			this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::MSIX_CONFIG_VECTOR, 0, this->pci_virtio_header_iomap);
-			uint16_t msix_vector = this->pci_device->ioRead16(VirtioLegacyHeaderOffset::MSIX_CONFIG_VECTOR, this->pci_virtio_header_iomap);
-			kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): config MSI-X vector read-back: %4x\n", this, msix_vector);
+			// Use vector 0 for both config and queue events
+			this->setConfigMSIXVector(0);
 			for (uint16_t queue_id = 0; queue_id < this->num_virtqueues; ++queue_id)
 			{
-				this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_SELECT, queue_id, this->pci_virtio_header_iomap);
-				this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::MSIX_QUEUE_VECTOR, 0, this->pci_virtio_header_iomap);
-				msix_vector = this->pci_device->ioRead16(VirtioLegacyHeaderOffset::MSIX_QUEUE_VECTOR, this->pci_virtio_header_iomap);
-				kprintf("VirtioLegacyPCIDevice[%p] beginHandlingInterrupts(): queue %u MSI-X vector read-back: %4x\n", this, queue_id, msix_vector);
+				this->setVirtqueueMSIXVector(queue_id, 0);
 			}
 		}
 	}
 	
-	assert(this->work_loop == nullptr);
-	if (workloop == nullptr)
-	{
-		workloop = this->pci_device->getWorkLoop();
-	}
-	if (workloop == nullptr)
-	{
-		workloop = IOWorkLoop::workLoop();
-	}
-	else
-	{
-		workloop->retain();
-	}
-	this->work_loop = workloop;
-	if (!this->work_loop)
-		return false;
-	
 	if (kIOReturnSuccess != this->work_loop->addEventSource(intr_event_source))
 	{
 		IOLog("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! Adding interrupt event source to work loop failed.\n");
 		OSSafeReleaseNULL(intr_event_source);
+		OSSafeReleaseNULL(this->work_loop);
 		return false;
 	}
 	intr_event_source->enable();
@@ -1316,22 +2030,115 @@ bool VirtioLegacyPCIDevice::beginHandlingInterrupts(IOWorkLoop* workloop)
 	return true;
 }
 
+bool VirtioLegacyPCIDevice::isMSIXEnabled(IOByteCount msix_cap_offset)
+{
+	uint16_t msix_control = this->pci_device->configRead16(msix_cap_offset + 2);
+	return (msix_control & 0x8000) != 0;
+}
+
+bool VirtioLegacyPCIDevice::setConfigMSIXVector(uint16_t vector)
+{
+	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::MSIX_CONFIG_VECTOR, vector, this->pci_virtio_header_iomap);
+	// the device reports VIRTIO_MSI_NO_VECTOR if it couldn't allocate the vector
+	uint16_t msix_vector = this->pci_device->ioRead16(VirtioLegacyHeaderOffset::MSIX_CONFIG_VECTOR, this->pci_virtio_header_iomap);
+	return msix_vector == vector;
+}
+
+bool VirtioLegacyPCIDevice::setVirtqueueMSIXVector(uint16_t queue_id, uint16_t vector)
+{
+	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::QUEUE_SELECT, queue_id, this->pci_virtio_header_iomap);
+	this->pci_device->ioWrite16(VirtioLegacyHeaderOffset::MSIX_QUEUE_VECTOR, vector, this->pci_virtio_header_iomap);
+	uint16_t msix_vector = this->pci_device->ioRead16(VirtioLegacyHeaderOffset::MSIX_QUEUE_VECTOR, this->pci_virtio_header_iomap);
+	return msix_vector == vector;
+}
 
+/// Sets up MSI-X vector 0 for config changes, and either vector 1 + i for
+/// virtqueue i or vector 1 for all virtqueues, each vector with its own event
+/// source. Leaves no sources behind on failure.
+bool VirtioLegacyPCIDevice::beginHandlingMSIXInterrupts(int msi_start_index, IOByteCount msix_cap_offset, bool per_queue_vectors)
+{
+	bool ok = true;
+	this->msix_first_intr_index = msi_start_index;
+	this->config_intr_source = IOFilterInterruptEventSource::filterInterruptEventSource(
+		this, &configInterruptAction, &configInterruptFilter, this->pci_device, msi_start_index);
+	ok = (this->config_intr_source != nullptr);
+	if (per_queue_vectors)
+	{
+		for (unsigned i = 0; ok && i < this->num_virtqueues; ++i)
+		{
+			this->virtqueues[i].intr_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(
+				this, &queueInterruptAction, &queueInterruptFilter, this->pci_device, msi_start_index + 1 + i);
+			ok = (this->virtqueues[i].intr_event_source != nullptr);
+		}
+	}
+	else if (ok)
+	{
+		this->intr_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(
+			this, &interruptAction, &sharedQueueInterruptFilter, this->pci_device, msi_start_index + 1);
+		ok = (this->intr_event_source != nullptr);
+	}
+	
+	if (ok)
+	{
+		ok = this->isMSIXEnabled(msix_cap_offset);
+	}
+	if (ok)
+	{
+		this->msix_active = true;
+		this->deviceSpecificConfigStartHeaderOffset = VirtioLegacyHeaderOffset::MSIX_END_HEADER;
+		ok = this->setConfigMSIXVector(0);
+		for (uint16_t queue_id = 0; ok && queue_id < this->num_virtqueues; ++queue_id)
+		{
+			ok = this->setVirtqueueMSIXVector(queue_id, per_queue_vectors ? queue_id + 1 : 1);
+		}
+	}
+	if (ok)
+	{
+		ok = (kIOReturnSuccess == this->work_loop->addEventSource(this->config_intr_source));
+		if (this->intr_event_source != nullptr && ok)
+		{
+			ok = (kIOReturnSuccess == this->work_loop->addEventSource(this->intr_event_source));
+		}
+		for (unsigned i = 0; per_queue_vectors && ok && i < this->num_virtqueues; ++i)
+		{
+			// completions of queues in a completion group run on the group's work loop
+			IOWorkLoop* queue_work_loop = this->virtqueues[i].work_loop ?: this->work_loop;
+			ok = (kIOReturnSuccess == queue_work_loop->addEventSource(this->virtqueues[i].intr_event_source));
+		}
+	}
+	
+	if (!ok)
+	{
+		this->releaseInterruptSources();
+		return false;
+	}
+	
+	this->config_intr_source->enable();
+	if (this->intr_event_source != nullptr)
+	{
+		this->intr_event_source->enable();
+	}
+	for (unsigned i = 0; per_queue_vectors && i < this->num_virtqueues; ++i)
+	{
+		this->virtqueues[i].intr_event_source->enable();
+	}
+	return true;
+}
 
 bool VirtioLegacyPCIDevice::interruptFilter(OSObject* me, IOFilterInterruptEventSource* source)
 {
 	// deliberately minimalistic function, as it will be called from an interrupt
-	VirtioLegacyPCIDevice* virtio_pci = OSDynamicCast(VirtioLegacyPCIDevice, me);
-	if (!virtio_pci || source != virtio_pci->intr_event_source)
+	VirtioLegacyPCIDevice* virtio_pci = static_cast<VirtioLegacyPCIDevice*>(me);
+	if (source != virtio_pci->intr_event_source)
 		return false; // this isn't really for us
 
-	kprintf("VirtioLegacyPCIDevice::interruptFilter\n");
 	// check if anything interesting has happened, record status register
 	
-	uint8_t isr = virtio_pci->pci_device->ioRead8(VirtioLegacyHeaderOffset::ISR_STATUS, virtio_pci->pci_virtio_header_iomap);
+	uint8_t isr = virtio_pci->readISRStatus();
 	//virtio_pci->last_isr = isr;
 	if (isr & VIRTIO_PCI_DEVICE_ISR_CONF_CHANGE)
 	{
+		virtio_pci->invalidateDeviceConfigCache();
 		OSTestAndSet(0, &virtio_pci->received_config_change);
 		return true;
 	}
@@ -1340,13 +2147,95 @@ bool VirtioLegacyPCIDevice::interruptFilter(OSObject* me, IOFilterInterruptEvent
 		// disable further virtqueue interrupts until the handler has run?
 		for (unsigned i = 0; i < virtio_pci->num_virtqueues; ++i)
 		{
-			virtio_pci->virtqueues[i].queue.available_ring->flags = VirtioVringAvailFlag::NO_INTERRUPT;
+			virtqueue_disable_interrupts(&virtio_pci->virtqueues[i]);
+			virtio_pci->virtqueues[i].queue.stats.interrupts++;
 		}
 		return true;
 	}
 	return false;
 }
 
+/// Returns the index of the virtqueue whose dedicated interrupt source this is, or -1.
+/** Vectors are assigned in queue order, so this needs no device access. */
+int VirtioLegacyPCIDevice::virtqueueIndexForInterruptSource(IOInterruptEventSource* source)
+{
+	int queue_index = source->getIntIndex() - this->msix_first_intr_index - 1;
+	if (queue_index < 0 || static_cast<unsigned>(queue_index) >= this->num_virtqueues
+		|| this->virtqueues[queue_index].intr_event_source != source)
+		return -1;
+	return queue_index;
+}
+
+// The MSI-X filters below run for every interrupt at full packet rate: the
+// vector alone says what happened, so they don't read the ISR status port
+// (a VM exit) and don't log.
+
+bool VirtioLegacyPCIDevice::queueInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source)
+{
+	VirtioLegacyPCIDevice* virtio_pci = static_cast<VirtioLegacyPCIDevice*>(me);
+	int queue_index = virtio_pci->virtqueueIndexForInterruptSource(source);
+	if (queue_index < 0)
+		return false;
+	
+	// only this queue is affected; the others carry on interrupting independently
+	virtqueue_disable_interrupts(&virtio_pci->virtqueues[queue_index]);
+	virtio_pci->virtqueues[queue_index].queue.stats.interrupts++;
+	return true;
+}
+
+bool VirtioLegacyPCIDevice::sharedQueueInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source)
+{
+	VirtioLegacyPCIDevice* virtio_pci = static_cast<VirtioLegacyPCIDevice*>(me);
+	if (source != virtio_pci->intr_event_source)
+		return false;
+	
+	for (unsigned i = 0; i < virtio_pci->num_virtqueues; ++i)
+	{
+		virtqueue_disable_interrupts(&virtio_pci->virtqueues[i]);
+		virtio_pci->virtqueues[i].queue.stats.interrupts++;
+	}
+	return true;
+}
+
+void VirtioLegacyPCIDevice::queueInterruptAction(OSObject* me, IOInterruptEventSource* source, int count)
+{
+	VirtioLegacyPCIDevice* virtio_pci = OSDynamicCast(VirtioLegacyPCIDevice, me);
+	if (!virtio_pci)
+		return;
+	int queue_index = virtio_pci->virtqueueIndexForInterruptSource(source);
+	if (queue_index < 0)
+		return;
+	
+	if (virtio_pci->pollVirtqueueForInterrupt(queue_index))
+	{
+		// Still busy: come back for another pass once other event sources on
+		// the work loop have had a look in.
+		virtio_pci->virtqueues[queue_index].intr_event_source->signalInterrupt();
+	}
+}
+
+bool VirtioLegacyPCIDevice::configInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source)
+{
+	VirtioLegacyPCIDevice* virtio_pci = static_cast<VirtioLegacyPCIDevice*>(me);
+	if (source != virtio_pci->config_intr_source)
+		return false;
+	// the config vector fires for nothing but config changes
+	virtio_pci->invalidateDeviceConfigCache();
+	return true;
+}
+
+void VirtioLegacyPCIDevice::configInterruptAction(OSObject* me, IOInterruptEventSource* source, int count)
+{
+	VirtioLegacyPCIDevice* virtio_pci = OSDynamicCast(VirtioLegacyPCIDevice, me);
+	if (!virtio_pci || source != virtio_pci->config_intr_source)
+		return;
+	
+	if (virtio_pci->configChangeAction != nullptr)
+	{
+		virtio_pci->configChangeAction(virtio_pci->configChangeTarget, virtio_pci);
+	}
+}
+
 bool VirtioLegacyPCIDevice::didTerminate( IOService * provider, IOOptionBits options, bool * defer )
 {
 	VLTLog("VirtioLegacyPCIDevice[%p]::didTerminate() provider = %p, options = %x, defer = %s [%p]\n", this, provider, options, defer ? ((*defer) ? "true" : "false") : "NULL", defer);
@@ -1378,20 +2267,44 @@ void VirtioLegacyPCIDevice::interruptAction(IOInterruptEventSource* source, int
 		}
 	}
 	
+	bool more_work = false;
 	for(unsigned i = 0; i < this->num_virtqueues; i++)
 	{
-		this->processCompletedRequestsInVirtqueue(&this->virtqueues[i].queue, 0 /* no limit */);
+		if (this->pollVirtqueueForInterrupt(i))
+			more_work = true;
+	}
+	if (more_work)
+	{
+		// queues that ran dry have re-armed their interrupts, the rest stay in polling mode
+		this->intr_event_source->signalInterrupt();
 	}
 }
 
-bool VirtioLegacyPCIDevice::endHandlingInterrupts()
+static void release_interrupt_source(IOFilterInterruptEventSource*& source, IOWorkLoop* work_loop)
+{
+	if (source != nullptr)
+	{
+		source->disable();
+		if (work_loop != nullptr)
+			work_loop->removeEventSource(source);
+		OSSafeReleaseNULL(source);
+	}
+}
+
+void VirtioLegacyPCIDevice::releaseInterruptSources()
 {
-	if(this->intr_event_source)
+	release_interrupt_source(this->intr_event_source, this->work_loop);
+	release_interrupt_source(this->config_intr_source, this->work_loop);
+	for (unsigned i = 0; this->virtqueues != nullptr && i < this->num_virtqueues; ++i)
 	{
-		this->intr_event_source->disable();
-		this->work_loop->removeEventSource(this->intr_event_source);
-		OSSafeReleaseNULL(this->intr_event_source);
+		release_interrupt_source(this->virtqueues[i].intr_event_source, this->virtqueues[i].work_loop ?: this->work_loop);
 	}
+}
+
+bool VirtioLegacyPCIDevice::endHandlingInterrupts()
+{
+	this->releaseKickTimers();
+	this->releaseInterruptSources();
 	OSSafeReleaseNULL(this->work_loop);
 	return true;
 }
@@ -16,6 +16,7 @@
 #define VirtioLegacyPCIDevice eu_dennis__jordan_driver_VirtioLegacyPCIDevice
 class IOPCIDevice;
 struct VirtioLegacyPCIVirtqueue;
+class IOTimerEventSource;
 class VirtioLegacyPCIDevice : public VirtioDevice
 {
 	OSDeclareDefaultStructors(VirtioLegacyPCIDevice);
@@ -23,8 +24,8 @@ protected:
 	IOMemoryMap* pci_virtio_header_iomap;
 	IOPCIDevice* pci_device;
 	bool msix_active;
-	uint32_t features;
-	uint32_t active_features;
+	uint64_t features;
+	uint64_t active_features;
 	
 	struct VirtioLegacyPCIVirtqueue* virtqueues;
 	unsigned num_virtqueues;
@@ -32,7 +33,16 @@ protected:
 	uint16_t deviceSpecificConfigStartHeaderOffset;
 	ConfigChangeAction configChangeAction;
 	OSObject* configChangeTarget;
+	/// Single interrupt source used for all events, unless each has its own MSI-X vector
 	IOFilterInterruptEventSource* intr_event_source;
+	/// Config change source when using separate MSI-X vectors
+	IOFilterInterruptEventSource* config_intr_source;
+	/// Interrupt index of MSI-X vector 0
+	int msix_first_intr_index;
+	/// Maximum completions handled per virtqueue in one pass of an interrupt action
+	unsigned interrupt_poll_budget;
+	/// No system mapper: physical segments of wired buffers may be written to descriptors directly
+	bool inline_physical_segments;
 	IOWorkLoop* work_loop;
 	volatile UInt8 received_config_change __attribute__((aligned(32)));
 
@@ -44,18 +54,26 @@ public:
 	virtual void handleClose(IOService* forClient, IOOptionBits options) override;
 	
 	virtual bool resetDevice() override;
-	virtual uint32_t supportedFeatures() override;
-	virtual bool requestFeatures(uint32_t use_features) override;
+	virtual uint64_t supportedFeatures() override;
+	virtual bool requestFeatures(uint64_t use_features) override;
 	virtual void failDevice() override;
-	virtual IOReturn setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[] = nullptr, unsigned out_queue_sizes[] = nullptr, const unsigned indirect_desc_per_request[] = nullptr) override;
+	virtual IOReturn setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[] = nullptr, unsigned out_queue_sizes[] = nullptr, const unsigned indirect_desc_per_request[] = nullptr, const VirtioVirtqueueCompletionContext completion_contexts[] = nullptr) override;
 	virtual IOReturn setVirtqueueInterruptsEnabled(uint16_t queue_id, bool enabled) override;
+	virtual IOWorkLoop* getVirtqueueWorkLoop(uint16_t queue_id) override;
 	virtual void startDevice(ConfigChangeAction action = nullptr, OSObject* target = nullptr, IOWorkLoop* workloop = nullptr) override;
 	
 	virtual void closePCIDevice();
 
 	virtual IOReturn submitBuffersToVirtqueue(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion) override;
+	virtual IOReturn submitRegisteredBuffersToVirtqueue(uint16_t queue_index, VirtioRegisteredBuffer* device_readable_buf, VirtioRegisteredBuffer* device_writable_buf, VirtioCompletion completion) override;
 	unsigned processCompletedRequestsInVirtqueue(VirtioVirtqueue* virtqueue, unsigned completion_limit);
 	virtual unsigned pollCompletedRequestsInVirtqueue(uint16_t queue_index, unsigned completion_limit = 0) override;
+	virtual IOReturn setVirtqueueCompletionPassAction(uint16_t queue_index, CompletionPassAction action, OSObject* target) override;
+	virtual IOReturn getVirtqueueStatistics(uint16_t queue_index, VirtioVirtqueueStatistics* out_stats) override;
+	virtual void beginVirtqueueBatch(uint16_t queue_index) override;
+	virtual void commitVirtqueueBatch(uint16_t queue_index) override;
+	virtual IOReturn setVirtqueueKickCoalescing(uint16_t queue_index, unsigned max_batch, uint32_t max_delay_us) override;
+	virtual void flushVirtqueueKicks(uint16_t queue_index) override;
 	
 	virtual uint8_t readDeviceConfig8(uint16_t device_specific_offset) override;
 
@@ -90,22 +108,60 @@ public:
 	static bool interruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
 	virtual void interruptAction(IOInterruptEventSource* source, int count);
 	virtual bool endHandlingInterrupts();
+	
+	static bool queueInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
+	static bool sharedQueueInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
+	static void queueInterruptAction(OSObject* me, IOInterruptEventSource* source, int count);
+	static bool configInterruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
+	static void configInterruptAction(OSObject* me, IOInterruptEventSource* source, int count);
 
 	virtual IOWorkLoop* getWorkLoop() const override;
+protected:
+	/// Transport-specific register access; everything else is shared by the legacy and modern transports.
+	virtual const char* transportName() const;
+	virtual bool mapHeaderIORegion();
+	virtual void unmapHeaderIORegion();
+	virtual uint8_t readISRStatus();
+	/// next_avail_index is the avail ring head index just published, or for
+	/// packed rings the next slot and wrap counter, for transports which pass it to the device
+	virtual void notifyVirtqueue(uint16_t queue_index, uint16_t next_avail_index);
+	virtual bool setConfigMSIXVector(uint16_t vector);
+	virtual bool setVirtqueueMSIXVector(uint16_t queue_id, uint16_t vector);
+	/// Selects the queue for the following register accesses and returns its size.
+	virtual uint16_t selectVirtqueue(uint16_t queue_id);
+	/// Tells the device where the selected queue's rings are; returns false if it refused.
+	virtual bool activateVirtqueue(uint16_t queue_id, uint16_t num_entries, uint64_t descriptor_table_phys, uint64_t available_ring_phys, uint64_t used_ring_phys);
+	
+	/// Allocate descriptor table and rings separately anywhere in 64-bit space, rather than as one legacy vring block
+	bool separate_ring_allocations;
+	
 private:
 	IOReturn setupVirtqueue(VirtioLegacyPCIVirtqueue* queue, uint16_t queue_id, bool interrupts_enabled, unsigned indirect_desc_per_request);
+	IOReturn setupPackedVirtqueue(VirtioLegacyPCIVirtqueue* queue, uint16_t queue_id, uint16_t num_queue_entries, bool interrupts_enabled);
+	IOReturn createCompletionWorkLoops(VirtioLegacyPCIVirtqueue* queues, uint16_t number_queues, const VirtioVirtqueueCompletionContext completion_contexts[]);
 	
 	
-	bool mapHeaderIORegion();
+	bool pollVirtqueueForInterrupt(uint16_t queue_index);
+	
+	/// Notifies the device of newly published requests, or defers it if the queue coalesces kicks.
+	void kickVirtqueue(uint16_t queue_index);
+	void flushDeferredKicks(uint16_t queue_index);
+	void publishPackedVirtqueue(uint16_t queue_index);
+	static void kickTimerAction(OSObject* me, IOTimerEventSource* sender);
+	void releaseKickTimers();
+	
+	bool beginHandlingMSIXInterrupts(int msi_start_index, IOByteCount msix_cap_offset, bool per_queue_vectors);
+	void releaseInterruptSources();
+	int virtqueueIndexForInterruptSource(IOInterruptEventSource* source);
+	bool isMSIXEnabled(IOByteCount msix_cap_offset);
 	
 	static bool outputVringDescSegment(
 		IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex);
-	static bool outputVringDescSegmentForIndirectTable(
-		IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex);
 	static bool outputIndirectVringDescSegment(
 		IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex);
 
 	IOReturn submitBuffersToVirtqueueDirect(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion);
+	IOReturn submitSegmentsToVirtqueue(uint16_t queue_index, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion);
 	IOReturn submitBuffersToVirtqueueIndirect(uint16_t queue_index, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion);
 
 };
@@ -14,7 +14,7 @@
 
 OSDefineMetaClassAndStructors(VirtioMemBalloonDevice, IOService);
 
-static const uint32_t VIRTIO_SUPPORTED_MEMORY_BALLOON_FEATURES = 0;
+static const uint64_t VIRTIO_SUPPORTED_MEMORY_BALLOON_FEATURES = 0;
 
 
 bool VirtioMemBalloonDevice::start(IOService* provider)
@@ -32,8 +32,8 @@ bool VirtioMemBalloonDevice::start(IOService* provider)
 	
 	virtio->resetDevice();
 	
-	uint32_t dev_features = virtio->supportedFeatures();
-	uint32_t use_features = dev_features & VIRTIO_SUPPORTED_MEMORY_BALLOON_FEATURES;
+	uint64_t dev_features = virtio->supportedFeatures();
+	uint64_t use_features = dev_features & VIRTIO_SUPPORTED_MEMORY_BALLOON_FEATURES;
 	
 	bool ok = virtio->requestFeatures(use_features);
 	if (!ok)
@@ -100,8 +100,8 @@ bool VirtioNetworkDevice::start(IOService* provider)
 	
 	virtio->resetDevice();
 	
-	uint32_t dev_features = virtio->supportedFeatures();
-	uint32_t use_features = dev_features & VirtioNetworkDeviceFeatures::VIRTIO_NET_F_GSO;
+	uint64_t dev_features = virtio->supportedFeatures();
+	uint64_t use_features = dev_features & VirtioNetworkDeviceFeatures::VIRTIO_NET_F_GSO;
 	
 	bool ok = virtio->requestFeatures(use_features);
 	if (!ok)
@@ -9,7 +9,7 @@
 #include "VirtioPCIDevice.h"
 #include "../lib/kextgizmos/iopcidevice_helpers.hpp"
 #include <IOKit/IOLib.h>
-#include <IOKit/IOFilterInterruptEventSource.h>
+#include <libkern/OSByteOrder.h>
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Winconsistent-missing-override"
@@ -24,6 +24,8 @@
 #define LogWarning(fmt, ...) LogWithLocation(ANSI_ESCAPE_RED "Warning: " ANSI_ESCAPE_RESET fmt, ## __VA_ARGS__)
 #if DEBUG
 #define LogVerbose(fmt, ...) LogWithLocation(fmt, ## __VA_ARGS__)
+#else
+#define LogVerbose(fmt, ...) do {} while (0)
 #endif
 
 
@@ -52,7 +54,7 @@ bool djt_ioregentry_read_uint32_from_data_property(uint32_t& out_value, IORegist
 	return success;
 }
 
-OSDefineMetaClassAndStructors(VirtioPCIDevice, IOService);
+OSDefineMetaClassAndStructors(VirtioPCIDevice, VirtioLegacyPCIDevice);
 
 template<typename FN_T> bool djt_iopcidevice_iterate_capabilities(IOPCIDevice* dev, FN_T fn)
 {
@@ -103,18 +105,6 @@ namespace VirtioCapOffset
 	};
 }
 
-struct VirtioModernPCIVirtqueue
-{
-	IOBufferMemoryDescriptor* descriptor_table_mem;
-	IODMACommand* descriptor_table_mem_dma;
-	IOBufferMemoryDescriptor* available_ring_mem;
-	IODMACommand* available_ring_mem_dma;
-	IOBufferMemoryDescriptor* used_ring_mem;
-	IODMACommand* used_ring_mem_dma;
-
-	struct VirtioVirtqueue queue;
-};
-
 // Types used in Virtio spec
 typedef uint64_t le64;
 typedef uint32_t le32;
@@ -172,7 +162,59 @@ struct virtio_pci_common_cfg
 	le64 queue_used; /* read-write */
 };
 
-static bool check_bar_type_and_length(IOPCIDevice* dev, uint8_t bar_index, uint32_t min_length)
+/// Device status bits, section 2.1 of the virtio 1.0 spec
+namespace VirtioDeviceStatus
+{
+	enum VirtioDeviceStatusBits : uint8_t
+	{
+		ACKNOWLEDGE = 1,
+		DRIVER = 2,
+		DRIVER_OK = 4,
+		FEATURES_OK = 8,
+		FAILED = 128,
+	};
+}
+
+#define VIRTIO_COMMON_CFG(field) offsetof(virtio_pci_common_cfg, field)
+/// Written to an MSI-X vector register by the driver to detach it, or read back if the device couldn't allocate one
+static const uint16_t VIRTIO_MSI_NO_VECTOR = 0xffff;
+/// How long to wait for the device status to read back as 0 after a reset
+static const unsigned VIRTIO_PCI_RESET_TIMEOUT_US = 100000;
+
+// All virtio structures are little endian, whatever the CPU.
+static inline uint8_t mmio_read8(volatile uint8_t* base, size_t offset)
+{
+	return base[offset];
+}
+static inline uint16_t mmio_read16(volatile uint8_t* base, size_t offset)
+{
+	return OSReadLittleInt16(base, offset);
+}
+static inline uint32_t mmio_read32(volatile uint8_t* base, size_t offset)
+{
+	return OSReadLittleInt32(base, offset);
+}
+static inline void mmio_write8(volatile uint8_t* base, size_t offset, uint8_t value)
+{
+	base[offset] = value;
+}
+static inline void mmio_write16(volatile uint8_t* base, size_t offset, uint16_t value)
+{
+	OSWriteLittleInt16(base, offset, value);
+}
+static inline void mmio_write32(volatile uint8_t* base, size_t offset, uint32_t value)
+{
+	OSWriteLittleInt32(base, offset, value);
+}
+/// 64-bit fields may be written as two 32-bit halves, low half first.
+static inline void mmio_write64(volatile uint8_t* base, size_t offset, uint64_t value)
+{
+	OSWriteLittleInt32(base, offset, static_cast<uint32_t>(value));
+	OSWriteLittleInt32(base, offset + sizeof(uint32_t), static_cast<uint32_t>(value >> 32u));
+}
+
+/// Checks the BAR is a memory range which covers at least min_length bytes.
+static bool check_bar_type_and_length(IOPCIDevice* dev, uint8_t bar_index, uint64_t min_length)
 {
 	if (bar_index > 5)
 	{
@@ -195,7 +237,7 @@ static bool check_bar_type_and_length(IOPCIDevice* dev, uint8_t bar_index, uint3
 				if (bar_mem == nullptr)
 					LogVerbose("Could not get device memory for BAR number %u.\n", bar_index);
 				else
-					LogVerbose("Device memory for BAR %u is too short (%llu, expect at least %u).\n", bar_index, bar_mem->getLength(), min_length);
+					LogVerbose("Device memory for BAR %u is too short (%llu, expect at least %llu).\n", bar_index, bar_mem->getLength(), min_length);
 				ok = false;
 			}
 			break;
@@ -211,6 +253,18 @@ static bool check_bar_type_and_length(IOPCIDevice* dev, uint8_t bar_index, uint3
 	return ok;
 }
 
+/// The structure must fit into its BAR, not just its length.
+static inline uint64_t cap_end_offset(const virtio_pci_cap& cap)
+{
+	return static_cast<uint64_t>(cap.bar_offset) + cap.bar_length;
+}
+
+static VirtioPCIStructureLocation cap_location(const virtio_pci_cap& cap)
+{
+	VirtioPCIStructureLocation location = { cap.bar, cap.bar_offset, cap.bar_length };
+	return location;
+}
+
 bool VirtioPCIDevice::setupCommonCFG(IOPCIDevice* dev, const virtio_pci_cap& cap, unsigned config_offset, bool do_setup)
 {
 	LogVerbose("@ offset %u\n", config_offset);
@@ -228,12 +282,12 @@ bool VirtioPCIDevice::setupCommonCFG(IOPCIDevice* dev, const virtio_pci_cap& cap
 		ok = false;
 	}
 	
-	if (!check_bar_type_and_length(dev, cap.bar, cap.bar_length))
+	if (!check_bar_type_and_length(dev, cap.bar, cap_end_offset(cap)))
 		ok = false;
 	
 	if (ok && do_setup)
 	{
-#warning TODO
+		this->common_cfg_location = cap_location(cap);
 	}
 	return ok;
 }
@@ -264,12 +318,13 @@ bool VirtioPCIDevice::setupNotificationStructure(IOPCIDevice* dev, const virtio_
 		ok = false;
 	}
 
-	if (!check_bar_type_and_length(dev, cap.bar, cap.bar_length))
+	if (!check_bar_type_and_length(dev, cap.bar, cap_end_offset(cap)))
 		ok = false;
 
 	if (ok && do_setup)
 	{
-#warning TODO
+		this->notify_location = cap_location(cap);
+		this->notify_off_multiplier = notify_off_multiplier;
 	}
 	return ok;
 }
@@ -286,12 +341,12 @@ bool VirtioPCIDevice::setupISRStatusStructure(IOPCIDevice* dev, const virtio_pci
 		ok = false;
 	}
 	
-	if (!check_bar_type_and_length(dev, cap.bar, cap.bar_length))
+	if (!check_bar_type_and_length(dev, cap.bar, cap_end_offset(cap)))
 		ok = false;
 	
 	if (ok && do_setup)
 	{
-#warning TODO
+		this->isr_location = cap_location(cap);
 	}
 	return ok;
 }
@@ -307,72 +362,26 @@ bool VirtioPCIDevice::setupDeviceSpecificStructure(IOPCIDevice* dev, const virti
 		ok = false;
 	}
 
-	if (!check_bar_type_and_length(dev, cap.bar, cap.bar_length))
+	if (!check_bar_type_and_length(dev, cap.bar, cap_end_offset(cap)))
 		ok = false;
 	
 	if (ok && do_setup)
 	{
-#warning TODO
+		this->device_cfg_location = cap_location(cap);
+		this->has_device_cfg = true;
 	}
 	return ok;
 }
 
-IOService* VirtioPCIDevice::probe(IOService* provider, SInt32* score)
+/// Walks the capability list for the virtio structures; fails unless common config, notification and ISR structures are usable.
+bool VirtioPCIDevice::locateVirtioStructures(IOPCIDevice* pci_dev, bool do_setup)
 {
-	IOPCIDevice* pci_dev = OSDynamicCast(IOPCIDevice, provider);
-	if (!pci_dev)
-	{
-		LogVerbose("VirtioPCIDevice::No PCI device found\n");
-		return NULL;
-	}
-	
-	uint32_t vendor_id = 0, device_id = 0;
-	if (!djt_ioregentry_read_uint32_from_data_property(vendor_id, pci_dev, IOKIT_PCI_VENDOR_ID_KEY))
-		LogVerbose("No Vendor ID on provider PCI device?\n");
-	if (!djt_ioregentry_read_uint32_from_data_property(device_id, pci_dev, IOKIT_PCI_DEVICE_ID_KEY))
-		LogVerbose("No Vendor ID on provider PCI device?\n");
-	LogVerbose("Vendor ID: 0x%04x, device ID: 0x%04x\n", vendor_id, device_id);
-	
-	/*
-	for (unsigned r = 0; r < 16; ++r)
-	{
-		uint8_t b[16];
-		for (unsigned i = 0; i < 16; ++i)
-		{
-			b[i] = pci_dev->configRead8(r * 16 + i);
-		}
-		IOLog("%02x %02x %02x %02x  %02x %02x %02x %02x  %02x %02x %02x %02x  %02x %02x %02x %02x\n",
-			b[0], b[1], b[2], b[3],
-			b[4], b[5], b[6], b[7],
-			b[8], b[9], b[10], b[11],
-			b[12], b[13], b[14], b[15]);
-	}
-	*/
-	
-	uint8_t config_space[256];
-	
-	for (unsigned i = 0; i < 256; ++i)
-	{
-		config_space[i] = pci_dev->configRead8(i);
-	}
-	
-	for (unsigned i = 0; i < 16; ++i)
-	{
-		unsigned offset = i * 16;
-		const uint8_t* b = config_space + offset;
-		LogVerbose("0x%04x:0x%04x [%3u]: %02x %02x %02x %02x  %02x %02x %02x %02x    %02x %02x %02x %02x  %02x %02x %02x %02x\n",
-			vendor_id, device_id, offset,
-			b[0], b[1], b[2], b[3],  b[4], b[5], b[6], b[7],  b[8], b[9], b[10], b[11],  b[12], b[13], b[14], b[15]);
-	}
-	
 	bool cap_checked[5] = {};
 	
-	bool mem_enable_reset = pci_dev->setMemoryEnable(true);
-	
 	bool ok =
 		djt_iopcidevice_iterate_capabilities(
 			pci_dev,
-			[this, pci_dev, &cap_checked](uint8_t offset, uint8_t cap_type)
+			[this, pci_dev, &cap_checked, do_setup](uint8_t offset, uint8_t cap_type)
 			{
 				LogVerbose("Capability 0x%02x found at offset %u\n", cap_type, offset);
 				if (cap_type == kIOPCIVendorSpecificCapability)
@@ -403,28 +412,28 @@ IOService* VirtioPCIDevice::probe(IOService* provider, SInt32* score)
 								// "The driver SHOULD use the first instance of each virtio structure type they can support."
 								if (!cap_checked_flag)
 								{
-									cap_checked_flag = this->setupCommonCFG(pci_dev, cap, offset, false /* don't set up, just check */);
+									cap_checked_flag = this->setupCommonCFG(pci_dev, cap, offset, do_setup);
 								}
 								break;
 						
 							case VIRTIO_PCI_CAP_NOTIFY_CFG:
 								if (!cap_checked_flag)
 								{
-									cap_checked_flag = this->setupNotificationStructure(pci_dev, cap, offset, false /* don't set up, just check */);
+									cap_checked_flag = this->setupNotificationStructure(pci_dev, cap, offset, do_setup);
 								}
 								break;
 						
 							case VIRTIO_PCI_CAP_ISR_CFG:
 								if (!cap_checked_flag)
 								{
-									cap_checked_flag = this->setupISRStatusStructure(pci_dev, cap, offset, false /* don't set up, just check */);
+									cap_checked_flag = this->setupISRStatusStructure(pci_dev, cap, offset, do_setup);
 								}
 								break;
 						
 							case VIRTIO_PCI_CAP_DEVICE_CFG:
 								if (!cap_checked_flag)
 								{
-									cap_checked_flag = this->setupDeviceSpecificStructure(pci_dev, cap, offset, false /* don't set up, just check */);
+									cap_checked_flag = this->setupDeviceSpecificStructure(pci_dev, cap, offset, do_setup);
 								}
 								break;
 						
@@ -436,6 +445,54 @@ IOService* VirtioPCIDevice::probe(IOService* provider, SInt32* score)
 				}
 			});
 	
+	if (!cap_checked[VIRTIO_PCI_CAP_COMMON_CFG - 1] || !cap_checked[VIRTIO_PCI_CAP_NOTIFY_CFG - 1] || !cap_checked[VIRTIO_PCI_CAP_ISR_CFG - 1])
+	{
+		LogVerbose("Missing virtio structure: common config %s, notification %s, ISR %s\n",
+			cap_checked[VIRTIO_PCI_CAP_COMMON_CFG - 1] ? "found" : "missing",
+			cap_checked[VIRTIO_PCI_CAP_NOTIFY_CFG - 1] ? "found" : "missing",
+			cap_checked[VIRTIO_PCI_CAP_ISR_CFG - 1] ? "found" : "missing");
+		ok = false;
+	}
+	return ok;
+}
+
+IOService* VirtioPCIDevice::probe(IOService* provider, SInt32* score)
+{
+	IOPCIDevice* pci_dev = OSDynamicCast(IOPCIDevice, provider);
+	if (!pci_dev)
+	{
+		LogVerbose("VirtioPCIDevice::No PCI device found\n");
+		return NULL;
+	}
+	
+	uint32_t vendor_id = 0, device_id = 0;
+	if (!djt_ioregentry_read_uint32_from_data_property(vendor_id, pci_dev, IOKIT_PCI_VENDOR_ID_KEY))
+		LogVerbose("No Vendor ID on provider PCI device?\n");
+	if (!djt_ioregentry_read_uint32_from_data_property(device_id, pci_dev, IOKIT_PCI_DEVICE_ID_KEY))
+		LogVerbose("No Vendor ID on provider PCI device?\n");
+	LogVerbose("Vendor ID: 0x%04x, device ID: 0x%04x\n", vendor_id, device_id);
+	
+	uint8_t config_space[256];
+	
+	for (unsigned i = 0; i < 256; ++i)
+	{
+		config_space[i] = pci_dev->configRead8(i);
+	}
+	
+	for (unsigned i = 0; i < 16; ++i)
+	{
+		unsigned offset = i * 16;
+		const uint8_t* b = config_space + offset;
+		LogVerbose("0x%04x:0x%04x [%3u]: %02x %02x %02x %02x  %02x %02x %02x %02x    %02x %02x %02x %02x  %02x %02x %02x %02x\n",
+			vendor_id, device_id, offset,
+			b[0], b[1], b[2], b[3],  b[4], b[5], b[6], b[7],  b[8], b[9], b[10], b[11],  b[12], b[13], b[14], b[15]);
+	}
+	
+	bool mem_enable_reset = pci_dev->setMemoryEnable(true);
+	
+	// Transitional devices without usable modern structures are left to the legacy driver
+	bool ok = this->locateVirtioStructures(pci_dev, false /* don't set up, just check */);
+	
 	pci_dev->setMemoryEnable(mem_enable_reset);
 	
 	djt_pci_interrupt_index_ranges interrupt_ranges = djt_iopcidevice_find_interrupt_ranges(pci_dev);
@@ -456,18 +513,6 @@ IOService* VirtioPCIDevice::probe(IOService* provider, SInt32* score)
 	return this;
 }
 
-void VirtioPCIDevice::interruptAction(OSObject* me, IOInterruptEventSource* source, int count)
-{
-	int int_index = source->getIntIndex();
-	VirtioPCIDevice* driver = static_cast<VirtioPCIDevice*>(me);
-	int vector_index = int_index - driver->msi_handlers.base_index;
-	LogVerbose("Interrupt on object %p, source %p, count = %d, index = %d (MSI[-X] vector %d)\n", me, source, count, int_index, vector_index);
-}
-bool VirtioPCIDevice::interruptFilter(OSObject* me, IOFilterInterruptEventSource* source)
-{
-	return true;
-}
-
 bool VirtioPCIDevice::start(IOService* provider)
 {
 	LogVerbose("\n");
@@ -479,152 +524,366 @@ bool VirtioPCIDevice::start(IOService* provider)
 		return false;
 	}
 
-	if (!this->IOService::start(provider))
+	// the structures must be located before the shared start code maps them
+	if (!this->locateVirtioStructures(pci_dev, true))
+	{
+		IOLog("VirtioPCIDevice::start(): Virtio structure capabilities missing or invalid.\n");
 		return false;
+	}
+	// queue memory may be anywhere in 64-bit space, and need not be contiguous
+	this->separate_ring_allocations = true;
+	
+	return VirtioLegacyPCIDevice::start(provider);
+}
 
-	bool ok = true;
+const char* VirtioPCIDevice::transportName() const
+{
+	return "VirtioPCIDevice";
+}
 
-	ok = setupInterruptHandlers(pci_dev);
-	if (!ok)
+volatile uint8_t* VirtioPCIDevice::mapStructure(const VirtioPCIStructureLocation& location)
+{
+	IOMemoryMap*& map = this->bar_maps[location.bar];
+	if (map == nullptr)
+	{
+		map = this->pci_device->mapDeviceMemoryWithRegister(djt_iopcidevice_register_for_range_index(location.bar));
+		if (map == nullptr)
+			return nullptr;
+	}
+	if (static_cast<uint64_t>(location.offset) + location.length > map->getLength())
+		return nullptr;
+	return reinterpret_cast<volatile uint8_t*>(map->getVirtualAddress() + location.offset);
+}
+
+bool VirtioPCIDevice::mapHeaderIORegion()
+{
+	assert(this->pci_virtio_header_iomap == nullptr);
+	this->pci_device->setMemoryEnable(true);
+	this->pci_device->setBusMasterEnable(true);
+	
+	this->common_cfg = this->mapStructure(this->common_cfg_location);
+	this->notify_base = this->mapStructure(this->notify_location);
+	this->isr_status = this->mapStructure(this->isr_location);
+	this->device_cfg = this->has_device_cfg ? this->mapStructure(this->device_cfg_location) : nullptr;
+	if (this->common_cfg == nullptr || this->notify_base == nullptr || this->isr_status == nullptr
+		|| (this->has_device_cfg && this->device_cfg == nullptr))
 	{
-		this->stop(provider);
+		IOLog("VirtioPCIDevice::mapHeaderIORegion(): Error! Memory-mapping the virtio structures failed.\n");
+		this->unmapHeaderIORegion();
 		return false;
 	}
 	
-	return ok;
+	// the shared code checks this to tell whether the device registers are mapped
+	this->pci_virtio_header_iomap = this->bar_maps[this->common_cfg_location.bar];
+	this->pci_virtio_header_iomap->retain();
+	return true;
 }
 
-	
-bool VirtioPCIDevice::setupInterruptHandlers(IOPCIDevice* pci_dev)
+void VirtioPCIDevice::unmapHeaderIORegion()
 {
-	djt_pci_interrupt_index_ranges interrupt_ranges = djt_iopcidevice_find_interrupt_ranges(pci_dev);
-	LogVerbose("Interrupt ranges: IRQ %d..%d, MSI(-X) %d..%d\n",
-		interrupt_ranges.irq_pin_start, interrupt_ranges.irq_pin_end,
-		interrupt_ranges.msi_start, interrupt_ranges.msi_end);
-	
-	if (interrupt_ranges.irq_pin_start == interrupt_ranges.irq_pin_end && interrupt_ranges.msi_start == interrupt_ranges.msi_end)
+	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
+	this->common_cfg = nullptr;
+	this->notify_base = nullptr;
+	this->isr_status = nullptr;
+	this->device_cfg = nullptr;
+	for (unsigned i = 0; i < sizeof(this->bar_maps) / sizeof(this->bar_maps[0]); ++i)
 	{
-		LogWarning("No interrupt sources found!\n");
-		return false;
+		OSSafeReleaseNULL(this->bar_maps[i]);
 	}
+}
+
+bool VirtioPCIDevice::resetDevice()
+{
+	if (this->common_cfg == nullptr)
+		return false;
 	
-	bool ok = true;
-	if (interrupt_ranges.msi_start != interrupt_ranges.msi_end)
-	{
-		// Device supports MSI or MSI-X
-		unsigned msi_sources = interrupt_ranges.msi_end - interrupt_ranges.msi_start;
-		this->msi_handlers.num_sources = msi_sources;
-		this->msi_handlers.base_index = interrupt_ranges.msi_start;
-		IOFilterInterruptEventSource** sources = IONew(IOFilterInterruptEventSource*, msi_sources);
-		this->msi_handlers.sources = sources;
-		IOWorkLoop** workloops = IONew(IOWorkLoop*, msi_sources);
-		this->msi_handlers.workloops = workloops;
-		memset(sources, 0, msi_sources * sizeof(sources[0]));
-		memset(workloops, 0, msi_sources * sizeof(workloops[0]));
-		for (int intr_index = interrupt_ranges.msi_start, i = 0; intr_index < interrupt_ranges.msi_end; ++intr_index, ++i)
+	mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), 0);
+	this->invalidateDeviceConfigCache();
+	// the reset is complete once the status reads back as 0
+	for (unsigned waited_us = 0; mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(device_status)) != 0; waited_us += 10)
+	{
+		if (waited_us >= VIRTIO_PCI_RESET_TIMEOUT_US)
 		{
-			LogVerbose("Trying to create interrupt source for index %d\n", intr_index);
-			auto temp_event_source = IOFilterInterruptEventSource::filterInterruptEventSource(this, &interruptAction, &interruptFilter, pci_dev, intr_index);
-			if (temp_event_source == nullptr)
-			{
-				LogWarning("VirtioLegacyPCIDevice beginHandlingInterrupts(): Error! Failed to create interrupt source with index %u.\n", intr_index);
-				ok = false;
-				break;
-			}
-			else
-			{
-				sources[i] = temp_event_source;
-				auto wl = workloops[i] = IOWorkLoop::workLoop();
-				if (wl == nullptr)
-				{
-					LogWarning("Failed to create interrupt workloop\n");
-					ok = false;
-					break;
-				}
-				else
-				{
-					LogVerbose("Interrupt index %d: source %p, workloop %p\n", intr_index, temp_event_source, wl);
-					wl->addEventSource(temp_event_source);
-					temp_event_source->enable();
-				}
-			}
+			IOLog("VirtioPCIDevice::resetDevice(): Device did not complete reset.\n");
+			return false;
 		}
-		
+		IODelay(10);
 	}
-	else
+	mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), VirtioDeviceStatus::ACKNOWLEDGE);
+	mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), VirtioDeviceStatus::ACKNOWLEDGE | VirtioDeviceStatus::DRIVER);
+	
+	//read out feature bits, 32 at a time
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(device_feature_select), 0);
+	uint64_t features = mmio_read32(this->common_cfg, VIRTIO_COMMON_CFG(device_feature));
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(device_feature_select), 1);
+	features |= static_cast<uint64_t>(mmio_read32(this->common_cfg, VIRTIO_COMMON_CFG(device_feature))) << 32u;
+	this->features = features;
+	if (0 == (features & VirtioDeviceGenericFeature::VIRTIO_F_VERSION_1))
 	{
-		IOFilterInterruptEventSource* source =
-			this->irq_source = IOFilterInterruptEventSource::filterInterruptEventSource(this, &interruptAction, &interruptFilter, pci_dev, interrupt_ranges.irq_pin_start);
-		if (source == nullptr)
-		{
-			LogWarning("Failed to create interrupt source for pin-based interrupt\n");
-			ok = false;
-		}
-		else
-		{
-			auto wl = this->irq_workloop = IOWorkLoop::workLoop();
-			if (wl == nullptr)
-			{
-				LogWarning("Failed to create interrupt workloop\n");
-				ok = false;
-			}
-			else
-			{
-				wl->addEventSource(source);
-				source->enable();
-			}
-		}
+		IOLog("VirtioPCIDevice::resetDevice(): Device does not offer VIRTIO_F_VERSION_1.\n");
+		return false;
 	}
-	LogVerbose("Done!\n");
-
-	return ok;
+	return true;
 }
 
+bool VirtioPCIDevice::requestFeatures(uint64_t use_features)
+{
+	// this driver only speaks the virtio 1.0 interface to modern devices
+	use_features |= VirtioDeviceGenericFeature::VIRTIO_F_VERSION_1;
+	// notification data is handled entirely by the transport, so use it whenever it's offered
+	use_features |= (this->features & VirtioDeviceGenericFeature::VIRTIO_F_NOTIFICATION_DATA);
+	if ((~this->features & use_features) != 0)
+	{
+		//a feature is present in the use features that is not supported
+		return false;
+	}
+	if (use_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_PACKED)
+	{
+		// the packed ring engine retires every request individually; in-order is only ever an optimisation
+		use_features &= ~static_cast<uint64_t>(VirtioDeviceGenericFeature::VIRTIO_F_IN_ORDER);
+	}
+	this->active_features = use_features;
+	this->eventIndexFeatureEnabled = (use_features & VirtioDeviceGenericFeature::VIRTIO_F_RING_EVENT_IDX) != 0;
+	this->notification_data = (use_features & VirtioDeviceGenericFeature::VIRTIO_F_NOTIFICATION_DATA) != 0;
+	
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(driver_feature_select), 0);
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(driver_feature), static_cast<uint32_t>(use_features));
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(driver_feature_select), 1);
+	mmio_write32(this->common_cfg, VIRTIO_COMMON_CFG(driver_feature), static_cast<uint32_t>(use_features >> 32u));
+	
+	// the device may still reject the combination
+	uint8_t status = mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(device_status));
+	mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), status | VirtioDeviceStatus::FEATURES_OK);
+	status = mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(device_status));
+	if (0 == (status & VirtioDeviceStatus::FEATURES_OK))
+	{
+		IOLog("VirtioPCIDevice::requestFeatures(): Device did not accept features 0x%016llx.\n", use_features);
+		return false;
+	}
+	return true;
+}
 
-void VirtioPCIDevice::shutdownInterruptHandlers()
+void VirtioPCIDevice::failDevice()
 {
-	LogVerbose("Shutting down interrupts\n");
-	IOFilterInterruptEventSource** sources = this->msi_handlers.sources;
-	IOWorkLoop** workloops = this->msi_handlers.workloops;
-	for (unsigned i = 0; i < this->msi_handlers.num_sources; ++i)
+	if (this->common_cfg != nullptr)
 	{
-		if (workloops[i] != nullptr)
-		{
-			LogVerbose("Disabling, removing and freeing: source %p, workloop %p\n", sources[i], workloops[i]);
-			sources[i]->disable();
-			workloops[i]->removeEventSource(sources[i]);
-		}
-		OSSafeReleaseNULL(workloops[i]);
-		OSSafeReleaseNULL(sources[i]);
+		mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), VirtioDeviceStatus::FAILED);
 	}
-	
-	if (this->msi_handlers.num_sources > 0)
+	this->endHandlingInterrupts();
+	this->unmapHeaderIORegion();
+}
+
+IOReturn VirtioPCIDevice::setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[], unsigned out_queue_sizes[], const unsigned indirect_desc_per_request[], const VirtioVirtqueueCompletionContext completion_contexts[])
+{
+	this->freeQueueDoorbells();
+	volatile uint8_t** doorbells = IONew(volatile uint8_t*, number_queues);
+	if (doorbells == nullptr)
+		return kIOReturnNoMemory;
+	memset(doorbells, 0, sizeof(doorbells[0]) * number_queues);
+	this->queue_doorbells = doorbells;
+	this->num_queue_doorbells = number_queues;
+	
+	IOReturn result = VirtioLegacyPCIDevice::setupVirtqueues(number_queues, queue_interrupts_enabled, out_queue_sizes, indirect_desc_per_request, completion_contexts);
+	if (result != kIOReturnSuccess)
 	{
-		assert(sources != nullptr);
-		assert(workloops != nullptr);
-		IODelete(sources, IOFilterInterruptEventSource*, this->msi_handlers.num_sources);
-		IODelete(workloops, IOWorkLoop*, this->msi_handlers.num_sources);
-		this->msi_handlers.num_sources = 0;
-		this->msi_handlers.workloops = nullptr;
-		this->msi_handlers.sources = nullptr;
+		this->freeQueueDoorbells();
 	}
-	else if (this->irq_workloop != nullptr)
+	return result;
+}
+
+void VirtioPCIDevice::freeQueueDoorbells()
+{
+	if (this->queue_doorbells != nullptr)
 	{
-		LogVerbose("Disabling, removing and freeing: source %p, workloop %p\n", this->irq_source, this->irq_workloop);
-		this->irq_source->disable();
-		this->irq_workloop->removeEventSource(this->irq_source);
-		OSSafeReleaseNULL(this->irq_workloop);
-		OSSafeReleaseNULL(this->irq_source);
+		IODelete(this->queue_doorbells, volatile uint8_t*, this->num_queue_doorbells);
+		this->queue_doorbells = nullptr;
+		this->num_queue_doorbells = 0;
 	}
+}
 
-	LogVerbose("Done!\n");
+void VirtioPCIDevice::handleClose(IOService* forClient, IOOptionBits options)
+{
+	VirtioLegacyPCIDevice::handleClose(forClient, options);
+	this->freeQueueDoorbells();
+}
 
+uint16_t VirtioPCIDevice::selectVirtqueue(uint16_t queue_id)
+{
+	mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_select), queue_id);
+	return mmio_read16(this->common_cfg, VIRTIO_COMMON_CFG(queue_size));
 }
 
-void VirtioPCIDevice::stop(IOService* provider)
+bool VirtioPCIDevice::activateVirtqueue(uint16_t queue_id, uint16_t num_entries, uint64_t descriptor_table_phys, uint64_t available_ring_phys, uint64_t used_ring_phys)
 {
-	this->shutdownInterruptHandlers();
+	assert(queue_id < this->num_queue_doorbells);
+	// the queue is still selected from selectVirtqueue(); it's only enabled in
+	// startDevice(), once its MSI-X vector has been assigned
+	mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_size), num_entries);
+	mmio_write64(this->common_cfg, VIRTIO_COMMON_CFG(queue_desc), descriptor_table_phys);
+	mmio_write64(this->common_cfg, VIRTIO_COMMON_CFG(queue_avail), available_ring_phys);
+	mmio_write64(this->common_cfg, VIRTIO_COMMON_CFG(queue_used), used_ring_phys);
+	
+	uint16_t notify_off = mmio_read16(this->common_cfg, VIRTIO_COMMON_CFG(queue_notify_off));
+	uint64_t doorbell_offset = static_cast<uint64_t>(notify_off) * this->notify_off_multiplier;
+	size_t doorbell_size = this->notification_data ? sizeof(uint32_t) : sizeof(uint16_t);
+	if (doorbell_offset + doorbell_size > this->notify_location.length)
+	{
+		IOLog("VirtioPCIDevice::activateVirtqueue(): Notification offset %llu for queue %u is outside the notification structure (%u bytes).\n",
+			doorbell_offset, queue_id, this->notify_location.length);
+		return false;
+	}
+	this->queue_doorbells[queue_id] = this->notify_base + doorbell_offset;
+	return true;
+}
+
+void VirtioPCIDevice::notifyVirtqueue(uint16_t queue_index, uint16_t next_avail_index)
+{
+	if (this->notification_data)
+	{
+		// queue index in the low half, so the device needn't fetch the avail ring's head index
+		uint32_t notification = queue_index | (static_cast<uint32_t>(next_avail_index) << 16u);
+		OSWriteLittleInt32(this->queue_doorbells[queue_index], 0, notification);
+	}
+	else
+	{
+		OSWriteLittleInt16(this->queue_doorbells[queue_index], 0, queue_index);
+	}
+}
+
+void VirtioPCIDevice::startDevice(ConfigChangeAction action, OSObject* target, IOWorkLoop* workloop)
+{
+	this->configChangeAction = action;
+	this->configChangeTarget = target;
 	
-	this->IOService::stop(provider);
+	// enable interrupt handling; this also assigns the MSI-X vectors
+	this->beginHandlingInterrupts(workloop);
+	
+	for (uint16_t queue_id = 0; queue_id < this->num_virtqueues; ++queue_id)
+	{
+		mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_select), queue_id);
+		mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_enable), 1);
+	}
+	
+	uint8_t status = mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(device_status));
+	mmio_write8(this->common_cfg, VIRTIO_COMMON_CFG(device_status), status | VirtioDeviceStatus::DRIVER_OK);
+}
+
+uint8_t VirtioPCIDevice::readISRStatus()
+{
+	return *this->isr_status;
+}
+
+bool VirtioPCIDevice::setConfigMSIXVector(uint16_t vector)
+{
+	mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(msix_config), vector);
+	// the device reports VIRTIO_MSI_NO_VECTOR if it couldn't allocate the vector
+	uint16_t msix_vector = mmio_read16(this->common_cfg, VIRTIO_COMMON_CFG(msix_config));
+	return msix_vector == vector && msix_vector != VIRTIO_MSI_NO_VECTOR;
+}
+
+bool VirtioPCIDevice::setVirtqueueMSIXVector(uint16_t queue_id, uint16_t vector)
+{
+	mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_select), queue_id);
+	mmio_write16(this->common_cfg, VIRTIO_COMMON_CFG(queue_msix_vector), vector);
+	uint16_t msix_vector = mmio_read16(this->common_cfg, VIRTIO_COMMON_CFG(queue_msix_vector));
+	return msix_vector == vector && msix_vector != VIRTIO_MSI_NO_VECTOR;
+}
+
+// Device configuration of modern devices is always little endian, so the
+// native and transitional accessors are the same. Devices without a device
+// configuration structure read as 0 and ignore writes. Reads go through the
+// config cache, which is emptied on config change interrupts.
+
+uint8_t VirtioPCIDevice::readDeviceConfig8(uint16_t device_specific_offset)
+{
+	if (this->device_cfg == nullptr)
+		return 0;
+	return this->cachedDeviceConfigRead<uint8_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return mmio_read8(this->device_cfg, device_specific_offset);
+		});
 }
 
+uint16_t VirtioPCIDevice::readDeviceConfig16LETransitional(uint16_t device_specific_offset)
+{
+	if (this->device_cfg == nullptr)
+		return 0;
+	return this->cachedDeviceConfigRead<uint16_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return mmio_read16(this->device_cfg, device_specific_offset);
+		});
+}
+uint32_t VirtioPCIDevice::readDeviceConfig32LETransitional(uint16_t device_specific_offset)
+{
+	if (this->device_cfg == nullptr)
+		return 0;
+	return this->cachedDeviceConfigRead<uint32_t>(device_specific_offset, 1, [this, device_specific_offset]()
+		{
+			return mmio_read32(this->device_cfg, device_specific_offset);
+		});
+}
+uint64_t VirtioPCIDevice::readDeviceConfig64LETransitional(uint16_t device_specific_offset)
+{
+	if (this->device_cfg == nullptr)
+		return 0;
+	// Both halves must come from the same config generation, or the device
+	// may have changed the field between the two 32-bit reads.
+	return this->cachedDeviceConfigRead<uint64_t>(device_specific_offset, 4, [this, device_specific_offset]()
+		{
+			uint8_t generation, generation_after;
+			uint32_t low, high;
+			generation_after = mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(config_generation));
+			do
+			{
+				generation = generation_after;
+				low = mmio_read32(this->device_cfg, device_specific_offset);
+				high = mmio_read32(this->device_cfg, device_specific_offset + 4);
+				generation_after = mmio_read8(this->common_cfg, VIRTIO_COMMON_CFG(config_generation));
+			} while (generation != generation_after);
+			return (static_cast<uint64_t>(high) << 32u) | low;
+		});
+}
+
+uint16_t VirtioPCIDevice::readDeviceConfig16Native(uint16_t device_specific_offset)
+{
+	return this->readDeviceConfig16LETransitional(device_specific_offset);
+}
+uint32_t VirtioPCIDevice::readDeviceConfig32Native(uint16_t device_specific_offset)
+{
+	return this->readDeviceConfig32LETransitional(device_specific_offset);
+}
+uint64_t VirtioPCIDevice::readDeviceConfig64Native(uint16_t device_specific_offset)
+{
+	return this->readDeviceConfig64LETransitional(device_specific_offset);
+}
+
+void VirtioPCIDevice::writeDeviceConfig8(uint16_t offset, uint8_t value_to_write)
+{
+	if (this->device_cfg != nullptr)
+		mmio_write8(this->device_cfg, offset, value_to_write);
+	this->invalidateDeviceConfigCache();
+}
+
+void VirtioPCIDevice::writeDeviceConfig16Native(uint16_t offset, uint16_t value_to_write)
+{
+	this->writeDeviceConfig16LETransitional(offset, value_to_write);
+}
+
+void VirtioPCIDevice::writeDeviceConfig32Native(uint16_t offset, uint32_t value_to_write)
+{
+	this->writeDeviceConfig32LETransitional(offset, value_to_write);
+}
+
+void VirtioPCIDevice::writeDeviceConfig16LETransitional(uint16_t device_specific_offset, uint16_t value_to_write)
+{
+	if (this->device_cfg != nullptr)
+		mmio_write16(this->device_cfg, device_specific_offset, value_to_write);
+	this->invalidateDeviceConfigCache();
+}
+
+void VirtioPCIDevice::writeDeviceConfig32LETransitional(uint16_t device_specific_offset, uint32_t value_to_write)
+{
+	if (this->device_cfg != nullptr)
+		mmio_write32(this->device_cfg, device_specific_offset, value_to_write);
+	this->invalidateDeviceConfigCache();
+}
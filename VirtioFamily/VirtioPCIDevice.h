@@ -8,47 +8,94 @@
 
 #pragma once
 
-#include "VirtioDevice.h"
+#include "VirtioLegacyPCIDevice.h"
 
 #define VirtioPCIDevice eu_dennis__jordan_driver_VirtioPCIDevice
 
 struct virtio_pci_cap;
 class IOPCIDevice;
-class IOInterruptEventSource;
-class IOFilterInterruptEventSource;
 
-
-struct djt_msi_interrupt_handlers
+/// Where one of the virtio structures lives in a memory BAR
+struct VirtioPCIStructureLocation
 {
-	unsigned num_sources;
-	int base_index;
-	IOFilterInterruptEventSource** sources;
-	IOWorkLoop** workloops;
+	uint8_t bar;
+	uint32_t offset;
+	uint32_t length;
 };
 
-class VirtioPCIDevice : public IOService
+/// Modern (virtio 1.0) PCI transport.
+/** The device registers are spread across memory BARs as described by vendor
+ * specific PCI capabilities, and queues are notified by writing to per-queue
+ * MMIO doorbells. Ring handling, interrupts and the client API are shared
+ * with the legacy transport. */
+class VirtioPCIDevice : public VirtioLegacyPCIDevice
 {
 	OSDeclareDefaultStructors(VirtioPCIDevice);
 public:
 	virtual IOService* probe(IOService* provider, SInt32* score) override;
 	virtual bool start(IOService* provider) override;
-	virtual void stop(IOService* provider) override;
+	virtual void handleClose(IOService* forClient, IOOptionBits options) override;
+
+	virtual bool resetDevice() override;
+	virtual bool requestFeatures(uint64_t use_features) override;
+	virtual void failDevice() override;
+	virtual IOReturn setupVirtqueues(uint16_t number_queues, const bool queue_interrupts_enabled[] = nullptr, unsigned out_queue_sizes[] = nullptr, const unsigned indirect_desc_per_request[] = nullptr, const VirtioVirtqueueCompletionContext completion_contexts[] = nullptr) override;
+	virtual void startDevice(ConfigChangeAction action = nullptr, OSObject* target = nullptr, IOWorkLoop* workloop = nullptr) override;
+
+	virtual uint8_t readDeviceConfig8(uint16_t device_specific_offset) override;
+
+	virtual uint16_t readDeviceConfig16LETransitional(uint16_t device_specific_offset) override;
+	virtual uint32_t readDeviceConfig32LETransitional(uint16_t device_specific_offset) override;
+	virtual uint64_t readDeviceConfig64LETransitional(uint16_t device_specific_offset) override;
+
+	virtual uint16_t readDeviceConfig16Native(uint16_t device_specific_offset) override;
+	virtual uint32_t readDeviceConfig32Native(uint16_t device_specific_offset) override;
+	virtual uint64_t readDeviceConfig64Native(uint16_t device_specific_offset) override;
+
+	virtual void writeDeviceConfig8(uint16_t offset, uint8_t value_to_write) override;
+
+	virtual void writeDeviceConfig16Native(uint16_t offset, uint16_t value_to_write) override;
+	virtual void writeDeviceConfig32Native(uint16_t offset, uint32_t value_to_write) override;
+
+	virtual void writeDeviceConfig16LETransitional(uint16_t device_specific_offset, uint16_t value_to_write) override;
+	virtual void writeDeviceConfig32LETransitional(uint16_t device_specific_offset, uint32_t value_to_write) override;
 
 protected:
+	virtual const char* transportName() const override;
+	virtual bool mapHeaderIORegion() override;
+	virtual void unmapHeaderIORegion() override;
+	virtual uint8_t readISRStatus() override;
+	virtual void notifyVirtqueue(uint16_t queue_index, uint16_t next_avail_index) override;
+	virtual bool setConfigMSIXVector(uint16_t vector) override;
+	virtual bool setVirtqueueMSIXVector(uint16_t queue_id, uint16_t vector) override;
+	virtual uint16_t selectVirtqueue(uint16_t queue_id) override;
+	virtual bool activateVirtqueue(uint16_t queue_id, uint16_t num_entries, uint64_t descriptor_table_phys, uint64_t available_ring_phys, uint64_t used_ring_phys) override;
 
+	bool locateVirtioStructures(IOPCIDevice* dev, bool do_setup);
 	bool setupCommonCFG(IOPCIDevice* dev, const virtio_pci_cap& cap, unsigned config_offset, bool do_setup);
 	bool setupNotificationStructure(IOPCIDevice* dev, const virtio_pci_cap& cap, unsigned config_offset, bool do_setup);
 	bool setupISRStatusStructure(IOPCIDevice* dev, const virtio_pci_cap& cap, unsigned config_offset, bool do_setup);
 	bool setupDeviceSpecificStructure(IOPCIDevice* dev, const virtio_pci_cap& cap, unsigned config_offset, bool do_setup);
+	volatile uint8_t* mapStructure(const VirtioPCIStructureLocation& location);
+	void freeQueueDoorbells();
 
-	bool setupInterruptHandlers(IOPCIDevice* pci_device);
-	void shutdownInterruptHandlers();
-	
-	djt_msi_interrupt_handlers msi_handlers;
-	IOFilterInterruptEventSource* irq_source;
-	IOWorkLoop* irq_workloop;
-	static void interruptAction(OSObject* me, IOInterruptEventSource* source, int count);
-	static bool interruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
-	//virtual void interruptAction(IOInterruptEventSource* source, int count);
-};
+	VirtioPCIStructureLocation common_cfg_location;
+	VirtioPCIStructureLocation notify_location;
+	VirtioPCIStructureLocation isr_location;
+	VirtioPCIStructureLocation device_cfg_location;
+	bool has_device_cfg;
+	uint32_t notify_off_multiplier;
+	/// VIRTIO_F_NOTIFICATION_DATA negotiated: doorbell writes are 32 bits and include the avail index
+	bool notification_data;
 
+	/// One mapping per BAR used by any of the structures
+	IOMemoryMap* bar_maps[6];
+	volatile uint8_t* common_cfg;
+	volatile uint8_t* notify_base;
+	volatile uint8_t* isr_status;
+	volatile uint8_t* device_cfg;
+
+	/// Notification address of each virtqueue, from queue_notify_off
+	volatile uint8_t** queue_doorbells;
+	unsigned num_queue_doorbells;
+};
@@ -0,0 +1,545 @@
+//
+//  VirtioPackedVirtqueue.cpp
+//  virtio-osx
+//
+//
+
+#define __STDC_LIMIT_MACROS
+#include "VirtioPackedVirtqueue.h"
+#include "VirtioPlatform.h"
+#include <stdint.h>
+#include "../virtio-net/virtio_ring.h"
+
+static const uint16_t VIRTIO_PACKED_WRAP_BIT = (1u << 15u);
+
+struct virtio_packed_desc_chain
+{
+	VirtioPackedVirtqueue* queue;
+	uint16_t buffer_id;
+	/// The head's flags are held back so the chain can be published atomically
+	uint16_t head_index;
+	uint16_t head_flags;
+	/// Slot and wrap counter for the next descriptor
+	uint16_t next_index;
+	bool wrap_counter;
+	/// Descriptors before the first device writable one
+	uint16_t num_readable;
+	uint16_t length;
+	bool device_writable;
+};
+
+static bool output_packed_desc_segment(IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex);
+
+static inline uint16_t packed_avail_flags(bool wrap_counter)
+{
+	// AVAIL must equal the driver's wrap counter and USED its inverse
+	return wrap_counter ? VirtioVringPackedDescFlag::AVAIL : VirtioVringPackedDescFlag::USED;
+}
+
+static inline bool packed_desc_is_used(const VirtioVringPackedDesc* desc, bool wrap_counter)
+{
+	uint16_t flags = desc->flags;
+	bool avail = (flags & VirtioVringPackedDescFlag::AVAIL) != 0;
+	bool used = (flags & VirtioVringPackedDescFlag::USED) != 0;
+	return avail == used && used == wrap_counter;
+}
+
+/// Caller must hold the queue's lock.
+static inline void virtio_packed_virtqueue_enable_interrupts(VirtioPackedVirtqueue* queue)
+{
+	if (queue->event_index)
+	{
+		// interrupt once the device has used anything beyond what we've already processed
+		queue->driver_event->offset_wrap = queue->next_used_index | (queue->used_wrap_counter ? VIRTIO_PACKED_WRAP_BIT : 0);
+		virtio_io_barrier();
+		queue->driver_event->flags = VirtioVringPackedEventFlag::DESC;
+	}
+	else
+	{
+		queue->driver_event->flags = VirtioVringPackedEventFlag::ENABLE;
+	}
+}
+
+void virtio_packed_virtqueue_disable_interrupts(VirtioPackedVirtqueue* queue)
+{
+	queue->driver_event->flags = VirtioVringPackedEventFlag::DISABLE;
+}
+
+/// Releases whatever has been allocated so far; safe on a partially initialised queue.
+static void virtio_packed_virtqueue_free_resources(VirtioPackedVirtqueue* queue)
+{
+	if (queue->buffer_dma != nullptr)
+	{
+		for (unsigned i = 0; i < queue->num_entries; ++i)
+		{
+			virtio_dma_command_release(queue->buffer_dma[i].dma_cmd);
+			virtio_dma_command_release(queue->buffer_dma[i].dma_cmd_2);
+		}
+		IOFreeAligned(queue->buffer_dma, sizeof(queue->buffer_dma[0]) * queue->num_entries);
+		queue->buffer_dma = nullptr;
+	}
+	if (queue->buffers != nullptr)
+	{
+		IOFreeAligned(queue->buffers, sizeof(queue->buffers[0]) * queue->num_entries);
+		queue->buffers = nullptr;
+	}
+	virtio_dma_memory_free(&queue->queue_mem);
+	queue->descriptor_ring = nullptr;
+	queue->driver_event = nullptr;
+	queue->device_event = nullptr;
+	if (queue->lock != nullptr)
+	{
+		virtio_spinlock_free(queue->lock);
+		queue->lock = nullptr;
+	}
+}
+
+IOReturn virtio_packed_virtqueue_init(VirtioPackedVirtqueue* queue, uint16_t num_entries, bool event_index, bool interrupts_enabled)
+{
+	// ring slots must fit in 15 bits, next to the wrap counter
+	if (num_entries == 0 || num_entries > VIRTIO_MAX_QUEUE_SIZE)
+	{
+		virtio_log("virtio_packed_virtqueue_init(): Unsupported queue size %u.\n", num_entries);
+		return kIOReturnBadArgument;
+	}
+	memset(queue, 0, sizeof(*queue));
+	queue->num_entries = num_entries;
+
+	// descriptor ring (16-byte aligned), followed by driver and device event areas (4-byte aligned)
+	const size_t ring_size = sizeof(VirtioVringPackedDesc) * num_entries;
+	const size_t queue_mem_size = ring_size + 2 * sizeof(VirtioVringPackedEvent);
+
+	queue->lock = virtio_spinlock_alloc();
+	if (queue->lock == nullptr)
+		return kIOReturnNoMemory;
+	IOReturn result = virtio_dma_memory_allocate(&queue->queue_mem, queue_mem_size, 16);
+	if (result != kIOReturnSuccess)
+	{
+		virtio_packed_virtqueue_free_resources(queue);
+		return result;
+	}
+
+	const size_t buffer_array_size = sizeof(queue->buffers[0]) * num_entries;
+	queue->buffers = static_cast<VirtioBuffer*>(IOMallocAligned(buffer_array_size, alignof(VirtioBuffer)));
+	const size_t buffer_dma_array_size = sizeof(queue->buffer_dma[0]) * num_entries;
+	queue->buffer_dma = static_cast<VirtioBufferDMA*>(IOMallocAligned(buffer_dma_array_size, alignof(VirtioBufferDMA)));
+	if (queue->buffers == nullptr || queue->buffer_dma == nullptr)
+	{
+		virtio_packed_virtqueue_free_resources(queue);
+		return kIOReturnNoMemory;
+	}
+	memset(queue->buffers, 0, buffer_array_size);
+	memset(queue->buffer_dma, 0, buffer_dma_array_size);
+	for (unsigned i = 0; i < num_entries; ++i)
+	{
+		// one DMA command each for the device-readable and device-writable part of a request
+		queue->buffer_dma[i].dma_cmd = virtio_dma_command_create(output_packed_desc_segment);
+		queue->buffer_dma[i].dma_cmd_2 = virtio_dma_command_create(output_packed_desc_segment);
+		queue->buffers[i].next_desc = (i + 1 < num_entries) ? static_cast<uint16_t>(i + 1) : VIRTIO_DESC_INDEX_NONE;
+		if (queue->buffer_dma[i].dma_cmd == nullptr || queue->buffer_dma[i].dma_cmd_2 == nullptr)
+		{
+			virtio_packed_virtqueue_free_resources(queue);
+			return kIOReturnNoMemory;
+		}
+	}
+
+	uint8_t* queue_mem_bytes = static_cast<uint8_t*>(queue->queue_mem.bytes);
+	queue->descriptor_ring = reinterpret_cast<VirtioVringPackedDesc*>(queue_mem_bytes);
+	queue->driver_event = reinterpret_cast<VirtioVringPackedEvent*>(queue_mem_bytes + ring_size);
+	queue->device_event = queue->driver_event + 1;
+	queue->descriptor_ring_phys = queue->queue_mem.phys_address;
+	queue->driver_event_phys = queue->queue_mem.phys_address + ring_size;
+	queue->device_event_phys = queue->driver_event_phys + sizeof(VirtioVringPackedEvent);
+
+	// Both wrap counters start at 1; a zeroed descriptor is neither available nor used.
+	queue->next_avail_index = 0;
+	queue->avail_wrap_counter = true;
+	queue->next_used_index = 0;
+	queue->used_wrap_counter = true;
+	queue->head_pending = false;
+	queue->num_added = 0;
+	queue->published_offset_wrap = VIRTIO_PACKED_WRAP_BIT;
+
+	queue->first_unused_buffer_id = 0;
+	queue->num_unused_descriptors = num_entries;
+
+	queue->event_index = event_index;
+	queue->interrupts_requested = interrupts_enabled;
+	if (interrupts_enabled)
+		virtio_packed_virtqueue_enable_interrupts(queue);
+	else
+		virtio_packed_virtqueue_disable_interrupts(queue);
+
+	return kIOReturnSuccess;
+}
+
+void virtio_packed_virtqueue_destroy(VirtioPackedVirtqueue* queue)
+{
+	virtio_packed_virtqueue_free_resources(queue);
+}
+
+static bool output_packed_desc_segment(IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex)
+{
+	virtio_packed_desc_chain* chain = static_cast<virtio_packed_desc_chain*>(segments);
+	VirtioPackedVirtqueue* queue = chain->queue;
+	uint16_t index = chain->next_index;
+	VirtioVringPackedDesc* descriptor = &queue->descriptor_ring[index];
+
+	// Only the address, length and ID are written here. No flags are set
+	// until commit_packed_chain(): a chain that fails part way through must
+	// leave nothing behind that the device could take for available.
+	descriptor->phys_address = segment.fIOVMAddr;
+	descriptor->length_bytes = static_cast<uint32_t>(segment.fLength);
+	descriptor->buffer_id = chain->buffer_id;
+	if (chain->length == 0)
+	{
+		chain->head_index = index;
+		chain->head_flags = packed_avail_flags(chain->wrap_counter);
+		if (chain->device_writable)
+			chain->head_flags |= VirtioVringPackedDescFlag::DEVICE_WRITABLE;
+	}
+	if (!chain->device_writable)
+		chain->num_readable++;
+	chain->length++;
+
+	if (++index == queue->num_entries)
+	{
+		index = 0;
+		chain->wrap_counter = !chain->wrap_counter;
+	}
+	chain->next_index = index;
+	return true;
+}
+
+static IOReturn generate_packed_segments(IODMACommand* dma_cmd, IOMemoryDescriptor* buf, virtio_packed_desc_chain* chain, UInt32 max_segments)
+{
+	UInt64 offset = 0;
+	IOReturn result = virtio_dma_map(dma_cmd, buf, &offset, chain, &max_segments);
+	const uint64_t length = virtio_buffer_length(buf);
+	if (result != kIOReturnSuccess || max_segments < 1 || offset != length)
+	{
+		if (result == kIOReturnSuccess)
+		{
+			// Running out of ring slots part way through: retry once in-flight requests have completed
+			result = (offset < length) ? kIOReturnBusy : kIOReturnInternalError;
+		}
+		virtio_dma_complete(dma_cmd);
+		return result;
+	}
+	return kIOReturnSuccess;
+}
+
+/// Takes the chain's buffer ID and ring slots, and arranges for the chain to be published.
+static void commit_packed_chain(VirtioPackedVirtqueue* queue, const virtio_packed_desc_chain* chain, VirtioCompletion completion, bool dma_cmd_used)
+{
+	// Flag the rest of the chain. The device can't get past the chain's head,
+	// or the pending head in front of it, before they are written.
+	uint16_t head_flags = chain->head_flags;
+	uint16_t index = chain->head_index;
+	bool wrap_counter = queue->avail_wrap_counter;
+	for (unsigned i = 1; i < chain->length; ++i)
+	{
+		if (++index == queue->num_entries)
+		{
+			index = 0;
+			wrap_counter = !wrap_counter;
+		}
+		uint16_t flags = packed_avail_flags(wrap_counter);
+		if (i >= chain->num_readable)
+			flags |= VirtioVringPackedDescFlag::DEVICE_WRITABLE;
+		if (i + 1 < chain->length)
+			flags |= VirtioVringPackedDescFlag::NEXT;
+		queue->descriptor_ring[index].flags = flags;
+	}
+	if (chain->length > 1)
+		head_flags |= VirtioVringPackedDescFlag::NEXT;
+
+	VirtioBuffer* buffer = &queue->buffers[chain->buffer_id];
+	queue->first_unused_buffer_id = buffer->next_desc;
+	buffer->next_desc = VIRTIO_DESC_INDEX_NONE;
+	buffer->completion = completion;
+	buffer->packed_chain_length = chain->length;
+	buffer->dma_cmd_used = dma_cmd_used;
+
+	queue->num_unused_descriptors -= chain->length;
+	queue->num_added += chain->length;
+	queue->next_avail_index = chain->next_index;
+	queue->avail_wrap_counter = chain->wrap_counter;
+
+	if (!queue->head_pending)
+	{
+		queue->head_pending = true;
+		queue->pending_head_index = chain->head_index;
+		queue->pending_head_flags = head_flags;
+	}
+	else
+	{
+		// the device stops at the pending head, so this chain is published along with it
+		queue->descriptor_ring[chain->head_index].flags = head_flags;
+	}
+}
+
+static inline IODMACommand::Segment64 packed_registered_segment64(const VirtioRegisteredSegment& registered_segment)
+{
+	IODMACommand::Segment64 segment = {};
+	segment.fIOVMAddr = registered_segment.phys_address;
+	segment.fLength = registered_segment.length;
+	return segment;
+}
+
+static IOReturn packed_submit_locked(VirtioPackedVirtqueue* queue, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
+{
+	const bool device_readable_descs = (device_readable_buf != nullptr && virtio_buffer_length(device_readable_buf) != 0);
+	const bool device_writable_descs = (device_writable_buf != nullptr && virtio_buffer_length(device_writable_buf) != 0);
+	unsigned min_descs_required = (device_readable_descs ? 1 : 0) + (device_writable_descs ? 1 : 0);
+	if (min_descs_required > queue->num_entries)
+	{
+		return kIOReturnUnsupported;
+	}
+	if (min_descs_required == 0)
+	{
+		return kIOReturnBadArgument;
+	}
+	if (min_descs_required > queue->num_unused_descriptors || queue->first_unused_buffer_id == VIRTIO_DESC_INDEX_NONE)
+	{
+		return kIOReturnBusy;
+	}
+
+	uint16_t buffer_id = queue->first_unused_buffer_id;
+	VirtioBufferDMA* dma = &queue->buffer_dma[buffer_id];
+	virtio_packed_desc_chain chain =
+		{ queue, buffer_id, UINT16_MAX, 0, queue->next_avail_index, queue->avail_wrap_counter, 0, 0, false };
+
+	// Descriptors are written in place, but neither their flags nor the
+	// queue's own indices change until the whole chain has been generated,
+	// so bailing out leaves the device nothing it could consume.
+	IOReturn result = kIOReturnSuccess;
+	if (device_readable_descs)
+	{
+		UInt32 max_segments = queue->num_unused_descriptors - (device_writable_descs ? 1 : 0);
+		result = generate_packed_segments(dma->dma_cmd, device_readable_buf, &chain, max_segments);
+		if (result != kIOReturnSuccess)
+			return result;
+	}
+	if (device_writable_descs)
+	{
+		chain.device_writable = true;
+		UInt32 max_segments = queue->num_unused_descriptors - chain.length;
+		result = generate_packed_segments(dma->dma_cmd_2, device_writable_buf, &chain, max_segments);
+		if (result != kIOReturnSuccess)
+		{
+			if (device_readable_descs)
+				virtio_dma_complete(dma->dma_cmd);
+			return result;
+		}
+	}
+
+	commit_packed_chain(queue, &chain, completion, true);
+	return kIOReturnSuccess;
+}
+
+IOReturn virtio_packed_virtqueue_submit(VirtioPackedVirtqueue* queue, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
+{
+	virtio_spinlock_lock(queue->lock);
+	IOReturn result = packed_submit_locked(queue, device_readable_buf, device_writable_buf, completion);
+	virtio_spinlock_unlock(queue->lock);
+	return result;
+}
+
+static IOReturn packed_add_segments_locked(VirtioPackedVirtqueue* queue, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion)
+{
+	const unsigned num_segments = num_readable_segments + num_writable_segments;
+	if (num_segments > queue->num_entries)
+	{
+		return kIOReturnUnsupported;
+	}
+	if (num_segments > queue->num_unused_descriptors || queue->first_unused_buffer_id == VIRTIO_DESC_INDEX_NONE)
+	{
+		return kIOReturnBusy;
+	}
+
+	virtio_packed_desc_chain chain =
+		{ queue, queue->first_unused_buffer_id, UINT16_MAX, 0, queue->next_avail_index, queue->avail_wrap_counter, 0, 0, false };
+	// same output path as for mapped buffers, minus the mapping
+	for (unsigned i = 0; i < num_readable_segments; ++i)
+		output_packed_desc_segment(nullptr, packed_registered_segment64(readable_segments[i]), &chain, i);
+	chain.device_writable = true;
+	for (unsigned i = 0; i < num_writable_segments; ++i)
+		output_packed_desc_segment(nullptr, packed_registered_segment64(writable_segments[i]), &chain, i);
+
+	commit_packed_chain(queue, &chain, completion, false);
+	return kIOReturnSuccess;
+}
+
+IOReturn virtio_packed_virtqueue_add_segments(VirtioPackedVirtqueue* queue, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion)
+{
+	if (num_readable_segments + num_writable_segments == 0)
+	{
+		return kIOReturnBadArgument;
+	}
+	virtio_spinlock_lock(queue->lock);
+	IOReturn result = packed_add_segments_locked(queue, readable_segments, num_readable_segments, writable_segments, num_writable_segments, completion);
+	virtio_spinlock_unlock(queue->lock);
+	return result;
+}
+
+IOReturn virtio_packed_virtqueue_submit_registered(VirtioPackedVirtqueue* queue, VirtioRegisteredBuffer* device_readable_buf, VirtioRegisteredBuffer* device_writable_buf, VirtioCompletion completion)
+{
+	if (device_readable_buf == nullptr && device_writable_buf == nullptr)
+	{
+		return kIOReturnBadArgument;
+	}
+	return virtio_packed_virtqueue_add_segments(queue,
+		device_readable_buf ? device_readable_buf->segments : nullptr, device_readable_buf ? device_readable_buf->num_segments : 0,
+		device_writable_buf ? device_writable_buf->segments : nullptr, device_writable_buf ? device_writable_buf->num_segments : 0,
+		completion);
+}
+
+bool virtio_packed_virtqueue_publish(VirtioPackedVirtqueue* queue)
+{
+	virtio_spinlock_lock(queue->lock);
+	if (!queue->head_pending)
+	{
+		virtio_spinlock_unlock(queue->lock);
+		return false;
+	}
+
+	virtio_io_barrier();
+	queue->descriptor_ring[queue->pending_head_index].flags = queue->pending_head_flags;
+	queue->head_pending = false;
+	// The device's event suppression area must be read after the descriptors are visible.
+	virtio_memory_barrier();
+
+	unsigned num_added = queue->num_added;
+	queue->num_added = 0;
+	uint16_t new_index = queue->next_avail_index;
+	bool avail_wrap_counter = queue->avail_wrap_counter;
+	queue->published_offset_wrap = new_index | (avail_wrap_counter ? VIRTIO_PACKED_WRAP_BIT : 0);
+	virtio_spinlock_unlock(queue->lock);
+
+	uint16_t flags = queue->device_event->flags;
+	if (flags != VirtioVringPackedEventFlag::DESC)
+	{
+		return flags != VirtioVringPackedEventFlag::DISABLE;
+	}
+	if (num_added >= queue->num_entries)
+	{
+		return true;
+	}
+
+	uint16_t old_index = new_index - static_cast<uint16_t>(num_added);
+	uint16_t offset_wrap = queue->device_event->offset_wrap;
+	uint16_t event_index = offset_wrap & ~VIRTIO_PACKED_WRAP_BIT;
+	bool event_wrap_counter = (offset_wrap & VIRTIO_PACKED_WRAP_BIT) != 0;
+	if (event_wrap_counter != avail_wrap_counter)
+	{
+		// event slot refers to the previous lap of the ring
+		event_index -= queue->num_entries;
+	}
+	return vring_need_event(event_index, new_index, old_index);
+}
+
+uint16_t virtio_packed_virtqueue_next_offset_wrap(const VirtioPackedVirtqueue* queue)
+{
+	// not next_avail_index: other submitters may have moved it on without publishing yet
+	return queue->published_offset_wrap;
+}
+
+uint32_t virtio_packed_virtqueue_notification_data(const VirtioPackedVirtqueue* queue, uint16_t queue_index)
+{
+	uint32_t next_off_wrap = virtio_packed_virtqueue_next_offset_wrap(queue);
+	return queue_index | (next_off_wrap << 16u);
+}
+
+bool virtio_packed_virtqueue_has_completed(VirtioPackedVirtqueue* queue)
+{
+	return packed_desc_is_used(&queue->descriptor_ring[queue->next_used_index], queue->used_wrap_counter);
+}
+
+unsigned virtio_packed_virtqueue_process_completed(VirtioPackedVirtqueue* queue, unsigned completion_limit)
+{
+	unsigned total_handled = 0;
+	virtio_spinlock_lock(queue->lock);
+	while (true)
+	{
+		while (completion_limit == 0 || total_handled < completion_limit)
+		{
+			VirtioVringPackedDesc* descriptor = &queue->descriptor_ring[queue->next_used_index];
+			if (!packed_desc_is_used(descriptor, queue->used_wrap_counter))
+				break;
+			// buffer ID and length must not be read before the flags
+			virtio_memory_barrier();
+			uint16_t buffer_id = descriptor->buffer_id;
+			uint32_t written_bytes = descriptor->length_bytes;
+			if (buffer_id >= queue->num_entries || queue->buffers[buffer_id].packed_chain_length == 0)
+			{
+				virtio_log("virtio_packed_virtqueue_process_completed(): Device returned invalid buffer ID %u in slot %u.\n", buffer_id, queue->next_used_index);
+				virtio_spinlock_unlock(queue->lock);
+				return total_handled;
+			}
+
+			VirtioBuffer* buffer = &queue->buffers[buffer_id];
+			VirtioCompletion completion = buffer->completion;
+
+			// the used descriptor replaces the whole chain, so skip over its slots
+			unsigned next_used = queue->next_used_index + buffer->packed_chain_length;
+			if (next_used >= queue->num_entries)
+			{
+				next_used -= queue->num_entries;
+				queue->used_wrap_counter = !queue->used_wrap_counter;
+			}
+			queue->next_used_index = next_used;
+			queue->num_unused_descriptors += buffer->packed_chain_length;
+
+			if (buffer->dma_cmd_used)
+			{
+				virtio_dma_complete(queue->buffer_dma[buffer_id].dma_cmd);
+				virtio_dma_complete(queue->buffer_dma[buffer_id].dma_cmd_2);
+				buffer->dma_cmd_used = false;
+			}
+			buffer->packed_chain_length = 0;
+			buffer->next_desc = queue->first_unused_buffer_id;
+			queue->first_unused_buffer_id = buffer_id;
+
+			++total_handled;
+			// the chain is back on the free list, so the action may resubmit
+			virtio_spinlock_unlock(queue->lock);
+			completion.action(completion.target, completion.ref, false, written_bytes);
+			virtio_spinlock_lock(queue->lock);
+		}
+
+		// like the split ring, a pass that hits its limit leaves interrupts suppressed
+		if (completion_limit != 0 && total_handled >= completion_limit)
+			break;
+		if (queue->interrupts_requested)
+			virtio_packed_virtqueue_enable_interrupts(queue);
+		// re-check for completions that raced with re-enabling interrupts
+		virtio_memory_barrier();
+		if (!virtio_packed_virtqueue_has_completed(queue))
+			break;
+	}
+	virtio_spinlock_unlock(queue->lock);
+	return total_handled;
+}
+
+void virtio_packed_virtqueue_set_interrupts_enabled(VirtioPackedVirtqueue* queue, bool enabled)
+{
+	virtio_spinlock_lock(queue->lock);
+	if (queue->interrupts_requested != enabled)
+	{
+		queue->interrupts_requested = enabled;
+		if (enabled)
+			virtio_packed_virtqueue_enable_interrupts(queue);
+		else
+			virtio_packed_virtqueue_disable_interrupts(queue);
+	}
+	virtio_spinlock_unlock(queue->lock);
+}
+
+void virtio_packed_virtqueue_rearm_interrupts(VirtioPackedVirtqueue* queue)
+{
+	virtio_spinlock_lock(queue->lock);
+	if (queue->interrupts_requested)
+		virtio_packed_virtqueue_enable_interrupts(queue);
+	virtio_spinlock_unlock(queue->lock);
+}
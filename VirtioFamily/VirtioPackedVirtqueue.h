@@ -0,0 +1,96 @@
+//
+//  VirtioPackedVirtqueue.h
+//  virtio-osx
+//
+//
+
+#ifndef __virtio_osx__VirtioPackedVirtqueue__
+#define __virtio_osx__VirtioPackedVirtqueue__
+
+#include "VirtioDevice.h"
+#include "VirtioPlatform.h"
+
+/// Driver state for a virtqueue using the packed ring layout (VIRTIO_F_RING_PACKED)
+/** Transport independent: the transport sets up the queue, programs the
+ * physical addresses of the descriptor ring and the two event areas into the
+ * device, and notifies the device whenever submission/publishing says so.
+ * Indirect descriptors are not used with packed rings, nor is
+ * VIRTIO_F_IN_ORDER's batched retiring. Kernel services are reached through
+ * VirtioPlatform.h only. */
+struct VirtioPackedVirtqueue
+{
+	uint16_t num_entries;
+	/// Serialises submission, publishing and reclaiming completed chains.
+	/** Completion actions run without it, so they may resubmit. Never taken
+	 * by virtio_packed_virtqueue_disable_interrupts(), which interrupt filters
+	 * call. Kernel debugger polling, which may interrupt a holder, therefore
+	 * can't use packed queues. */
+	virtio_spinlock* lock;
+
+	VirtioVringPackedDesc* descriptor_ring;
+	/// Written by the driver: whether the device should interrupt on completion
+	VirtioVringPackedEvent* driver_event;
+	/// Written by the device: whether the driver should send notifications
+	VirtioVringPackedEvent* device_event;
+
+	uint64_t descriptor_ring_phys;
+	uint64_t driver_event_phys;
+	uint64_t device_event_phys;
+
+	/// Holds the descriptor ring and both event areas
+	VirtioDMAMemory queue_mem;
+
+	/// Ring slot the next descriptor will be written to, and the wrap counter to mark it with
+	uint16_t next_avail_index;
+	bool avail_wrap_counter;
+	/// Ring slot in which the next used descriptor will appear
+	uint16_t next_used_index;
+	bool used_wrap_counter;
+
+	/// Head of the oldest chain not yet made visible to the device. Its flags
+	/// are written last, which publishes it and every chain behind it at once.
+	bool head_pending;
+	uint16_t pending_head_index;
+	uint16_t pending_head_flags;
+	/// Ring slots filled since the device was last considered for notification
+	unsigned num_added;
+	/// Slot and wrap counter (offset_wrap format) just past the last published descriptor.
+	/** Submission moves next_avail_index on before publishing, so that can run ahead of what the device may see. */
+	uint16_t published_offset_wrap;
+
+	/// One per buffer ID; next_desc chains the unused IDs.
+	VirtioBuffer* buffers;
+	VirtioBufferDMA* buffer_dma;
+	/// VIRTIO_DESC_INDEX_NONE if all buffer IDs are in use
+	uint16_t first_unused_buffer_id;
+	unsigned num_unused_descriptors;
+
+	bool interrupts_requested;
+	bool event_index;
+};
+
+IOReturn virtio_packed_virtqueue_init(VirtioPackedVirtqueue* queue, uint16_t num_entries, bool event_index, bool interrupts_enabled);
+void virtio_packed_virtqueue_destroy(VirtioPackedVirtqueue* queue);
+
+/// Writes a request's descriptors to the ring; it only becomes visible to the device once published.
+IOReturn virtio_packed_virtqueue_submit(VirtioPackedVirtqueue* queue, IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion);
+IOReturn virtio_packed_virtqueue_submit_registered(VirtioPackedVirtqueue* queue, VirtioRegisteredBuffer* device_readable_buf, VirtioRegisteredBuffer* device_writable_buf, VirtioCompletion completion);
+/// Like virtio_packed_virtqueue_submit_registered(), for physical segments the caller already knows.
+IOReturn virtio_packed_virtqueue_add_segments(VirtioPackedVirtqueue* queue, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion);
+/// Makes all submitted requests visible to the device; returns true if the device needs to be notified.
+bool virtio_packed_virtqueue_publish(VirtioPackedVirtqueue* queue);
+/// Doorbell value with VIRTIO_F_NOTIFICATION_DATA: queue index, next ring offset and avail wrap counter.
+uint32_t virtio_packed_virtqueue_notification_data(const VirtioPackedVirtqueue* queue, uint16_t queue_index);
+/// The ring slot and wrap counter just past the last published descriptor, in the format of the device event area's offset_wrap.
+uint16_t virtio_packed_virtqueue_next_offset_wrap(const VirtioPackedVirtqueue* queue);
+
+bool virtio_packed_virtqueue_has_completed(VirtioPackedVirtqueue* queue);
+unsigned virtio_packed_virtqueue_process_completed(VirtioPackedVirtqueue* queue, unsigned completion_limit);
+
+void virtio_packed_virtqueue_set_interrupts_enabled(VirtioPackedVirtqueue* queue, bool enabled);
+/// Re-arms interrupts after a pass that left the queue in polling mode; only if they're requested.
+void virtio_packed_virtqueue_rearm_interrupts(VirtioPackedVirtqueue* queue);
+/// Suppresses interrupts until the next completion pass re-arms them; safe from primary interrupt context.
+void virtio_packed_virtqueue_disable_interrupts(VirtioPackedVirtqueue* queue);
+
+#endif /* defined(__virtio_osx__VirtioPackedVirtqueue__) */
@@ -0,0 +1,186 @@
+//
+//  VirtioPlatform.h
+//  virtio-osx
+//
+//
+
+#ifndef __virtio_osx__VirtioPlatform__
+#define __virtio_osx__VirtioPlatform__
+
+/* The kernel services used by the virtqueue engines (VirtioSplitVirtqueue.cpp,
+ * VirtioPackedVirtqueue.cpp).
+ * The ring logic goes through these rather than libkern and IOKit directly,
+ * so that it can be built against other implementations of them, for example
+ * to exercise and profile it outside the kernel. */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IODMACommand.h>
+#include <libkern/OSAtomic.h>
+#include <stdint.h>
+
+/// Orders accesses to ring memory shared with the device
+static inline void virtio_memory_barrier()
+{
+	OSMemoryBarrier();
+}
+
+/// Ensures ring contents are visible to the device before it's told about them
+static inline void virtio_io_barrier()
+{
+	OSSynchronizeIO();
+}
+
+static inline bool virtio_atomic_cas32(UInt32 old_value, UInt32 new_value, volatile UInt32* address)
+{
+	return OSCompareAndSwap(old_value, new_value, address);
+}
+
+static inline bool virtio_atomic_cas16(uint16_t old_value, uint16_t new_value, volatile uint16_t* address)
+{
+	// libkern has no 16-bit compare-and-swap
+	return __sync_bool_compare_and_swap(address, old_value, new_value);
+}
+
+/// These return the value before the operation
+static inline SInt32 virtio_atomic_increment32(volatile SInt32* address)
+{
+	return OSIncrementAtomic(address);
+}
+
+static inline SInt32 virtio_atomic_decrement32(volatile SInt32* address)
+{
+	return OSDecrementAtomic(address);
+}
+
+static inline uint16_t virtio_atomic_fetch_add16(volatile uint16_t* address, int16_t amount)
+{
+	return static_cast<uint16_t>(OSAddAtomic16(amount, reinterpret_cast<volatile SInt16*>(address)));
+}
+
+/// For short critical sections which may be entered with preemption disabled
+typedef IOSimpleLock virtio_spinlock;
+
+static inline virtio_spinlock* virtio_spinlock_alloc()
+{
+	return IOSimpleLockAlloc();
+}
+
+static inline void virtio_spinlock_free(virtio_spinlock* lock)
+{
+	IOSimpleLockFree(lock);
+}
+
+static inline void virtio_spinlock_lock(virtio_spinlock* lock)
+{
+	IOSimpleLockLock(lock);
+}
+
+static inline void virtio_spinlock_unlock(virtio_spinlock* lock)
+{
+	IOSimpleLockUnlock(lock);
+}
+
+/// Physically contiguous, zeroed memory shared with the device, such as a ring
+struct VirtioDMAMemory
+{
+	void* bytes;
+	uint64_t phys_address;
+	size_t size;
+	IOBufferMemoryDescriptor* memory;
+	IODMACommand* dma_cmd;
+};
+
+static inline void virtio_dma_memory_free(VirtioDMAMemory* mem)
+{
+	if (mem->dma_cmd != nullptr)
+	{
+		mem->dma_cmd->clearMemoryDescriptor();
+		OSSafeReleaseNULL(mem->dma_cmd);
+	}
+	OSSafeReleaseNULL(mem->memory);
+	mem->bytes = nullptr;
+	mem->phys_address = 0;
+	mem->size = 0;
+}
+
+/// alignment must be a power of 2.
+static inline IOReturn virtio_dma_memory_allocate(VirtioDMAMemory* mem, size_t size, uint64_t alignment)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->memory = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
+		kernel_task, kIOMemoryPhysicallyContiguous | kIODirectionInOut, size, ~static_cast<mach_vm_address_t>(alignment - 1u));
+	if (mem->memory == nullptr)
+		return kIOReturnNoMemory;
+	mem->bytes = mem->memory->getBytesNoCopy();
+	memset(mem->bytes, 0, size);
+	mem->size = size;
+
+	mem->dma_cmd = IODMACommand::withSpecification(
+		IODMACommand::OutputHost64, 64, 0 /* no limit on segment size */, IODMACommand::kMapped, 0 /* no limit on transfer size */, static_cast<UInt32>(alignment));
+	if (mem->dma_cmd == nullptr)
+	{
+		virtio_dma_memory_free(mem);
+		return kIOReturnNoMemory;
+	}
+	IOReturn result = mem->dma_cmd->setMemoryDescriptor(mem->memory);
+	if (result != kIOReturnSuccess)
+	{
+		OSSafeReleaseNULL(mem->dma_cmd);
+		virtio_dma_memory_free(mem);
+		return result;
+	}
+	IODMACommand::Segment64 phys_segment = {};
+	UInt64 offset = 0;
+	UInt32 num_segments = 1;
+	result = mem->dma_cmd->genIOVMSegments(&offset, &phys_segment, &num_segments);
+	if (result == kIOReturnSuccess && (offset != size || num_segments != 1 || phys_segment.fLength != size))
+	{
+		result = kIOReturnInternalError;
+	}
+	if (result != kIOReturnSuccess)
+	{
+		virtio_dma_memory_free(mem);
+		return result;
+	}
+	mem->phys_address = phys_segment.fIOVMAddr;
+	return kIOReturnSuccess;
+}
+
+/// DMA command for mapping clients' buffers; output_segment is called with each physical segment.
+static inline IODMACommand* virtio_dma_command_create(IODMACommand::SegmentFunction output_segment)
+{
+	return IODMACommand::withSpecification(output_segment, 64, UINT32_MAX, IODMACommand::kMapped, UINT32_MAX);
+}
+
+static inline void virtio_dma_command_release(IODMACommand*& dma_cmd)
+{
+	OSSafeReleaseNULL(dma_cmd);
+}
+
+/// Prepares buf for DMA and generates up to *num_segments segments from
+/// *offset onwards, like IODMACommand::genIOVMSegments(). On failure, or if
+/// not all of buf was generated, the caller completes the command.
+static inline IOReturn virtio_dma_map(IODMACommand* dma_cmd, IOMemoryDescriptor* buf, UInt64* offset, void* segments, UInt32* num_segments)
+{
+	IOReturn result = dma_cmd->setMemoryDescriptor(buf, true /* prepare DMA */);
+	if (result != kIOReturnSuccess)
+		return result;
+	return dma_cmd->genIOVMSegments(offset, segments, num_segments);
+}
+
+/// Completes DMA on a buffer the device has finished with and unmaps it.
+static inline void virtio_dma_complete(IODMACommand* dma_cmd)
+{
+	dma_cmd->clearMemoryDescriptor(true);
+}
+
+static inline uint64_t virtio_buffer_length(IOMemoryDescriptor* buf)
+{
+	return buf->getLength();
+}
+
+#define virtio_log IOLog
+
+#endif /* defined(__virtio_osx__VirtioPlatform__) */
@@ -26,10 +26,12 @@ namespace VirtioSCSIControllerFeatures
 		VIRTIO_SCSI_F_T10_PI = (1u << 3),
 	};
 	
-	static const uint32_t SUPPORTED_FEATURES =
+	static const uint64_t SUPPORTED_FEATURES =
 		VirtioSCSIControllerFeatures::VIRTIO_SCSI_F_INOUT
 		| VirtioSCSIControllerFeatures::VIRTIO_SCSI_F_HOTPLUG
-		| VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC;
+		| VirtioDeviceGenericFeature::VIRTIO_F_RING_INDIRECT_DESC
+		| VirtioDeviceGenericFeature::VIRTIO_F_RING_EVENT_IDX
+		| VirtioDeviceGenericFeature::VIRTIO_F_IN_ORDER;
 }
 
 enum virtio_scsi_event_type
@@ -95,8 +97,8 @@ bool VirtioSCSIController::InitializeController(void)
 	virtio->resetDevice();
 	//kprintf("VirtioBlockDevice::start() resetDevice\n");
 	
-	uint32_t dev_features = virtio->supportedFeatures();
-	uint32_t use_features = dev_features & VirtioSCSIControllerFeatures::SUPPORTED_FEATURES;
+	uint64_t dev_features = virtio->supportedFeatures();
+	uint64_t use_features = dev_features & VirtioSCSIControllerFeatures::SUPPORTED_FEATURES;
 	this->active_features = use_features;
 	//kprintf("VirtioBlockDevice::start() use Features\n");
 
@@ -165,11 +167,19 @@ bool VirtioSCSIController::InitializeController(void)
 	{
 		IOBufferMemoryDescriptor* eventBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(
 			kernel_task, kIODirectionIn | kIOMemoryPhysicallyContiguous, event_info_size, alignof(uint32_t));
-		VirtioCompletion completion = { &eventCompleted, this, eventBuffer };
-		IOReturn res = virtio->submitBuffersToVirtqueue(1, nullptr, eventBuffer, completion);
+		if (eventBuffer == nullptr)
+			break;
+		// event buffers are resubmitted for as long as the device runs, so map them once
+		VirtioRegisteredBuffer* registeredEventBuffer = nullptr;
+		IOReturn res = virtio->registerBuffer(eventBuffer, &registeredEventBuffer);
+		eventBuffer->release();
+		if(res != kIOReturnSuccess)
+			break;
+		VirtioCompletion completion = { &eventCompleted, this, registeredEventBuffer };
+		res = virtio->submitRegisteredBuffersToVirtqueue(1, nullptr, registeredEventBuffer, completion);
 		if(res != kIOReturnSuccess)
 		{
-			eventBuffer->release();
+			VirtioDevice::unregisterBuffer(registeredEventBuffer);
 			break;
 		}
 	}
@@ -211,14 +221,15 @@ bool VirtioSCSIController::InitializeController(void)
 
 void VirtioSCSIController::eventCompleted(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
 {
-	IOBufferMemoryDescriptor* eventBuffer = static_cast<IOBufferMemoryDescriptor*>(ref);
+	VirtioRegisteredBuffer* registeredEventBuffer = static_cast<VirtioRegisteredBuffer*>(ref);
+	IOBufferMemoryDescriptor* eventBuffer = static_cast<IOBufferMemoryDescriptor*>(registeredEventBuffer->memory);
 	VirtioSCSIController* controller = static_cast<VirtioSCSIController*>(target);
 	
 	if(device_reset)
 	{
 		IOLog("VirtioSCSIController::eventCompleted -> device reset\n");
 
-		eventBuffer->release();
+		VirtioDevice::unregisterBuffer(registeredEventBuffer);
 	}
 	else
 	{
@@ -245,11 +256,11 @@ void VirtioSCSIController::eventCompleted(OSObject* target, void* ref, bool devi
 				//controller
 			}
 		}
-		VirtioCompletion completion = { &eventCompleted, controller, eventBuffer };
-		IOReturn res = controller->virtio_dev->submitBuffersToVirtqueue(1, nullptr, eventBuffer, completion);
+		VirtioCompletion completion = { &eventCompleted, controller, registeredEventBuffer };
+		IOReturn res = controller->virtio_dev->submitRegisteredBuffersToVirtqueue(1, nullptr, registeredEventBuffer, completion);
 		if(res != kIOReturnSuccess)
 		{
-			eventBuffer->release();
+			VirtioDevice::unregisterBuffer(registeredEventBuffer);
 		}
 	}
 }
@@ -31,7 +31,7 @@ protected:
 	static const unsigned CONFIG_MAX_TARGET_OFFSET = 30;
 	static const unsigned CONFIG_MAX_LUN_OFFSET = 32;
 
-	uint32_t active_features;
+	uint64_t active_features;
 	uint16_t max_target;
 	uint32_t max_task_count;
 	uint32_t max_lun;
@@ -0,0 +1,430 @@
+//
+//  VirtioSplitVirtqueue.cpp
+//  virtio-osx
+//
+//
+
+#define __STDC_LIMIT_MACROS
+#include "VirtioSplitVirtqueue.h"
+#include "VirtioPlatform.h"
+#include <stdint.h>
+#include "../virtio-net/virtio_ring.h"
+
+static inline uint16_t free_list_head_index(UInt32 head)
+{
+	return head & 0xffffu;
+}
+
+/// New value for free_list_head with the given top entry and the next tag.
+static inline UInt32 free_list_head_replace(UInt32 old_head, uint16_t index)
+{
+	return ((old_head + 0x10000u) & 0xffff0000u) | index;
+}
+
+uint16_t reserveNewDescriptor(VirtioVirtqueue* virtqueue)
+{
+	if (virtqueue->in_order)
+	{
+		// the device expects descriptors to be used in table order, wrapping at the end
+		if (virtqueue->num_unused_descriptors == 0)
+			return VIRTIO_DESC_INDEX_NONE;
+		uint16_t descriptorIndex = virtqueue->first_unused_descriptor_index;
+		virtqueue->first_unused_descriptor_index = virtio_virtqueue_wrap(virtqueue, descriptorIndex + 1u);
+		virtio_atomic_decrement32(&virtqueue->num_unused_descriptors);
+		virtqueue->descriptor_buffers[descriptorIndex].next_desc = VIRTIO_DESC_INDEX_NONE;
+		return descriptorIndex;
+	}
+	
+	UInt32 old_head, new_head;
+	uint16_t descriptorIndex;
+	do
+	{
+		old_head = virtqueue->free_list_head;
+		descriptorIndex = free_list_head_index(old_head);
+		if (descriptorIndex == VIRTIO_DESC_INDEX_NONE)
+			return VIRTIO_DESC_INDEX_NONE;
+		// If another thread pops this entry first, next_desc may be stale, but
+		// then the tag will have moved on and the swap fails.
+		new_head = free_list_head_replace(old_head, virtqueue->descriptor_buffers[descriptorIndex].next_desc);
+	} while (!virtio_atomic_cas32(old_head, new_head, &virtqueue->free_list_head));
+	virtio_atomic_decrement32(&virtqueue->num_unused_descriptors);
+	
+	// don't leave the rest of the free list dangling off a descriptor that may be returned before it's chained
+	virtqueue->descriptor_buffers[descriptorIndex].next_desc = VIRTIO_DESC_INDEX_NONE;
+	return descriptorIndex;
+}
+
+void returnUnusedDescriptor(VirtioVirtqueue* virtqueue, uint16_t descriptorIndex)
+{
+	if (virtqueue->in_order)
+	{
+		// Only used for backing out of a failed submission, which holds the
+		// most recently reserved descriptors, so just rewind the allocator.
+		virtqueue->first_unused_descriptor_index =
+			virtio_virtqueue_wrap(virtqueue, virtqueue->first_unused_descriptor_index + virtqueue->num_entries - 1u);
+		virtio_atomic_increment32(&virtqueue->num_unused_descriptors);
+		return;
+	}
+	
+	// count it before it becomes available, so the count never falls short
+	virtio_atomic_increment32(&virtqueue->num_unused_descriptors);
+	UInt32 old_head, new_head;
+	do
+	{
+		old_head = virtqueue->free_list_head;
+		virtqueue->descriptor_buffers[descriptorIndex].next_desc = free_list_head_index(old_head);
+		new_head = free_list_head_replace(old_head, descriptorIndex);
+	} while (!virtio_atomic_cas32(old_head, new_head, &virtqueue->free_list_head));
+}
+
+/// Undoes a partially built submission: completes any prepared DMA and returns the chain's descriptors.
+void virtio_virtqueue_release_chain(VirtioVirtqueue* queue, uint16_t descriptorIndex)
+{
+	while (descriptorIndex != VIRTIO_DESC_INDEX_NONE)
+	{
+		uint16_t next = queue->descriptor_buffers[descriptorIndex].next_desc;
+		if (queue->descriptor_buffers[descriptorIndex].dma_cmd_used)
+		{
+			virtio_dma_complete(queue->descriptor_dma[descriptorIndex].dma_cmd);
+			queue->descriptor_buffers[descriptorIndex].dma_cmd_used = false;
+		}
+		returnUnusedDescriptor(queue, descriptorIndex);
+		descriptorIndex = next;
+	}
+}
+
+void virtio_fill_vring_descriptor(VirtioVringDesc* descriptor, uint16_t descriptorIndex, VirtioVringDesc* previousDescriptor, IODMACommand::Segment64 segment, bool device_writable)
+{
+	// 2. fill physical address & length fields in descriptor with values from segment argument
+	descriptor->phys_address = segment.fIOVMAddr;
+	descriptor->length_bytes = static_cast<uint32_t>(segment.fLength);
+	
+	// set flags to 0 or WRITE depending on chain->device_writable
+	if (device_writable)
+	{
+		descriptor->flags = VirtioVringDescFlag::DEVICE_WRITABLE;
+	}
+	else
+	{
+		descriptor->flags = 0;
+	}
+	// 3. Check if this is the first segment
+	if (previousDescriptor != nullptr)
+	{
+		// update previous descriptor's next field with current descriptor index, and set "next" flag
+		previousDescriptor->next = descriptorIndex;
+		previousDescriptor->flags |= VirtioVringDescFlag::NEXT;
+	}
+
+	// 5. Save index of current descriptor as last descriptor
+	descriptor->next = 0xffff;
+}
+
+static inline IODMACommand::Segment64 virtio_registered_segment64(const VirtioRegisteredSegment& registered_segment)
+{
+	IODMACommand::Segment64 segment = {};
+	segment.fIOVMAddr = registered_segment.phys_address;
+	segment.fLength = registered_segment.length;
+	return segment;
+}
+
+/// Chains descriptors for a list of physical segments onto [first, last]; false if the queue ran out.
+static bool append_segment_vring_descs(VirtioVirtqueue* queue, const VirtioRegisteredSegment* segments, unsigned num_segments, bool device_writable, uint16_t& first_descriptor_index, uint16_t& last_descriptor_index)
+{
+	for (unsigned i = 0; i < num_segments; ++i)
+	{
+		uint16_t descriptorIndex = reserveNewDescriptor(queue);
+		if (descriptorIndex == VIRTIO_DESC_INDEX_NONE)
+			return false;
+		VirtioVringDesc* previousDescriptor = nullptr;
+		if (last_descriptor_index == VIRTIO_DESC_INDEX_NONE)
+		{
+			first_descriptor_index = descriptorIndex;
+		}
+		else
+		{
+			previousDescriptor = &queue->descriptor_table[last_descriptor_index];
+			queue->descriptor_buffers[last_descriptor_index].next_desc = descriptorIndex;
+		}
+		virtio_fill_vring_descriptor(&queue->descriptor_table[descriptorIndex], descriptorIndex, previousDescriptor, virtio_registered_segment64(segments[i]), device_writable);
+		last_descriptor_index = descriptorIndex;
+	}
+	return true;
+}
+
+/// Writes a list of physical segments to an indirect table from position index; returns the next free position.
+static unsigned fill_segment_indirect_table(VirtioVringDesc* desc_array, unsigned index, const VirtioRegisteredSegment* segments, unsigned num_segments, bool device_writable)
+{
+	for (unsigned i = 0; i < num_segments; ++i, ++index)
+	{
+		virtio_fill_vring_descriptor(&desc_array[index], index, index == 0 ? nullptr : &desc_array[index - 1], virtio_registered_segment64(segments[i]), device_writable);
+	}
+	return index;
+}
+
+IOReturn virtio_virtqueue_add_segments(VirtioVirtqueue* queue, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion)
+{
+	const unsigned num_segments = num_readable_segments + num_writable_segments;
+	uint16_t first_descriptor_index = VIRTIO_DESC_INDEX_NONE;
+	uint16_t large_table = VIRTIO_DESC_INDEX_NONE;
+	if (queue->indirect_descriptors)
+	{
+		if (num_segments > queue->indirect_small_table_size && num_segments > queue->indirect_large_table_size)
+			return kIOReturnUnsupported;
+		first_descriptor_index = reserveNewDescriptor(queue);
+		if (first_descriptor_index == VIRTIO_DESC_INDEX_NONE)
+			return kIOReturnBusy;
+		if (num_segments > queue->indirect_small_table_size)
+		{
+			large_table = virtio_virtqueue_reserve_indirect_large_table(queue);
+			if (large_table == VIRTIO_DESC_INDEX_NONE)
+			{
+				returnUnusedDescriptor(queue, first_descriptor_index);
+				return kIOReturnBusy;
+			}
+		}
+		
+		VirtioVringDesc* desc_array = queue->indirect_tables + virtio_indirect_table_offset(queue, first_descriptor_index, large_table);
+		unsigned num_descs = fill_segment_indirect_table(desc_array, 0, readable_segments, num_readable_segments, false);
+		num_descs = fill_segment_indirect_table(desc_array, num_descs, writable_segments, num_writable_segments, true);
+		
+		IODMACommand::Segment64 table_segment = {};
+		table_segment.fIOVMAddr = queue->indirect_tables_phys
+			+ sizeof(VirtioVringDesc) * virtio_indirect_table_offset(queue, first_descriptor_index, large_table);
+		table_segment.fLength = sizeof(VirtioVringDesc) * num_descs;
+		VirtioVringDesc* descriptor = &queue->descriptor_table[first_descriptor_index];
+		virtio_fill_vring_descriptor(descriptor, first_descriptor_index, nullptr, table_segment, false);
+		descriptor->flags = VirtioVringDescFlag::INDIRECT;
+	}
+	else
+	{
+		if (num_segments > queue->num_entries)
+			return kIOReturnUnsupported;
+		SInt32 num_unused = queue->num_unused_descriptors;
+		if (num_unused < 0 || num_segments > static_cast<unsigned>(num_unused))
+			return kIOReturnBusy;
+		
+		uint16_t last_descriptor_index = VIRTIO_DESC_INDEX_NONE;
+		bool ok = append_segment_vring_descs(queue, readable_segments, num_readable_segments, false, first_descriptor_index, last_descriptor_index);
+		if (ok)
+			ok = append_segment_vring_descs(queue, writable_segments, num_writable_segments, true, first_descriptor_index, last_descriptor_index);
+		if (!ok)
+		{
+			// concurrent submitters got to the remaining descriptors first
+			virtio_virtqueue_release_chain(queue, first_descriptor_index);
+			return kIOReturnBusy;
+		}
+	}
+	
+	// nothing to unmap on completion
+	VirtioBuffer* desc_buffer = &queue->descriptor_buffers[first_descriptor_index];
+	desc_buffer->dma_cmd_used = false;
+	desc_buffer->indirect_large_table = large_table;
+	desc_buffer->completion = completion;
+	
+	virtio_virtqueue_add_descriptor_to_ring(queue, first_descriptor_index);
+	return kIOReturnSuccess;
+}
+
+void virtio_virtqueue_init_available_slots(VirtioVirtqueue* queue)
+{
+	// tag each slot with the position that last used it, one lap before the next claim
+	uint16_t head = queue->available_ring->head_index;
+	for (unsigned i = 0; i < queue->num_entries; ++i)
+	{
+		uint16_t pos = head + i;
+		queue->available_ring_ready[virtio_virtqueue_wrap(queue, pos)] = pos - queue->num_entries;
+	}
+	queue->available_ring_next_index = head;
+}
+
+void virtio_virtqueue_add_descriptor_to_ring(VirtioVirtqueue* queue, uint16_t first_descriptor_index)
+{
+	// claim a slot in the 'available' ring; every submitter gets its own, even when racing
+	uint16_t avail_pos = static_cast<uint16_t>(
+		virtio_atomic_fetch_add16(&queue->available_ring_next_index, 1));
+	uint16_t slot = virtio_virtqueue_wrap(queue, avail_pos);
+	// add index of first descriptor in chain to the ring; the device won't see it until published
+	queue->available_ring->ring[slot] = first_descriptor_index;
+	// then mark the slot filled; a publisher stops at the first slot that isn't
+	virtio_memory_barrier();
+	queue->available_ring_ready[slot] = avail_pos;
+	// Full fence: the ready mark must be visible before this submitter loads
+	// batch_depth or scans other slots, or two racing submitters (or a
+	// submitter and a batch committer) can each miss the other's slot and
+	// leave it unpublished.
+	virtio_memory_barrier();
+}
+
+/** Publishes the longest run of filled slots after head_index. A slot that
+ * was claimed but not yet filled holds back the ones after it; its
+ * submitter publishes them when it gets there. Safe to race against other
+ * publishers: only one of them moves head_index over any given range of
+ * slots, and only that one considers notifying. */
+bool virtio_virtqueue_publish_available(VirtioVirtqueue* queue)
+{
+	uint16_t old_avail_pos, avail_pos;
+	do
+	{
+		old_avail_pos = queue->available_ring->head_index;
+		avail_pos = old_avail_pos;
+		while (static_cast<uint16_t>(avail_pos - old_avail_pos) < queue->num_entries
+			&& queue->available_ring_ready[virtio_virtqueue_wrap(queue, avail_pos)] == avail_pos)
+		{
+			++avail_pos;
+		}
+		if (avail_pos == old_avail_pos)
+			return false;
+		
+		// the slots' contents must be visible to the device before the new head index
+		virtio_memory_barrier();
+	} while (!virtio_atomic_cas16(old_avail_pos, avail_pos, &queue->available_ring->head_index));
+	// The device's avail_event/NO_NOTIFY must be read after the new head index is visible.
+	virtio_memory_barrier();
+	
+	if (queue->event_index)
+	{
+		return vring_need_event(*queue->avail_ring_notify_index, avail_pos, old_avail_pos);
+	}
+	return (queue->used_ring->flags & VirtioVringUsedFlag::NO_NOTIFY) == 0;
+}
+
+uint16_t virtio_virtqueue_reserve_indirect_large_table(VirtioVirtqueue* queue)
+{
+	UInt32 old_head, new_head;
+	uint16_t table;
+	do
+	{
+		old_head = queue->indirect_large_free_head;
+		table = free_list_head_index(old_head);
+		if (table == VIRTIO_DESC_INDEX_NONE)
+			return VIRTIO_DESC_INDEX_NONE;
+		new_head = free_list_head_replace(old_head, queue->indirect_large_next[table]);
+	} while (!virtio_atomic_cas32(old_head, new_head, &queue->indirect_large_free_head));
+	return table;
+}
+
+void virtio_virtqueue_return_indirect_large_table(VirtioVirtqueue* queue, uint16_t table)
+{
+	UInt32 old_head, new_head;
+	do
+	{
+		old_head = queue->indirect_large_free_head;
+		queue->indirect_large_next[table] = free_list_head_index(old_head);
+		new_head = free_list_head_replace(old_head, table);
+	} while (!virtio_atomic_cas32(old_head, new_head, &queue->indirect_large_free_head));
+}
+
+static inline void virtio_virtqueue_release_buffer_dma(VirtioVirtqueue* virtqueue, uint16_t descriptorIndex)
+{
+	VirtioBuffer* buffer = &virtqueue->descriptor_buffers[descriptorIndex];
+	if (buffer->dma_cmd_used)
+	{
+		// only now touch the cold DMA command array
+		VirtioBufferDMA* dma = &virtqueue->descriptor_dma[descriptorIndex];
+		virtio_dma_complete(dma->dma_cmd);
+		buffer->dma_cmd_used = false;
+		if (virtqueue->indirect_descriptors)
+			virtio_dma_complete(dma->dma_cmd_2);
+	}
+	// requests on registered buffers may borrow a large table without using the DMA commands
+	if (buffer->indirect_large_table != VIRTIO_DESC_INDEX_NONE)
+	{
+		virtio_virtqueue_return_indirect_large_table(virtqueue, buffer->indirect_large_table);
+		buffer->indirect_large_table = VIRTIO_DESC_INDEX_NONE;
+	}
+}
+
+/// VIRTIO_F_IN_ORDER: a used entry also retires every request made available
+/// before it. Descriptors were handed out in table order, so the retired
+/// chains form one contiguous run that is recycled without touching the
+/// free list. Returns the number of requests completed.
+/** The device only reports a written length for the last request in the
+ * batch; how much it wrote to the others is unknown, so they report 0 rather
+ * than anything a client could mistake for valid data. */
+static unsigned virtio_virtqueue_retire_in_order(VirtioVirtqueue* virtqueue, uint16_t last_head, uint32_t last_written_bytes)
+{
+	const unsigned queue_len = virtqueue->num_entries;
+	unsigned handled = 0;
+	while (static_cast<unsigned>(virtqueue->num_unused_descriptors) < queue_len)
+	{
+		// the oldest in-flight chain starts right after the unused run
+		uint16_t head = virtio_virtqueue_wrap(virtqueue, virtqueue->first_unused_descriptor_index + virtqueue->num_unused_descriptors);
+		VirtioBuffer* head_buffer = &virtqueue->descriptor_buffers[head];
+		VirtioCompletion completion = head_buffer->completion;
+		uint32_t written_bytes = (head == last_head) ? last_written_bytes : 0;
+
+		uint16_t descriptorIndex = head;
+		while (descriptorIndex != VIRTIO_DESC_INDEX_NONE)
+		{
+			VirtioBuffer* buffer = &virtqueue->descriptor_buffers[descriptorIndex];
+			uint16_t next = buffer->next_desc;
+			virtio_virtqueue_release_buffer_dma(virtqueue, descriptorIndex);
+			virtio_atomic_increment32(&virtqueue->num_unused_descriptors);
+			descriptorIndex = next;
+		}
+		++handled;
+		completion.action(completion.target, completion.ref, false, written_bytes);
+		if (head == last_head)
+			break;
+	}
+	return handled;
+}
+
+unsigned virtio_virtqueue_process_completed(VirtioVirtqueue* virtqueue, unsigned completion_limit)
+{
+	unsigned total_handled = 0;
+	const unsigned queue_len = virtqueue->num_entries;
+	while (true)
+	{
+		uint16_t currentUsedRingHeadIndex = virtqueue->used_ring->head_index;
+		uint16_t nextUsedRingIndex = virtqueue->used_ring_last_head_index;
+		uint16_t numAdded = currentUsedRingHeadIndex - virtqueue->used_ring_last_head_index;
+		if (completion_limit != 0 && total_handled >= completion_limit)
+		{
+			// budget used up: interrupts stay as they are, the caller polls again
+			return total_handled;
+		}
+		if(numAdded == 0)
+		{
+			if (virtqueue->interrupts_requested)
+				virtio_virtqueue_enable_interrupts(virtqueue);
+			// re-check for completions that raced with re-enabling interrupts
+			virtio_memory_barrier();
+			currentUsedRingHeadIndex = virtqueue->used_ring->head_index;
+			numAdded = currentUsedRingHeadIndex - virtqueue->used_ring_last_head_index;
+			if (numAdded == 0)
+				return total_handled;
+		}
+		for( ; nextUsedRingIndex != currentUsedRingHeadIndex && (completion_limit == 0 || total_handled < completion_limit); nextUsedRingIndex++)
+		{
+			unsigned item = virtio_virtqueue_wrap(virtqueue, nextUsedRingIndex);
+			uint32_t writtenBytes = virtqueue->used_ring->ring[item].written_bytes;
+			uint32_t dequeuedDescriptor = virtqueue->used_ring->ring[item].descriptor_id;
+
+			if (dequeuedDescriptor >= queue_len)
+			{
+				virtio_log("virtio_virtqueue_process_completed(): Device returned invalid descriptor %u.\n", dequeuedDescriptor);
+				continue;
+			}
+			if (virtqueue->in_order)
+			{
+				total_handled += virtio_virtqueue_retire_in_order(virtqueue, dequeuedDescriptor, writtenBytes);
+				continue;
+			}
+
+			VirtioCompletion completion = virtqueue->descriptor_buffers[dequeuedDescriptor].completion;
+			uint16_t descriptorIndex = static_cast<uint16_t>(dequeuedDescriptor);
+			while (descriptorIndex != VIRTIO_DESC_INDEX_NONE)
+			{
+				uint16_t next = virtqueue->descriptor_buffers[descriptorIndex].next_desc;
+				virtio_virtqueue_release_buffer_dma(virtqueue, descriptorIndex);
+				returnUnusedDescriptor(virtqueue, descriptorIndex);
+				descriptorIndex = next;
+			}
+			++total_handled;
+			completion.action(completion.target, completion.ref, false, writtenBytes);
+		}
+		virtqueue->used_ring_last_head_index = nextUsedRingIndex;
+	}
+}
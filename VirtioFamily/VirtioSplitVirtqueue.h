@@ -0,0 +1,83 @@
+//
+//  VirtioSplitVirtqueue.h
+//  virtio-osx
+//
+//
+
+#ifndef __virtio_osx__VirtioSplitVirtqueue__
+#define __virtio_osx__VirtioSplitVirtqueue__
+
+#include "VirtioDevice.h"
+#include <IOKit/IODMACommand.h>
+
+/* Descriptor management, ring publishing and completion processing for split
+ * virtqueues. Transport independent: ring memory, indirect tables and the
+ * DMA commands are set up by the transport, which also notifies the device.
+ * Kernel services are only used through the shims in VirtioPlatform.h. */
+
+/// Ask the device to interrupt once it has used anything beyond what we've already processed.
+static inline void virtio_virtqueue_enable_interrupts(VirtioVirtqueue* queue)
+{
+	queue->available_ring->flags = 0; // clear NO_INTERRUPT
+	if (queue->event_index)
+	{
+		*queue->used_ring_interrupt_index = queue->used_ring_last_head_index;
+	}
+}
+
+/// Suppress completion interrupts. With event indices, the flag is ignored by
+/// the device, so park used_event just behind the last processed entry instead.
+static inline void virtio_virtqueue_disable_interrupts(VirtioVirtqueue* queue)
+{
+	queue->available_ring->flags = VirtioVringAvailFlag::NO_INTERRUPT;
+	if (queue->event_index)
+	{
+		*queue->used_ring_interrupt_index = static_cast<uint16_t>(queue->used_ring_last_head_index - 1u);
+	}
+}
+
+/// Ring and table positions wrap at the queue size, which is always a power of 2.
+static inline uint16_t virtio_virtqueue_wrap(const VirtioVirtqueue* queue, unsigned index)
+{
+	return static_cast<uint16_t>(index & (queue->num_entries - 1u));
+}
+
+/// Position of an indirect table within the queue's slab, in descriptors.
+static inline size_t virtio_indirect_table_offset(const VirtioVirtqueue* queue, uint16_t descriptor_index, uint16_t large_table)
+{
+	if (large_table == VIRTIO_DESC_INDEX_NONE)
+		return static_cast<size_t>(descriptor_index) * queue->indirect_small_table_size;
+	return static_cast<size_t>(queue->num_entries) * queue->indirect_small_table_size
+		+ static_cast<size_t>(large_table) * queue->indirect_large_table_size;
+}
+
+/// Returns VIRTIO_DESC_INDEX_NONE if no descriptors are available.
+uint16_t reserveNewDescriptor(VirtioVirtqueue* virtqueue);
+void returnUnusedDescriptor(VirtioVirtqueue* virtqueue, uint16_t descriptorIndex);
+/// Undoes a partially built submission: completes any prepared DMA and returns the chain's descriptors.
+void virtio_virtqueue_release_chain(VirtioVirtqueue* queue, uint16_t descriptorIndex);
+
+/// Returns VIRTIO_DESC_INDEX_NONE if all large indirect tables are in use.
+uint16_t virtio_virtqueue_reserve_indirect_large_table(VirtioVirtqueue* queue);
+void virtio_virtqueue_return_indirect_large_table(VirtioVirtqueue* queue, uint16_t table);
+
+/// Writes one segment to a descriptor and chains it onto previousDescriptor, if any.
+void virtio_fill_vring_descriptor(VirtioVringDesc* descriptor, uint16_t descriptorIndex, VirtioVringDesc* previousDescriptor, IODMACommand::Segment64 segment, bool device_writable);
+/// Builds a chain, or an indirect table, for a request whose physical segments are already known, and fills an avail ring slot with it.
+/** Nothing needs unmapping on completion. Returns kIOReturnBusy if the queue
+ * is short of descriptors or large indirect tables; the caller publishes. */
+IOReturn virtio_virtqueue_add_segments(VirtioVirtqueue* queue, const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion);
+
+/// Sets up available_ring_ready for a new queue; the avail ring's head_index must already be set.
+void virtio_virtqueue_init_available_slots(VirtioVirtqueue* queue);
+/// Fills the next slot in the avail ring; it only becomes visible to the device once published.
+/** Never waits for other submitters. */
+void virtio_virtqueue_add_descriptor_to_ring(VirtioVirtqueue* queue, uint16_t first_descriptor_index);
+/// Makes all chains added since the last call visible to the device; returns true if the device needs to be notified.
+bool virtio_virtqueue_publish_available(VirtioVirtqueue* queue);
+
+/// Runs completion actions for used requests, at most completion_limit of them if non-zero.
+/** Re-arms interrupts if requested once the used ring has run dry. */
+unsigned virtio_virtqueue_process_completed(VirtioVirtqueue* virtqueue, unsigned completion_limit);
+
+#endif /* defined(__virtio_osx__VirtioSplitVirtqueue__) */
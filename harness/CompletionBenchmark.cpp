@@ -0,0 +1,240 @@
+//
+//  CompletionBenchmark.cpp
+//  virtio-osx harness
+//
+//  Measures the cost per completion of walking used chains back onto the
+//  free list, for the per-descriptor bookkeeping layouts before and after
+//  VirtioBuffer's DMA commands moved into the parallel VirtioBufferDMA
+//  array. The "engine" rows time virtio_virtqueue_process_completed() on
+//  the current layout. The "walk" rows time the same chain walk over a
+//  copy of the old layout and over the current one, so the two can be
+//  compared without building the engine twice.
+//
+
+#include "HarnessTransport.h"
+#include "VirtioPlatform.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+/// VirtioBuffer as it was before the DMA commands moved out of it.
+struct OldLayoutVirtioBuffer
+{
+	IODMACommand* dma_cmd;
+	VirtioCompletion completion;
+	uint16_t next_desc;
+	bool dma_cmd_used;
+	uint16_t indirect_large_table;
+	IODMACommand* dma_cmd_2;
+	uint16_t packed_chain_length;
+	uint32_t device_writable_length;
+};
+
+/// Large enough to push the bookkeeping arrays out of the caches between submission and completion
+static std::vector<uint8_t> cache_flush_buffer(64u << 20u);
+
+static void flush_caches()
+{
+	volatile uint8_t* bytes = cache_flush_buffer.data();
+	for (size_t i = 0; i < cache_flush_buffer.size(); i += 64)
+		bytes[i] = bytes[i] + 1;
+}
+
+static void count_completion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
+{
+	++*reinterpret_cast<uint64_t*>(target);
+}
+
+/// Shuffled used ring order: devices complete requests out of order.
+static std::vector<uint16_t> completion_order(const std::vector<uint16_t>& heads, std::mt19937& random)
+{
+	std::vector<uint16_t> order(heads);
+	std::shuffle(order.begin(), order.end(), random);
+	return order;
+}
+
+/// ns per completion of virtio_virtqueue_process_completed(), 3-descriptor chains on registered buffers.
+static double engine_ns_per_completion(uint16_t num_entries, unsigned rounds, bool cold)
+{
+	HarnessTransport transport;
+	HarnessQueueConfig config = {};
+	config.num_entries = num_entries;
+	config.event_index = true;
+	if (transport.setup(config) != kIOReturnSuccess)
+		return -1.0;
+	VirtioVirtqueue* queue = &transport.queue;
+	uint64_t header[2] = {};
+	uint8_t data[512];
+	uint8_t status = 0;
+	VirtioRegisteredSegment readable = { reinterpret_cast<uintptr_t>(header), sizeof(header) };
+	VirtioRegisteredSegment writable[2] = {
+		{ reinterpret_cast<uintptr_t>(data), sizeof(data) }, { reinterpret_cast<uintptr_t>(&status), sizeof(status) } };
+	uint64_t completed = 0;
+	std::mt19937 random(num_entries);
+	uint16_t last_avail_index = 0;
+	double total_ns = 0.0;
+	uint64_t total_completions = 0;
+	for (unsigned round = 0; round < rounds; ++round)
+	{
+		while (virtio_virtqueue_add_segments(queue, &readable, 1, writable, 2, { &count_completion, reinterpret_cast<OSObject*>(&completed), nullptr }) == kIOReturnSuccess)
+		{
+		}
+		virtio_virtqueue_publish_available(queue);
+		std::vector<uint16_t> heads;
+		for (; last_avail_index != queue->available_ring->head_index; ++last_avail_index)
+			heads.push_back(queue->available_ring->ring[virtio_virtqueue_wrap(queue, last_avail_index)]);
+		uint16_t used_index = queue->used_ring->head_index;
+		for (uint16_t head : completion_order(heads, random))
+		{
+			VirtioVringUsedElement* element = &queue->used_ring->ring[virtio_virtqueue_wrap(queue, used_index++)];
+			element->descriptor_id = head;
+			element->written_bytes = sizeof(data) + sizeof(status);
+		}
+		virtio_memory_barrier();
+		queue->used_ring->head_index = used_index;
+		if (cold)
+			flush_caches();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		unsigned handled = virtio_virtqueue_process_completed(queue, 0);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		total_ns += std::chrono::duration<double, std::nano>(end - start).count();
+		total_completions += handled;
+	}
+	return (total_completions == completed && total_completions > 0) ? total_ns / total_completions : -1.0;
+}
+
+/// The engine's completion walk, minus the atomics, over either bookkeeping layout.
+template <typename Buffer, typename LoadDMA>
+static uint64_t walk_chains(Buffer* buffers, const std::vector<uint16_t>& used, uint16_t& free_head, LoadDMA load_dma)
+{
+	uint64_t completed = 0;
+	for (uint16_t head : used)
+	{
+		VirtioCompletion completion = buffers[head].completion;
+		uint16_t index = head;
+		while (index != VIRTIO_DESC_INDEX_NONE)
+		{
+			Buffer* buffer = &buffers[index];
+			uint16_t next = buffer->next_desc;
+			if (buffer->dma_cmd_used)
+			{
+				load_dma(index);
+				buffer->dma_cmd_used = false;
+			}
+			if (buffer->indirect_large_table != VIRTIO_DESC_INDEX_NONE)
+				buffer->indirect_large_table = VIRTIO_DESC_INDEX_NONE;
+			buffer->next_desc = free_head;
+			free_head = index;
+			index = next;
+		}
+		completion.action(completion.target, completion.ref, false, 0);
+		++completed;
+	}
+	return completed;
+}
+
+/// Chains the buffers into 3-descriptor requests the way the free list hands them out after a while: scattered.
+template <typename Buffer>
+static std::vector<uint16_t> build_chains(Buffer* buffers, unsigned num_entries, bool dma_used, uint64_t* counter, std::mt19937& random)
+{
+	std::vector<uint16_t> indices(num_entries);
+	for (unsigned i = 0; i < num_entries; ++i)
+		indices[i] = i;
+	std::shuffle(indices.begin(), indices.end(), random);
+	std::vector<uint16_t> heads;
+	for (unsigned i = 0; i + 3 <= num_entries; i += 3)
+	{
+		for (unsigned j = 0; j < 3; ++j)
+		{
+			Buffer* buffer = &buffers[indices[i + j]];
+			buffer->next_desc = (j < 2) ? indices[i + j + 1] : VIRTIO_DESC_INDEX_NONE;
+			buffer->dma_cmd_used = dma_used && j == 0;
+			buffer->indirect_large_table = VIRTIO_DESC_INDEX_NONE;
+		}
+		buffers[indices[i]].completion = { &count_completion, reinterpret_cast<OSObject*>(counter), nullptr };
+		heads.push_back(indices[i]);
+	}
+	return completion_order(heads, random);
+}
+
+struct WalkResult
+{
+	double old_layout_ns;
+	double new_layout_ns;
+};
+
+static WalkResult layout_ns_per_completion(unsigned num_entries, unsigned rounds, bool dma_used)
+{
+	std::vector<OldLayoutVirtioBuffer> old_buffers(num_entries);
+	std::vector<VirtioBuffer> new_buffers(num_entries);
+	std::vector<VirtioBufferDMA> new_dma(num_entries);
+	memset(old_buffers.data(), 0, sizeof(old_buffers[0]) * num_entries);
+	memset(new_buffers.data(), 0, sizeof(new_buffers[0]) * num_entries);
+	memset(new_dma.data(), 0, sizeof(new_dma[0]) * num_entries);
+	std::mt19937 random(num_entries);
+	uint64_t completed = 0;
+	volatile uintptr_t sink = 0;
+	double old_ns = 0.0;
+	double new_ns = 0.0;
+	uint64_t old_completions = 0;
+	uint64_t new_completions = 0;
+	for (unsigned round = 0; round < rounds; ++round)
+	{
+		uint16_t free_head = VIRTIO_DESC_INDEX_NONE;
+		std::vector<uint16_t> used = build_chains(old_buffers.data(), num_entries, dma_used, &completed, random);
+		flush_caches();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		old_completions += walk_chains(old_buffers.data(), used, free_head,
+			[&](uint16_t index) { sink = reinterpret_cast<uintptr_t>(old_buffers[index].dma_cmd) ^ reinterpret_cast<uintptr_t>(old_buffers[index].dma_cmd_2); });
+		old_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+		free_head = VIRTIO_DESC_INDEX_NONE;
+		used = build_chains(new_buffers.data(), num_entries, dma_used, &completed, random);
+		flush_caches();
+		start = std::chrono::steady_clock::now();
+		new_completions += walk_chains(new_buffers.data(), used, free_head,
+			[&](uint16_t index) { sink = reinterpret_cast<uintptr_t>(new_dma[index].dma_cmd) ^ reinterpret_cast<uintptr_t>(new_dma[index].dma_cmd_2); });
+		new_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	}
+	WalkResult result = { old_ns / old_completions, new_ns / new_completions };
+	return result;
+}
+
+int main(int argc, const char* argv[])
+{
+	unsigned rounds = 20;
+	if (argc > 1 && strcmp(argv[1], "--quick") == 0)
+		rounds = 2;
+	else if (argc > 1)
+	{
+		fprintf(stderr, "Usage: %s [--quick]\n", argv[0]);
+		return 2;
+	}
+
+	static const uint16_t queue_sizes[] = { 256, 4096, 32768 };
+	bool ok = true;
+	printf("bookkeeping per descriptor: old layout %zu bytes, now %zu bytes plus %zu bytes of DMA commands\n\n",
+		sizeof(OldLayoutVirtioBuffer), sizeof(VirtioBuffer), sizeof(VirtioBufferDMA));
+	printf("%-8s %-6s %14s %14s\n", "engine", "qsize", "warm ns/compl", "cold ns/compl");
+	for (uint16_t queue_size : queue_sizes)
+	{
+		double warm = engine_ns_per_completion(queue_size, rounds, false);
+		double cold = engine_ns_per_completion(queue_size, rounds, true);
+		printf("%-8s %-6u %14.1f %14.1f\n", "", queue_size, warm, cold);
+		if (warm < 0.0 || cold < 0.0)
+			ok = false;
+	}
+	printf("\n%-8s %-6s %-9s %14s %14s %10s\n", "walk", "qsize", "dma", "before ns", "after ns", "change");
+	for (uint16_t queue_size : queue_sizes)
+	{
+		for (unsigned dma_used = 0; dma_used < 2; ++dma_used)
+		{
+			WalkResult result = layout_ns_per_completion(queue_size, rounds, dma_used != 0);
+			printf("%-8s %-6u %-9s %14.1f %14.1f %9.1f%%\n", "", queue_size, dma_used ? "mapped" : "registered",
+				result.old_layout_ns, result.new_layout_ns, 100.0 * (result.new_layout_ns - result.old_layout_ns) / result.old_layout_ns);
+		}
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,443 @@
+//
+//  HarnessTransport.cpp
+//  virtio-osx harness
+//
+//
+
+#include "HarnessTransport.h"
+#include "VirtioDeviceEmulator.h"
+#include "VirtioPlatform.h"
+
+// Same indirect table slab geometry as VirtioLegacyPCIDevice
+static const unsigned VIRTIO_INDIRECT_SMALL_TABLE_SIZE = 8;
+static const unsigned VIRTIO_INDIRECT_DESCS_PER_LARGE_TABLE = 4;
+
+static inline size_t vring_avail_size(unsigned qsz)
+{
+	// flags, head index, ring, used_event
+	return sizeof(uint16_t) * (3 + qsz);
+}
+
+static inline size_t vring_used_size(unsigned qsz)
+{
+	// flags, head index, ring, avail_event
+	return sizeof(uint16_t) * 3 + sizeof(VirtioVringUsedElement) * qsz;
+}
+
+static void* allocate_zeroed(size_t size, size_t alignment)
+{
+	void* mem = IOMallocAligned(size, alignment);
+	if (mem != nullptr)
+		memset(mem, 0, size);
+	return mem;
+}
+
+HarnessTransport::HarnessTransport() :
+	kicks(0), config(), device(nullptr), pass_action(nullptr), pass_target(nullptr),
+	interrupt_pending(false), stopping(false),
+	coalescing(false), kicks_deferred(0), kick_timer_armed(0), kick_deferred_since(0), kick_timer_pending(false)
+{
+	memset(&this->queue, 0, sizeof(this->queue));
+	memset(&this->packed, 0, sizeof(this->packed));
+}
+
+HarnessTransport::~HarnessTransport()
+{
+	this->stop();
+	this->destroy();
+}
+
+IOReturn HarnessTransport::setup(const HarnessQueueConfig& config)
+{
+	const unsigned num_entries = config.num_entries;
+	this->config = config;
+	this->coalescing = config.kick_max_batch > 1 && config.kick_max_delay_us > 0;
+	VirtioVirtqueue* queue = &this->queue;
+	if (config.packed)
+	{
+		// as in VirtioLegacyPCIDevice::setupPackedVirtqueue(); sizes needn't be powers of 2
+		IOReturn result = virtio_packed_virtqueue_init(&this->packed, num_entries, config.event_index, true);
+		if (result != kIOReturnSuccess)
+			return result;
+		queue->num_entries = num_entries;
+		queue->batch_depth = 0;
+		return kIOReturnSuccess;
+	}
+	if (num_entries == 0 || (num_entries & (num_entries - 1u)) != 0 || num_entries > VIRTIO_MAX_QUEUE_SIZE)
+		return kIOReturnBadArgument;
+
+	queue->num_entries = num_entries;
+	// alignment requirements from section 2.4 of the virtio 1.0 spec
+	queue->descriptor_table = static_cast<VirtioVringDesc*>(allocate_zeroed(sizeof(VirtioVringDesc) * num_entries, 16));
+	queue->available_ring = static_cast<VirtioVringAvail*>(allocate_zeroed(vring_avail_size(num_entries), 2));
+	queue->used_ring = static_cast<VirtioVringUsed*>(allocate_zeroed(vring_used_size(num_entries), 4));
+	queue->descriptor_buffers = static_cast<VirtioBuffer*>(allocate_zeroed(sizeof(VirtioBuffer) * num_entries, alignof(VirtioBuffer)));
+	queue->descriptor_dma = static_cast<VirtioBufferDMA*>(allocate_zeroed(sizeof(VirtioBufferDMA) * num_entries, alignof(VirtioBufferDMA)));
+	queue->available_ring_ready = static_cast<volatile uint16_t*>(allocate_zeroed(sizeof(uint16_t) * num_entries, alignof(uint16_t)));
+	if (queue->descriptor_table == nullptr || queue->available_ring == nullptr || queue->used_ring == nullptr
+		|| queue->descriptor_buffers == nullptr || queue->descriptor_dma == nullptr || queue->available_ring_ready == nullptr)
+	{
+		this->destroy();
+		return kIOReturnNoMemory;
+	}
+	queue->used_ring_interrupt_index = &queue->available_ring->ring[num_entries];
+	queue->avail_ring_notify_index = reinterpret_cast<uint16_t*>(&queue->used_ring->ring[num_entries]);
+
+	queue->indirect_descriptors = config.indirect_desc_per_request > 0;
+	if (queue->indirect_descriptors)
+	{
+		unsigned small_table_size = config.indirect_desc_per_request;
+		unsigned large_table_size = 0;
+		unsigned num_large_tables = 0;
+		if (small_table_size > VIRTIO_INDIRECT_SMALL_TABLE_SIZE)
+		{
+			small_table_size = VIRTIO_INDIRECT_SMALL_TABLE_SIZE;
+			large_table_size = config.indirect_desc_per_request;
+			num_large_tables = num_entries / VIRTIO_INDIRECT_DESCS_PER_LARGE_TABLE;
+			if (num_large_tables == 0)
+				num_large_tables = 1;
+		}
+		const size_t slab_size = sizeof(VirtioVringDesc)
+			* (static_cast<size_t>(small_table_size) * num_entries + static_cast<size_t>(large_table_size) * num_large_tables);
+		queue->indirect_tables = static_cast<VirtioVringDesc*>(allocate_zeroed(slab_size, 4096));
+		if (queue->indirect_tables == nullptr)
+		{
+			this->destroy();
+			return kIOReturnNoMemory;
+		}
+		if (num_large_tables > 0)
+		{
+			queue->indirect_large_next = static_cast<uint16_t*>(IOMalloc(sizeof(uint16_t) * num_large_tables));
+			if (queue->indirect_large_next == nullptr)
+			{
+				this->destroy();
+				return kIOReturnNoMemory;
+			}
+		}
+		for (unsigned i = 0; i < num_large_tables; ++i)
+		{
+			queue->indirect_large_next[i] = (i + 1 < num_large_tables) ? i + 1 : VIRTIO_DESC_INDEX_NONE;
+		}
+		queue->indirect_large_free_head = (num_large_tables > 0) ? 0 : VIRTIO_DESC_INDEX_NONE;
+		queue->indirect_num_large_tables = num_large_tables;
+		queue->indirect_small_table_size = small_table_size;
+		queue->indirect_large_table_size = large_table_size;
+		queue->indirect_tables_phys = reinterpret_cast<uintptr_t>(queue->indirect_tables);
+	}
+
+	queue->used_ring_last_head_index = queue->used_ring->head_index;
+	virtio_virtqueue_init_available_slots(queue);
+	queue->batch_depth = 0;
+	queue->event_index = config.event_index;
+	queue->in_order = config.in_order;
+	queue->interrupts_requested = true;
+	virtio_virtqueue_enable_interrupts(queue);
+
+	queue->free_list_head = 0;
+	queue->first_unused_descriptor_index = 0;
+	for (unsigned i = 0; i < num_entries; ++i)
+	{
+		queue->descriptor_buffers[i].next_desc = (i + 1 < num_entries) ? i + 1 : VIRTIO_DESC_INDEX_NONE;
+		queue->descriptor_buffers[i].indirect_large_table = VIRTIO_DESC_INDEX_NONE;
+	}
+	queue->num_unused_descriptors = num_entries;
+	return kIOReturnSuccess;
+}
+
+void HarnessTransport::destroy()
+{
+	if (this->config.packed)
+	{
+		virtio_packed_virtqueue_destroy(&this->packed);
+		memset(&this->queue, 0, sizeof(this->queue));
+		return;
+	}
+	VirtioVirtqueue* queue = &this->queue;
+	IOFreeAligned(queue->descriptor_table, 0);
+	IOFreeAligned(queue->available_ring, 0);
+	IOFreeAligned(queue->used_ring, 0);
+	IOFreeAligned(queue->descriptor_buffers, 0);
+	IOFreeAligned(queue->descriptor_dma, 0);
+	IOFreeAligned(const_cast<uint16_t*>(queue->available_ring_ready), 0);
+	IOFreeAligned(queue->indirect_tables, 0);
+	IOFree(queue->indirect_large_next, 0);
+	memset(queue, 0, sizeof(*queue));
+}
+
+VirtioDeviceEmulator* HarnessTransport::createDevice(unsigned used_batch)
+{
+	if (this->config.packed)
+		return new VirtioDeviceEmulator(&this->packed, this->config.event_index, used_batch);
+	return new VirtioDeviceEmulator(&this->queue, this->config.event_index, this->config.in_order, used_batch);
+}
+
+void HarnessTransport::start(VirtioDeviceEmulator* device)
+{
+	this->device = device;
+	this->stopping = false;
+	this->completion_thread = std::thread(&HarnessTransport::completionThread, this);
+	if (this->coalescing)
+		this->kick_timer_thread = std::thread(&HarnessTransport::kickTimerThread, this);
+}
+
+void HarnessTransport::stop()
+{
+	if (!this->completion_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(this->interrupt_mutex);
+		this->stopping = true;
+	}
+	this->interrupt_signal.notify_one();
+	this->completion_thread.join();
+	if (this->kick_timer_thread.joinable())
+	{
+		this->kick_timer_signal.notify_one();
+		this->kick_timer_thread.join();
+	}
+	// don't leave the device waiting for anything deferred so far
+	this->flushDeferredKicks();
+	this->device = nullptr;
+}
+
+IOReturn HarnessTransport::submit(const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion)
+{
+	IOReturn result = this->config.packed
+		? virtio_packed_virtqueue_add_segments(&this->packed, readable_segments, num_readable_segments, writable_segments, num_writable_segments, completion)
+		: virtio_virtqueue_add_segments(&this->queue, readable_segments, num_readable_segments, writable_segments, num_writable_segments, completion);
+	if (result != kIOReturnSuccess)
+		return result;
+	this->publish();
+	return kIOReturnSuccess;
+}
+
+IOReturn HarnessTransport::submitMapped(IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion)
+{
+	if (!this->config.packed)
+		return kIOReturnUnsupported;
+	IOReturn result = virtio_packed_virtqueue_submit(&this->packed, device_readable_buf, device_writable_buf, completion);
+	if (result != kIOReturnSuccess)
+		return result;
+	this->publish();
+	return kIOReturnSuccess;
+}
+
+void HarnessTransport::publish()
+{
+	if (this->queue.batch_depth != 0)
+		return;
+	bool notify = this->config.packed
+		? virtio_packed_virtqueue_publish(&this->packed)
+		: virtio_virtqueue_publish_available(&this->queue);
+	if (notify)
+	{
+		this->kick();
+	}
+}
+
+void HarnessTransport::beginBatch()
+{
+	virtio_atomic_increment32(&this->queue.batch_depth);
+}
+
+void HarnessTransport::commitBatch()
+{
+	// whoever closes the outermost batch publishes everything submitted during it
+	SInt32 old_depth = virtio_atomic_decrement32(&this->queue.batch_depth);
+	if (old_depth != 1)
+		return;
+	bool notify = this->config.packed
+		? virtio_packed_virtqueue_publish(&this->packed)
+		: virtio_virtqueue_publish_available(&this->queue);
+	if (notify)
+	{
+		this->kick();
+	}
+}
+
+void HarnessTransport::notifyDevice()
+{
+	this->kicks.fetch_add(1, std::memory_order_relaxed);
+	if (this->device == nullptr)
+		return;
+	if (this->config.notification_data)
+	{
+		// what VirtioLegacyPCIDevice passes to notifyVirtqueue()
+		if (this->config.packed)
+			this->device->notify(virtio_packed_virtqueue_next_offset_wrap(&this->packed));
+		else
+			this->device->notify(this->queue.available_ring->head_index);
+	}
+	else
+	{
+		this->device->notify();
+	}
+}
+
+static uint64_t steady_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void HarnessTransport::kick()
+{
+	if (!this->coalescing)
+	{
+		this->notifyDevice();
+		__atomic_fetch_add(&this->queue.stats.notifications, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	// record the start of the batch before owing the kick, so a flush that sees the kick sees a time too
+	uint64_t unset = 0;
+	if (this->kick_deferred_since == 0)
+		this->kick_deferred_since.compare_exchange_strong(unset, steady_now_ns());
+	int32_t owed = this->kicks_deferred.fetch_add(1) + 1;
+	uint32_t disarmed = 0;
+	if (owed >= static_cast<int32_t>(this->config.kick_max_batch))
+	{
+		this->flushDeferredKicks();
+	}
+	else if (this->kick_timer_armed.compare_exchange_strong(disarmed, 1))
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->kick_timer_mutex);
+			this->kick_timer_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(this->config.kick_max_delay_us);
+			this->kick_timer_pending = true;
+		}
+		this->kick_timer_signal.notify_one();
+	}
+}
+
+/// Sends one notification on behalf of all deferred ones, if any are owed.
+void HarnessTransport::flushDeferredKicks()
+{
+	int32_t owed = this->kicks_deferred.load();
+	do
+	{
+		if (owed <= 0)
+			return;
+	} while (!this->kicks_deferred.compare_exchange_weak(owed, 0));
+	uint64_t deferred_since = this->kick_deferred_since.exchange(0);
+
+	this->notifyDevice();
+
+	uint64_t now = steady_now_ns();
+	uint64_t latency_ns = (deferred_since != 0 && now > deferred_since) ? now - deferred_since : 0;
+	VirtioVirtqueueStatistics* stats = &this->queue.stats;
+	__atomic_fetch_add(&stats->notifications, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->notifications_coalesced, owed - 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->deferred_kicks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->deferred_kick_latency_total_ns, latency_ns, __ATOMIC_RELAXED);
+	uint64_t max_latency = __atomic_load_n(&stats->deferred_kick_latency_max_ns, __ATOMIC_RELAXED);
+	while (latency_ns > max_latency
+		&& !__atomic_compare_exchange_n(&stats->deferred_kick_latency_max_ns, &max_latency, latency_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+/// Stands in for the queue's IOTimerEventSource and VirtioLegacyPCIDevice::kickTimerAction().
+void HarnessTransport::kickTimerThread()
+{
+	std::unique_lock<std::mutex> lock(this->kick_timer_mutex);
+	while (true)
+	{
+		this->kick_timer_signal.wait(lock, [this] { return this->kick_timer_pending || this->stopping; });
+		if (this->stopping)
+			return;
+		if (this->kick_timer_signal.wait_until(lock, this->kick_timer_deadline, [this] { return this->stopping; }))
+			return;
+		this->kick_timer_pending = false;
+		lock.unlock();
+		// disarm first, so a kick racing with the flush arms a new timeout
+		uint32_t armed = 1;
+		this->kick_timer_armed.compare_exchange_strong(armed, 0);
+		this->flushDeferredKicks();
+		lock.lock();
+	}
+}
+
+unsigned HarnessTransport::pollCompleted(unsigned completion_limit)
+{
+	// anything resubmitted by completion actions is published in one go
+	this->beginBatch();
+	unsigned handled = this->config.packed
+		? virtio_packed_virtqueue_process_completed(&this->packed, completion_limit)
+		: virtio_virtqueue_process_completed(&this->queue, completion_limit);
+	this->commitBatch();
+	this->queue.stats.completions += handled;
+	if (handled > 0 && this->pass_action != nullptr)
+	{
+		this->pass_action(this->pass_target);
+	}
+	return handled;
+}
+
+void HarnessTransport::setCompletionPassAction(CompletionPassAction action, void* target)
+{
+	this->pass_target = target;
+	this->pass_action = action;
+}
+
+void HarnessTransport::interruptFilter(void* me)
+{
+	HarnessTransport* transport = static_cast<HarnessTransport*>(me);
+	if (transport->config.packed)
+		virtio_packed_virtqueue_disable_interrupts(&transport->packed);
+	else
+		virtio_virtqueue_disable_interrupts(&transport->queue);
+	++transport->queue.stats.interrupts;
+	{
+		std::lock_guard<std::mutex> lock(transport->interrupt_mutex);
+		transport->interrupt_pending = true;
+	}
+	transport->interrupt_signal.notify_one();
+}
+
+/// Same policy as VirtioLegacyPCIDevice::pollVirtqueueForInterrupt(): true while the budget keeps getting used up.
+bool HarnessTransport::pollForInterrupt()
+{
+	VirtioVirtqueue* queue = &this->queue;
+	queue->stats.polls++;
+	unsigned handled = this->pollCompleted(this->config.interrupt_poll_budget);
+	if (handled < this->config.interrupt_poll_budget)
+		return false;
+
+	if (!this->hasCompleted())
+	{
+		// exactly used up the budget; re-arm as if we'd run dry
+		if (this->config.packed)
+			virtio_packed_virtqueue_rearm_interrupts(&this->packed);
+		else if (queue->interrupts_requested)
+			virtio_virtqueue_enable_interrupts(queue);
+		virtio_memory_barrier();
+		if (!this->hasCompleted())
+			return false;
+	}
+	queue->stats.budget_exhausted++;
+	return true;
+}
+
+bool HarnessTransport::hasCompleted()
+{
+	if (this->config.packed)
+		return virtio_packed_virtqueue_has_completed(&this->packed);
+	return this->queue.used_ring->head_index != this->queue.used_ring_last_head_index;
+}
+
+void HarnessTransport::completionThread()
+{
+	std::unique_lock<std::mutex> lock(this->interrupt_mutex);
+	while (true)
+	{
+		this->interrupt_signal.wait(lock, [this] { return this->interrupt_pending || this->stopping; });
+		if (this->stopping)
+			return;
+		this->interrupt_pending = false;
+		lock.unlock();
+		while (this->pollForInterrupt())
+		{
+		}
+		lock.lock();
+	}
+}
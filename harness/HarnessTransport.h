@@ -0,0 +1,117 @@
+//
+//  HarnessTransport.h
+//  virtio-osx harness
+//
+//
+
+#ifndef __virtio_osx__HarnessTransport__
+#define __virtio_osx__HarnessTransport__
+
+#include "VirtioSplitVirtqueue.h"
+#include "VirtioPackedVirtqueue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class VirtioDeviceEmulator;
+
+struct HarnessQueueConfig
+{
+	uint16_t num_entries;
+	/// VIRTIO_F_RING_EVENT_IDX negotiated
+	bool event_index;
+	/// VIRTIO_F_IN_ORDER negotiated; submissions must then be serialised
+	bool in_order;
+	/// Descriptors per request to size indirect tables for; 0 for direct descriptor chains
+	unsigned indirect_desc_per_request;
+	/// Completions handled per interrupt-driven pass before polling again
+	unsigned interrupt_poll_budget;
+	/// VIRTIO_F_RING_PACKED negotiated: packed ring, no indirect descriptors or in-order retiring
+	bool packed;
+	/// VIRTIO_F_NOTIFICATION_DATA negotiated: kicks carry the published avail position
+	bool notification_data;
+	/// Kick coalescing as set with VirtioDevice::setVirtqueueKickCoalescing(); off unless both are set and max_batch > 1
+	unsigned kick_max_batch;
+	uint32_t kick_max_delay_us;
+};
+
+/// Driver side of one virtqueue, set up and driven the way VirtioLegacyPCIDevice does it.
+/** The rings live in ordinary memory shared with a VirtioDeviceEmulator.
+ * Interrupts arrive on the device's thread, where interruptFilter() masks
+ * the queue like the kext's primary interrupt filter; completions then run
+ * on the transport's completion thread, which stands in for the work loop. */
+class HarnessTransport
+{
+public:
+	typedef void(*CompletionPassAction)(void* target);
+
+	HarnessTransport();
+	~HarnessTransport();
+
+	IOReturn setup(const HarnessQueueConfig& config);
+	/// A device emulator for the queue set up, split or packed; the caller deletes it.
+	VirtioDeviceEmulator* createDevice(unsigned used_batch);
+	/// Starts handling the device's interrupts on the completion thread.
+	void start(VirtioDeviceEmulator* device);
+	void stop();
+
+	/// Like VirtioDevice::submitRegisteredBuffersToVirtqueue(); safe to call from several threads at once.
+	IOReturn submit(const VirtioRegisteredSegment* readable_segments, unsigned num_readable_segments, const VirtioRegisteredSegment* writable_segments, unsigned num_writable_segments, VirtioCompletion completion);
+	/// Like VirtioDevice::submitBuffersToVirtqueue(); packed queues only, the split ring's mapping path lives in the PCI transport.
+	IOReturn submitMapped(IOMemoryDescriptor* device_readable_buf, IOMemoryDescriptor* device_writable_buf, VirtioCompletion completion);
+	void beginBatch();
+	void commitBatch();
+	/// Runs completion actions on the calling thread, at most completion_limit of them if non-zero.
+	unsigned pollCompleted(unsigned completion_limit = 0);
+	/// Runs after every completion pass that completed anything, on the same thread.
+	void setCompletionPassAction(CompletionPassAction action, void* target);
+
+	/// The device's interrupt line; called on the device's thread.
+	static void interruptFilter(void* me);
+
+	/// Split ring state; for packed queues, only the size, batch depth and statistics
+	VirtioVirtqueue queue;
+	VirtioPackedVirtqueue packed;
+	/// Notifications sent to the device
+	std::atomic<uint64_t> kicks;
+
+private:
+	/// Like VirtioLegacyPCIDevice::kickVirtqueue(): notifies the device now, or defers it when coalescing
+	void kick();
+	void notifyDevice();
+	void flushDeferredKicks();
+	void kickTimerThread();
+	/// Publishes unless a batch is open, and kicks if the device wants to know
+	void publish();
+	bool hasCompleted();
+	void completionThread();
+	bool pollForInterrupt();
+	void destroy();
+
+	HarnessQueueConfig config;
+	VirtioDeviceEmulator* device;
+	CompletionPassAction pass_action;
+	void* pass_target;
+
+	std::thread completion_thread;
+	std::mutex interrupt_mutex;
+	std::condition_variable interrupt_signal;
+	bool interrupt_pending;
+	bool stopping;
+
+	/// Kick coalescing, mirroring VirtioLegacyPCIVirtqueue; the timer thread stands in for the IOTimerEventSource
+	bool coalescing;
+	std::atomic<int32_t> kicks_deferred;
+	std::atomic<uint32_t> kick_timer_armed;
+	/// Nanoseconds since the steady clock's epoch when the oldest owed kick was deferred; 0 if not yet recorded
+	std::atomic<uint64_t> kick_deferred_since;
+	std::thread kick_timer_thread;
+	std::mutex kick_timer_mutex;
+	std::condition_variable kick_timer_signal;
+	std::chrono::steady_clock::time_point kick_timer_deadline;
+	bool kick_timer_pending;
+};
+
+#endif /* defined(__virtio_osx__HarnessTransport__) */
@@ -0,0 +1,607 @@
+//
+//  VirtioDeviceEmulator.cpp
+//  virtio-osx harness
+//
+//
+
+#include "VirtioDeviceEmulator.h"
+#include "VirtioSplitVirtqueue.h"
+#include "VirtioPlatform.h"
+#include "../virtio-net/virtio_ring.h"
+
+/// Ring memory is shared with the driver, which may change it at any time.
+static inline uint16_t read_shared16(const uint16_t* address)
+{
+	return *static_cast<const volatile uint16_t*>(address);
+}
+
+static inline void write_shared16(uint16_t* address, uint16_t value)
+{
+	*static_cast<volatile uint16_t*>(address) = value;
+}
+
+static const uint16_t PACKED_WRAP_BIT = (1u << 15u);
+
+static inline uint8_t* phys_to_virt(uint64_t phys_address)
+{
+	return reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(phys_address));
+}
+
+VirtioDeviceEmulator::VirtioDeviceEmulator(VirtioVirtqueue* queue, bool event_index, bool in_order, unsigned used_batch) :
+	notifications(0), interrupts(0), chains_used(0), kick_to_consume_ns(0), kick_to_consume_samples(0), errors(0),
+	queue(queue), packed(nullptr), event_index(event_index), in_order(in_order), used_batch(used_batch > 0 ? used_batch : 1),
+	interrupt_action(nullptr), interrupt_target(nullptr),
+	last_avail_index(0), used_index(0), avail_wrap_counter(true), used_wrap_counter(true), in_use(queue->num_entries, false),
+	doorbell(false), notified(false), notified_avail(0), pass_notified(false), pass_notified_avail(0), pass_timed(false), stopping(false)
+{
+	this->first_error[0] = '\0';
+	// the driver has only just set up the queue, so nothing has been made available or used yet
+	this->last_avail_index = read_shared16(&queue->available_ring->head_index);
+	this->used_index = read_shared16(&queue->used_ring->head_index);
+}
+
+VirtioDeviceEmulator::VirtioDeviceEmulator(VirtioPackedVirtqueue* queue, bool event_index, unsigned used_batch) :
+	notifications(0), interrupts(0), chains_used(0), kick_to_consume_ns(0), kick_to_consume_samples(0), errors(0),
+	queue(nullptr), packed(queue), event_index(event_index), in_order(false), used_batch(used_batch > 0 ? used_batch : 1),
+	interrupt_action(nullptr), interrupt_target(nullptr),
+	last_avail_index(0), used_index(0), avail_wrap_counter(true), used_wrap_counter(true), in_use(queue->num_entries, false),
+	doorbell(false), notified(false), notified_avail(0), pass_notified(false), pass_notified_avail(0), pass_timed(false), stopping(false)
+{
+	this->first_error[0] = '\0';
+	// both of the device's wrap counters start at 1, like the driver's
+	if (event_index)
+	{
+		write_shared16(&queue->device_event->offset_wrap, PACKED_WRAP_BIT);
+		virtio_memory_barrier();
+		write_shared16(&queue->device_event->flags, VirtioVringPackedEventFlag::DESC);
+	}
+}
+
+VirtioDeviceEmulator::~VirtioDeviceEmulator()
+{
+	this->stop();
+}
+
+void VirtioDeviceEmulator::start(InterruptAction interrupt_action, void* interrupt_target)
+{
+	this->interrupt_action = interrupt_action;
+	this->interrupt_target = interrupt_target;
+	this->stopping = false;
+	this->thread = std::thread(&VirtioDeviceEmulator::run, this);
+}
+
+void VirtioDeviceEmulator::stop()
+{
+	if (!this->thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->doorbell_signal.notify_one();
+	this->thread.join();
+}
+
+void VirtioDeviceEmulator::notify()
+{
+	this->notifications.fetch_add(1, std::memory_order_relaxed);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (!this->doorbell)
+			this->doorbell_time = now;
+		this->doorbell = true;
+	}
+	this->doorbell_signal.notify_one();
+}
+
+void VirtioDeviceEmulator::notify(uint16_t next_avail)
+{
+	this->notifications.fetch_add(1, std::memory_order_relaxed);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (!this->doorbell)
+			this->doorbell_time = now;
+		this->doorbell = true;
+		// doorbells from different submitters may land out of order; takeNotifiedAvailable() drops stale ones
+		this->notified = true;
+		this->notified_avail = next_avail;
+	}
+	this->doorbell_signal.notify_one();
+}
+
+unsigned VirtioDeviceEmulator::takeNotifiedAvailable()
+{
+	if (!this->pass_notified)
+		return 0;
+	this->pass_notified = false;
+	unsigned num_entries;
+	unsigned distance;
+	if (this->packed != nullptr)
+	{
+		num_entries = this->packed->num_entries;
+		uint16_t slot = this->pass_notified_avail & ~PACKED_WRAP_BIT;
+		bool wrap_counter = (this->pass_notified_avail & PACKED_WRAP_BIT) != 0;
+		if (slot >= num_entries)
+			return 0;
+		if (wrap_counter == this->avail_wrap_counter)
+			distance = (slot >= this->last_avail_index) ? slot - this->last_avail_index : num_entries + 1;
+		else
+			distance = (slot < this->last_avail_index) ? slot + num_entries - this->last_avail_index : num_entries + 1;
+	}
+	else
+	{
+		num_entries = this->queue->num_entries;
+		distance = static_cast<uint16_t>(this->pass_notified_avail - this->last_avail_index);
+	}
+	// anything further than a ring's worth ahead is a doorbell that's been overtaken
+	return distance <= num_entries ? distance : 0;
+}
+
+void VirtioDeviceEmulator::recordKickToConsume()
+{
+	if (!this->pass_timed)
+		return;
+	this->pass_timed = false;
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - this->pass_doorbell_time;
+	this->kick_to_consume_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+	this->kick_to_consume_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void VirtioDeviceEmulator::processPending()
+{
+	if (this->packed != nullptr)
+		this->processPackedAvailable();
+	else
+		this->processAvailable();
+}
+
+void VirtioDeviceEmulator::reportError(const char* format, ...)
+{
+	if (this->errors.fetch_add(1) == 0)
+	{
+		va_list args;
+		va_start(args, format);
+		vsnprintf(this->first_error, sizeof(this->first_error), format, args);
+		va_end(args);
+	}
+}
+
+void VirtioDeviceEmulator::run()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (true)
+	{
+		this->doorbell_signal.wait(lock, [this] { return this->doorbell || this->stopping; });
+		if (this->stopping)
+			return;
+		this->doorbell = false;
+		this->pass_notified = this->notified;
+		this->pass_notified_avail = this->notified_avail;
+		this->notified = false;
+		this->pass_timed = true;
+		this->pass_doorbell_time = this->doorbell_time;
+		lock.unlock();
+		this->processPending();
+		this->pass_timed = false;
+		lock.lock();
+	}
+}
+
+/// While busy, the device asks not to be notified; the driver sees that through avail_event or NO_NOTIFY.
+void VirtioDeviceEmulator::setNotificationsSuppressed(bool suppressed)
+{
+	if (this->event_index)
+	{
+		// Left where it was while busy, so only the first request published
+		// after going idle notifies.
+		if (!suppressed)
+			write_shared16(this->queue->avail_ring_notify_index, this->last_avail_index);
+	}
+	else
+	{
+		write_shared16(&this->queue->used_ring->flags, suppressed ? VirtioVringUsedFlag::NO_NOTIFY : 0);
+	}
+}
+
+void VirtioDeviceEmulator::processAvailable()
+{
+	VirtioVirtqueue* queue = this->queue;
+	this->setNotificationsSuppressed(true);
+	unsigned notified_available = this->takeNotifiedAvailable();
+	while (true)
+	{
+		uint16_t avail_head;
+		if (notified_available != 0)
+		{
+			// the doorbell said how far to go, and was written after the ring entries it covers
+			avail_head = this->last_avail_index + notified_available;
+			notified_available = 0;
+		}
+		else
+		{
+			avail_head = read_shared16(&queue->available_ring->head_index);
+			// ring entries must be read after the head index that covers them
+			virtio_memory_barrier();
+		}
+		while (this->last_avail_index != avail_head)
+		{
+			uint16_t slot = virtio_virtqueue_wrap(queue, this->last_avail_index);
+			uint16_t head = read_shared16(&queue->available_ring->ring[slot]);
+			++this->last_avail_index;
+			this->recordKickToConsume();
+			this->consumeChain(head);
+			if (this->pending_heads.size() >= this->used_batch)
+				this->flushUsed();
+		}
+		this->flushUsed();
+
+		// about to go idle: ask for notifications again, then pick up anything that raced with that
+		this->setNotificationsSuppressed(false);
+		virtio_memory_barrier();
+		if (read_shared16(&queue->available_ring->head_index) == this->last_avail_index)
+			return;
+		this->setNotificationsSuppressed(true);
+	}
+}
+
+void VirtioDeviceEmulator::consumeChain(uint16_t head)
+{
+	VirtioVirtqueue* queue = this->queue;
+	const unsigned num_entries = queue->num_entries;
+	if (head >= num_entries)
+	{
+		this->reportError("avail ring entry %u names descriptor %u of %u\n", static_cast<uint16_t>(this->last_avail_index - 1u), head, num_entries);
+		return;
+	}
+
+	VirtioVringDesc* table = queue->descriptor_table;
+	unsigned table_size = num_entries;
+	uint16_t index = head;
+	bool indirect = (table[head].flags & VirtioVringDescFlag::INDIRECT) != 0;
+	if (indirect)
+	{
+		const VirtioVringDesc* indirect_desc = &table[head];
+		if ((indirect_desc->flags & VirtioVringDescFlag::NEXT) != 0
+			|| indirect_desc->length_bytes == 0 || indirect_desc->length_bytes % sizeof(VirtioVringDesc) != 0)
+		{
+			this->reportError("descriptor %u: malformed indirect descriptor (flags 0x%x, length %u)\n", head, indirect_desc->flags, indirect_desc->length_bytes);
+			return;
+		}
+		if (this->in_use[head])
+			this->reportError("descriptor %u made available while the device still owns it\n", head);
+		this->in_use[head] = true;
+		this->pending_descriptors.push_back(head);
+		table = reinterpret_cast<VirtioVringDesc*>(phys_to_virt(indirect_desc->phys_address));
+		table_size = indirect_desc->length_bytes / sizeof(VirtioVringDesc);
+		index = 0;
+	}
+
+	uint8_t* first_readable = nullptr;
+	uint32_t first_readable_length = 0;
+	uint8_t* first_writable = nullptr;
+	uint32_t first_writable_length = 0;
+	uint32_t written = 0;
+	bool seen_writable = false;
+	unsigned num_descs = 0;
+	while (true)
+	{
+		if (index >= table_size || ++num_descs > table_size)
+		{
+			this->reportError("chain from descriptor %u runs off its table or loops\n", head);
+			break;
+		}
+		const VirtioVringDesc* desc = &table[index];
+		if (!indirect)
+		{
+			if (this->in_use[index])
+				this->reportError("descriptor %u made available while the device still owns it\n", index);
+			this->in_use[index] = true;
+			this->pending_descriptors.push_back(index);
+		}
+		else if ((desc->flags & VirtioVringDescFlag::INDIRECT) != 0)
+		{
+			this->reportError("nested indirect table in chain from descriptor %u\n", head);
+		}
+
+		if ((desc->flags & VirtioVringDescFlag::DEVICE_WRITABLE) != 0)
+		{
+			if (first_writable == nullptr)
+			{
+				first_writable = phys_to_virt(desc->phys_address);
+				first_writable_length = desc->length_bytes;
+			}
+			written += desc->length_bytes;
+			seen_writable = true;
+		}
+		else if (seen_writable)
+		{
+			this->reportError("chain from descriptor %u has a device readable buffer after a writable one\n", head);
+		}
+		else if (first_readable == nullptr)
+		{
+			first_readable = phys_to_virt(desc->phys_address);
+			first_readable_length = desc->length_bytes;
+		}
+
+		if ((desc->flags & VirtioVringDescFlag::NEXT) == 0)
+			break;
+		index = desc->next;
+	}
+
+	if (first_readable != nullptr && first_writable != nullptr)
+	{
+		uint32_t echo_length = 8;
+		if (first_readable_length < echo_length)
+			echo_length = first_readable_length;
+		if (first_writable_length < echo_length)
+			echo_length = first_writable_length;
+		memcpy(first_writable, first_readable, echo_length);
+	}
+	this->pending_heads.push_back(head);
+	this->pending_written.push_back(written);
+}
+
+/// Returns the pending chains to the driver and raises an interrupt unless it's suppressed.
+void VirtioDeviceEmulator::flushUsed()
+{
+	if (this->pending_heads.empty())
+		return;
+	VirtioVirtqueue* queue = this->queue;
+	VirtioVringUsed* used_ring = queue->used_ring;
+	const uint16_t old_used_index = this->used_index;
+	size_t first = this->in_order ? this->pending_heads.size() - 1 : 0;
+	for (size_t i = first; i < this->pending_heads.size(); ++i)
+	{
+		VirtioVringUsedElement* element = &used_ring->ring[virtio_virtqueue_wrap(queue, this->used_index)];
+		element->descriptor_id = this->pending_heads[i];
+		element->written_bytes = this->pending_written[i];
+		++this->used_index;
+	}
+	// the driver may reuse the descriptors as soon as it sees the new used index
+	for (uint16_t index : this->pending_descriptors)
+	{
+		this->in_use[index] = false;
+	}
+	this->chains_used.fetch_add(this->pending_heads.size(), std::memory_order_relaxed);
+	this->pending_heads.clear();
+	this->pending_written.clear();
+	this->pending_descriptors.clear();
+
+	virtio_memory_barrier();
+	write_shared16(&used_ring->head_index, this->used_index);
+	// used_event/NO_INTERRUPT must be read after the new used index is visible
+	virtio_memory_barrier();
+
+	bool interrupt;
+	if (this->event_index)
+		interrupt = vring_need_event(read_shared16(queue->used_ring_interrupt_index), this->used_index, old_used_index);
+	else
+		interrupt = (read_shared16(&queue->available_ring->flags) & VirtioVringAvailFlag::NO_INTERRUPT) == 0;
+	if (interrupt)
+	{
+		this->interrupts.fetch_add(1, std::memory_order_relaxed);
+		if (this->interrupt_action != nullptr)
+			this->interrupt_action(this->interrupt_target);
+	}
+}
+
+/// Packed ring counterpart of setNotificationsSuppressed(), through the device event area.
+void VirtioDeviceEmulator::setPackedNotificationsSuppressed(bool suppressed)
+{
+	VirtioVringPackedEvent* device_event = this->packed->device_event;
+	if (this->event_index)
+	{
+		// as for split rings, the event slot is only moved on going idle
+		if (!suppressed)
+		{
+			write_shared16(&device_event->offset_wrap, this->last_avail_index | (this->avail_wrap_counter ? PACKED_WRAP_BIT : 0));
+			virtio_memory_barrier();
+			write_shared16(&device_event->flags, VirtioVringPackedEventFlag::DESC);
+		}
+	}
+	else
+	{
+		write_shared16(&device_event->flags, suppressed ? VirtioVringPackedEventFlag::DISABLE : VirtioVringPackedEventFlag::ENABLE);
+	}
+}
+
+/// Whether the driver has made the descriptor in the given slot available on the device's current lap.
+bool VirtioDeviceEmulator::packedDescIsAvailable(uint16_t index)
+{
+	uint16_t flags = read_shared16(&this->packed->descriptor_ring[index].flags);
+	bool avail = (flags & VirtioVringPackedDescFlag::AVAIL) != 0;
+	bool used = (flags & VirtioVringPackedDescFlag::USED) != 0;
+	return avail == this->avail_wrap_counter && used != this->avail_wrap_counter;
+}
+
+void VirtioDeviceEmulator::processPackedAvailable()
+{
+	this->setPackedNotificationsSuppressed(true);
+	// A packed ring device reads each descriptor's flags along with the rest
+	// of it anyway, so notification data only tells it how much to expect.
+	unsigned notified_available = this->takeNotifiedAvailable();
+	while (true)
+	{
+		while (this->packedDescIsAvailable(this->last_avail_index))
+		{
+			// the rest of the descriptor must be read after its flags
+			virtio_memory_barrier();
+			this->recordKickToConsume();
+			uint16_t start = this->last_avail_index;
+			this->consumePackedChain();
+			unsigned consumed = (this->last_avail_index + this->packed->num_entries - start) % this->packed->num_entries;
+			if (consumed == 0)
+				consumed = this->packed->num_entries;
+			notified_available = consumed < notified_available ? notified_available - consumed : 0;
+			if (this->pending_heads.size() >= this->used_batch)
+				this->flushPackedUsed();
+		}
+		this->flushPackedUsed();
+		if (notified_available != 0)
+		{
+			this->reportError("doorbell announced %u more slots than were available\n", notified_available);
+			notified_available = 0;
+		}
+
+		this->setPackedNotificationsSuppressed(false);
+		virtio_memory_barrier();
+		if (!this->packedDescIsAvailable(this->last_avail_index))
+			return;
+		this->setPackedNotificationsSuppressed(true);
+	}
+}
+
+void VirtioDeviceEmulator::consumePackedChain()
+{
+	VirtioPackedVirtqueue* queue = this->packed;
+	const unsigned num_entries = queue->num_entries;
+	const uint16_t head = this->last_avail_index;
+	const uint16_t buffer_id = queue->descriptor_ring[head].buffer_id;
+	if (buffer_id >= num_entries)
+	{
+		this->reportError("slot %u: buffer ID %u of %u\n", head, buffer_id, num_entries);
+	}
+	else
+	{
+		if (this->in_use[buffer_id])
+			this->reportError("slot %u: buffer ID %u made available while the device still owns it\n", head, buffer_id);
+		this->in_use[buffer_id] = true;
+	}
+
+	uint8_t* first_readable = nullptr;
+	uint32_t first_readable_length = 0;
+	uint8_t* first_writable = nullptr;
+	uint32_t first_writable_length = 0;
+	uint32_t written = 0;
+	bool seen_writable = false;
+	uint16_t chain_length = 0;
+	while (true)
+	{
+		uint16_t index = this->last_avail_index;
+		const VirtioVringPackedDesc* desc = &queue->descriptor_ring[index];
+		// the head was checked by the caller; the rest of the chain must have been made available with it
+		if (chain_length > 0 && !this->packedDescIsAvailable(index))
+		{
+			this->reportError("chain from slot %u continues into slot %u, which isn't available\n", head, index);
+			break;
+		}
+		if (++chain_length > num_entries)
+		{
+			this->reportError("chain from slot %u is longer than the ring\n", head);
+			break;
+		}
+		if (++this->last_avail_index == num_entries)
+		{
+			this->last_avail_index = 0;
+			this->avail_wrap_counter = !this->avail_wrap_counter;
+		}
+
+		const uint16_t flags = desc->flags;
+		if ((flags & VirtioVringPackedDescFlag::INDIRECT) != 0)
+			this->reportError("slot %u: indirect descriptor on a packed ring\n", index);
+		if (desc->buffer_id != buffer_id)
+			this->reportError("chain from slot %u: slot %u has buffer ID %u, expected %u\n", head, index, desc->buffer_id, buffer_id);
+		if ((flags & VirtioVringPackedDescFlag::DEVICE_WRITABLE) != 0)
+		{
+			if (first_writable == nullptr)
+			{
+				first_writable = phys_to_virt(desc->phys_address);
+				first_writable_length = desc->length_bytes;
+			}
+			written += desc->length_bytes;
+			seen_writable = true;
+		}
+		else if (seen_writable)
+		{
+			this->reportError("chain from slot %u has a device readable buffer after a writable one\n", head);
+		}
+		else if (first_readable == nullptr)
+		{
+			first_readable = phys_to_virt(desc->phys_address);
+			first_readable_length = desc->length_bytes;
+		}
+
+		if ((flags & VirtioVringPackedDescFlag::NEXT) == 0)
+			break;
+	}
+
+	if (first_readable != nullptr && first_writable != nullptr)
+	{
+		uint32_t echo_length = 8;
+		if (first_readable_length < echo_length)
+			echo_length = first_readable_length;
+		if (first_writable_length < echo_length)
+			echo_length = first_writable_length;
+		memcpy(first_writable, first_readable, echo_length);
+	}
+	this->pending_heads.push_back(buffer_id);
+	this->pending_written.push_back(written);
+	this->pending_chain_lengths.push_back(chain_length);
+}
+
+/// Writes a used descriptor per pending chain, in the slot its head occupied, and interrupts unless that's suppressed.
+void VirtioDeviceEmulator::flushPackedUsed()
+{
+	if (this->pending_heads.empty())
+		return;
+	VirtioPackedVirtqueue* queue = this->packed;
+	const unsigned num_entries = queue->num_entries;
+	unsigned num_used_slots = 0;
+	for (size_t i = 0; i < this->pending_heads.size(); ++i)
+	{
+		VirtioVringPackedDesc* desc = &queue->descriptor_ring[this->used_index];
+		uint16_t buffer_id = this->pending_heads[i];
+		desc->buffer_id = buffer_id;
+		desc->length_bytes = this->pending_written[i];
+		if (buffer_id < num_entries)
+			this->in_use[buffer_id] = false;
+		// buffer ID and length must be visible before the flags hand the slot back
+		virtio_memory_barrier();
+		write_shared16(&desc->flags, this->used_wrap_counter ? (VirtioVringPackedDescFlag::AVAIL | VirtioVringPackedDescFlag::USED) : 0);
+
+		unsigned next_used = this->used_index + this->pending_chain_lengths[i];
+		if (next_used >= num_entries)
+		{
+			next_used -= num_entries;
+			this->used_wrap_counter = !this->used_wrap_counter;
+		}
+		this->used_index = next_used;
+		num_used_slots += this->pending_chain_lengths[i];
+	}
+	this->chains_used.fetch_add(this->pending_heads.size(), std::memory_order_relaxed);
+	this->pending_heads.clear();
+	this->pending_written.clear();
+	this->pending_chain_lengths.clear();
+	// the driver event area must be read after the used descriptors are visible
+	virtio_memory_barrier();
+
+	bool interrupt;
+	uint16_t flags = read_shared16(&queue->driver_event->flags);
+	if (flags != VirtioVringPackedEventFlag::DESC)
+	{
+		interrupt = (flags != VirtioVringPackedEventFlag::DISABLE);
+	}
+	else if (num_used_slots >= num_entries)
+	{
+		interrupt = true;
+	}
+	else
+	{
+		// same arithmetic as the driver's notification check
+		uint16_t new_index = this->used_index;
+		uint16_t old_index = new_index - static_cast<uint16_t>(num_used_slots);
+		uint16_t offset_wrap = read_shared16(&queue->driver_event->offset_wrap);
+		uint16_t event_index = offset_wrap & ~PACKED_WRAP_BIT;
+		if (((offset_wrap & PACKED_WRAP_BIT) != 0) != this->used_wrap_counter)
+			event_index -= num_entries;
+		interrupt = vring_need_event(event_index, new_index, old_index);
+	}
+	if (interrupt)
+	{
+		this->interrupts.fetch_add(1, std::memory_order_relaxed);
+		if (this->interrupt_action != nullptr)
+			this->interrupt_action(this->interrupt_target);
+	}
+}
@@ -0,0 +1,119 @@
+//
+//  VirtioDeviceEmulator.h
+//  virtio-osx harness
+//
+//
+
+#ifndef __virtio_osx__VirtioDeviceEmulator__
+#define __virtio_osx__VirtioDeviceEmulator__
+
+#include "VirtioDevice.h"
+#include "VirtioPackedVirtqueue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Device side of a split or packed virtqueue, running on its own thread.
+/** Behaves like a backend that processes requests whenever it's notified:
+ * it consumes the avail ring, checks every chain against the rules a real
+ * device relies on, copies the first 8 bytes of the first device readable
+ * buffer to the first device writable one, and returns the chain in the used
+ * ring, reporting all its writable bytes as written. It only touches the
+ * memory a device would be given: the descriptor table, the avail and used
+ * rings, and indirect tables, or for packed rings the descriptor ring and
+ * the two event areas. */
+class VirtioDeviceEmulator
+{
+public:
+	typedef void(*InterruptAction)(void* target);
+
+	/// used_batch chains are returned per used ring update; with in_order, only the last of them gets a used entry.
+	VirtioDeviceEmulator(VirtioVirtqueue* queue, bool event_index, bool in_order, unsigned used_batch);
+	/// Packed ring; used descriptors are written used_batch chains at a time.
+	VirtioDeviceEmulator(VirtioPackedVirtqueue* queue, bool event_index, unsigned used_batch);
+	~VirtioDeviceEmulator();
+
+	void start(InterruptAction interrupt_action, void* interrupt_target);
+	void stop();
+
+	/// The queue's doorbell; safe to call from any thread.
+	void notify();
+	/// Doorbell write with VIRTIO_F_NOTIFICATION_DATA: the avail ring head index, or packed offset and wrap counter.
+	/** The device takes the extent of the new work from it rather than reading the ring. */
+	void notify(uint16_t next_avail);
+	/// Consumes whatever is available on the calling thread; only while the device isn't started.
+	void processPending();
+
+	/// Doorbell writes seen
+	std::atomic<uint64_t> notifications;
+	/// Interrupts raised
+	std::atomic<uint64_t> interrupts;
+	/// Requests returned to the driver
+	std::atomic<uint64_t> chains_used;
+	/// Time from a doorbell write to the device holding the first chain it announced, summed over all doorbells that found work
+	std::atomic<uint64_t> kick_to_consume_ns;
+	std::atomic<uint64_t> kick_to_consume_samples;
+	/// Malformed chains, double submissions and the like
+	std::atomic<uint64_t> errors;
+	/// Description of the first error, empty if none
+	char first_error[256];
+
+private:
+	void run();
+	void processAvailable();
+	/// How far the driver says it has filled the ring, as an offset from the device's position; 0 if not known
+	unsigned takeNotifiedAvailable();
+	void recordKickToConsume();
+	void consumeChain(uint16_t head);
+	void flushUsed();
+	void setNotificationsSuppressed(bool suppressed);
+	void processPackedAvailable();
+	bool packedDescIsAvailable(uint16_t index);
+	void consumePackedChain();
+	void flushPackedUsed();
+	void setPackedNotificationsSuppressed(bool suppressed);
+	void reportError(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+	VirtioVirtqueue* queue;
+	VirtioPackedVirtqueue* packed;
+	bool event_index;
+	bool in_order;
+	unsigned used_batch;
+	InterruptAction interrupt_action;
+	void* interrupt_target;
+
+	/// Device state: next avail ring position to consume and next used ring position to fill
+	/** For packed rings, ring slots, along with the device's wrap counters. */
+	uint16_t last_avail_index;
+	uint16_t used_index;
+	bool avail_wrap_counter;
+	bool used_wrap_counter;
+	/// Chains consumed but not yet returned, and their (in)direct ring descriptors
+	/** For packed rings, pending_heads holds buffer IDs, alongside the number of slots each chain took up. */
+	std::vector<uint16_t> pending_heads;
+	std::vector<uint32_t> pending_written;
+	std::vector<uint16_t> pending_descriptors;
+	std::vector<uint16_t> pending_chain_lengths;
+	/// Per ring descriptor (buffer ID for packed rings): part of a chain the device currently owns
+	std::vector<bool> in_use;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable doorbell_signal;
+	bool doorbell;
+	/// Latest notification data, and when the first doorbell not yet serviced was written
+	bool notified;
+	uint16_t notified_avail;
+	std::chrono::steady_clock::time_point doorbell_time;
+	/// Snapshots of the above for the pass in progress
+	bool pass_notified;
+	uint16_t pass_notified_avail;
+	bool pass_timed;
+	std::chrono::steady_clock::time_point pass_doorbell_time;
+	bool stopping;
+};
+
+#endif /* defined(__virtio_osx__VirtioDeviceEmulator__) */
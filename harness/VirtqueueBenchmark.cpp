@@ -0,0 +1,394 @@
+//
+//  VirtqueueBenchmark.cpp
+//  virtio-osx harness
+//
+//  Drives block-style requests (readable header, writable data, writable
+//  status byte) through the virtqueue engines and the device emulator, and
+//  reports throughput, cost per request, and how many notifications and
+//  interrupts it took, for a range of queue sizes and submission batch sizes,
+//  side by side for split rings with direct and indirect descriptors and for
+//  packed rings, and with VIRTIO_F_RING_EVENT_IDX next to plain flag based
+//  suppression. With --latency, it instead sends one request at a time and
+//  reports round trip and kick-to-consume latency, with and without
+//  VIRTIO_F_NOTIFICATION_DATA. With --coalescing, it streams single
+//  submissions with a range of kick coalescing settings and reports the
+//  notifications saved and how long deferred ones waited.
+//
+
+#include "HarnessTransport.h"
+#include "VirtioDeviceEmulator.h"
+#include <chrono>
+#include <memory>
+#include <vector>
+
+struct BenchmarkRequest
+{
+	uint64_t header[2];
+	uint8_t data[512];
+	uint8_t status;
+};
+
+struct BenchmarkState
+{
+	std::mutex mutex;
+	std::condition_variable progress;
+	/// Requests whose slots may be reused, returned by completions
+	std::vector<BenchmarkRequest*> free_requests;
+	uint64_t completed;
+	uint64_t bad_completions;
+};
+
+static void benchmark_completion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
+{
+	BenchmarkState* state = reinterpret_cast<BenchmarkState*>(target);
+	BenchmarkRequest* request = static_cast<BenchmarkRequest*>(ref);
+	std::lock_guard<std::mutex> lock(state->mutex);
+	if (device_reset)
+		++state->bad_completions;
+	state->free_requests.push_back(request);
+	++state->completed;
+}
+
+static void benchmark_pass(void* target)
+{
+	static_cast<BenchmarkState*>(target)->progress.notify_one();
+}
+
+struct BenchmarkResult
+{
+	uint64_t requests;
+	double seconds;
+	uint64_t kicks;
+	uint64_t interrupts;
+	uint64_t device_errors;
+	uint64_t bad_completions;
+	/// The transport's view: notifications folded into later ones, and how long deferred ones waited
+	VirtioVirtqueueStatistics stats;
+	double kick_to_consume_ns;
+};
+
+static bool run_benchmark(const HarnessQueueConfig& config, unsigned batch, uint64_t num_requests, BenchmarkResult& result)
+{
+	HarnessTransport transport;
+	if (transport.setup(config) != kIOReturnSuccess)
+		return false;
+	std::unique_ptr<VirtioDeviceEmulator> device_ptr(transport.createDevice(32));
+	VirtioDeviceEmulator& device = *device_ptr;
+	BenchmarkState state;
+	state.completed = 0;
+	state.bad_completions = 0;
+	// enough requests to keep every ring descriptor busy
+	std::vector<BenchmarkRequest> requests(config.indirect_desc_per_request > 0 ? config.num_entries : config.num_entries / 3);
+	for (BenchmarkRequest& request : requests)
+		state.free_requests.push_back(&request);
+	transport.setCompletionPassAction(&benchmark_pass, &state);
+	device.start(&HarnessTransport::interruptFilter, &transport);
+	transport.start(&device);
+
+	// wait for a whole batch of free requests, or as many as there can be
+	const size_t batch_ready = batch < requests.size() ? batch : requests.size();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t submitted = 0;
+	std::vector<BenchmarkRequest*> to_submit;
+	bool stalled = false;
+	while (submitted < num_requests && !stalled)
+	{
+		uint64_t completed;
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			if (!state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.free_requests.size() >= batch_ready || state.free_requests.size() >= num_requests - submitted; }))
+			{
+				stalled = true;
+				break;
+			}
+			while (!state.free_requests.empty() && to_submit.size() < batch && submitted + to_submit.size() < num_requests)
+			{
+				to_submit.push_back(state.free_requests.back());
+				state.free_requests.pop_back();
+			}
+			// taken before submitting, so completions racing with a full ring aren't missed
+			completed = state.completed;
+		}
+
+		transport.beginBatch();
+		size_t num_submitted = 0;
+		for (BenchmarkRequest* request : to_submit)
+		{
+			request->header[0] = submitted + num_submitted;
+			VirtioRegisteredSegment readable = { reinterpret_cast<uintptr_t>(request->header), sizeof(request->header) };
+			VirtioRegisteredSegment writable[2] = {
+				{ reinterpret_cast<uintptr_t>(request->data), sizeof(request->data) },
+				{ reinterpret_cast<uintptr_t>(&request->status), sizeof(request->status) } };
+			if (transport.submit(&readable, 1, writable, 2, { &benchmark_completion, reinterpret_cast<OSObject*>(&state), request }) != kIOReturnSuccess)
+				break;
+			++num_submitted;
+		}
+		transport.commitBatch();
+		submitted += num_submitted;
+		to_submit.erase(to_submit.begin(), to_submit.begin() + num_submitted);
+		if (!to_submit.empty())
+		{
+			// out of ring descriptors: hand the leftovers back and wait for completions
+			std::unique_lock<std::mutex> lock(state.mutex);
+			state.free_requests.insert(state.free_requests.end(), to_submit.begin(), to_submit.end());
+			to_submit.clear();
+			if (!state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.completed != completed; }))
+				stalled = true;
+		}
+	}
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		if (!state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.completed == submitted; }))
+			stalled = true;
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	transport.stop();
+	device.stop();
+
+	result.requests = state.completed;
+	result.seconds = std::chrono::duration<double>(end - start).count();
+	result.kicks = transport.kicks;
+	result.interrupts = device.interrupts;
+	result.device_errors = device.errors;
+	result.bad_completions = state.bad_completions;
+	result.stats = transport.queue.stats;
+	uint64_t samples = device.kick_to_consume_samples;
+	result.kick_to_consume_ns = samples > 0 ? static_cast<double>(device.kick_to_consume_ns) / samples : 0.0;
+	if (device.errors != 0)
+		fprintf(stderr, "device: %s", device.first_error);
+	return !stalled && state.completed == num_requests;
+}
+
+struct LatencyResult
+{
+	uint64_t requests;
+	double round_trip_ns;
+	double kick_to_consume_ns;
+	uint64_t device_errors;
+};
+
+/// One request in flight at a time, so every submission finds the device idle and kicks it.
+static bool run_latency(const HarnessQueueConfig& config, uint64_t num_requests, LatencyResult& result)
+{
+	HarnessTransport transport;
+	if (transport.setup(config) != kIOReturnSuccess)
+		return false;
+	std::unique_ptr<VirtioDeviceEmulator> device_ptr(transport.createDevice(1));
+	VirtioDeviceEmulator& device = *device_ptr;
+	BenchmarkState state;
+	state.completed = 0;
+	state.bad_completions = 0;
+	BenchmarkRequest request;
+	transport.setCompletionPassAction(&benchmark_pass, &state);
+	device.start(&HarnessTransport::interruptFilter, &transport);
+	transport.start(&device);
+
+	bool stalled = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t submitted = 0;
+	for (; submitted < num_requests && !stalled; ++submitted)
+	{
+		request.header[0] = submitted;
+		VirtioRegisteredSegment readable = { reinterpret_cast<uintptr_t>(request.header), sizeof(request.header) };
+		VirtioRegisteredSegment writable[2] = {
+			{ reinterpret_cast<uintptr_t>(request.data), sizeof(request.data) },
+			{ reinterpret_cast<uintptr_t>(&request.status), sizeof(request.status) } };
+		if (transport.submit(&readable, 1, writable, 2, { &benchmark_completion, reinterpret_cast<OSObject*>(&state), &request }) != kIOReturnSuccess)
+			break;
+		std::unique_lock<std::mutex> lock(state.mutex);
+		if (!state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.completed == submitted + 1; }))
+			stalled = true;
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	transport.stop();
+	device.stop();
+
+	result.requests = state.completed;
+	result.round_trip_ns = std::chrono::duration<double, std::nano>(end - start).count() / (submitted > 0 ? submitted : 1);
+	uint64_t samples = device.kick_to_consume_samples;
+	result.kick_to_consume_ns = samples > 0 ? static_cast<double>(device.kick_to_consume_ns) / samples : 0.0;
+	result.device_errors = device.errors;
+	if (device.errors != 0)
+		fprintf(stderr, "device: %s", device.first_error);
+	return !stalled && state.completed == num_requests && state.bad_completions == 0;
+}
+
+static bool latency_benchmark(uint64_t num_requests, bool event_index)
+{
+	printf("%-9s %-10s %10s %14s %18s\n", "ring", "doorbell", "requests", "round trip ns", "kick-to-consume ns");
+	bool ok = true;
+	for (unsigned packed = 0; packed < 2; ++packed)
+	{
+		for (unsigned notification_data = 0; notification_data < 2; ++notification_data)
+		{
+			HarnessQueueConfig config = {};
+			config.num_entries = 256;
+			config.event_index = event_index;
+			config.interrupt_poll_budget = 64;
+			config.packed = packed != 0;
+			config.notification_data = notification_data != 0;
+			LatencyResult result = {};
+			bool run_ok = run_latency(config, num_requests, result);
+			printf("%-9s %-10s %10llu %14.0f %18.0f%s\n", packed ? "packed" : "split", notification_data ? "data" : "index only",
+				static_cast<unsigned long long>(result.requests), result.round_trip_ns, result.kick_to_consume_ns,
+				run_ok ? "" : "  INCOMPLETE");
+			if (!run_ok || result.device_errors != 0)
+				ok = false;
+		}
+	}
+	return ok;
+}
+
+struct CoalescingSetting
+{
+	unsigned max_batch;
+	uint32_t max_delay_us;
+};
+
+static bool coalescing_benchmark(uint64_t num_requests, bool event_index)
+{
+	static const CoalescingSetting settings[] = { { 0, 0 }, { 4, 20 }, { 16, 20 }, { 16, 100 }, { 64, 100 } };
+	printf("%-9s %-6s %-9s %12s %10s %10s %12s %14s %14s %18s\n",
+		"ring", "batch", "delay us", "req/s", "kicks", "saved", "kicks/req", "mean wait ns", "max wait ns", "kick-to-consume ns");
+	bool ok = true;
+	for (unsigned packed = 0; packed < 2; ++packed)
+	{
+		for (const CoalescingSetting& setting : settings)
+		{
+			HarnessQueueConfig config = {};
+			config.num_entries = 256;
+			config.event_index = event_index;
+			config.interrupt_poll_budget = 64;
+			config.packed = packed != 0;
+			config.kick_max_batch = setting.max_batch;
+			config.kick_max_delay_us = setting.max_delay_us;
+			BenchmarkResult result = {};
+			// single submissions, as a streaming client without batching of its own makes them
+			bool run_ok = run_benchmark(config, 1, num_requests, result);
+			double requests = result.requests > 0 ? static_cast<double>(result.requests) : 1.0;
+			double mean_wait = result.stats.deferred_kicks > 0
+				? static_cast<double>(result.stats.deferred_kick_latency_total_ns) / result.stats.deferred_kicks : 0.0;
+			char batch[16];
+			char delay[16];
+			snprintf(batch, sizeof(batch), setting.max_batch > 1 ? "%u" : "off", setting.max_batch);
+			snprintf(delay, sizeof(delay), setting.max_batch > 1 ? "%u" : "-", setting.max_delay_us);
+			printf("%-9s %-6s %-9s %12.0f %10llu %10llu %12.4f %14.0f %14llu %18.0f%s\n",
+				packed ? "packed" : "split", batch, delay,
+				result.requests / result.seconds,
+				static_cast<unsigned long long>(result.kicks),
+				static_cast<unsigned long long>(result.stats.notifications_coalesced),
+				result.kicks / requests, mean_wait,
+				static_cast<unsigned long long>(result.stats.deferred_kick_latency_max_ns),
+				result.kick_to_consume_ns,
+				run_ok ? "" : "  INCOMPLETE");
+			if (!run_ok || result.device_errors != 0 || result.bad_completions != 0)
+				ok = false;
+		}
+	}
+	return ok;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [--quick] [--requests N] [--event-idx | --no-event-idx] [--in-order] [--latency | --coalescing]\n", name);
+}
+
+int main(int argc, const char* argv[])
+{
+	uint64_t num_requests = 200000;
+	// by default, each configuration runs with and without event index
+	bool with_event_index = true;
+	bool without_event_index = true;
+	bool in_order = false;
+	bool quick = false;
+	bool latency = false;
+	bool coalescing = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+			quick = true;
+		else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc)
+			num_requests = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--event-idx") == 0)
+			without_event_index = false;
+		else if (strcmp(argv[i], "--no-event-idx") == 0)
+			with_event_index = false;
+		else if (strcmp(argv[i], "--in-order") == 0)
+			in_order = true;
+		else if (strcmp(argv[i], "--latency") == 0)
+			latency = true;
+		else if (strcmp(argv[i], "--coalescing") == 0)
+			coalescing = true;
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (quick)
+		num_requests = 5000;
+	if (num_requests == 0 || (!with_event_index && !without_event_index) || (latency && coalescing))
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (latency)
+	{
+		// a round trip is a couple of thread wake-ups, so fewer requests do
+		return latency_benchmark(num_requests / 4, with_event_index) ? 0 : 1;
+	}
+	if (coalescing)
+	{
+		return coalescing_benchmark(num_requests, with_event_index) ? 0 : 1;
+	}
+
+	static const uint16_t queue_sizes[] = { 64, 256, 1024 };
+	static const unsigned batch_sizes[] = { 1, 8, 32 };
+	static const char* const layouts[] = { "direct", "indirect", "packed" };
+	printf("%-6s %-6s %-9s %-10s %10s %12s %10s %10s %10s %12s %12s\n",
+		"qsize", "batch", "ring", "notify", "requests", "req/s", "ns/op", "kicks", "interrupts", "kicks/req", "irqs/req");
+	bool ok = true;
+	for (uint16_t queue_size : queue_sizes)
+	{
+		for (unsigned batch : batch_sizes)
+		{
+			for (unsigned layout = 0; layout < 3; ++layout)
+			{
+				const bool packed = (layout == 2);
+				// the packed engine doesn't do in-order retiring, so there's nothing to compare
+				if (packed && in_order)
+					continue;
+				for (unsigned suppression = 0; suppression < 2; ++suppression)
+				{
+					const bool event_index = (suppression == 0);
+					if (event_index ? !with_event_index : !without_event_index)
+						continue;
+					HarnessQueueConfig config = {};
+					config.num_entries = queue_size;
+					config.event_index = event_index;
+					config.in_order = in_order;
+					config.indirect_desc_per_request = (layout == 1) ? 3 : 0;
+					config.packed = packed;
+					config.interrupt_poll_budget = 64;
+					BenchmarkResult result = {};
+					bool run_ok = run_benchmark(config, batch, num_requests, result);
+					double requests = result.requests > 0 ? static_cast<double>(result.requests) : 1.0;
+					printf("%-6u %-6u %-9s %-10s %10llu %12.0f %10.1f %10llu %10llu %12.4f %12.4f%s\n",
+						queue_size, batch, layouts[layout], event_index ? "event-idx" : "flags",
+						static_cast<unsigned long long>(result.requests),
+						result.requests / result.seconds,
+						result.seconds * 1e9 / requests,
+						static_cast<unsigned long long>(result.kicks),
+						static_cast<unsigned long long>(result.interrupts),
+						result.kicks / requests,
+						result.interrupts / requests,
+						run_ok ? "" : "  INCOMPLETE");
+					if (!run_ok || result.device_errors != 0 || result.bad_completions != 0)
+						ok = false;
+				}
+			}
+		}
+	}
+	return ok ? 0 : 1;
+}
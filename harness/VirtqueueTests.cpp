@@ -0,0 +1,969 @@
+//
+//  VirtqueueTests.cpp
+//  virtio-osx harness
+//
+//  Tests for the split virtqueue engine: the lock-free descriptor free list,
+//  avail ring publishing, notification and interrupt suppression, in-order
+//  retirement, and whole request round trips through the device emulator,
+//  which also run against the packed ring engine.
+//  Run with a test name to run just that test.
+//
+
+#include "HarnessTransport.h"
+#include "VirtioDeviceEmulator.h"
+#include "VirtioPlatform.h"
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			return false; \
+		} \
+	} while (0)
+
+static HarnessQueueConfig queue_config(uint16_t num_entries, bool event_index, bool in_order, unsigned indirect_desc_per_request)
+{
+	HarnessQueueConfig config = {};
+	config.num_entries = num_entries;
+	config.event_index = event_index;
+	config.in_order = in_order;
+	config.indirect_desc_per_request = indirect_desc_per_request;
+	config.interrupt_poll_budget = 16;
+	return config;
+}
+
+static HarnessQueueConfig packed_queue_config(uint16_t num_entries, bool event_index)
+{
+	HarnessQueueConfig config = queue_config(num_entries, event_index, false, 0);
+	config.packed = true;
+	return config;
+}
+
+static VirtioRegisteredSegment segment_for(void* buffer, uint32_t length)
+{
+	VirtioRegisteredSegment segment = { reinterpret_cast<uintptr_t>(buffer), length };
+	return segment;
+}
+
+/// Collects what completion actions report, for tests which run them on the calling thread.
+struct CompletionLog
+{
+	std::vector<uintptr_t> refs;
+	std::vector<uint32_t> written;
+};
+
+static void log_completion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
+{
+	CompletionLog* log = reinterpret_cast<CompletionLog*>(target);
+	log->refs.push_back(reinterpret_cast<uintptr_t>(ref));
+	log->written.push_back(num_bytes_written);
+}
+
+static VirtioCompletion logged_completion(CompletionLog* log, uintptr_t ref)
+{
+	VirtioCompletion completion = { &log_completion, reinterpret_cast<OSObject*>(log), reinterpret_cast<void*>(ref) };
+	return completion;
+}
+
+/// Plays the device for tests without an emulator: hands a chain back in the used ring.
+static void device_use(VirtioVirtqueue* queue, uint16_t head, uint32_t written_bytes)
+{
+	uint16_t used_index = queue->used_ring->head_index;
+	VirtioVringUsedElement* element = &queue->used_ring->ring[virtio_virtqueue_wrap(queue, used_index)];
+	element->descriptor_id = head;
+	element->written_bytes = written_bytes;
+	virtio_memory_barrier();
+	queue->used_ring->head_index = used_index + 1;
+}
+
+/// Heads made available but not yet seen by the (pretend) device, in order
+static std::vector<uint16_t> take_available(VirtioVirtqueue* queue, uint16_t& last_avail_index)
+{
+	std::vector<uint16_t> heads;
+	for (; last_avail_index != queue->available_ring->head_index; ++last_avail_index)
+	{
+		heads.push_back(queue->available_ring->ring[virtio_virtqueue_wrap(queue, last_avail_index)]);
+	}
+	return heads;
+}
+
+/// Walks the free list, checking it holds every unused descriptor exactly once.
+static bool free_list_is_complete(VirtioVirtqueue* queue)
+{
+	std::vector<bool> seen(queue->num_entries, false);
+	unsigned count = 0;
+	for (uint16_t index = queue->free_list_head & 0xffffu; index != VIRTIO_DESC_INDEX_NONE; index = queue->descriptor_buffers[index].next_desc)
+	{
+		CHECK(index < queue->num_entries);
+		CHECK(!seen[index]);
+		seen[index] = true;
+		++count;
+	}
+	CHECK(count == queue->num_entries);
+	CHECK(queue->num_unused_descriptors == static_cast<SInt32>(queue->num_entries));
+	return true;
+}
+
+/// Every buffer ID is unused and on the packed queue's list of unused IDs exactly once.
+static bool packed_buffer_ids_are_complete(VirtioPackedVirtqueue* queue)
+{
+	std::vector<bool> seen(queue->num_entries, false);
+	unsigned count = 0;
+	for (uint16_t id = queue->first_unused_buffer_id; id != VIRTIO_DESC_INDEX_NONE; id = queue->buffers[id].next_desc)
+	{
+		CHECK(id < queue->num_entries);
+		CHECK(!seen[id]);
+		CHECK(queue->buffers[id].packed_chain_length == 0);
+		seen[id] = true;
+		++count;
+	}
+	CHECK(count == queue->num_entries);
+	CHECK(queue->num_unused_descriptors == queue->num_entries);
+	CHECK(!queue->head_pending);
+	return true;
+}
+
+static bool test_free_list_exhaust_and_refill()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(16, true, false, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+
+	for (unsigned round = 0; round < 2; ++round)
+	{
+		std::vector<bool> reserved(16, false);
+		std::vector<uint16_t> order;
+		for (unsigned i = 0; i < 16; ++i)
+		{
+			uint16_t index = reserveNewDescriptor(queue);
+			CHECK(index < 16);
+			CHECK(!reserved[index]);
+			reserved[index] = true;
+			order.push_back(index);
+		}
+		CHECK(reserveNewDescriptor(queue) == VIRTIO_DESC_INDEX_NONE);
+		CHECK(queue->num_unused_descriptors == 0);
+		// give them back in a different order from the one they came out in
+		for (unsigned i = 0; i < 16; i += 2)
+			returnUnusedDescriptor(queue, order[i]);
+		for (unsigned i = 1; i < 16; i += 2)
+			returnUnusedDescriptor(queue, order[i]);
+		CHECK(free_list_is_complete(queue));
+	}
+	return true;
+}
+
+static bool test_free_list_concurrent()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(64, true, false, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+
+	const unsigned num_threads = 4;
+	const unsigned iterations = 20000;
+	std::vector<std::atomic<unsigned>> owner(64);
+	for (auto& entry : owner)
+		entry = 0;
+	std::atomic<unsigned> double_allocations(0);
+	std::vector<std::thread> threads;
+	for (unsigned t = 1; t <= num_threads; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			uint16_t held[3];
+			for (unsigned i = 0; i < iterations; ++i)
+			{
+				unsigned num_held = 0;
+				for (unsigned j = 0; j < 1 + (i + t) % 3; ++j)
+				{
+					uint16_t index = reserveNewDescriptor(queue);
+					if (index == VIRTIO_DESC_INDEX_NONE)
+						break;
+					unsigned expected = 0;
+					if (!owner[index].compare_exchange_strong(expected, t))
+						++double_allocations;
+					held[num_held++] = index;
+				}
+				if (i % 64 == 0)
+					std::this_thread::yield();
+				while (num_held > 0)
+				{
+					uint16_t index = held[--num_held];
+					owner[index] = 0;
+					returnUnusedDescriptor(queue, index);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	CHECK(double_allocations == 0);
+	CHECK(free_list_is_complete(queue));
+	return true;
+}
+
+// Smallest ring, one descriptor at a time: the same few indices are popped
+// and pushed back over and over, which is where an untagged free list head
+// would go wrong (ABA).
+static bool test_free_list_tiny_queue_stress()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(2, true, false, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+
+	const unsigned num_threads = 6;
+	const unsigned iterations = 100000;
+	std::atomic<unsigned> owner[2];
+	owner[0] = 0;
+	owner[1] = 0;
+	std::atomic<unsigned> double_allocations(0);
+	std::atomic<unsigned> bad_indices(0);
+	std::vector<std::thread> threads;
+	for (unsigned t = 1; t <= num_threads; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			for (unsigned i = 0; i < iterations; ++i)
+			{
+				uint16_t index = reserveNewDescriptor(queue);
+				if (index == VIRTIO_DESC_INDEX_NONE)
+					continue;
+				if (index >= 2)
+				{
+					++bad_indices;
+					return;
+				}
+				unsigned expected = 0;
+				if (!owner[index].compare_exchange_strong(expected, t))
+					++double_allocations;
+				if ((i + t) % 16 == 0)
+					std::this_thread::yield();
+				owner[index] = 0;
+				returnUnusedDescriptor(queue, index);
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	CHECK(bad_indices == 0);
+	CHECK(double_allocations == 0);
+	CHECK(free_list_is_complete(queue));
+	return true;
+}
+
+static bool test_in_order_allocation()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(8, true, true, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+
+	CHECK(reserveNewDescriptor(queue) == 0);
+	CHECK(reserveNewDescriptor(queue) == 1);
+	CHECK(reserveNewDescriptor(queue) == 2);
+	// backing out of a failed submission rewinds the allocator
+	returnUnusedDescriptor(queue, 2);
+	CHECK(queue->num_unused_descriptors == 6);
+	CHECK(reserveNewDescriptor(queue) == 2);
+	for (uint16_t expected = 3; expected < 8; ++expected)
+		CHECK(reserveNewDescriptor(queue) == expected);
+	CHECK(reserveNewDescriptor(queue) == VIRTIO_DESC_INDEX_NONE);
+	return true;
+}
+
+static bool test_indirect_large_tables()
+{
+	// 12 segments don't fit the 8 entry small tables, so each request borrows one of the 16 / 4 large ones
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(16, true, false, 12)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+	CHECK(queue->indirect_small_table_size == 8);
+	CHECK(queue->indirect_large_table_size == 12);
+	CHECK(queue->indirect_num_large_tables == 4);
+
+	uint8_t buffers[12][16];
+	VirtioRegisteredSegment segments[12];
+	for (unsigned i = 0; i < 12; ++i)
+		segments[i] = segment_for(buffers[i], sizeof(buffers[i]));
+	CompletionLog log;
+	for (unsigned i = 0; i < 4; ++i)
+		CHECK(transport.submit(segments, 4, segments + 4, 8, logged_completion(&log, i)) == kIOReturnSuccess);
+	CHECK(transport.submit(segments, 4, segments + 4, 8, logged_completion(&log, 4)) == kIOReturnBusy);
+	// a failed submission must not leak its ring descriptor
+	CHECK(queue->num_unused_descriptors == 12);
+	// small requests still fit
+	CHECK(transport.submit(segments, 1, segments + 1, 1, logged_completion(&log, 5)) == kIOReturnSuccess);
+	CHECK(transport.submit(segments, 4, segments + 4, 9, logged_completion(&log, 6)) == kIOReturnUnsupported);
+
+	uint16_t last_avail_index = 0;
+	std::vector<uint16_t> heads = take_available(queue, last_avail_index);
+	CHECK(heads.size() == 5);
+	for (uint16_t head : heads)
+	{
+		CHECK((queue->descriptor_table[head].flags & VirtioVringDescFlag::INDIRECT) != 0);
+		device_use(queue, head, 0);
+	}
+	CHECK(transport.pollCompleted() == 5);
+	CHECK(free_list_is_complete(queue));
+	for (unsigned i = 0; i < 4; ++i)
+		CHECK(virtio_virtqueue_reserve_indirect_large_table(queue) != VIRTIO_DESC_INDEX_NONE);
+	CHECK(virtio_virtqueue_reserve_indirect_large_table(queue) == VIRTIO_DESC_INDEX_NONE);
+	return true;
+}
+
+static bool test_publish_waits_for_claimed_slot()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(8, true, false, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+	uint8_t buffer[16];
+	VirtioRegisteredSegment segment = segment_for(buffer, sizeof(buffer));
+	CompletionLog log;
+
+	CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+	CHECK(queue->available_ring->head_index == 1);
+
+	// a second submitter claims the next slot but hasn't filled it yet...
+	uint16_t claimed_pos = virtio_atomic_fetch_add16(&queue->available_ring_next_index, 1);
+	CHECK(claimed_pos == 1);
+	// ...while a third fills the one after and publishes without waiting
+	CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 2)) == kIOReturnSuccess);
+	CHECK(queue->available_ring->head_index == 1);
+
+	// the second one finishes, and its publish takes both slots
+	uint16_t descriptor = reserveNewDescriptor(queue);
+	CHECK(descriptor != VIRTIO_DESC_INDEX_NONE);
+	IODMACommand::Segment64 dma_segment = { reinterpret_cast<uintptr_t>(buffer), sizeof(buffer) };
+	virtio_fill_vring_descriptor(&queue->descriptor_table[descriptor], descriptor, nullptr, dma_segment, false);
+	queue->descriptor_buffers[descriptor].next_desc = VIRTIO_DESC_INDEX_NONE;
+	queue->descriptor_buffers[descriptor].dma_cmd_used = false;
+	queue->descriptor_buffers[descriptor].completion = logged_completion(&log, 1);
+	queue->available_ring->ring[virtio_virtqueue_wrap(queue, claimed_pos)] = descriptor;
+	virtio_memory_barrier();
+	queue->available_ring_ready[virtio_virtqueue_wrap(queue, claimed_pos)] = claimed_pos;
+	virtio_virtqueue_publish_available(queue);
+	CHECK(queue->available_ring->head_index == 3);
+	CHECK(!virtio_virtqueue_publish_available(queue));
+
+	// slots are reused on the next lap without confusing the markers
+	uint16_t last_avail_index = 0;
+	for (unsigned lap = 0; lap < 3; ++lap)
+	{
+		for (uint16_t head : take_available(queue, last_avail_index))
+			device_use(queue, head, 0);
+		transport.pollCompleted();
+		for (unsigned i = 0; i < 5; ++i)
+			CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(queue->available_ring->head_index == static_cast<uint16_t>(3 + 5 * (lap + 1)));
+	}
+	return true;
+}
+
+static bool test_publish_notify_decision()
+{
+	uint8_t buffer[16];
+	VirtioRegisteredSegment segment = segment_for(buffer, sizeof(buffer));
+	CompletionLog log;
+	{
+		HarnessTransport transport;
+		CHECK(transport.setup(queue_config(16, true, false, 0)) == kIOReturnSuccess);
+		VirtioVirtqueue* queue = &transport.queue;
+		// the device wants to hear about anything beyond avail position 0
+		*queue->avail_ring_notify_index = 0;
+		CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(transport.kicks == 1);
+		// it hasn't caught up yet, so it needs no further notifications
+		CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(transport.kicks == 1);
+		// now it has, and wants to know once position 2 is used
+		*queue->avail_ring_notify_index = 2;
+		transport.beginBatch();
+		for (unsigned i = 0; i < 4; ++i)
+			CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(transport.kicks == 1);
+		CHECK(queue->available_ring->head_index == 2);
+		transport.commitBatch();
+		CHECK(queue->available_ring->head_index == 6);
+		CHECK(transport.kicks == 2);
+	}
+	{
+		HarnessTransport transport;
+		CHECK(transport.setup(queue_config(16, false, false, 0)) == kIOReturnSuccess);
+		VirtioVirtqueue* queue = &transport.queue;
+		queue->used_ring->flags = VirtioVringUsedFlag::NO_NOTIFY;
+		CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(transport.kicks == 0);
+		queue->used_ring->flags = 0;
+		CHECK(transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, 0)) == kIOReturnSuccess);
+		CHECK(transport.kicks == 1);
+	}
+	return true;
+}
+
+/// Plain submitters and batch committers racing on one queue: once they're
+/// all done, every filled avail slot must have been published by someone.
+static bool test_batch_commit_concurrent_submitters()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(256, true, false, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+	const unsigned num_threads = 4;
+	const unsigned requests_per_thread = 16;
+	uint8_t buffer[16];
+	VirtioRegisteredSegment segment = segment_for(buffer, sizeof(buffer));
+	CompletionLog log;
+	uint16_t last_avail_index = 0;
+	for (unsigned round = 0; round < 2000; ++round)
+	{
+		std::atomic<unsigned> failures(0);
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < num_threads; ++t)
+		{
+			threads.emplace_back([&, t]
+			{
+				// even threads submit one at a time, odd ones in batches of varying size
+				unsigned batch = (t % 2 == 0) ? 0 : 1 + (round + t) % 5;
+				unsigned in_batch = 0;
+				for (unsigned i = 0; i < requests_per_thread; ++i)
+				{
+					if (batch > 0 && in_batch == 0)
+						transport.beginBatch();
+					if (transport.submit(&segment, 1, nullptr, 0, logged_completion(&log, t)) != kIOReturnSuccess)
+						++failures;
+					if (batch > 0 && ++in_batch == batch)
+					{
+						transport.commitBatch();
+						in_batch = 0;
+					}
+					if ((i + round) % 7 == 0)
+						std::this_thread::yield();
+				}
+				if (in_batch > 0)
+					transport.commitBatch();
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+		CHECK(failures == 0);
+		CHECK(queue->batch_depth == 0);
+		CHECK(queue->available_ring->head_index == queue->available_ring_next_index);
+
+		std::vector<uint16_t> heads = take_available(queue, last_avail_index);
+		CHECK(heads.size() == num_threads * requests_per_thread);
+		for (uint16_t head : heads)
+			device_use(queue, head, 0);
+		log.refs.clear();
+		log.written.clear();
+		log.written.clear();
+		CHECK(transport.pollCompleted() == num_threads * requests_per_thread);
+		CHECK(log.refs.size() == num_threads * requests_per_thread);
+	}
+	CHECK(free_list_is_complete(queue));
+	return true;
+}
+
+static bool test_completion_budget()
+{
+	for (unsigned event_index = 0; event_index < 2; ++event_index)
+	{
+		HarnessTransport transport;
+		CHECK(transport.setup(queue_config(8, event_index != 0, false, 0)) == kIOReturnSuccess);
+		VirtioVirtqueue* queue = &transport.queue;
+		uint8_t buffers[6][16];
+		CompletionLog log;
+		for (unsigned i = 0; i < 6; ++i)
+		{
+			VirtioRegisteredSegment segment = segment_for(buffers[i], sizeof(buffers[i]));
+			CHECK(transport.submit(nullptr, 0, &segment, 1, logged_completion(&log, i)) == kIOReturnSuccess);
+		}
+		uint16_t last_avail_index = 0;
+		for (uint16_t head : take_available(queue, last_avail_index))
+			device_use(queue, head, 16);
+
+		// as after an interrupt
+		virtio_virtqueue_disable_interrupts(queue);
+		CHECK(transport.pollCompleted(4) == 4);
+		// the budget ran out: still polling, so interrupts stay off
+		CHECK(queue->available_ring->flags == VirtioVringAvailFlag::NO_INTERRUPT);
+		CHECK(transport.pollCompleted(4) == 2);
+		// ran dry: re-armed
+		if (event_index)
+			CHECK(*queue->used_ring_interrupt_index == 6);
+		else
+			CHECK(queue->available_ring->flags == 0);
+		CHECK(log.refs.size() == 6);
+		for (unsigned i = 0; i < 6; ++i)
+		{
+			CHECK(log.refs[i] == i);
+			CHECK(log.written[i] == 16);
+		}
+		CHECK(free_list_is_complete(queue));
+	}
+	return true;
+}
+
+/// VIRTIO_F_IN_ORDER: one used entry retires everything made available before it.
+static bool test_in_order_retire()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(queue_config(8, true, true, 0)) == kIOReturnSuccess);
+	VirtioVirtqueue* queue = &transport.queue;
+	uint8_t header[16];
+	uint8_t data[64];
+	CompletionLog log;
+	for (unsigned round = 0; round < 3; ++round)
+	{
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			VirtioRegisteredSegment readable = segment_for(header, sizeof(header));
+			VirtioRegisteredSegment writable = segment_for(data, sizeof(data));
+			CHECK(transport.submit(&readable, 1, &writable, 1, logged_completion(&log, round * 3 + i)) == kIOReturnSuccess);
+		}
+		uint16_t last_avail_index = static_cast<uint16_t>(round * 3);
+		std::vector<uint16_t> heads = take_available(queue, last_avail_index);
+		CHECK(heads.size() == 3);
+		// chains are handed out in table order, wrapping around
+		for (unsigned i = 0; i < 3; ++i)
+			CHECK(heads[i] == (round * 6 + i * 2) % 8);
+		device_use(queue, heads[2], 40);
+		CHECK(transport.pollCompleted() == 3);
+		CHECK(queue->num_unused_descriptors == 8);
+	}
+	CHECK(log.refs.size() == 9);
+	for (unsigned i = 0; i < 9; ++i)
+	{
+		CHECK(log.refs[i] == i);
+		// only the request with the used entry knows how much was written
+		CHECK(log.written[i] == ((i % 3 == 2) ? 40u : 0u));
+	}
+	return true;
+}
+
+/// A mapped buffer of num_ranges 16 byte ranges, 16 bytes apart so none of them merge.
+static IOMemoryDescriptor* scattered_buffer(uint8_t* bytes, unsigned num_ranges)
+{
+	std::vector<IOAddressRange> ranges(num_ranges);
+	for (unsigned i = 0; i < num_ranges; ++i)
+		ranges[i] = { reinterpret_cast<uintptr_t>(bytes + 32 * i), 16 };
+	return IOMemoryDescriptor::withAddressRanges(ranges.data(), num_ranges, kIODirectionInOut, kernel_task);
+}
+
+// A mapped submission that runs out of ring slots part way through must not
+// leave anything available behind it: a shorter chain submitted at the same
+// position afterwards would otherwise lead the device into the stale slots.
+static bool test_packed_partial_submit()
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(packed_queue_config(8, true)) == kIOReturnSuccess);
+	VirtioPackedVirtqueue* queue = &transport.packed;
+	std::unique_ptr<VirtioDeviceEmulator> device(transport.createDevice(1));
+	CompletionLog log;
+	uint64_t header[2] = {};
+	uint8_t status = 0;
+	static uint8_t scattered[32 * 8];
+
+	// a few laps of the ring, so stale slots from earlier laps come into it too
+	for (unsigned lap = 0; lap < 6; ++lap)
+	{
+		// a request left in flight, taking 2 slots
+		VirtioRegisteredSegment readable = segment_for(header, sizeof(header));
+		VirtioRegisteredSegment writable = segment_for(&status, sizeof(status));
+		CHECK(transport.submit(&readable, 1, &writable, 1, logged_completion(&log, 1)) == kIOReturnSuccess);
+
+		// 6 slots left: the writable part runs out after the readable one took 3
+		IOMemoryDescriptor* readable_buf = scattered_buffer(scattered, 3);
+		IOMemoryDescriptor* writable_buf = scattered_buffer(scattered + 8, 5);
+		CHECK(transport.submitMapped(readable_buf, writable_buf, logged_completion(&log, 2)) == kIOReturnBusy);
+		writable_buf->release();
+		// and here the readable part already does
+		writable_buf = scattered_buffer(scattered + 8, 1);
+		readable_buf->release();
+		readable_buf = scattered_buffer(scattered, 7);
+		CHECK(transport.submitMapped(readable_buf, writable_buf, logged_completion(&log, 3)) == kIOReturnBusy);
+		readable_buf->release();
+		writable_buf->release();
+		CHECK(queue->num_unused_descriptors == 6);
+
+		// a single slot chain where the failed ones started
+		CHECK(transport.submit(nullptr, 0, &writable, 1, logged_completion(&log, 4)) == kIOReturnSuccess);
+		device->processPending();
+		if (device->errors != 0)
+			fprintf(stderr, "device: %s", device->first_error);
+		CHECK(device->errors == 0);
+		CHECK(device->chains_used == 2 * (lap + 1));
+
+		CHECK(transport.pollCompleted() == 2);
+		CHECK(log.refs.size() == 2);
+		CHECK(log.refs[0] == 1 && log.refs[1] == 4);
+		log.refs.clear();
+		log.written.clear();
+		CHECK(packed_buffer_ids_are_complete(queue));
+	}
+	return true;
+}
+
+// Kick coalescing: kicks are owed until max_batch of them have built up.
+static bool test_kick_coalescing_batch()
+{
+	HarnessTransport transport;
+	// no event index, and no device to suppress notifications, so every publish wants a kick
+	HarnessQueueConfig config = queue_config(64, false, false, 0);
+	config.kick_max_batch = 4;
+	config.kick_max_delay_us = 1000000;
+	CHECK(transport.setup(config) == kIOReturnSuccess);
+	CompletionLog log;
+	uint8_t status = 0;
+	VirtioRegisteredSegment writable = segment_for(&status, sizeof(status));
+	for (unsigned round = 1; round <= 3; ++round)
+	{
+		for (unsigned i = 0; i < 3; ++i)
+			CHECK(transport.submit(nullptr, 0, &writable, 1, logged_completion(&log, i)) == kIOReturnSuccess);
+		CHECK(transport.kicks == round - 1);
+		CHECK(transport.submit(nullptr, 0, &writable, 1, logged_completion(&log, 3)) == kIOReturnSuccess);
+		CHECK(transport.kicks == round);
+		CHECK(transport.queue.stats.notifications == round);
+		CHECK(transport.queue.stats.notifications_coalesced == 3 * round);
+		CHECK(transport.queue.stats.deferred_kicks == round);
+	}
+	return true;
+}
+
+struct EndToEndRequest
+{
+	uint64_t header[2];
+	uint64_t data[8];
+	uint8_t status;
+	std::atomic<bool> in_flight;
+	uint64_t cookie;
+};
+
+struct EndToEndState
+{
+	bool in_order;
+	std::atomic<uint64_t> completed;
+	std::atomic<uint64_t> bad_completions;
+	std::mutex mutex;
+	std::condition_variable progress;
+	uint64_t generation;
+};
+
+static void end_to_end_completion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
+{
+	EndToEndState* state = reinterpret_cast<EndToEndState*>(target);
+	EndToEndRequest* request = static_cast<EndToEndRequest*>(ref);
+	const uint32_t expected = sizeof(request->data) + sizeof(request->status);
+	bool ok = request->in_flight && request->data[0] == request->cookie
+		&& (num_bytes_written == expected || (state->in_order && num_bytes_written == 0));
+	if (!ok)
+		++state->bad_completions;
+	request->in_flight = false;
+	++state->completed;
+}
+
+static void end_to_end_pass(void* target)
+{
+	EndToEndState* state = static_cast<EndToEndState*>(target);
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		++state->generation;
+	}
+	state->progress.notify_all();
+}
+
+/// Submits requests from several threads through the emulated device and checks each completes once, with the right data.
+static bool run_end_to_end(const HarnessQueueConfig& config, unsigned num_submitters, unsigned requests_per_submitter, unsigned batch, unsigned used_batch)
+{
+	HarnessTransport transport;
+	CHECK(transport.setup(config) == kIOReturnSuccess);
+	std::unique_ptr<VirtioDeviceEmulator> device_ptr(transport.createDevice(used_batch));
+	VirtioDeviceEmulator& device = *device_ptr;
+	EndToEndState state;
+	state.in_order = config.in_order;
+	state.completed = 0;
+	state.bad_completions = 0;
+	state.generation = 0;
+	transport.setCompletionPassAction(&end_to_end_pass, &state);
+	device.start(&HarnessTransport::interruptFilter, &transport);
+	transport.start(&device);
+
+	const unsigned requests_per_pool = config.num_entries;
+	std::vector<EndToEndRequest> requests(requests_per_pool * num_submitters);
+	for (EndToEndRequest& request : requests)
+		request.in_flight = false;
+	std::atomic<unsigned> stalls(0);
+	std::vector<std::thread> submitters;
+	for (unsigned t = 0; t < num_submitters; ++t)
+	{
+		submitters.emplace_back([&, t]
+		{
+			EndToEndRequest* pool = &requests[t * requests_per_pool];
+			unsigned next_request = 0;
+			unsigned submitted = 0;
+			while (submitted < requests_per_submitter && stalls == 0)
+			{
+				unsigned in_batch = 0;
+				bool busy = false;
+				// taken before submitting, so completions racing with a busy queue aren't missed
+				uint64_t generation;
+				{
+					std::lock_guard<std::mutex> lock(state.mutex);
+					generation = state.generation;
+				}
+				transport.beginBatch();
+				while (in_batch < batch && submitted < requests_per_submitter)
+				{
+					EndToEndRequest* request = &pool[next_request];
+					if (request->in_flight)
+					{
+						busy = true;
+						break;
+					}
+					request->cookie = (static_cast<uint64_t>(t + 1) << 32) | submitted;
+					request->header[0] = request->cookie;
+					request->data[0] = 0;
+					request->in_flight = true;
+					VirtioRegisteredSegment readable = segment_for(request->header, sizeof(request->header));
+					VirtioRegisteredSegment writable[2] = {
+						segment_for(request->data, sizeof(request->data)), segment_for(&request->status, sizeof(request->status)) };
+					IOReturn result = transport.submit(&readable, 1, writable, 2, { &end_to_end_completion, reinterpret_cast<OSObject*>(&state), request });
+					if (result != kIOReturnSuccess)
+					{
+						request->in_flight = false;
+						busy = true;
+						break;
+					}
+					next_request = (next_request + 1) % requests_per_pool;
+					++submitted;
+					++in_batch;
+				}
+				transport.commitBatch();
+				if (busy)
+				{
+					std::unique_lock<std::mutex> lock(state.mutex);
+					if (!state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.generation != generation; }))
+						++stalls;
+				}
+			}
+		});
+	}
+	for (std::thread& thread : submitters)
+		thread.join();
+
+	const uint64_t total = static_cast<uint64_t>(num_submitters) * requests_per_submitter;
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		state.progress.wait_for(lock, std::chrono::seconds(10), [&] { return state.completed == total; });
+	}
+	transport.stop();
+	device.stop();
+
+	if (device.errors != 0)
+		fprintf(stderr, "device: %s", device.first_error);
+	CHECK(stalls == 0);
+	CHECK(device.errors == 0);
+	CHECK(state.completed == total);
+	CHECK(state.bad_completions == 0);
+	CHECK(device.chains_used == total);
+	CHECK(device.notifications == transport.kicks);
+	// notification suppression should save most kicks once the device is busy
+	CHECK(transport.kicks <= total);
+	if (config.packed)
+		CHECK(packed_buffer_ids_are_complete(&transport.packed));
+	else if (!config.in_order)
+		CHECK(free_list_is_complete(&transport.queue));
+	else
+		CHECK(transport.queue.num_unused_descriptors == static_cast<SInt32>(config.num_entries));
+	return true;
+}
+
+static bool test_end_to_end_direct()
+{
+	return run_end_to_end(queue_config(64, true, false, 0), 1, 20000, 8, 16);
+}
+
+static bool test_end_to_end_indirect()
+{
+	return run_end_to_end(queue_config(64, true, false, 3), 1, 20000, 8, 16);
+}
+
+static bool test_end_to_end_concurrent_submitters()
+{
+	bool ok = run_end_to_end(queue_config(128, true, false, 0), 4, 10000, 1, 8);
+	return ok && run_end_to_end(queue_config(128, true, false, 3), 4, 10000, 4, 8);
+}
+
+// Many submitters on a ring that's almost always full, with the device
+// returning one chain at a time: submission, publishing, batch commits and
+// completion all race with each other.
+static bool test_end_to_end_small_queue_stress()
+{
+	bool ok = run_end_to_end(queue_config(8, true, false, 0), 6, 5000, 3, 1);
+	ok = ok && run_end_to_end(queue_config(8, false, false, 0), 6, 5000, 1, 1);
+	return ok && run_end_to_end(queue_config(8, true, false, 3), 6, 5000, 2, 1);
+}
+
+static bool test_end_to_end_notification_data()
+{
+	HarnessQueueConfig split = queue_config(64, true, false, 0);
+	split.notification_data = true;
+	HarnessQueueConfig packed = packed_queue_config(64, true);
+	packed.notification_data = true;
+	// concurrent submitters, so doorbells overtake each other
+	bool ok = run_end_to_end(split, 4, 10000, 4, 8);
+	return ok && run_end_to_end(packed, 4, 10000, 4, 8);
+}
+
+// The deferred-kick timer must flush whatever falls short of a full batch, or the tail stalls.
+static bool test_end_to_end_kick_coalescing()
+{
+	HarnessQueueConfig config = queue_config(64, true, false, 0);
+	config.kick_max_batch = 8;
+	config.kick_max_delay_us = 50;
+	bool ok = run_end_to_end(config, 2, 10000, 3, 16);
+	config = queue_config(64, false, false, 0);
+	config.kick_max_batch = 16;
+	config.kick_max_delay_us = 200;
+	ok = ok && run_end_to_end(config, 2, 10000, 1, 16);
+	config = packed_queue_config(64, true);
+	config.kick_max_batch = 8;
+	config.kick_max_delay_us = 50;
+	return ok && run_end_to_end(config, 2, 10000, 3, 16);
+}
+
+static bool test_end_to_end_no_event_index()
+{
+	return run_end_to_end(queue_config(64, false, false, 0), 2, 10000, 4, 16);
+}
+
+static bool test_end_to_end_in_order()
+{
+	// in-order queues need serialised submission
+	return run_end_to_end(queue_config(64, true, true, 0), 1, 20000, 8, 8);
+}
+
+static bool test_end_to_end_packed()
+{
+	// 63 entries: chains straddle the end of the ring at varying offsets
+	bool ok = run_end_to_end(packed_queue_config(64, true), 1, 20000, 8, 16);
+	return ok && run_end_to_end(packed_queue_config(63, true), 1, 20000, 8, 5);
+}
+
+static bool test_end_to_end_packed_concurrent_submitters()
+{
+	return run_end_to_end(packed_queue_config(128, true), 4, 10000, 4, 8);
+}
+
+static bool test_end_to_end_packed_no_event_index()
+{
+	return run_end_to_end(packed_queue_config(64, false), 2, 10000, 4, 16);
+}
+
+// The largest queue the spec allows: every descriptor index, the end of the
+// free list, and the 16 bit ring indices wrapping every second lap.
+static bool test_max_queue_size()
+{
+	const unsigned num_entries = VIRTIO_MAX_QUEUE_SIZE;
+	{
+		HarnessTransport transport;
+		CHECK(transport.setup(queue_config(num_entries, true, false, 0)) == kIOReturnSuccess);
+		VirtioVirtqueue* queue = &transport.queue;
+		CompletionLog log;
+		uint8_t status = 0;
+		VirtioRegisteredSegment writable = segment_for(&status, sizeof(status));
+		uint16_t last_avail_index = 0;
+		// three laps: the avail and used indices wrap past 65535 during the third
+		for (unsigned round = 0; round < 3; ++round)
+		{
+			for (unsigned i = 0; i < num_entries; ++i)
+				CHECK(transport.submit(nullptr, 0, &writable, 1, logged_completion(&log, i)) == kIOReturnSuccess);
+			CHECK(transport.submit(nullptr, 0, &writable, 1, logged_completion(&log, num_entries)) == kIOReturnBusy);
+			CHECK(queue->num_unused_descriptors == 0);
+			CHECK(queue->available_ring->head_index == static_cast<uint16_t>((round + 1) * num_entries));
+
+			std::vector<uint16_t> heads = take_available(queue, last_avail_index);
+			CHECK(heads.size() == num_entries);
+			std::vector<bool> seen(num_entries, false);
+			for (uint16_t head : heads)
+			{
+				CHECK(head < num_entries);
+				CHECK(!seen[head]);
+				seen[head] = true;
+			}
+			// complete them back to front, so the free list ends up in a different order
+			for (size_t i = heads.size(); i-- > 0;)
+				device_use(queue, heads[i], 0);
+			CHECK(transport.pollCompleted() == num_entries);
+			CHECK(log.refs.size() == num_entries);
+			log.refs.clear();
+			log.written.clear();
+			CHECK(free_list_is_complete(queue));
+		}
+	}
+
+	// and with the emulated device, long enough for the indices to wrap several times
+	bool ok = run_end_to_end(queue_config(num_entries, true, false, 0), 2, 100000, 32, 64);
+	ok = ok && run_end_to_end(queue_config(num_entries, true, false, 3), 1, 100000, 32, 64);
+	return ok && run_end_to_end(packed_queue_config(num_entries, true), 2, 100000, 32, 64);
+}
+
+struct TestCase
+{
+	const char* name;
+	bool(*function)();
+};
+
+static const TestCase tests[] =
+{
+	{ "free_list_exhaust_and_refill", &test_free_list_exhaust_and_refill },
+	{ "free_list_concurrent", &test_free_list_concurrent },
+	{ "free_list_tiny_queue_stress", &test_free_list_tiny_queue_stress },
+	{ "in_order_allocation", &test_in_order_allocation },
+	{ "indirect_large_tables", &test_indirect_large_tables },
+	{ "publish_waits_for_claimed_slot", &test_publish_waits_for_claimed_slot },
+	{ "publish_notify_decision", &test_publish_notify_decision },
+	{ "batch_commit_concurrent_submitters", &test_batch_commit_concurrent_submitters },
+	{ "completion_budget", &test_completion_budget },
+	{ "in_order_retire", &test_in_order_retire },
+	{ "packed_partial_submit", &test_packed_partial_submit },
+	{ "kick_coalescing_batch", &test_kick_coalescing_batch },
+	{ "end_to_end_direct", &test_end_to_end_direct },
+	{ "end_to_end_indirect", &test_end_to_end_indirect },
+	{ "end_to_end_concurrent_submitters", &test_end_to_end_concurrent_submitters },
+	{ "end_to_end_small_queue_stress", &test_end_to_end_small_queue_stress },
+	{ "end_to_end_notification_data", &test_end_to_end_notification_data },
+	{ "end_to_end_kick_coalescing", &test_end_to_end_kick_coalescing },
+	{ "end_to_end_no_event_index", &test_end_to_end_no_event_index },
+	{ "end_to_end_in_order", &test_end_to_end_in_order },
+	{ "end_to_end_packed", &test_end_to_end_packed },
+	{ "end_to_end_packed_concurrent_submitters", &test_end_to_end_packed_concurrent_submitters },
+	{ "end_to_end_packed_no_event_index", &test_end_to_end_packed_no_event_index },
+	{ "max_queue_size", &test_max_queue_size },
+};
+
+int main(int argc, const char* argv[])
+{
+	unsigned num_run = 0;
+	unsigned num_failed = 0;
+	for (const TestCase& test : tests)
+	{
+		if (argc > 1 && strcmp(argv[1], test.name) != 0)
+			continue;
+		++num_run;
+		bool ok = test.function();
+		printf("%s: %s\n", test.name, ok ? "ok" : "FAILED");
+		if (!ok)
+			++num_failed;
+	}
+	if (num_run == 0)
+	{
+		fprintf(stderr, "No test named '%s'.\n", argc > 1 ? argv[1] : "");
+		return 2;
+	}
+	return num_failed == 0 ? 0 : 1;
+}
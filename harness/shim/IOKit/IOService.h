@@ -0,0 +1,2 @@
+// Harness shim, see KernelShim.h
+#include "../KernelShim.h"
@@ -0,0 +1,348 @@
+//
+//  KernelShim.h
+//  virtio-osx harness
+//
+//
+
+#ifndef __virtio_osx__KernelShim__
+#define __virtio_osx__KernelShim__
+
+/* The handful of libkern and IOKit declarations the virtqueue engines
+ * (VirtioSplitVirtqueue.cpp and VirtioPackedVirtqueue.cpp, via
+ * VirtioPlatform.h and VirtioDevice.h) need, implemented on top of the C++
+ * runtime so that they build and run as an ordinary user space program.
+ * "Physical" addresses are plain pointers. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The virtqueue harness only supports little endian hosts."
+#endif
+
+typedef uint8_t UInt8;
+typedef int16_t SInt16;
+typedef uint16_t UInt16;
+typedef int32_t SInt32;
+typedef uint32_t UInt32;
+typedef int64_t SInt64;
+typedef uint64_t UInt64;
+typedef UInt32 IOOptionBits;
+
+typedef int IOReturn;
+enum
+{
+	kIOReturnSuccess = 0,
+	kIOReturnError = 0x2bc,
+	kIOReturnNoMemory = 0x2bd,
+	kIOReturnBadArgument = 0x2c2,
+	kIOReturnUnsupported = 0x2c7,
+	kIOReturnInternalError = 0x2c9,
+	kIOReturnBusy = 0x2d5,
+	kIOReturnNoSpace = 0x2db,
+	kIOReturnOverrun = 0x2e8,
+};
+
+// libkern/OSAtomic.h: these return the value before the operation
+static inline void OSMemoryBarrier()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+static inline void OSSynchronizeIO()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+static inline bool OSCompareAndSwap(UInt32 old_value, UInt32 new_value, volatile UInt32* address)
+{
+	return __sync_bool_compare_and_swap(address, old_value, new_value);
+}
+
+static inline bool OSCompareAndSwap64(UInt64 old_value, UInt64 new_value, volatile UInt64* address)
+{
+	return __sync_bool_compare_and_swap(address, old_value, new_value);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+	return __sync_fetch_and_add(address, 1);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+	return __sync_fetch_and_sub(address, 1);
+}
+
+static inline SInt16 OSAddAtomic16(SInt32 amount, volatile SInt16* address)
+{
+	return __sync_fetch_and_add(address, static_cast<SInt16>(amount));
+}
+
+static inline SInt64 OSIncrementAtomic64(volatile SInt64* address)
+{
+	return __sync_fetch_and_add(address, 1);
+}
+
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+	return __sync_fetch_and_add(address, amount);
+}
+
+// libkern/OSByteOrder.h, little endian hosts only
+#define OSSwapLittleToHostInt16(x) (static_cast<uint16_t>(x))
+#define OSSwapLittleToHostInt32(x) (static_cast<uint32_t>(x))
+#define OSSwapLittleToHostInt64(x) (static_cast<uint64_t>(x))
+#define OSSwapHostToLittleInt16(x) (static_cast<uint16_t>(x))
+#define OSSwapHostToLittleInt32(x) (static_cast<uint32_t>(x))
+
+// IOKit/IOLib.h
+static inline void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static inline void IOLog(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+static inline void* IOMalloc(size_t size)
+{
+	return malloc(size);
+}
+
+static inline void IOFree(void* address, size_t size)
+{
+	free(address);
+}
+
+static inline void* IOMallocAligned(size_t size, size_t alignment)
+{
+	void* address = nullptr;
+	if (alignment < sizeof(void*))
+		alignment = sizeof(void*);
+	if (posix_memalign(&address, alignment, size) != 0)
+		return nullptr;
+	return address;
+}
+
+static inline void IOFreeAligned(void* address, size_t size)
+{
+	free(address);
+}
+
+// IOKit/IOLocks.h
+struct IOSimpleLock
+{
+	std::atomic_flag held;
+};
+
+static inline IOSimpleLock* IOSimpleLockAlloc()
+{
+	IOSimpleLock* lock = new IOSimpleLock;
+	lock->held.clear();
+	return lock;
+}
+
+static inline void IOSimpleLockFree(IOSimpleLock* lock)
+{
+	delete lock;
+}
+
+static inline void IOSimpleLockLock(IOSimpleLock* lock)
+{
+	// a holder may have been preempted, which can't happen in the kernel
+	while (lock->held.test_and_set(std::memory_order_acquire))
+		std::this_thread::yield();
+}
+
+static inline void IOSimpleLockUnlock(IOSimpleLock* lock)
+{
+	lock->held.clear(std::memory_order_release);
+}
+
+// libkern C++ runtime and IOService, only as far as VirtioDevice.h declares against them
+#define OSDeclareAbstractStructors(className)
+#define OSMetaClassDeclareReservedUnused(className, index)
+#define OSSafeReleaseNULL(object) do { if ((object) != nullptr) (object)->release(); (object) = nullptr; } while (0)
+
+class OSDictionary;
+class OSObject
+{
+public:
+	OSObject() : retain_count(1) {}
+	virtual ~OSObject() {}
+	void retain() { ++this->retain_count; }
+	void release()
+	{
+		if (--this->retain_count == 0)
+			delete this;
+	}
+private:
+	std::atomic<int> retain_count;
+};
+
+class IOService : public OSObject
+{
+public:
+	virtual bool init(OSDictionary* dictionary = nullptr) { return true; }
+	virtual bool matchPropertyTable(OSDictionary* table, SInt32* score) { return true; }
+};
+
+// IOKit/IOMemoryDescriptor.h: a list of virtually (and so "physically") contiguous ranges
+typedef struct task* task_t;
+static task_t const kernel_task = nullptr;
+typedef UInt64 mach_vm_address_t;
+typedef UInt64 mach_vm_size_t;
+enum
+{
+	kIODirectionInOut = 3,
+	kIOMemoryPhysicallyContiguous = 0x10,
+};
+
+struct IOAddressRange
+{
+	mach_vm_address_t address;
+	mach_vm_size_t length;
+};
+
+class IOMemoryDescriptor : public OSObject
+{
+public:
+	static IOMemoryDescriptor* withAddressRanges(IOAddressRange* ranges, UInt32 rangeCount, IOOptionBits options, task_t task)
+	{
+		IOMemoryDescriptor* memory = new IOMemoryDescriptor;
+		memory->ranges.assign(ranges, ranges + rangeCount);
+		for (UInt32 i = 0; i < rangeCount; ++i)
+			memory->length += ranges[i].length;
+		return memory;
+	}
+	UInt64 getLength() const { return this->length; }
+	
+	std::vector<IOAddressRange> ranges;
+protected:
+	IOMemoryDescriptor() : length(0) {}
+	UInt64 length;
+};
+
+// IOKit/IOBufferMemoryDescriptor.h
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+public:
+	static IOBufferMemoryDescriptor* inTaskWithPhysicalMask(task_t inTask, IOOptionBits options, mach_vm_size_t capacity, mach_vm_address_t physicalMask)
+	{
+		void* bytes = IOMallocAligned(capacity, static_cast<size_t>(~physicalMask + 1u));
+		if (bytes == nullptr)
+			return nullptr;
+		IOBufferMemoryDescriptor* memory = new IOBufferMemoryDescriptor;
+		memory->bytes = bytes;
+		memory->length = capacity;
+		IOAddressRange range = { reinterpret_cast<uintptr_t>(bytes), capacity };
+		memory->ranges.push_back(range);
+		return memory;
+	}
+	~IOBufferMemoryDescriptor() { IOFreeAligned(this->bytes, this->length); }
+	void* getBytesNoCopy() { return this->bytes; }
+private:
+	IOBufferMemoryDescriptor() : bytes(nullptr) {}
+	void* bytes;
+};
+
+// IOKit/IODMACommand.h: generates a memory descriptor's ranges as segments
+class IODMACommand : public OSObject
+{
+public:
+	struct Segment64
+	{
+		UInt64 fIOVMAddr;
+		UInt64 fLength;
+	};
+	typedef bool (*SegmentFunction)(IODMACommand* target, Segment64 segment, void* segments, UInt32 segmentIndex);
+	enum MappingOptions
+	{
+		kMapped = 0,
+	};
+	
+	static bool OutputHost64(IODMACommand* target, Segment64 segment, void* segments, UInt32 segmentIndex)
+	{
+		static_cast<Segment64*>(segments)[segmentIndex] = segment;
+		return true;
+	}
+	
+	static IODMACommand* withSpecification(SegmentFunction outSegFunc, UInt8 numAddressBits, UInt64 maxSegmentSize,
+		MappingOptions mappingOptions = kMapped, UInt64 maxTransferSize = 0, UInt32 alignment = 1)
+	{
+		IODMACommand* command = new IODMACommand;
+		command->output_segment = outSegFunc;
+		command->max_segment_size = maxSegmentSize;
+		return command;
+	}
+	
+	IOReturn setMemoryDescriptor(IOMemoryDescriptor* mem, bool autoPrepare = true)
+	{
+		// the engines must complete a command before reusing it
+		if (this->memory != nullptr)
+			return kIOReturnBusy;
+		mem->retain();
+		this->memory = mem;
+		return kIOReturnSuccess;
+	}
+	
+	IOReturn clearMemoryDescriptor(bool autoComplete = true)
+	{
+		if (this->memory != nullptr)
+		{
+			this->memory->release();
+			this->memory = nullptr;
+			++this->num_completions;
+		}
+		return kIOReturnSuccess;
+	}
+	
+	IOReturn genIOVMSegments(UInt64* offset, void* segments, UInt32* numSegments)
+	{
+		if (this->memory == nullptr || *offset >= this->memory->getLength())
+			return kIOReturnOverrun;
+		UInt32 generated = 0;
+		UInt64 range_start = 0;
+		for (const IOAddressRange& range : this->memory->ranges)
+		{
+			while (generated < *numSegments && *offset < range_start + range.length)
+			{
+				UInt64 range_offset = *offset - range_start;
+				Segment64 segment = { range.address + range_offset, range.length - range_offset };
+				if (this->max_segment_size != 0 && segment.fLength > this->max_segment_size)
+					segment.fLength = this->max_segment_size;
+				if (!this->output_segment(this, segment, segments, generated))
+				{
+					*numSegments = generated;
+					return kIOReturnSuccess;
+				}
+				++generated;
+				*offset += segment.fLength;
+			}
+			range_start += range.length;
+		}
+		*numSegments = generated;
+		return kIOReturnSuccess;
+	}
+	
+	/// Number of times a mapping has been completed and torn down
+	unsigned num_completions;
+	
+private:
+	IODMACommand() : num_completions(0), output_segment(nullptr), max_segment_size(0), memory(nullptr) {}
+	~IODMACommand() { this->clearMemoryDescriptor(); }
+	SegmentFunction output_segment;
+	UInt64 max_segment_size;
+	IOMemoryDescriptor* memory;
+};
+
+#endif /* defined(__virtio_osx__KernelShim__) */
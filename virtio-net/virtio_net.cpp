@@ -33,6 +33,8 @@
 #include <IOKit/IOFilterInterruptEventSource.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netinet/ip6.h>
 #include <net/ethernet.h>
 
 // darwin doesn't have inttypes.h TODO: build an inttypes.h for the kernel
@@ -170,6 +172,16 @@ bool PJVirtioNet::init(OSDictionary* properties)
 	{
 		pref_allow_offloading = pref_allow_offloading_default;
 	}
+	OSBoolean* allow_large_receive_val = NULL;
+	if (properties && ((allow_large_receive_val = OSDynamicCast(OSBoolean, properties->getObject("PJVirtioNetAllowLargeReceive")))))
+	{
+		pref_allow_large_receive = allow_large_receive_val->getValue();
+		VIOLog("virtio-net: Large receive (guest TSO) %sALLOWED by plist preferences.\n", pref_allow_large_receive ? "" : "DIS");
+	}
+	else
+	{
+		pref_allow_large_receive = pref_allow_large_receive_default;
+	}
 	virtio_net_log_property_dict(properties);
 	
 	transmit_packets_to_free = NULL;
@@ -239,6 +251,12 @@ enum VirtioPCIFeatureBits
 	/// "high" features are supported
 	VIRTIO_F_FEATURES_HIGH = (1u << 31u),
 	
+	// feature bits 32 and up, only offered by modern devices
+	VIRTIO_F_VERSION_1 = (1ull << 32u),
+	VIRTIO_F_RING_PACKED = (1ull << 34u),
+	VIRTIO_F_IN_ORDER = (1ull << 35u),
+	VIRTIO_F_NOTIFICATION_DATA = (1ull << 38u),
+	
 	VIRTIO_ALL_KNOWN_FEATURES =
 		VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_CTRL_GUEST_OFFLOADS | VIRTIO_NET_F_MAC
 		| VIRTIO_NET_F_GSO | VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6
@@ -248,6 +266,7 @@ enum VirtioPCIFeatureBits
 		| VIRTIO_NET_F_CTRL_RX | VIRTIO_NET_F_CTRL_VLAN
 		| VIRTIO_NET_F_CTRL_RX_EXTRA | VIRTIO_NET_F_GUEST_ANNOUNCE
 		|	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_F_RING_INDIRECT_DESC
+		| VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED | VIRTIO_F_IN_ORDER | VIRTIO_F_NOTIFICATION_DATA
 		| VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_BAD_FEATURE | VIRTIO_F_FEATURES_HIGH
 };
 
@@ -261,6 +280,7 @@ struct virtio_net_config
 
 // Packet header flags
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
 #define VIRTIO_NET_HDR_GSO_NONE 0 
 #define VIRTIO_NET_HDR_GSO_TCPV4 1
 #define VIRTIO_NET_HDR_GSO_UDP 3
@@ -278,6 +298,10 @@ struct virtio_net_hdr
 	/* Only if	VIRTIO_NET_F_MRG_RXBUF: */
 	uint16_t num_buffers[];
 };
+/// Header length when the num_buffers field is present (VIRTIO_NET_F_MRG_RXBUF or VIRTIO_F_VERSION_1)
+#define VIRTIO_NET_HDR_MRG_RXBUF_LEN (sizeof(virtio_net_hdr) + sizeof(uint16_t))
+/// Largest packet the device may deliver with guest TSO: maximum IP packet plus (VLAN tagged) ethernet header
+static const uint32_t VIRTIO_NET_MAX_LARGE_RECEIVE_SIZE = IP_MAXPACKET + ETHER_HDR_LEN + ETHER_VLAN_ENCAP_LEN;
 
 struct virtio_net_packet
 {
@@ -285,6 +309,8 @@ struct virtio_net_packet
 	{
 		// Used as the first virtqueue buffer.
 		virtio_net_hdr header;
+		// Makes room for num_buffers; only the first net_header_len bytes are transferred.
+		uint8_t header_space[VIRTIO_NET_HDR_MRG_RXBUF_LEN];
 		// When dequeued by the debugger, the packet is not freed but simply linked to the
 		virtio_net_packet* next_free;
 	};
@@ -301,7 +327,7 @@ struct virtio_net_packet
 };
 
 
-static void log_feature(uint32_t feature_bitmap, uint32_t feature, const char* feature_name)
+static void log_feature(uint64_t feature_bitmap, uint64_t feature, const char* feature_name)
 {
 	if (feature_bitmap & feature)
 	{
@@ -313,13 +339,17 @@ static void log_feature(uint32_t feature_bitmap, uint32_t feature, const char* f
 #define LOG_FEATURE(FEATURES, FEATURE) \
 log_feature(FEATURES, FEATURE, #FEATURE)
 
-static void virtio_log_supported_features(uint32_t dev_features)
+static void virtio_log_supported_features(uint64_t dev_features)
 {
-	VIOLog("virtio-net: Device reports LOW feature bitmap 0x%08x.\n", dev_features);
+	VIOLog("virtio-net: Device reports feature bitmap 0x%016llx.\n", dev_features);
 	VIOLog("virtio-net: Recognised generic virtio features:\n");
 	LOG_FEATURE(dev_features, VIRTIO_F_NOTIFY_ON_EMPTY);    // Supported by VBox 4.1.0, Qemu 1.3
 	LOG_FEATURE(dev_features, VIRTIO_F_RING_INDIRECT_DESC); // Supported by Qemu 1.3
 	LOG_FEATURE(dev_features, VIRTIO_F_RING_EVENT_IDX);     // Supported by Qemu 1.3
+	LOG_FEATURE(dev_features, VIRTIO_F_VERSION_1);
+	LOG_FEATURE(dev_features, VIRTIO_F_RING_PACKED);
+	LOG_FEATURE(dev_features, VIRTIO_F_IN_ORDER);
+	LOG_FEATURE(dev_features, VIRTIO_F_NOTIFICATION_DATA);
 
 	// legacy bits, no longer in the 0.9.5 spec, but log them if they do turn up
 	LOG_FEATURE(dev_features, VIRTIO_F_BAD_FEATURE);        // Must mask this out
@@ -348,10 +378,10 @@ static void virtio_log_supported_features(uint32_t dev_features)
 
 	
 	
-	uint32_t unrecognised = dev_features & ~static_cast<uint32_t>(VIRTIO_ALL_KNOWN_FEATURES);
+	uint64_t unrecognised = dev_features & ~static_cast<uint64_t>(VIRTIO_ALL_KNOWN_FEATURES);
 	if (unrecognised > 0)
 	{
-		VIOLog("Feature bits not recognised by this driver: 0x%08x\n", unrecognised);
+		VIOLog("Feature bits not recognised by this driver: 0x%016llx\n", unrecognised);
 	}
 }
 
@@ -392,31 +422,55 @@ void PJVirtioNet::receiveQueueCompletion(OSObject* target, void* ref, bool devic
 
 void PJVirtioNet::receiveQueueCompletion(virtio_net_packet* packet, bool device_reset, uint32_t num_bytes_written)
 {
+	if (device_reset)
+	{
+		if (this->receive_buffers_posted > 0)
+			--this->receive_buffers_posted;
+		if (packet->mbuf)
+			freePacket(packet->mbuf);
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
+		// a partially received packet will never be completed now
+		discardMergedPacket();
+		return;
+	}
+	
 	if (this->debugger_receive_mem != nullptr)
 	{
-		UInt32 copy_len = min(num_bytes_written - sizeof(virtio_net_hdr), this->debugger_receive_size);
-		errno_t e = mbuf_copydata(packet->mbuf, 0, copy_len, this->debugger_receive_mem);
-		if (e != 0)
-			this->debugger_receive_size = 0;
+		if (this->feature_mergeable_rx_buffers)
+		{
+			debuggerReceiveMergeableBuffer(packet, num_bytes_written);
+		}
 		else
-			this->debugger_receive_size = copy_len;
+		{
+			UInt32 copy_len = 0;
+			if (num_bytes_written > this->net_header_len)
+				copy_len = min(num_bytes_written - this->net_header_len, this->debugger_receive_size);
+			errno_t e = mbuf_copydata(packet->mbuf, 0, copy_len, this->debugger_receive_mem);
+			if (e != 0)
+				this->debugger_receive_size = 0;
+			else
+				this->debugger_receive_size = copy_len;
+		}
 
 		// immediately re-queue into available ring
 		VirtioCompletion completion = { &receiveQueueCompletion, this, packet };
-		this->virtio_dev->submitBuffersToVirtqueue(RECEIVE_QUEUE_INDEX, nullptr, packet->dma_md, completion);
+		if (this->feature_mergeable_rx_buffers)
+			this->virtio_dev->submitBuffersToVirtqueue(RECEIVE_QUEUE_INDEX, nullptr, packet->mbuf_md, completion);
+		else
+			this->virtio_dev->submitBuffersToVirtqueue(RECEIVE_QUEUE_INDEX, nullptr, packet->dma_md, completion);
 		
 		return;
 	}
 	else
 	{
-		this->handleReceivedPacket(packet);
-			/*
-			IOLog("virtio-net interruptAction(): Populated receive buffers: %u free descriptors left, avail idx %u\n",
-				rx_queue.num_free_desc, rx_queue.avail->idx);
-			*/
-	
+		if (this->feature_mergeable_rx_buffers)
+			this->handleMergeableReceiveBuffer(packet, num_bytes_written);
+		else
+			this->handleReceivedPacket(packet, num_bytes_written);
 		
-		// Ensure there are plenty of receive buffers
+		// Ensure there are plenty of receive buffers; runs inside the completion
+		// batch, so the refills are published to the device together.
 		this->populateReceiveBuffers();
 	}
 }
@@ -424,13 +478,7 @@ void PJVirtioNet::receiveQueueCompletion(virtio_net_packet* packet, bool device_
 void PJVirtioNet::transmitQueueCompletion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
 {
 	PJVirtioNet* me = static_cast<PJVirtioNet*>(target);
-			/*kprintf("TX queue last used idx: %u, tx_queue used: %p, desc: %p, avail: %p, free: %u, head: %u\n",
-				tx_queue.last_used_idx, tx_queue.used, tx_queue.desc, tx_queue.avail, tx_queue.num_free_desc, tx_queue.free_desc_head);
-			*/
-			//IOLog("TX queue last used idx (%u) differs from current (%u), freeing packets.\n", tx_queue.last_used_idx, tx_queue.used->idx);
-			
-			me->releaseSentPacket(static_cast<virtio_net_packet*>(ref));
-	
+	me->releaseSentPacket(static_cast<virtio_net_packet*>(ref));
 }
 
 
@@ -439,7 +487,7 @@ UInt32 PJVirtioNet::getFeatures() const
 #warning TODO: probably can report some extra features here
 	if (driver_state == kDriverStateInitial)
 		VIOLog("virtio-net getFeatures(): Warning! System asked about driver features before they could be detected.\n");
-	return (feature_tso_v4 ? kIONetworkFeatureTSOIPv4 : 0);
+	return (feature_tso_v4 ? kIONetworkFeatureTSOIPv4 : 0) | (feature_tso_v6 ? kIONetworkFeatureTSOIPv6 : 0);
 }
 
 bool PJVirtioNet::start(IOService* provider)
@@ -497,6 +545,74 @@ bool PJVirtioNet::start(IOService* provider)
 	return true;
 }
 
+/// Feature bits the driver will request, given those offered by the device
+uint64_t PJVirtioNet::desiredFeatures(uint64_t dev_features) const
+{
+	/* VIRTIO_F_IN_ORDER is deliberately not requested: a batched used entry
+	 * only reports the written length of its last request, and receive
+	 * buffers need the length of every packet. VIRTIO_F_VERSION_1 is only
+	 * ever offered by the modern transport, which requires it.
+	 */
+	uint64_t features = VIRTIO_F_VERSION_1 | VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_F_RING_EVENT_IDX
+		| VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_NET_F_MRG_RXBUF;
+	if (pref_allow_offloading)
+	{
+		features |= VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | VIRTIO_NET_F_GUEST_CSUM;
+		// large receive needs GUEST_CSUM and mergeable buffers, see setNegotiatedFeatures()
+		if (pref_allow_large_receive
+			&& 0 != (dev_features & VIRTIO_NET_F_GUEST_CSUM) && 0 != (dev_features & VIRTIO_NET_F_MRG_RXBUF))
+		{
+			features |= VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN;
+		}
+	}
+	features &= dev_features;
+	// host TSO is meaningless without checksum offload
+	if (0 == (features & VIRTIO_NET_F_CSUM))
+		features &= ~(VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6);
+	return features;
+}
+
+/// Sets the feature flags, header length and receive buffer size from a negotiated feature mask
+void PJVirtioNet::setNegotiatedFeatures(uint64_t features)
+{
+	// We can use the notify-on-empty feature to permanently disable transmission interrupts
+	feature_notify_on_empty = (0 != (features & VIRTIO_F_NOTIFY_ON_EMPTY));
+	
+	/* Checksum offloading and IPv4/IPv6 TCP segmentation; checksumming is
+	 * necessary to enable TSO. OSX won't provide us with a partial checksum
+	 * for the pseudo header, so we calculate that ourselves.
+	 */
+	feature_checksum_offload = (0 != (features & VIRTIO_NET_F_CSUM));
+	feature_tso_v4 = feature_checksum_offload && (0 != (features & VIRTIO_NET_F_HOST_TSO4));
+	feature_tso_v6 = feature_checksum_offload && (0 != (features & VIRTIO_NET_F_HOST_TSO6));
+	
+	/* Mergeable receive buffers let us post page-sized buffers with the header
+	 * inline, one descriptor each, instead of a header plus full-size mbuf.
+	 * The header grows by the num_buffers field in that case, and always has it
+	 * with VIRTIO_F_VERSION_1 (which the modern transport always negotiates).
+	 */
+	feature_mergeable_rx_buffers = (0 != (features & VIRTIO_NET_F_MRG_RXBUF));
+	net_header_len = static_cast<uint32_t>(
+		(feature_mergeable_rx_buffers || 0 != (features & VIRTIO_F_VERSION_1))
+		? VIRTIO_NET_HDR_MRG_RXBUF_LEN : sizeof(virtio_net_hdr));
+	receive_buffer_size = feature_mergeable_rx_buffers ? PAGE_SIZE : kIOEthernetMaxPacketSize;
+	
+	/* Receive checksum offload: the device tells us which packets it has
+	 * already verified, and may leave the checksum of packets which never left
+	 * the host incomplete, for us to fill in.
+	 */
+	feature_rx_checksum_offload = (0 != (features & VIRTIO_NET_F_GUEST_CSUM));
+	
+	/* Large receive: the device may hand us coalesced TCP segments of up to
+	 * 64KiB. Only worth it (and, without mergeable buffers, only possible
+	 * without posting 64KiB per slot) with mergeable buffers. The spec requires
+	 * GUEST_CSUM for guest TSO, as the device won't fill in the checksum of
+	 * a coalesced segment.
+	 */
+	feature_large_receive = feature_rx_checksum_offload && feature_mergeable_rx_buffers
+		&& 0 != (features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6));
+}
+
 bool PJVirtioNet::startWithIOEnabled()
 {
 	PJLogVerbose("virtio-net start(): Device Initialisation Sequence\n");
@@ -504,30 +620,17 @@ bool PJVirtioNet::startWithIOEnabled()
 	// partially start up the device
 	this->virtio_dev->resetDevice();
 
-	uint32_t dev_features = this->virtio_dev->supportedFeatures();
+	uint64_t dev_features = this->virtio_dev->supportedFeatures();
 #ifdef PJ_VIRTIO_NET_VERBOSE
 	virtio_log_supported_features(dev_features);
 #endif
 	this->dev_feature_bitmap = dev_features;
 	
-	// We can use the notify-on-empty feature to permanently disable transmission interrupts
-	feature_notify_on_empty = (0 != (dev_features & VIRTIO_F_NOTIFY_ON_EMPTY));
-	
-	/* If supported, enable checksum offloading and IPv4 TCP segmentation, as this
-	 * is necessary to enable TSO - we won't actually use the checksum offload
-	 * mechanism itself as OSX won't provide us with a partial checksum for the
-	 * pseudo header.
+	/* The interface is configured (TSO, checksum support) before the device
+	 * is enabled, so set up the feature flags as if everything we'd request
+	 * was accepted. enablePartial() redoes this with the negotiated features.
 	 */
-	feature_checksum_offload = false;
-	feature_tso_v4 = false;
-	if (pref_allow_offloading)
-	{
-		feature_checksum_offload = (0 != (dev_features & VIRTIO_NET_F_CSUM));
-		if (feature_checksum_offload)
-		{
-			feature_tso_v4 = (0 != (dev_features & VIRTIO_NET_F_HOST_TSO4));
-		}
-	}
+	setNegotiatedFeatures(desiredFeatures(dev_features));
 	
 	determineMACAddress();
 	detectLinkStatusFeature();
@@ -722,11 +825,10 @@ bool PJVirtioNet::enablePartial()
 		return false;
 	}
 	
-	uint32_t dev_features = this->virtio_dev->supportedFeatures();
+	uint64_t dev_features = this->virtio_dev->supportedFeatures();
 
 	// write back supported features
-	uint32_t supported_features = dev_features &
-		(VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | (feature_checksum_offload ? (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4) : 0));
+	uint64_t supported_features = desiredFeatures(dev_features);
 	if (!this->virtio_dev->requestFeatures(supported_features))
 	{
 		this->virtio_dev->failDevice();
@@ -734,7 +836,9 @@ bool PJVirtioNet::enablePartial()
 		return false;
 	}
 	this->dev_feature_bitmap = supported_features;
-	PJLogVerbose("virtio-net enable(): Wrote driver-supported feature bits: 0x%08X\n", supported_features);
+	// header layout, buffer size and offloads all follow from what was actually negotiated
+	setNegotiatedFeatures(supported_features);
+	PJLogVerbose("virtio-net enable(): Wrote driver-supported feature bits: 0x%016llX\n", supported_features);
 
 	// Initialise the receive and transmit virtqueues, both with interrupts disabled
 	bool interrupts_enabled[] = {false, false};
@@ -747,16 +851,27 @@ bool PJVirtioNet::enablePartial()
 		this->virtio_dev->close(this);
 		return false;
 	}
+	this->virtio_dev->setVirtqueueCompletionPassAction(RECEIVE_QUEUE_INDEX, &receivePassComplete, this);
 	this->receive_virtqueue_length = virtqueue_lengths[RECEIVE_QUEUE_INDEX];
 	this->transmit_virtqueue_length = virtqueue_lengths[TRANSMIT_QUEUE_INDEX];
+	this->receive_buffers_posted = 0;
+	discardMergedPacket();
 	
 	// Don't support VIRTIO_NET_F_CTRL_VQ for now
 	
 			
 	
 	// tell device we're ready
-	this->virtio_dev->startDevice(&configChangeHandler, this);
+	this->virtio_dev->startDevice(&configChangeHandler, this, this->work_loop);
 	PJLogVerbose("virtio-net enable(): Device set to 'driver ok' state.\n");
+	
+	/* The output queue hands us one packet at a time with no end-of-batch
+	 * signal, so let consecutive transmissions share a notification. With
+	 * EVENT_IDX, a device that's busy draining the queue wouldn't ask for
+	 * them anyway; this saves the exits when it isn't. */
+	IOReturn coalesce_ret = this->virtio_dev->setVirtqueueKickCoalescing(TRANSMIT_QUEUE_INDEX, TRANSMIT_KICK_MAX_BATCH, TRANSMIT_KICK_MAX_DELAY_US);
+	if (coalesce_ret != kIOReturnSuccess)
+		VIOLog("virtio-net enable(): Warning! Failed to enable transmit notification coalescing (%x).\n", coalesce_ret);
 
 	// The virtqueues can now be used
 	
@@ -965,6 +1080,8 @@ IOReturn PJVirtioNet::disable(IONetworkInterface* interface)
 void PJVirtioNet::disablePartial()
 {
 	PJLogVerbose("virtio-net disablePartial()\n");
+	// deliver anything already received, but don't post any more receive buffers
+	this->receive_virtqueue_length = 0;
 	handleReceivedPackets();
 	releaseSentPackets();
 
@@ -1000,7 +1117,7 @@ UInt32 PJVirtioNet::outputPacket(mbuf_t buffer, void *param)
 			was_stalled = true;
 			return kIOReturnOutputStall;
 		}
-		kprintf("virtio-net outputPacket(): failed to add packet (length: %lu, return value %X) to queue, dropping it.\n", mbuf_len(buffer), add_ret);
+		VIOLog("virtio-net outputPacket(): failed to add packet (length: %lu, return value %X) to queue, dropping it.\n", mbuf_len(buffer), add_ret);
 		freePacket(buffer);
 		return kIOReturnOutputDropped;
 	}
@@ -1042,16 +1159,21 @@ void PJVirtioNet::receivePacket(void *pkt, UInt32 *pktSize, UInt32 timeout)
 	this->debugger_receive_size = 0;
 }
 
-static void vring_push_free_desc(virtio_net_virtqueue& queue, uint16_t free_idx);
-static int32_t vring_pop_free_desc(virtio_net_virtqueue& queue);
-
 IOReturn PJVirtioNet::getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput)
 {
 	*checksumMask = 0;
 	if (checksumFamily != kChecksumFamilyTCPIP)
 		return kIOReturnUnsupported;
-	if (feature_checksum_offload)
-		*checksumMask = kChecksumTCP;
+	if (isOutput)
+	{
+		if (feature_checksum_offload)
+			*checksumMask = kChecksumTCP | kChecksumTCPIPv6 | kChecksumUDP | kChecksumUDPIPv6;
+	}
+	else if (feature_rx_checksum_offload)
+	{
+		// received TCP and UDP checksums are either verified by the host or completed by us
+		*checksumMask = kChecksumTCP | kChecksumUDP;
+	}
 	return kIOReturnSuccess;
 }
 
@@ -1071,7 +1193,7 @@ void PJVirtioNet::sendPacket(void *pkt, UInt32 pktSize)
 	
 	if (this->debugger_transmit_packet_in_use)
 	{
-		this->virtio_dev->pollCompletedRequestsInVirtqueue(TRANSMIT_QUEUE_INDEX);
+		this->releaseSentPackets(true /* from debugger */);
 		if (this->debugger_transmit_packet_in_use)
 		{
 			// previous packet hasn't sent yet
@@ -1082,18 +1204,14 @@ void PJVirtioNet::sendPacket(void *pkt, UInt32 pktSize)
 	virtio_net_packet* packet = this->debugger_transmit_packet;
 	mbuf_copyback(packet->mbuf, 0, pktSize, pkt, MBUF_DONTWAIT);
 
-	packet->header.flags = 0;
+	memset(packet->header_space, 0, sizeof(packet->header_space));
 	packet->header.gso_type = VIRTIO_NET_HDR_GSO_NONE;
-	packet->header.hdr_len = 0;
-	packet->header.gso_size = 0;
-	packet->header.csum_start = 0;
-	packet->header.csum_offset = 0;
 	
 	packet->mbuf_md->initWithMbuf(packet->mbuf, kIODirectionOut);
 	
 	packet->dma_md_subranges[0].md = packet->mem;
 	packet->dma_md_subranges[0].offset = 0;
-	packet->dma_md_subranges[0].length = sizeof(virtio_net_hdr);
+	packet->dma_md_subranges[0].length = this->net_header_len;
 	
 	packet->dma_md_subranges[1].md = packet->mbuf_md;
 	packet->dma_md_subranges[1].offset = 0;
@@ -1110,7 +1228,10 @@ void PJVirtioNet::sendPacket(void *pkt, UInt32 pktSize)
 		packet->dma_md->initWithDescriptorRanges(nullptr, 0, kIODirectionNone, false);
 		packet->mbuf_md->initWithMbuf(nullptr, kIODirectionNone);
 		this->debugger_transmit_packet_in_use = false;
+		return;
 	}
+	// the coalescing timer won't fire while the debugger holds the machine
+	this->virtio_dev->flushVirtqueueKicks(TRANSMIT_QUEUE_INDEX);
 }
 
 void PJVirtioNet::debuggerTransmitCompletionAction(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written)
@@ -1161,7 +1282,33 @@ virtio_net_packet* PJVirtioNet::allocPacket()
 	}
 }
 
-static void virtio_net_enable_tcp_csum(virtio_net_packet* packet, bool need_partial, mbuf_t packet_mbuf, uint16_t ip_hdr_len, struct ip* ip_hdr)
+/// Partial checksum of the IPv4 pseudo header, as the device expects to find it in the transport header's checksum field
+static uint16_t virtio_net_ipv4_pseudo_header_csum(const struct ip* ip_hdr, uint8_t protocol, unsigned transport_len)
+{
+	uint32_t csum_l = 0;
+	union
+	{
+		uint32_t l;
+		uint16_t s[2];
+	} tmp;
+	
+	tmp.l = ip_hdr->ip_src.s_addr;
+	csum_l += tmp.s[0];
+	csum_l += tmp.s[1];
+	
+	tmp.l = ip_hdr->ip_dst.s_addr;
+	csum_l += tmp.s[0];
+	csum_l += tmp.s[1];
+	
+	csum_l += htons(protocol);
+	csum_l += htons(transport_len & 0xffff);
+	
+	csum_l = (csum_l & 0xffff) + (csum_l >> 16);
+	
+	return (csum_l & 0xffff) + (csum_l >> 16);
+}
+
+static void virtio_net_enable_tcp_csum(virtio_net_hdr* header, bool need_partial, mbuf_t packet_mbuf, uint16_t ip_hdr_len, struct ip* ip_hdr)
 {
 	// calculate the pseudo-header checksum (this will be extended by the data checksum by the "hardware")
 	char* ip_start = reinterpret_cast<char*>(ip_hdr);
@@ -1170,29 +1317,7 @@ static void virtio_net_enable_tcp_csum(virtio_net_packet* packet, bool need_part
 	{
 			unsigned ip_len = ntohs(ip_hdr->ip_len);
 			unsigned tcp_len = ip_len - ip_hdr_len;
-			uint32_t csum_l = 0;
-			union
-			{
-				uint32_t l;
-				uint16_t s[2];
-			} tmp;
-			
-			tmp.l = ip_hdr->ip_src.s_addr;
-			csum_l += tmp.s[0];
-			csum_l += tmp.s[1];
-			
-			tmp.l = ip_hdr->ip_dst.s_addr;
-			csum_l += tmp.s[0];
-			csum_l += tmp.s[1];
-			
-			csum_l += htons(ip_hdr->ip_p);
-			csum_l += htons(tcp_len & 0xffff);
-			
-			csum_l = (csum_l & 0xffff) + (csum_l >> 16);
-			
-			uint16_t csum = (csum_l & 0xffff) + (csum_l >> 16);
-			
-			tcp_hdr->th_sum = csum;
+			tcp_hdr->th_sum = virtio_net_ipv4_pseudo_header_csum(ip_hdr, ip_hdr->ip_p, tcp_len);
 		}
 		else
 		{
@@ -1209,21 +1334,120 @@ static void virtio_net_enable_tcp_csum(virtio_net_packet* packet, bool need_part
 				VIOLog("Warning! IP header refers to protocol %u, expected 6 for TCP!\n", ip_hdr->ip_p);
 			}
 			
-			packet->header.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
-			packet->header.csum_start = ETHER_HDR_LEN + ip_hdr_len;
-			packet->header.csum_offset = 16;
+			header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+			header->csum_start = ETHER_HDR_LEN + ip_hdr_len;
+			header->csum_offset = 16;
+}
+
+static void virtio_net_enable_udp_csum(virtio_net_hdr* header, uint16_t ip_hdr_len, struct ip* ip_hdr)
+{
+	char* ip_start = reinterpret_cast<char*>(ip_hdr);
+	struct udphdr* udp_hdr = reinterpret_cast<struct udphdr*>(ip_start + ip_hdr_len);
+	if (ip_hdr->ip_p != IPPROTO_UDP)
+	{
+		VIOLog("Warning! IP header refers to protocol %u, expected 17 for UDP!\n", ip_hdr->ip_p);
+	}
+	
+	udp_hdr->uh_sum = virtio_net_ipv4_pseudo_header_csum(ip_hdr, IPPROTO_UDP, ntohs(ip_hdr->ip_len) - ip_hdr_len);
+	header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	header->csum_start = ETHER_HDR_LEN + ip_hdr_len;
+	header->csum_offset = offsetof(struct udphdr, uh_sum);
+}
+
+/// Locates the transport header behind an IPv6 header and any extension headers
+/** avail is the number of contiguous bytes from the start of the IPv6 header.
+ * Returns the transport header's offset from the IPv6 header, or 0 if the
+ * packet doesn't carry protocol, is fragmented, or its headers are not
+ * contiguous. */
+static unsigned virtio_net_ipv6_transport_offset(const struct ip6_hdr* ip6_hdr, size_t avail, uint8_t protocol)
+{
+	const uint8_t* ip_start = reinterpret_cast<const uint8_t*>(ip6_hdr);
+	unsigned offset = sizeof(*ip6_hdr);
+	uint8_t next_header = ip6_hdr->ip6_nxt;
+	// bounded in case of a malformed chain of headers
+	for (unsigned i = 0; i < 8 && offset < avail; ++i)
+	{
+		if (next_header == protocol)
+			return offset;
+		if (offset + 2 > avail)
+			return 0;
+		const uint8_t* ext = ip_start + offset;
+		switch (next_header)
+		{
+			case IPPROTO_HOPOPTS:
+			case IPPROTO_ROUTING:
+			case IPPROTO_DSTOPTS:
+				offset += (ext[1] + 1u) * 8u;
+				break;
+			case IPPROTO_AH:
+				offset += (ext[1] + 2u) * 4u;
+				break;
+			default:
+				// fragments can't be offloaded; anything else isn't what we're looking for
+				return 0;
+		}
+		next_header = ext[0];
+	}
+	return 0;
+}
+
+/// IPv6 version of virtio_net_ipv4_pseudo_header_csum
+static uint16_t virtio_net_ipv6_pseudo_header_csum(const struct ip6_hdr* ip6_hdr, uint8_t protocol, unsigned transport_len)
+{
+	// source and destination addresses, upper-layer length, next header
+	uint32_t csum_l = 0;
+	uint16_t addr_words[sizeof(ip6_hdr->ip6_src) / sizeof(uint16_t)];
+	memcpy(addr_words, &ip6_hdr->ip6_src, sizeof(addr_words));
+	for (unsigned i = 0; i < sizeof(addr_words) / sizeof(addr_words[0]); ++i)
+		csum_l += addr_words[i];
+	memcpy(addr_words, &ip6_hdr->ip6_dst, sizeof(addr_words));
+	for (unsigned i = 0; i < sizeof(addr_words) / sizeof(addr_words[0]); ++i)
+		csum_l += addr_words[i];
+	
+	csum_l += htons(transport_len & 0xffff);
+	csum_l += htons(protocol);
+	
+	csum_l = (csum_l & 0xffff) + (csum_l >> 16);
+	return (csum_l & 0xffff) + (csum_l >> 16);
+}
+
+/// IPv6 version of virtio_net_enable_tcp_csum and virtio_net_enable_udp_csum; transport_offset is relative to the IPv6 header
+/** UDP packets always need the partial checksum; for TCP, only non-TSO ones do. */
+static void virtio_net_enable_ipv6_csum(virtio_net_hdr* header, bool need_partial, struct ip6_hdr* ip6_hdr, uint8_t protocol, unsigned transport_offset)
+{
+	char* transport_hdr = reinterpret_cast<char*>(ip6_hdr) + transport_offset;
+	unsigned transport_len = ntohs(ip6_hdr->ip6_plen) + sizeof(*ip6_hdr) - transport_offset;
+	uint16_t csum = need_partial ? virtio_net_ipv6_pseudo_header_csum(ip6_hdr, protocol, transport_len) : 0;
+	unsigned csum_offset;
+	if (protocol == IPPROTO_UDP)
+	{
+		csum_offset = offsetof(struct udphdr, uh_sum);
+		reinterpret_cast<struct udphdr*>(transport_hdr)->uh_sum = csum;
+	}
+	else
+	{
+		csum_offset = offsetof(struct tcphdr, th_sum);
+		reinterpret_cast<struct tcphdr*>(transport_hdr)->th_sum = csum;
+	}
+	
+	header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	header->csum_start = ETHER_HDR_LEN + transport_offset;
+	header->csum_offset = csum_offset;
 }
 
 /* returns kIOReturnOutputStall if there aren't enough descriptors,
- * kIOReturnSuccess if everything went well, kIOReturnNoMemory if alloc failed,
- * and kIOReturnError if something else went wrong.
+ * kIOReturnSuccess if everything went well, kIOReturnOutputDropped if the
+ * packet could not be queued for any other reason.
  */
 IOReturn PJVirtioNet::addPacketToTransmitQueue(mbuf_t packet_mbuf)
 {
 	// when transmitting, we may want to request specific "hardware" features
 	bool requested_tcp_csum = false;
 	bool requested_tsov4 = false;
+	bool requested_tcp6_csum = false;
+	bool requested_tsov6 = false;
 	bool requested_udp_csum = false;
+	bool requested_udp6_csum = false;
 	mbuf_csum_request_flags_t tso_req = 0;
 	uint32_t tso_val = 0;
 
@@ -1232,7 +1456,7 @@ IOReturn PJVirtioNet::addPacketToTransmitQueue(mbuf_t packet_mbuf)
 		// deal with any checksum offloading requests
 		UInt32 demand_mask = 0;
 		getChecksumDemand(packet_mbuf, kChecksumFamilyTCPIP, &demand_mask);
-		if (demand_mask != 0 && demand_mask != kChecksumTCP)
+		if (0 != (demand_mask & ~(kChecksumTCP | kChecksumTCPIPv6 | kChecksumUDP | kChecksumUDPIPv6)))
 		{
 			static bool has_warned_bad_demand_mask = false;
 			if (!has_warned_bad_demand_mask)
@@ -1243,8 +1467,20 @@ IOReturn PJVirtioNet::addPacketToTransmitQueue(mbuf_t packet_mbuf)
 		{
 			requested_tcp_csum = true;
 		}
+		if (demand_mask & kChecksumTCPIPv6)
+		{
+			requested_tcp6_csum = true;
+		}
+		if (demand_mask & kChecksumUDP)
+		{
+			requested_udp_csum = true;
+		}
+		if (demand_mask & kChecksumUDPIPv6)
+		{
+			requested_udp6_csum = true;
+		}
 		
-		if (feature_tso_v4)
+		if (feature_tso_v4 || feature_tso_v6)
 		{
 			// may need to handle tso
 			errno_t tso_err = mbuf_get_tso_requested(packet_mbuf, &tso_req, &tso_val);
@@ -1267,24 +1503,128 @@ IOReturn PJVirtioNet::addPacketToTransmitQueue(mbuf_t packet_mbuf)
 				}
 				tso_req &= (MBUF_TSO_IPV4 | MBUF_TSO_IPV6);
 
-				if (tso_req == MBUF_TSO_IPV4)
+				if (tso_req == MBUF_TSO_IPV4 && feature_tso_v4)
 				{
 					requested_tsov4 = true;
 				}
+				else if (tso_req == MBUF_TSO_IPV6 && feature_tso_v6)
+				{
+					requested_tsov6 = true;
+				}
 				else
 				{
-					static bool has_had_tso6 = false;
-					//if (!has_had_tso6)
-						VIOLog("virtio-net addPacketToQueue(): Warning! mbuf_get_tso_requested() requested unexpected TCPv6 TSO: %08X\n", tso_req);
-					has_had_tso6 = true;
+					static bool has_had_bad_tso = false;
+					if (!has_had_bad_tso)
+						VIOLog("virtio-net addPacketToQueue(): Warning! mbuf_get_tso_requested() requested unexpected TSO: %08X\n", tso_req);
+					has_had_bad_tso = true;
 				}
 			}
 		}
 	}
-	return addPacketToQueue(packet_mbuf, TRANSMIT_QUEUE_INDEX, false /* device is not writing */);
+
+	// initialise the packet buffer header
+	virtio_net_hdr header = {};
+	header.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	
+	struct ip* ip_hdr = NULL;
+	unsigned ip_hdr_len = 0;
+	if (requested_tcp_csum || requested_tsov4 || requested_udp_csum)
+	{
+		// the IP and transport headers must be in the first mbuf
+		size_t transport_hdr_len = (requested_tcp_csum || requested_tsov4) ? sizeof(struct tcphdr) : sizeof(struct udphdr);
+		size_t head_len = mbuf_len(packet_mbuf);
+		void* hdr_data = mbuf_data(packet_mbuf);
+		const struct ether_header* eth_hdr = static_cast<const struct ether_header*>(hdr_data);
+		if (head_len >= ETHER_HDR_LEN + sizeof(struct ip) && eth_hdr->ether_type == htons(ETHERTYPE_IP))
+		{
+			char* ip_start = static_cast<char*>(hdr_data) + ETHER_HDR_LEN;
+			ip_hdr = reinterpret_cast<struct ip*>(ip_start);
+			ip_hdr_len = ip_hdr->ip_hl * 4;
+		}
+		if (ip_hdr == NULL || ip_hdr_len < sizeof(struct ip) || ETHER_HDR_LEN + ip_hdr_len + transport_hdr_len > head_len)
+		{
+			static bool has_warned_bad_ipv4 = false;
+			if (!has_warned_bad_ipv4)
+				VIOLog("virtio-net addPacketToQueue(): Warning! Could not locate transport header in IPv4 packet requesting offload, dropping it.\n");
+			has_warned_bad_ipv4 = true;
+			return kIOReturnOutputDropped;
+		}
+	}
+	
+	if (requested_tsov4 && !requested_tcp_csum)
+	{
+		// force checksum offloading if TSO is active, as each segment will need its own checksum
+		requested_tcp_csum = true;
+	}
+	if (requested_tcp_csum)
+	{
+		// write the appropriate fields to activate checksumming and calculate pseudo-header partial checksum if needed
+		virtio_net_enable_tcp_csum(
+			&header,
+			!requested_tsov4, //Partial checksum needed only for non-TSO packets
+			packet_mbuf, ip_hdr_len, ip_hdr);
+	}
+	else if (requested_udp_csum)
+	{
+		virtio_net_enable_udp_csum(&header, ip_hdr_len, ip_hdr);
+	}
+	
+	// finally, request TSO if necessary
+	if (requested_tsov4)
+	{
+		size_t head_len = mbuf_len(packet_mbuf);
+		header.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+		int max_head_len = kIOEthernetMaxPacketSize - kIOEthernetCRCSize - tso_val;
+		if (max_head_len >= 14 + 20 + 20) /* ethernet + IP + TCP */
+		{
+			if (head_len != max_head_len)
+			{
+				VIOLog("virtio-net addPacketToQueue(): Warning! head mbuf %lu does not match mtu-seg %d\n", head_len, max_head_len);
+			}
+		}
+		header.hdr_len = head_len; // not sure if this is right...
+		header.gso_size = tso_val;
+	}
+	
+	if (requested_tcp6_csum || requested_tsov6 || requested_udp6_csum)
+	{
+		// the IPv6, extension and transport headers must all be in the first mbuf
+		uint8_t protocol = requested_udp6_csum ? IPPROTO_UDP : IPPROTO_TCP;
+		size_t transport_hdr_len = requested_udp6_csum ? sizeof(struct udphdr) : sizeof(struct tcphdr);
+		size_t head_len = mbuf_len(packet_mbuf);
+		const struct ether_header* eth_hdr = static_cast<const struct ether_header*>(mbuf_data(packet_mbuf));
+		unsigned transport_offset = 0;
+		struct ip6_hdr* ip6_hdr = NULL;
+		if (head_len >= ETHER_HDR_LEN + sizeof(struct ip6_hdr) && eth_hdr->ether_type == htons(ETHERTYPE_IPV6))
+		{
+			ip6_hdr = reinterpret_cast<struct ip6_hdr*>(static_cast<char*>(mbuf_data(packet_mbuf)) + ETHER_HDR_LEN);
+			transport_offset = virtio_net_ipv6_transport_offset(ip6_hdr, head_len - ETHER_HDR_LEN, protocol);
+		}
+		if (transport_offset == 0 || ETHER_HDR_LEN + transport_offset + transport_hdr_len > head_len)
+		{
+			static bool has_warned_bad_ipv6 = false;
+			if (!has_warned_bad_ipv6)
+				VIOLog("virtio-net addPacketToQueue(): Warning! Could not locate transport header in IPv6 packet requesting offload, dropping it.\n");
+			has_warned_bad_ipv6 = true;
+			return kIOReturnOutputDropped;
+		}
+		
+		// as with IPv4, TSO packets need no partial checksum
+		virtio_net_enable_ipv6_csum(&header, !requested_tsov6, ip6_hdr, protocol, transport_offset);
+		
+		if (requested_tsov6)
+		{
+			const struct tcphdr* tcp_hdr = reinterpret_cast<const struct tcphdr*>(reinterpret_cast<char*>(ip6_hdr) + transport_offset);
+			header.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+			header.hdr_len = ETHER_HDR_LEN + transport_offset + tcp_hdr->th_off * 4u;
+			header.gso_size = tso_val;
+		}
+	}
+
+	return addPacketToQueue(packet_mbuf, TRANSMIT_QUEUE_INDEX, false /* device is not writing */, &header);
 }
 
-IOReturn PJVirtioNet::addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_index, bool for_writing)
+IOReturn PJVirtioNet::addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_index, bool for_writing, const virtio_net_hdr* header)
 {
 	// recycle or allocate memory for the packet virtio header buffer
 	virtio_net_packet* packet = allocPacket();
@@ -1295,18 +1635,16 @@ IOReturn PJVirtioNet::addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_index,
 	}
 
 	packet->mbuf = packet_mbuf;
-	IODirection buf_direction = for_writing ? kIODirectionOut : kIODirectionOut;
+	IODirection buf_direction = for_writing ? kIODirectionIn : kIODirectionOut;
 	if (!packet->mbuf_md->initWithMbuf(packet_mbuf, buf_direction))
 	{
 		VIOLog("virtio-net addPacketToQueue(): Failed to init mbuf memory descriptor\n");
-		packet_bufdesc_pool->setObject(packet->mem);
-		packet->mem->release();
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
 		return kIOReturnOutputDropped;
 	}
 	
-	packet->mem->setDirection(buf_direction);
-	
-	packet->dma_md_subranges[0].length = sizeof(packet->header);
+	packet->dma_md_subranges[0].length = this->net_header_len;
 	packet->dma_md_subranges[0].md = packet->mem;
 	packet->dma_md_subranges[0].offset = offsetof(virtio_net_packet, header);
 	packet->dma_md_subranges[1].length = packet->mbuf_md->getLength();
@@ -1315,233 +1653,156 @@ IOReturn PJVirtioNet::addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_index,
 	if (!packet->dma_md->initWithDescriptorRanges(packet->dma_md_subranges, 2, buf_direction, false))
 	{
 		VIOLog("virtio-net addPacketToQueue(): Failed to init virtqueue multi memory descriptor\n");
-		packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
-		packet_bufdesc_pool->setObject(packet->mem);
-		packet->mem->release();
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
 		return kIOReturnOutputDropped;
 	}
 
-	size_t head_len = mbuf_len(packet_mbuf);
-
-	// initialise the packet buffer header
-	packet->header.flags = 0;
-	packet->header.csum_start = 0;
-	packet->header.csum_offset = 0;
-	packet->header.gso_type = VIRTIO_NET_HDR_GSO_NONE;
-	packet->header.hdr_len = 0;
-	packet->header.gso_size = 0;
-	
-	
-	struct ip* ip_hdr = NULL;
-	unsigned ip_hdr_len = 0;
-	if (requested_tcp_csum || requested_tsov4 || requested_udp_csum)
-	{
-		void* hdr_data = mbuf_data(packet_mbuf);
-		char* ip_start = static_cast<char*>(hdr_data) + ETHER_HDR_LEN;
-		ip_hdr = reinterpret_cast<struct ip*>(ip_start);
-		ip_hdr_len = ip_hdr->ip_hl * 4;
-	}
+	memset(packet->header_space, 0, sizeof(packet->header_space));
+	if (header != NULL)
+		memcpy(&packet->header, header, sizeof(packet->header));
 	
-	if (requested_tsov4 && !requested_tcp_csum)
+	IOReturn ret;
+	if (for_writing)
 	{
-		// force checksum offloading if TSO is active, as each segment will need its own checksum
-		requested_tcp_csum = true;
+		VirtioCompletion completion = { &receiveQueueCompletion, this, packet };
+		ret = this->virtio_dev->submitBuffersToVirtqueue(queue_index, nullptr, packet->dma_md, completion);
 	}
-	if (requested_tcp_csum)
+	else
 	{
-		// write the appropriate fields to activate checksumming and calculate pseudo-header partial checksum if needed
-		virtio_net_enable_tcp_csum(
-			packet,
-			!requested_tsov4, //Partial checksum needed only for non-TSO packets
-			packet_mbuf, ip_hdr_len, ip_hdr);
+		VirtioCompletion completion = { &transmitQueueCompletion, this, packet };
+		ret = this->virtio_dev->submitBuffersToVirtqueue(queue_index, packet->dma_md, nullptr, completion);
 	}
-	
-	IOReturn ret = packet->dma_cmd->setMemoryDescriptor(packet->dma_md, true /* prepare */);
 	if (ret != kIOReturnSuccess)
 	{
-		VIOLog("virtio-net addPacketToQueue(): Failed to set memory descriptor for DMA command: %x\n", ret);
-		packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
-		packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
-		packet_bufdesc_pool->setObject(packet->mem);
-		packet->mem->release();
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
+		if (ret == kIOReturnBusy)
+			return kIOReturnOutputStall;
+		VIOLog("virtio-net addPacketToQueue(): submitting packet to queue %u failed: %x\n", queue_index, ret);
 		return kIOReturnOutputDropped;
 	}
 	
-	const uint16_t direction_flag = for_writing ? VRING_DESC_F_WRITE : 0;
-
-	// array for the allocated descriptors, -1 = not yet allocated
-	int32_t descs[max_segs];
-	for (unsigned i = 0; i < max_segs; ++i)
-		descs[i] = -1;
+	return kIOReturnSuccess;
+}
 
-	struct virtio_net_cursor_segment_context segment_context = {
-		this, queue, descs, max_segs, -1, direction_flag, 0, false, false, 0
-	};
-	
-	UInt64 offset = 0;
-	UInt32 segments = max_segs;
-	ret = packet->dma_cmd->genIOVMSegments(&offset, &segment_context, &segments);
-	if (ret != kIOReturnSuccess || offset < packet->dma_md->getLength())
-	{
-	
-		kprintf("virtio-net addPacketToQueue(): an error %x occurred. %u segments produced, offset reached %llu (of %llu) "
-			"max index: %d, error: %s, out of descriptors: %s, total length so far %u, descriptors allocated: %u, max segments: %u, free descriptors: %u.\n",
-			ret, (uint32_t)segments, offset, (uint64_t)packet->dma_md->getLength(), segment_context.max_segment_created,
-			segment_context.error ? "yes" : "no", segment_context.out_of_descriptors ? "yes" : "no", segment_context.total_len,
-			segment_context.descs_allocd, max_segs, queue.num_free_desc);
-		for (unsigned i = 0; i < max_segs; ++i)
-		{
-			if (descs[i] >= 0)
-			{
-				vring_push_free_desc(queue, descs[i]);
-			}
-		}
-		packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
-		packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
-		packet_bufdesc_pool->setObject(packet->mem);
-		packet->mem->release();
-		return kIOReturnOutputStall;
-	}
-	
-	if (offset != packet->dma_md->getLength())
+/// Detaches the packet from its memory descriptors and returns its memory to the pool; does not touch the mbuf
+void PJVirtioNet::returnPacketToPool(virtio_net_packet* packet)
+{
+	packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
+	packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
+	IOBufferMemoryDescriptor* mem = packet->mem;
+	if (mem)
 	{
-		VIOLog("virtio-net addPacketToQueue(): genIOVMSegments moved offset to %llu (expected %llu). %u segments created (max %u)\n", offset, (uint64_t)packet->dma_md->getLength(), (uint32_t)segments, max_segs);
+		packet_bufdesc_pool->setObject(mem);
 	}
-	if (segments != segment_context.max_segment_created + 1)
+	else
 	{
-		VIOLog("virtio-net addPacketToQueue(): genPhysicalSegments reports %lu, max index is %d!\n", (unsigned long)segments, segment_context.max_segment_created);
+		VIOLog("virtio-net returnPacketToPool(): warning, packet with no memory descriptor, probably leaking memory.\n");
 	}
+	OSSafeReleaseNULL(mem);
+}
 
-	uint16_t head_desc = descs[0];
-	uint16_t prev = head_desc;
-	for (unsigned i = 1; i < segments; ++i)
+/// Submits a page-sized mbuf to the receive queue as a single mergeable buffer
+/** The device writes the header to the start of the buffer, so no separate
+ * header descriptor is needed. Return values as for addPacketToQueue(). */
+IOReturn PJVirtioNet::addReceiveBufferToQueue(mbuf_t packet_mbuf)
+{
+	virtio_net_packet* packet = allocPacket();
+	if (!packet)
 	{
-		if (descs[i] < 0)
-		{
-			VIOLog("virtio-net addPacketToQueue(): no descriptor for index %u (%u total), max seg %d\n", i, (uint32_t)segments, segment_context.max_segment_created);
-			continue;
-		}
-		queue.desc[prev].next = descs[i];
-		queue.desc[prev].flags |= VRING_DESC_F_NEXT;
-		prev = descs[i];
+		VIOLog("virtio-net addReceiveBufferToQueue(): Failed to alloc packet\n");
+		return kIOReturnOutputDropped;
 	}
 
-	// finally, request TSO if necessary
-	if (requested_tsov4)
+	packet->mbuf = packet_mbuf;
+	if (!packet->mbuf_md->initWithMbuf(packet_mbuf, kIODirectionIn))
 	{
-		//IOLog("virtio-net addPacketToQueue(): TSO4 packet.\n");
-		static unsigned tso_packets = 0;
-		static unsigned tso4_packets = 0;
-		tso_packets++;
-				
-				
-		++tso4_packets;
-		packet->header.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-		int max_head_len = kIOEthernetMaxPacketSize - kIOEthernetCRCSize - tso_val;
-		if (max_head_len >= 14 + 20 + 20) /* ethernet + IP + TCP */
-		{
-			if (head_len != max_head_len)
-			{
-				VIOLog("virtio-net addPacketToQueue(): Warning! head mbuf %lu does not match mtu-seg %d\n", head_len, max_head_len);
-			}
-		}
-		packet->header.hdr_len = head_len; // not sure if this is right...
-		packet->header.gso_size = tso_val;
-#if 0				
-				if (tso_packets % 100 == 1)
-				{
-					VIOLog("virtio-net addPacketToQueue: %u TSO (%u TSO4) packets processed, current packet's length %u, segment size %u, ethernet+ip hdr len %u, total header len %lu, %u segments.\n",
-						tso_packets, tso4_packets, segment_context.total_len, packet->header.gso_size, packet->header.hdr_len, head_len, segments);
-//#if 0
-					uint16_t desc = head_desc;
-					while (true)
-					{
-						// TODO: Defend against infinite loop (out of range descriptors, circular lists)
-						/* note that lacking any driver bugs, this will only defend against a
-						 * buggy/malicious hypervisor, which is like fighting windmills.
-						 */
-						VIOLog("virtio-net addPacketToQueue(): used buffer %u: length %u.\n",
-							desc, tx_queue.desc[desc].len, packet);
-						if (0 == (tx_queue.desc[desc].flags & VRING_DESC_F_NEXT))
-							break;
-						desc = tx_queue.desc[desc].next;
-					}
-//#endif
-				}
-#endif		
+		VIOLog("virtio-net addReceiveBufferToQueue(): Failed to init mbuf memory descriptor\n");
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
+		return kIOReturnOutputDropped;
 	}
-
-	
-	// ensure we can find the packet again
-	queue.packets_for_descs[head_desc] = packet;
-	
-	// add the chain to the available ring
-	queue.avail->ring[at_avail_idx % queue.num] = head_desc;
-	++at_avail_idx;
 	
+	VirtioCompletion completion = { &receiveQueueCompletion, this, packet };
+	IOReturn ret = this->virtio_dev->submitBuffersToVirtqueue(RECEIVE_QUEUE_INDEX, nullptr, packet->mbuf_md, completion);
+	if (ret != kIOReturnSuccess)
+	{
+		packet->mbuf = NULL;
+		returnPacketToPool(packet);
+		if (ret == kIOReturnBusy)
+			return kIOReturnOutputStall;
+		VIOLog("virtio-net addReceiveBufferToQueue(): submitting buffer failed: %x\n", ret);
+		return kIOReturnOutputDropped;
+	}
 	return kIOReturnSuccess;
 }
 
-/// Fill the receive queue with buffers for the first time and make them available to the device
-/** Each packet will have a 10-byte header (virtio_net_hdr) and an mbuf with the
- * maximum ethernet packet size. Separate virtqueue buffers are used for header
- * and packet so that the packet can be handed off to the network subsystem
- * without copying. We might be able to place the header in leading space, but
- * we'll leave that as an optimisation for later.
+/// Fill the receive queue with buffers and make them available to the device
+/** Without mergeable receive buffers, each packet will have a header
+ * (virtio_net_hdr) and an mbuf with the maximum ethernet packet size. Separate
+ * virtqueue buffers are used for header and packet so that the packet can be
+ * handed off to the network subsystem without copying.
  * The packet may be split over multiple buffers (max 2 for now in practice) as
  * we need physical addresses.
+ * With VIRTIO_NET_F_MRG_RXBUF, page-sized mbufs are posted instead, with the
+ * header written inline by the device; large packets span several of them.
+ * All buffers added by one call are published to the device with a single
+ * notification.
  */
 bool PJVirtioNet::populateReceiveBuffers()
 {
-	uint16_t avail_idx = rx_queue.avail->idx;
-	bool added = false;
-	// with less than 2 descriptors remaining, we definitely won't be able to fit another packet
-	while (rx_queue.num_free_desc >= 2)
+	this->virtio_dev->beginVirtqueueBatch(RECEIVE_QUEUE_INDEX);
+	while (this->receive_buffers_posted < this->receive_virtqueue_length)
 	{
 		// allocate data buffer and header memory
-		mbuf_t packet_mbuf = allocatePacket(kIOEthernetMaxPacketSize);
+		mbuf_t packet_mbuf = allocatePacket(this->receive_buffer_size);
 		if (!packet_mbuf)
 		{
 			static int alloc_fail_count = 0;
 			if (alloc_fail_count % 10 == 0 && alloc_fail_count < 100)
 				VIOLog("virtio-net populateReceiveBuffers(): Warning! Failed to allocate mbuf for receiving (%d).\n", alloc_fail_count);
 			++alloc_fail_count;
-			
-			return (added && notifyQueueAvailIdx(rx_queue, avail_idx)), false;
+			break;
 		}
 		
 		{
-			size_t len = mbuf_len(packet_mbuf);
-			if (len != kIOEthernetMaxPacketSize)
-				kprintf("virtio-net populateReceiveBuffers(): unexpected new packet length %lu (wanted: %u)\n",
-					len, kIOEthernetMaxPacketSize);
-			assert(len == kIOEthernetMaxPacketSize);
+			size_t len = mbuf_pkthdr_len(packet_mbuf);
+			if (len != this->receive_buffer_size)
+				VIOLog("virtio-net populateReceiveBuffers(): unexpected new packet length %lu (wanted: %u)\n",
+					len, this->receive_buffer_size);
+			assert(len == this->receive_buffer_size);
 		}
 		
-		// this will increment avail_idx if successful
-		IOReturn add_ret = addPacketToQueue(packet_mbuf, rx_queue, true /* packet is writeable */, avail_idx);
+		IOReturn add_ret = this->feature_mergeable_rx_buffers
+			? addReceiveBufferToQueue(packet_mbuf)
+			: addPacketToQueue(packet_mbuf, RECEIVE_QUEUE_INDEX, true /* packet is writeable */);
 		if (add_ret != kIOReturnSuccess)
 		{
-			static int add_fail_count = 0;
-			if (add_fail_count % 10 == 0 && add_fail_count < 100)
-				VIOLog("virtio-net populateReceiveBuffers(): Warning! Failed to add packet to receive queue (%d).\n", add_fail_count);
-			++add_fail_count;
-			return freePacket(packet_mbuf), (added && notifyQueueAvailIdx(rx_queue, avail_idx)), false;
+			freePacket(packet_mbuf);
+			// running out of descriptors just means the queue is full
+			if (add_ret != kIOReturnOutputStall)
+			{
+				static int add_fail_count = 0;
+				if (add_fail_count % 10 == 0 && add_fail_count < 100)
+					VIOLog("virtio-net populateReceiveBuffers(): Warning! Failed to add packet to receive queue (%d).\n", add_fail_count);
+				++add_fail_count;
+			}
+			break;
 		}
 		
-		added = true;
+		++this->receive_buffers_posted;
 	}
-	if (added)
-		notifyQueueAvailIdx(rx_queue, avail_idx); 
+	this->virtio_dev->commitVirtqueueBatch(RECEIVE_QUEUE_INDEX);
 	
-	return true;
+	return this->receive_buffers_posted > 0;
 }
 
 void PJVirtioNet::releaseSentPackets(bool from_debugger)
 {
 	if (!from_debugger && (!work_loop || !work_loop->inGate()))
 	{
-		kprintf("virtio-net releaseSentPackets(): Warning! Not holding work-loop gate!\n");
+		VIOLog("virtio-net releaseSentPackets(): Warning! Not holding work-loop gate!\n");
 	}
 	
 	if (!from_debugger)
@@ -1554,116 +1815,43 @@ void PJVirtioNet::releaseSentPackets(bool from_debugger)
 			virtio_net_packet* next = cur->next_free;
 			
 			freePacket(cur->mbuf);
-			if (cur->mem)
-			{
-				packet_bufdesc_pool->setObject(cur->mem);
-				cur->mem->release();
-			}
+			cur->mbuf = NULL;
+			returnPacketToPool(cur);
 			cur = next;
 		}
 	}
 
-	while (tx_queue.last_used_idx != tx_queue.used->idx)
-	{
-		vring_used_elem& used = tx_queue.used->ring[tx_queue.last_used_idx % tx_queue.num];
-		uint16_t used_desc = used.id;
-		if (used_desc == UINT16_MAX && used.len == 0)
-		{
-			// this was already dealt with by the debugger
-			if (!from_debugger)
-				kprintf("virtio-net releaseSentPackets(): Warning! Detected 'used' slot used for debugger packet.\n");
-			++tx_queue.last_used_idx;
-			continue;
-		}
-		if (used_desc >= tx_queue.num)
-		{
-			VIOLog("virtio-net releaseSentPackets(): Warning! Out of range descriptor index %u in used transmit queue.\n", used_desc);
-			++tx_queue.last_used_idx;
-			continue;
-		}
-		virtio_net_packet* packet = tx_queue.packets_for_descs[used_desc];
+	this->releasing_from_debugger = from_debugger;
+	this->virtio_dev->pollCompletedRequestsInVirtqueue(TRANSMIT_QUEUE_INDEX);
+	this->releasing_from_debugger = false;
+}
 
-		if (packet)
-		{
-			packet->dma_cmd->clearMemoryDescriptor();
-			packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
-			packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
-			
-			if (packet == debugger_transmit_packet)
-			{
-				// this packet was queued with the debugging API - this is weird
-				tx_queue.packets_for_descs[used_desc] = NULL;
-				kprintf("virtio-net: releaseSentPackets(): detected KDP transmit packet, this should normally not happen (debugger%s active).\n", from_debugger ? "" : " not");
-				freeDescriptorChain(tx_queue, used_desc);
-				++tx_queue.last_used_idx;
-				continue;
-			}
-			else if (packet->mbuf)
-			{
-				if (from_debugger)
-				{
-					// in the debugger, just put all packets to free in a linked list to avoid memory operations
-					packet->next_free = transmit_packets_to_free;
-					transmit_packets_to_free = packet;
-					freeDescriptorChain(tx_queue, used_desc);
-					++tx_queue.last_used_idx;
-					continue;
-				}
-				freePacket(packet->mbuf);
-			}
-			else
-			{
-				VIOLog("virtio-net releaseSentPackets(): warning, packet with no mbuf, probably leaking memory.\n");
-			}
-			packet->mbuf = NULL;
-			IOBufferMemoryDescriptor* mem = packet->mem;
-			if (mem)
-			{
-				packet_bufdesc_pool->setObject(mem);
-			}
-			else
-			{
-				VIOLog("virtio-net releaseSentPackets(): warning, packet with no memory descriptor, probably leaking memory.\n");
-			}
-			OSSafeReleaseNULL(mem);
-		}
-		else
-		{
-			VIOLog("virtio-net releaseSentPackets(): warning, used transmit buffer chain without matching packet reported. Probably leaking memory.\n");
-			VIOLog("virtio-net releaseSentPackets(): tx queue used element: desc %u, length %u\n", used.id, used.len);
-			uint16_t desc = used_desc;
-			uint16_t desc2 = used_desc;
-			while (true)
-			{
-				// TODO: Defend against infinite loop (out of range descriptors, circular lists)
-				/* note that lacking any driver bugs, this will only defend against a
-				 * buggy/malicious hypervisor, which is like fighting windmills.
-				 */
-				VIOLog("virtio-net releaseSentPackets(): used buffer %u: length %u, associated packet: %p\n",
-					desc2, tx_queue.desc[desc2].len, packet);
-				if (desc2 >= tx_queue.num || 0 == (tx_queue.desc[desc2].flags & VRING_DESC_F_NEXT))
-					break;
-				desc2 = tx_queue.desc[desc2].next;
-				if (desc == desc2)
-					break;
-				VIOLog("virtio-net releaseSentPackets(): used buffer %u: length %u, associated packet: %p\n",
-					desc2, tx_queue.desc[desc2].len, packet);
-				if (desc2 >= tx_queue.num || 0 == (tx_queue.desc[desc2].flags & VRING_DESC_F_NEXT))
-					break;
-				desc2 = tx_queue.desc[desc2].next;
-				desc = tx_queue.desc[desc].next;
-				if (desc == desc2)
-					break;
-			}
-		}
-		
-		// recycle the descriptors
-		freeDescriptorChain(tx_queue, used_desc);
-		++tx_queue.last_used_idx;
+void PJVirtioNet::releaseSentPacket(virtio_net_packet* packet)
+{
+	packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
+	packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
+	
+	if (this->releasing_from_debugger)
+	{
+		// in the debugger, just put all packets to free in a linked list to avoid memory operations
+		packet->next_free = transmit_packets_to_free;
+		transmit_packets_to_free = packet;
+		return;
+	}
+	
+	if (packet->mbuf)
+	{
+		freePacket(packet->mbuf);
+	}
+	else
+	{
+		VIOLog("virtio-net releaseSentPacket(): warning, packet with no mbuf, probably leaking memory.\n");
 	}
+	packet->mbuf = NULL;
+	returnPacketToPool(packet);
 
 	// clear any stall condition
-	if (!from_debugger && was_stalled)
+	if (was_stalled)
 	{
 		//IOLog("virtio-net: Unsticking the output queue after a stall\n");
 		was_stalled = false;
@@ -1671,124 +1859,350 @@ void PJVirtioNet::releaseSentPackets(bool from_debugger)
 	}
 }
 
-void PJVirtioNet::handleReceivedPackets()
+/// Sets the lengths of a receive buffer's mbufs to cover exactly the bytes the device wrote
+static void virtio_net_trim_receive_buffer(mbuf_t buffer_mbuf, uint32_t num_bytes_written)
 {
-	if (!work_loop || !work_loop->inGate())
+	for (mbuf_t m = buffer_mbuf; m != NULL; m = mbuf_next(m))
+	{
+		size_t len = min(mbuf_len(m), static_cast<size_t>(num_bytes_written));
+		mbuf_setlen(m, len);
+		num_bytes_written -= len;
+	}
+}
+
+void PJVirtioNet::handleReceivedPacket(virtio_net_packet* packet, uint32_t num_bytes_written)
+{
+	if (this->receive_buffers_posted > 0)
+		--this->receive_buffers_posted;
+
+	// work out actual packet length, without the header
+	uint32_t len = num_bytes_written;
+	if (len >= this->net_header_len)
+	{
+		len -= this->net_header_len;
+	}
+	else
 	{
-		kprintf("virtio-net handleReceivedPackets(): Warning! Not holding work-loop gate!\n");
+		len = 0;
 	}
-	unsigned packets_submitted = 0;
-	//IOLog("virtio-net: handleReceivedPackets(): rx queue used: %u, last time: %u\n",
-	//	rx_queue.used->idx, rx_queue.last_used_idx);
-	while (rx_queue.last_used_idx != rx_queue.used->idx)
+	
+	mbuf_t packet_mbuf = packet->mbuf;
+	packet->mbuf = NULL;
+	virtio_net_hdr header;
+	memcpy(&header, &packet->header, sizeof(header));
+	returnPacketToPool(packet);
+	if (packet_mbuf)
 	{
-		vring_used_elem& used = rx_queue.used->ring[rx_queue.last_used_idx % rx_queue.num];
-		uint16_t used_desc = used.id;
-		if (used_desc >= rx_queue.num)
+		virtio_net_trim_receive_buffer(packet_mbuf, len);
+		inputReceivedPacket(packet_mbuf, len, header);
+	}
+	else
+	{
+		VIOLog("virtio-net handleReceivedPacket(): warning, no mbuf for received packet. Ignoring packet.\n");
+	}
+}
+
+static uint16_t virtio_net_csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/// One's complement sum of native-endian 16-bit words; a trailing odd byte is padded with zero
+static uint16_t virtio_net_csum_data(const uint8_t* data, size_t len)
+{
+	uint32_t sum = 0;
+	while (len >= 2)
+	{
+		uint16_t word;
+		memcpy(&word, data, sizeof(word));
+		sum += word;
+		data += 2;
+		len -= 2;
+		// fold regularly so a 64KiB segment can't overflow
+		if (sum & 0x80000000u)
+			sum = (sum & 0xffff) + (sum >> 16);
+	}
+	if (len > 0)
+	{
+		uint8_t last[2] = { data[0], 0 };
+		uint16_t word;
+		memcpy(&word, last, sizeof(word));
+		sum += word;
+	}
+	return virtio_net_csum_fold(sum);
+}
+
+/// Fills in a checksum the device left partial (VIRTIO_NET_HDR_F_NEEDS_CSUM)
+/** The checksum field at csum_start + csum_offset holds the pseudo-header sum;
+ * the one's complement sum from csum_start to the end of the packet, which
+ * includes that field, is stored there. Returns false if the offsets are out
+ * of range. */
+static bool virtio_net_complete_partial_csum(mbuf_t packet_mbuf, uint32_t len, uint16_t csum_start, uint16_t csum_offset)
+{
+	uint32_t field_offset = static_cast<uint32_t>(csum_start) + csum_offset;
+	if (field_offset + sizeof(uint16_t) > len)
+		return false;
+	
+	uint32_t sum = 0;
+	uint32_t skip = csum_start;
+	uint32_t remaining = len - csum_start;
+	// position relative to csum_start, to byte-swap the sums of oddly aligned pieces
+	uint32_t pos = 0;
+	for (mbuf_t m = packet_mbuf; m != NULL && remaining > 0; m = mbuf_next(m))
+	{
+		size_t m_len = mbuf_len(m);
+		if (skip >= m_len)
 		{
-			if (!(used_desc == UINT16_MAX && used.len == 0))
-			{
-				VIOLog("virtio-net handleReceivedPackets(): Warning! Out of range descriptor %u in used ring, skipping.\n",
-					used_desc);
-			}
-			++rx_queue.last_used_idx;
+			skip -= m_len;
 			continue;
 		}
-		virtio_net_packet* packet = rx_queue.packets_for_descs[used_desc];
-		
-		// work out actual packet length, without the header
-		uint32_t len = used.len;
-		if (len >= sizeof(virtio_net_hdr))
+		const uint8_t* data = static_cast<const uint8_t*>(mbuf_data(m)) + skip;
+		uint32_t n = min(static_cast<uint32_t>(m_len - skip), remaining);
+		skip = 0;
+		uint16_t piece = virtio_net_csum_data(data, n);
+		if (pos & 1)
+			piece = static_cast<uint16_t>((piece << 8) | (piece >> 8));
+		sum += piece;
+		pos += n;
+		remaining -= n;
+	}
+	if (remaining > 0)
+		return false;
+	
+	uint16_t csum = ~virtio_net_csum_fold(sum);
+	// 0 means "no checksum" for UDP; 0xffff is equivalent for TCP too
+	if (csum == 0)
+		csum = 0xffff;
+	return 0 == mbuf_copyback(packet_mbuf, field_offset, sizeof(csum), &csum, MBUF_DONTWAIT);
+}
+
+/// Applies the received header's offload information to the packet and passes it to the interface
+/** Frees the packet if it can't be delivered. */
+void PJVirtioNet::inputReceivedPacket(mbuf_t packet_mbuf, uint32_t len, const virtio_net_hdr& header)
+{
+	uint8_t gso_type = header.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	bool gso_ok = (gso_type == VIRTIO_NET_HDR_GSO_NONE)
+		|| (this->feature_large_receive
+			&& (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 || gso_type == VIRTIO_NET_HDR_GSO_TCPV6)
+			&& 0 != (header.flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)));
+	uint32_t max_len = this->feature_large_receive ? VIRTIO_NET_MAX_LARGE_RECEIVE_SIZE : kIOEthernetMaxPacketSize;
+	if (!interface || len == 0 || len > max_len || !gso_ok)
+	{
+		VIOLog("virtio-net inputReceivedPacket(): warning, no interface (%p), bad packet length (%u) or unexpected GSO type reported by device. Ignoring packet.\n",
+			interface, len);
+		VIOLog("virtio-net inputReceivedPacket(): packet dump: flags=0x%02x, gso_type=0x%02x, hdr_len=%u(0x%04x), gso_size=%u(0x%04x) csum_start=%u csum_offset=%u\n",
+			header.flags, header.gso_type, header.hdr_len, header.hdr_len,
+			header.gso_size, header.gso_size, header.csum_start, header.csum_offset);
+		freePacket(packet_mbuf);
+		return;
+	}
+	
+	/* Coalesced TCP segments are taken by the stack as one oversized segment,
+	 * there's nowhere to put gso_size. Such a packet can't be bridged or
+	 * forwarded as-is, which is why guest TSO is only negotiated when
+	 * PJVirtioNetAllowLargeReceive is set. Either way, the device only vouches for
+	 * the TCP/UDP checksum, the IP header checksum is still checked by the stack.
+	 */
+	if (header.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+	{
+		// the packet never left the host, so only has the pseudo-header sum; complete it in case it's forwarded
+		if (!virtio_net_complete_partial_csum(packet_mbuf, len, header.csum_start, header.csum_offset))
 		{
-			len -= static_cast<uint32_t>(sizeof(virtio_net_hdr));
+			VIOLog("virtio-net inputReceivedPacket(): warning, partial checksum at %u+%u outside packet of length %u. Ignoring packet.\n",
+				header.csum_start, header.csum_offset, len);
+			freePacket(packet_mbuf);
+			return;
 		}
-		else
+		mbuf_set_csum_performed(packet_mbuf, MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR, 0xffff);
+	}
+	else if (header.flags & VIRTIO_NET_HDR_F_DATA_VALID)
+	{
+		mbuf_set_csum_performed(packet_mbuf, MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR, 0xffff);
+	}
+	
+	mbuf_pkthdr_setlen(packet_mbuf, len);
+	// length is taken from the packet header, as it may be spread across a chain
+	// handed to the stack in one go by receivePassComplete()
+	interface->inputPacket(packet_mbuf, 0, IONetworkInterface::kInputOptionQueuePacket);
+}
+
+static mbuf_t virtio_net_last_mbuf(mbuf_t chain)
+{
+	while (mbuf_t next = mbuf_next(chain))
+		chain = next;
+	return chain;
+}
+
+/// Adds a completed mergeable receive buffer to the packet being reassembled
+/** The first buffer of each packet starts with the virtio header, whose
+ * num_buffers field says how many buffers (including this one) the packet
+ * occupies. Buffers are chained onto the first one's mbuf and the packet is
+ * passed up once the last has arrived; with large receive, a single packet
+ * can span up to 17 page-sized buffers. */
+void PJVirtioNet::handleMergeableReceiveBuffer(virtio_net_packet* packet, uint32_t num_bytes_written)
+{
+	if (this->receive_buffers_posted > 0)
+		--this->receive_buffers_posted;
+
+	mbuf_t buffer_mbuf = packet->mbuf;
+	packet->mbuf = NULL;
+	returnPacketToPool(packet);
+	
+	// header plus largest packet inputReceivedPacket() accepts
+	uint32_t max_len = this->net_header_len
+		+ (this->feature_large_receive ? VIRTIO_NET_MAX_LARGE_RECEIVE_SIZE : kIOEthernetMaxPacketSize);
+	if (this->rx_merge_buffers_remaining == 0)
+	{
+		// first buffer of a new packet; the debugger may have left a partial one behind
+		if (this->rx_merge_head || this->rx_merge_discard)
+			discardMergedPacket();
+		uint8_t header_bytes[VIRTIO_NET_HDR_MRG_RXBUF_LEN] = {};
+		if (!buffer_mbuf || num_bytes_written < this->net_header_len
+			|| 0 != mbuf_copydata(buffer_mbuf, 0, this->net_header_len, header_bytes))
+		{
+			VIOLog("virtio-net handleMergeableReceiveBuffer(): warning, no mbuf (%p) or bad buffer length (%u) reported by device. Ignoring packet.\n",
+				buffer_mbuf, num_bytes_written);
+			if (buffer_mbuf)
+				freePacket(buffer_mbuf);
+			return;
+		}
+		uint16_t num_buffers = OSReadLittleInt16(header_bytes, sizeof(virtio_net_hdr));
+		uint32_t max_buffers = (max_len + this->receive_buffer_size - 1u) / this->receive_buffer_size;
+		if (num_buffers == 0 || num_buffers > max_buffers || num_bytes_written > max_len)
 		{
-			len = 0;
+			VIOLog("virtio-net handleMergeableReceiveBuffer(): warning, device reported packet spanning %u buffers (max %u), %u bytes in the first. Ignoring packet.\n",
+				num_buffers, max_buffers, num_bytes_written);
+			freePacket(buffer_mbuf);
+			return;
 		}
 		
-		// this buffer should correspond to a packet we queued; pass it to the network system
-		if (packet)
+		// the header stays in place until the packet is complete
+		virtio_net_trim_receive_buffer(buffer_mbuf, num_bytes_written);
+		this->rx_merge_head = buffer_mbuf;
+		this->rx_merge_tail = virtio_net_last_mbuf(buffer_mbuf);
+		this->rx_merge_length = num_bytes_written;
+		this->rx_merge_buffers_remaining = num_buffers - 1u;
+	}
+	else
+	{
+		--this->rx_merge_buffers_remaining;
+		if (buffer_mbuf)
 		{
-			rx_queue.packets_for_descs[used_desc] = NULL;
-
-			packet->dma_cmd->clearMemoryDescriptor();
-			packet->dma_md->initWithDescriptorRanges(NULL, 0, kIODirectionNone, false);
-			packet->mbuf_md->initWithMbuf(NULL, kIODirectionNone);
-
-			if (interface && len <= kIOEthernetMaxPacketSize && packet->mbuf)
+			if (this->rx_merge_head && num_bytes_written <= max_len - this->rx_merge_length)
+			{
+				virtio_net_trim_receive_buffer(buffer_mbuf, num_bytes_written);
+				mbuf_setnext(this->rx_merge_tail, buffer_mbuf);
+				this->rx_merge_tail = virtio_net_last_mbuf(buffer_mbuf);
+				this->rx_merge_length += num_bytes_written;
+			}
+			else if (this->rx_merge_head)
 			{
-				interface->inputPacket(packet->mbuf, len, IONetworkInterface::kInputOptionQueuePacket);
-				++packets_submitted;
+				// oversized: drop what we have now, swallow the remaining buffers as they arrive
+				VIOLog("virtio-net handleMergeableReceiveBuffer(): warning, merged packet exceeds %u bytes, dropping packet.\n", max_len);
+				freePacket(this->rx_merge_head);
+				freePacket(buffer_mbuf);
+				this->rx_merge_head = NULL;
+				this->rx_merge_tail = NULL;
+				this->rx_merge_length = 0;
+				this->rx_merge_discard = true;
 			}
 			else
 			{
-				kprintf("virtio-net handleReceivedPackets(): warning, no interface (%p), no mbuf (%p) or bad packet length (%u) reported by device. Ignoring packet.\n",
-					interface, packet->mbuf, len);
-				kprintf("virtio-net handleReceivedPackets(): used ring entry: id=%u (0x%x), len=%u\n", used.id, used.id, used.len);
-				kprintf("virtio-net handleReceivedPackets(): packet dump: flags=0x%02x, gso_type=0x%02x, hdr_len=%u(0x%04x), gso_size=%u(0x%04x) csum_start=%u csum_offset=%u\n",
-					packet->header.flags, packet->header.gso_type, packet->header.hdr_len, packet->header.hdr_len,
-					packet->header.gso_size, packet->header.gso_size, packet->header.csum_start, packet->header.csum_offset);
-				kprintf("virtio-net handleReceivedPackets(): packet dump: mbuf=%p, mem=%p\n", packet->mbuf, packet->mem);
-				if (packet->mbuf)
-					freePacket(packet->mbuf);
+				// rest of a packet that was consumed by the debugger or dropped
+				freePacket(buffer_mbuf);
 			}
-			packet->mbuf = NULL;
-			IOBufferMemoryDescriptor* mem = packet->mem;
-			if (mem)
-				packet_bufdesc_pool->setObject(mem);
-			OSSafeReleaseNULL(mem);
 		}
 		else
 		{
-			VIOLog("virtio-net handleReceivedPackets(): warning, used receive buffer chain without matching packet reported. Probably leaking memory.\n");
-			VIOLog("virtio-net: handleReceivedPackets(): rx queue used element: desc %u, length %u\n", used.id, used.len);
-			uint16_t desc = used_desc;
-			while (true)
-			{
-				// TODO: Defend against infinite loop (out of range descriptors, circular lists)
-				/* note that lacking any driver bugs, this will only defend against a
-				 * buggy/malicious hypervisor, which is like fighting windmills.
-				 */
-				VIOLog("virtio-net: handleReceivedPackets(): used buffer %u: length %u, associated packet: %p\n",
-					desc, rx_queue.desc[desc].len, packet);
-				if (0 == (rx_queue.desc[desc].flags & VRING_DESC_F_NEXT))
-					break;
-				desc = rx_queue.desc[desc].next;
-			}
+			VIOLog("virtio-net handleMergeableReceiveBuffer(): warning, receive buffer with no mbuf, dropping packet.\n");
+			this->rx_merge_discard = true;
 		}
-		
-		// recycle the descriptors
-		freeDescriptorChain(rx_queue, used_desc);
-		++rx_queue.last_used_idx;
 	}
-	if (packets_submitted > 0)
+	
+	if (this->rx_merge_buffers_remaining > 0)
+		return;
+	
+	mbuf_t packet_mbuf = this->rx_merge_head;
+	uint32_t len = this->rx_merge_length;
+	bool discard = this->rx_merge_discard;
+	this->rx_merge_head = NULL;
+	this->rx_merge_tail = NULL;
+	this->rx_merge_length = 0;
+	this->rx_merge_discard = false;
+	if (!packet_mbuf)
+		return;
+	virtio_net_hdr header;
+	if (discard || 0 != mbuf_copydata(packet_mbuf, 0, sizeof(header), &header))
 	{
-		interface->flushInputQueue();
-		//IOLog("virtio-net handleReceivedPackets(): %u received\n", packets_submitted);
+		freePacket(packet_mbuf);
+		return;
 	}
+	mbuf_adj(packet_mbuf, this->net_header_len);
+	inputReceivedPacket(packet_mbuf, len - this->net_header_len, header);
 }
 
-void PJVirtioNet::freeDescriptorChain(virtio_net_virtqueue& queue, uint16_t desc_chain_head)
+/// Frees any partially reassembled mergeable receive packet
+void PJVirtioNet::discardMergedPacket()
 {
-	uint16_t desc = desc_chain_head; 
-	while (true)
+	if (this->rx_merge_head)
+		freePacket(this->rx_merge_head);
+	this->rx_merge_head = NULL;
+	this->rx_merge_tail = NULL;
+	this->rx_merge_length = 0;
+	this->rx_merge_buffers_remaining = 0;
+	this->rx_merge_discard = false;
+}
+
+/// Copies a single-buffer packet to the debugger; multi-buffer packets are skipped
+/** Must not allocate or free memory, so a packet being reassembled for the
+ * interface is only marked for discarding. */
+void PJVirtioNet::debuggerReceiveMergeableBuffer(virtio_net_packet* packet, uint32_t num_bytes_written)
+{
+	UInt32 capacity = this->debugger_receive_size;
+	this->debugger_receive_size = 0;
+	if (this->rx_merge_buffers_remaining > 0)
 	{
-		// TODO: Defend against infinite loop (out of range descriptors, circular lists)
-		/* note that lacking any driver bugs, this will only defend against a
-		 * buggy/malicious hypervisor, which is like fighting windmills.
-		 */
-		uint16_t next = queue.desc[desc].next;
-		bool has_next = (0 != (queue.desc[desc].flags & VRING_DESC_F_NEXT));
-		queue.desc[desc].addr = 0;
-		queue.desc[desc].len = 0;
-		queue.desc[desc].flags = 0;
-		queue.desc[desc].next = 0;
-		vring_push_free_desc(queue, desc);
-		if (!has_next)
-			break;
-		desc = next;
+		--this->rx_merge_buffers_remaining;
+		this->rx_merge_discard = true;
+		return;
+	}
+	
+	uint8_t header_bytes[VIRTIO_NET_HDR_MRG_RXBUF_LEN] = {};
+	if (num_bytes_written < this->net_header_len
+		|| 0 != mbuf_copydata(packet->mbuf, 0, this->net_header_len, header_bytes))
+		return;
+	uint16_t num_buffers = OSReadLittleInt16(header_bytes, sizeof(virtio_net_hdr));
+	if (num_buffers != 1)
+	{
+		if (num_buffers > 1)
+			this->rx_merge_buffers_remaining = num_buffers - 1u;
+		return;
 	}
+	
+	UInt32 copy_len = min(num_bytes_written - this->net_header_len, capacity);
+	if (0 == mbuf_copydata(packet->mbuf, this->net_header_len, copy_len, this->debugger_receive_mem))
+		this->debugger_receive_size = copy_len;
+}
+
+/// Passes the packets queued up during a receive queue completion pass to the network stack
+void PJVirtioNet::receivePassComplete(OSObject* target, uint16_t queue_index)
+{
+	PJVirtioNet* me = static_cast<PJVirtioNet*>(target);
+	// the debugger's polls copy packets out rather than queueing them, and can't call into the stack
+	if (me->debugger_receive_mem != nullptr || me->interface == nullptr)
+		return;
+	me->interface->flushInputQueue();
+}
+
+void PJVirtioNet::handleReceivedPackets()
+{
+	if (!work_loop || !work_loop->inGate())
+	{
+		VIOLog("virtio-net handleReceivedPackets(): Warning! Not holding work-loop gate!\n");
+	}
+	this->virtio_dev->pollCompletedRequestsInVirtqueue(RECEIVE_QUEUE_INDEX);
 }
 
 
@@ -1812,7 +2226,6 @@ void PJVirtioNet::flushPacketPool()
 			if (IOBufferMemoryDescriptor* buf = OSDynamicCast(IOBufferMemoryDescriptor, obj))
 			{
 				virtio_net_packet* packet = static_cast<virtio_net_packet*>(buf->getBytesNoCopy());
-				OSSafeReleaseNULL(packet->dma_cmd);
 				OSSafeReleaseNULL(packet->dma_md);
 				OSSafeReleaseNULL(packet->mbuf_md);
 			}
@@ -1824,7 +2237,7 @@ void PJVirtioNet::flushPacketPool()
 void PJVirtioNet::stop(IOService* provider)
 {
 	PJLogVerbose("virtio-net stop()\n");
-	if (provider != this->pci_dev)
+	if (provider != this->virtio_dev)
 		VIOLog("Warning: stopping virtio-net with a different provider!?\n");
 
 	if (interface)
@@ -1843,19 +2256,11 @@ void PJVirtioNet::stop(IOService* provider)
 		debugger = NULL;
 	}
 
-	// we don't want interrupt handlers trying to dereference any zeroed or dangling pointers, so make sure they're off
-	if (intr_event_source)
-	{
-		VIOLog("virtio-net stop(): Warning! Event source still exists, this should have been shut down by now.\n");
-		endHandlingInterrupts();
-	}
-	
 	if (debugger_transmit_packet)
 	{
 		if (debugger_transmit_packet->mbuf)
 			freePacket(debugger_transmit_packet->mbuf);
 		debugger_transmit_packet->mbuf = NULL;
-		OSSafeReleaseNULL(debugger_transmit_packet->dma_cmd);
 		OSSafeReleaseNULL(debugger_transmit_packet->dma_md);
 		OSSafeReleaseNULL(debugger_transmit_packet->mbuf_md);
 		if (debugger_transmit_packet->mem)
@@ -1871,20 +2276,10 @@ void PJVirtioNet::stop(IOService* provider)
 	flushPacketPool();
 	
 	OSSafeReleaseNULL(interface);
-	clearVirtqueuePackets(rx_queue);
-	clearVirtqueuePackets(tx_queue);
-	virtqueue_free(rx_queue);
-	virtqueue_free(tx_queue);
-	
-	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
 
-	if (this->pci_dev && this->should_disable_io)
-		this->pci_dev->setIOEnable(false);
-	this->should_disable_io = false;
-
-	if (pci_dev && pci_dev->isOpen(this))
-		pci_dev->close(this);
-	this->pci_dev = NULL;
+	if (this->virtio_dev && this->virtio_dev->isOpen(this))
+		this->virtio_dev->close(this);
+	this->virtio_dev = NULL;
 	driver_state = kDriverStateStopped;
 	
 	PJLogVerbose("virtio-net end stop()\n");
@@ -1898,17 +2293,10 @@ void PJVirtioNet::free()
 	
 	OSSafeReleaseNULL(packet_bufdesc_pool);
 
-	OSSafeReleaseNULL(this->pci_virtio_header_iomap);
-
-	if (intr_event_source)
-	{
-		VIOLog("virtio-net free(): Warning! Event source still exists, this should have been shut down by now.\n");
-		endHandlingInterrupts();
-	}
 	OSSafeReleaseNULL(work_loop);
-	if (this->pci_dev && this->pci_dev->isOpen(this))
-		this->pci_dev->close(this);
-	this->pci_dev = NULL;
+	if (this->virtio_dev && this->virtio_dev->isOpen(this))
+		this->virtio_dev->close(this);
+	this->virtio_dev = NULL;
 	
 #ifdef VIRTIO_NET_SINGLE_INSTANCE
 	OSDecrementAtomic(&instances);
@@ -34,7 +34,7 @@ class IOFilterInterruptEventSource;
 class IOInterruptEventSource;
 
 struct virtio_net_packet;
-struct virtio_net_virtqueue;
+struct virtio_net_hdr;
 
 class PJVirtioNet : public IOEthernetController
 {
@@ -159,26 +159,20 @@ protected:
 	// Virtqueue management functions:
 	
 	/** Allocates/recycles the header buffer, sets up the packet data buffers,
-	 * writes the virtqueue descriptors, and the head's packets_for_descs entry.
-	 * Then fills out the 'available' ring buffer
-	 * entry at the specified index (modulo queue size), incrementing said index
-	 * as necessary. Returns true on success, false on failure. The mbuf is not
-	 * freed in either case (but referenced as a buffer in case of success).
+	 * and submits header and mbuf to the virtqueue as a single request. The
+	 * header is zeroed if none is given. Returns kIOReturnSuccess,
+	 * kIOReturnOutputStall if the queue is full, or kIOReturnOutputDropped.
+	 * The mbuf is not freed in either case (but referenced as a buffer in case
+	 * of success).
 	 */
-	IOReturn addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_id, bool for_writing);
+	IOReturn addPacketToQueue(mbuf_t packet_mbuf, unsigned queue_id, bool for_writing, const virtio_net_hdr* header = NULL);
 	IOReturn addPacketToTransmitQueue(mbuf_t packet_mbuf);
+	IOReturn addReceiveBufferToQueue(mbuf_t packet_mbuf);
 	virtio_net_packet* allocPacket();
-	/// Segment output function for the DMA command, adds a physical memory segment to the buffer descriptor chain
-	static bool outputPacketSegment(IODMACommand* target, IODMACommand::Segment64 segment, void* segments, UInt32 segmentIndex);
+	void returnPacketToPool(virtio_net_packet* packet);
 
 	void freeVirtioPacket(virtio_net_packet* packet);
-	void freeDescriptorChain(virtio_net_virtqueue& queue, uint16_t desc_chain_head);
 	bool populateReceiveBuffers();
-
-	bool notifyQueueAvailIdx(virtio_net_virtqueue& queue, uint16_t new_avail_idx);		
-	
-	/// Free any packet buffers in the now shut down queue
-	void clearVirtqueuePackets(virtio_net_virtqueue& queue);
 	
 
 	/// Read network device status register; returns negative value if unsupported
@@ -187,21 +181,6 @@ protected:
 	/** Returns true if the link is up, false if not. */
 	bool updateLinkStatus();
 	
-	/// Creates and activates the interrupt event source
-	/** Should be called as soon as the virtqueues become active, i.e. at the end of enable() */
-	bool beginHandlingInterrupts();
-	/// Deactivates and destroys the interrupt event source
-	/** Should be called as soon as the virtqueues have been deactivated, but
-	 * before they are cleared. (i.e. in disable()) */
-	void endHandlingInterrupts();
-
-	/// Interrupt filter that checks whether the interrupt means work needs to be done
-	/** Also disables further interrupts until the initial interrupt has been handled.
-	 */
-	static bool interruptFilter(OSObject* me, IOFilterInterruptEventSource* source);
-	
-	/// Secondary interrupt. Forwards to the member function of the same name.
-	static void interruptAction(OSObject* me, IOInterruptEventSource* source, int count);
 	static void configChangeHandler(OSObject* target, VirtioDevice* source);
 
 	static void receiveQueueCompletion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written);
@@ -209,34 +188,54 @@ protected:
 	static void transmitQueueCompletion(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written);
 	static void debuggerTransmitCompletionAction(OSObject* target, void* ref, bool device_reset, uint32_t num_bytes_written);
 	
-	void handleReceivedPacket(virtio_net_packet* packet);
+	void handleReceivedPacket(virtio_net_packet* packet, uint32_t num_bytes_written);
+	void handleMergeableReceiveBuffer(virtio_net_packet* packet, uint32_t num_bytes_written);
+	void inputReceivedPacket(mbuf_t packet_mbuf, uint32_t len, const virtio_net_hdr& header);
+	void debuggerReceiveMergeableBuffer(virtio_net_packet* packet, uint32_t num_bytes_written);
+	void discardMergedPacket();
 	void handleReceivedPackets();
+	static void receivePassComplete(OSObject* target, uint16_t queue_index);
 	
-	/// Frees any packets marked as "used" in the transmit queue and frees their descriptors
+	/// Frees any packets completed by the transmit queue
 	void releaseSentPackets(bool from_debugger = false);
 	void releaseSentPacket(virtio_net_packet* packet);
 	
 	void flushPacketPool();
+	
+	uint64_t desiredFeatures(uint64_t dev_features) const;
+	void setNegotiatedFeatures(uint64_t features);
 
 	DriverState driver_state;
 	
 	/// Whether or not the driver is permitted to negotiate any checksumming or offloading features
 	bool pref_allow_offloading;
 	static const bool pref_allow_offloading_default = true;
+	/// Whether the driver may negotiate guest TSO, i.e. receive coalesced TCP segments of up to 64KiB
+	/** Off by default: the stack takes such a packet as one oversized segment
+	 * and its gso_size is lost, so if it is bridged or forwarded out of
+	 * another interface it is sent as an over-MTU frame. Only enable this
+	 * on hosts which terminate all their TCP traffic locally. */
+	bool pref_allow_large_receive;
+	static const bool pref_allow_large_receive_default = false;
 	
 	/// The provider device. NOT retained.
 	VirtioDevice* virtio_dev;
 	
 	/// The standard bit map of virtio device features
-	uint32_t dev_feature_bitmap;
+	uint64_t dev_feature_bitmap;
 		
 	IOEthernetInterface* interface;
 	
 	static const unsigned RECEIVE_QUEUE_INDEX = 0;
 	static const unsigned TRANSMIT_QUEUE_INDEX = 1;
+	/// Transmit notification coalescing: at most this many packets share a notification, which is delayed by at most this long
+	static const unsigned TRANSMIT_KICK_MAX_BATCH = 16;
+	static const uint32_t TRANSMIT_KICK_MAX_DELAY_US = 20;
 	
 	unsigned transmit_virtqueue_length;
 	unsigned receive_virtqueue_length;
+	/// Number of receive buffers currently owned by the device
+	unsigned receive_buffers_posted;
 	
 	IOEthernetAddress mac_address;
 	/// Set to true once the mac address has been initialised
@@ -253,6 +252,28 @@ protected:
 	bool feature_checksum_offload;
 	/// TSO for IPv4 has been negotiated
 	bool feature_tso_v4;
+	/// TSO for IPv6 has been negotiated
+	bool feature_tso_v6;
+	/// VIRTIO_NET_F_MRG_RXBUF: receive buffers are page-sized with the header inline
+	bool feature_mergeable_rx_buffers;
+	/// VIRTIO_NET_F_GUEST_CSUM: received packets may be marked checksum-verified, or have a partial checksum
+	bool feature_rx_checksum_offload;
+	/// Guest TSO (large receive of coalesced TCP segments) and the GUEST_CSUM it depends on have been negotiated
+	bool feature_large_receive;
+	/// Size of the virtio_net_hdr on the wire, including num_buffers if present
+	uint32_t net_header_len;
+	/// Size of the mbufs posted to the receive queue
+	uint32_t receive_buffer_size;
+	
+	/// Mergeable receive packet being reassembled from multiple buffers
+	mbuf_t rx_merge_head;
+	/// Last mbuf in the rx_merge_head chain
+	mbuf_t rx_merge_tail;
+	uint32_t rx_merge_length;
+	/// Buffers still to come for the current packet; 0 if the next buffer starts a new one
+	unsigned rx_merge_buffers_remaining;
+	/// Part of the current packet was lost (e.g. taken by the debugger), drop it once complete
+	bool rx_merge_discard;
 	
 	/// non-NULL while the debugger is polling in receivePacket - receive completion will copy to this memory
 	void* debugger_receive_mem;
@@ -274,6 +295,8 @@ protected:
 	/// Linked list of packets to be freed
 	/** accumulated by the debugger dequeueing used tx packets */
 	struct virtio_net_packet* transmit_packets_to_free;
+	/// Set while the debugger is reaping the transmit queue, so completions must not free memory
+	bool releasing_from_debugger;
 	
 	bool was_stalled;
 